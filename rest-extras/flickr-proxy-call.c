@@ -23,6 +23,7 @@
 
 #include <string.h>
 #include <libsoup/soup.h>
+#include <rest/rest-private.h>
 #include <rest/rest-proxy-call.h>
 #include "flickr-proxy-call.h"
 #include "flickr-proxy.h"
@@ -61,6 +62,33 @@ flickr_proxy_call_set_property (GObject      *object,
     }
 }
 
+/* Signs the string parameters exactly as they are sent, repeated names
+ * included, where flickr_proxy_sign() only sees one value per name */
+static char *
+sign_params (FlickrProxy *proxy,
+             RestParams  *params)
+{
+  g_autoptr(GPtrArray) strings = _rest_params_get_sorted_strings (params);
+  GChecksum *checksum;
+  char *md5;
+
+  checksum = g_checksum_new (G_CHECKSUM_MD5);
+  g_checksum_update (checksum, (guchar *) flickr_proxy_get_shared_secret (proxy), -1);
+
+  for (guint i = 0; i < strings->len; i++)
+    {
+      RestParam *param = g_ptr_array_index (strings, i);
+
+      g_checksum_update (checksum, (guchar *) rest_param_get_name (param), -1);
+      g_checksum_update (checksum, (guchar *) rest_param_get_content (param), -1);
+    }
+
+  md5 = g_strdup (g_checksum_get_string (checksum));
+  g_checksum_free (checksum);
+
+  return md5;
+}
+
 static gboolean
 _prepare (RestProxyCall  *call,
           GError        **error)
@@ -70,16 +98,15 @@ _prepare (RestProxyCall  *call,
 
   FlickrProxy *proxy = NULL;
   const gchar *token = NULL;
-  GHashTable *params;
   char *s;
 
   g_object_get (self, "proxy", &proxy, NULL);
 
   if (priv->upload) {
-    rest_proxy_bind (REST_PROXY(proxy), "up", "upload");
+    rest_proxy_call_bind (call, "up", "upload");
     rest_proxy_call_set_function (call, NULL);
   } else {
-    rest_proxy_bind (REST_PROXY(proxy), "api", "rest");
+    rest_proxy_call_bind (call, "api", "rest");
     rest_proxy_call_add_param (call, "method",
                                rest_proxy_call_get_function (call));
   /* We need to reset the function because Flickr puts the function in the
@@ -93,10 +120,7 @@ _prepare (RestProxyCall  *call,
   if (token)
     rest_proxy_call_add_param (call, "auth_token", token);
 
-  /* Get the string params as a hash for signing */
-  params = rest_params_as_string_hash_table (rest_proxy_call_get_params (call));
-  s = flickr_proxy_sign (proxy, params);
-  g_hash_table_unref (params);
+  s = sign_params (proxy, rest_proxy_call_get_params (call));
 
   rest_proxy_call_add_param (call, "api_sig", s);
   g_free (s);
@@ -106,6 +130,16 @@ _prepare (RestProxyCall  *call,
   return TRUE;
 }
 
+static void
+_reset (RestProxyCall *call)
+{
+  FlickrProxyCall *self = (FlickrProxyCall *)call;
+  FlickrProxyCallPrivate *priv = flickr_proxy_call_get_instance_private (self);
+
+  /* A reset call is handed out again by rest_proxy_acquire_call() */
+  priv->upload = FALSE;
+}
+
 static void
 flickr_proxy_call_class_init (FlickrProxyCallClass *klass)
 {
@@ -113,6 +147,7 @@ flickr_proxy_call_class_init (FlickrProxyCallClass *klass)
   RestProxyCallClass *call_class = REST_PROXY_CALL_CLASS (klass);
 
   call_class->prepare = _prepare;
+  call_class->reset = _reset;
   object_class->set_property = flickr_proxy_call_set_property;
 
   /**
@@ -178,6 +178,8 @@ flickr_proxy_class_init (FlickrProxyClass *klass)
 static void
 flickr_proxy_init (FlickrProxy *self)
 {
+  /* Flickr allows 3600 queries an hour for each key */
+  rest_proxy_set_rate_limit (REST_PROXY (self), NULL, NULL, 1.0, 10);
 }
 
 RestProxy *
@@ -290,7 +292,9 @@ flickr_proxy_set_token (FlickrProxy *self,
  * @proxy: an #FlickrProxy
  * @params: (element-type utf8 utf8): the request parameters
  *
- * Get the md5 checksum of the request.
+ * Get the md5 checksum of the request.  @params holds one value per name,
+ * so a request repeating a parameter can't be signed with it; #FlickrProxyCall
+ * signs the parameters it sends itself.
  *
  * Returns: The md5 checksum of the request
  */
@@ -30,11 +30,37 @@
 
 G_DEFINE_TYPE (LastfmProxyCall, lastfm_proxy_call, REST_TYPE_PROXY_CALL)
 
+/* Signs the string parameters exactly as they are sent, repeated names
+ * included, where lastfm_proxy_sign() only sees one value per name */
+static char *
+sign_params (LastfmProxy *proxy,
+             RestParams  *params)
+{
+  g_autoptr(GPtrArray) strings = _rest_params_get_sorted_strings (params);
+  GString *s;
+  char *md5;
+
+  s = g_string_new (NULL);
+  for (guint i = 0; i < strings->len; i++)
+    {
+      RestParam *param = g_ptr_array_index (strings, i);
+
+      g_string_append_printf (s, "%s%s",
+                              rest_param_get_name (param),
+                              (const char *) rest_param_get_content (param));
+    }
+  g_string_append (s, lastfm_proxy_get_secret (proxy));
+
+  md5 = g_compute_checksum_for_string (G_CHECKSUM_MD5, s->str, s->len);
+  g_string_free (s, TRUE);
+
+  return md5;
+}
+
 static gboolean
 _prepare (RestProxyCall *call, GError **error)
 {
   LastfmProxy *proxy = NULL;
-  GHashTable *params;
   const gchar *session_key;
   char *s;
 
@@ -52,9 +78,7 @@ _prepare (RestProxyCall *call, GError **error)
   if (session_key)
     rest_proxy_call_add_param (call, "sk", session_key);
 
-  params = rest_params_as_string_hash_table (rest_proxy_call_get_params (call));
-  s = lastfm_proxy_sign (proxy, params);
-  g_hash_table_unref (params);
+  s = sign_params (proxy, rest_proxy_call_get_params (call));
   rest_proxy_call_add_param (call, "api_sig", s);
   g_free (s);
 
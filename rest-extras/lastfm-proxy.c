@@ -169,6 +169,8 @@ lastfm_proxy_class_init (LastfmProxyClass *klass)
 static void
 lastfm_proxy_init (LastfmProxy *self)
 {
+  /* Last.fm allows 5 requests a second, averaged over 5 minutes */
+  rest_proxy_set_rate_limit (REST_PROXY (self), NULL, NULL, 5.0, 10);
 }
 
 RestProxy *
@@ -279,7 +281,9 @@ lastfm_proxy_set_session_key (LastfmProxy *self,
  * @proxy: an #LastfmProxy
  * @params: (element-type utf8 utf8): the request parameters
  *
- * Get the md5 checksum of the request.
+ * Get the md5 checksum of the request.  @params holds one value per name,
+ * so a request repeating a parameter can't be signed with it; #LastfmProxyCall
+ * signs the parameters it sends itself.
  *
  * Returns: The md5 checksum of the request
  */
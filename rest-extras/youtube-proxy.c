@@ -490,8 +490,13 @@ youtube_proxy_upload_async (YoutubeProxy              *self,
 #else
   g_bytes_unref (sb);
   soup_message_headers_unref (part_headers);
-  message = soup_message_new_from_multipart (UPLOAD_URL, mp);
+  /* Like soup_message_new_from_multipart(), keeping the body for the proxy
+   * to send under its bandwidth limits */
+  message = soup_message_new (SOUP_METHOD_POST, UPLOAD_URL);
   request_headers = soup_message_get_request_headers (message);
+  soup_multipart_to_message (mp, request_headers, &sb);
+  _rest_message_set_request_bytes (message, NULL, sb);
+  g_bytes_unref (sb);
 #endif
 
   soup_multipart_free (mp);
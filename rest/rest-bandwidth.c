@@ -0,0 +1,415 @@
+/*
+ * librest - RESTful web services access
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Bandwidth shaping of request and response bodies.  A limit is a bucket of
+ * bytes, refilled at its rate and holding no more than a chunk: what goes
+ * through in PACING_INTERVAL.  Bodies are moved a chunk at a time, each
+ * taking its bytes from every limit it is under (its call, its proxy and
+ * the global one) and waiting for those it is owed.  The bytes of a long
+ * body are thus spread evenly over time rather than sent in bursts, and
+ * bodies under the same limit share it in the order they asked.
+ */
+
+#include <config.h>
+#include "rest-private.h"
+
+/* The time the bytes of a chunk take to go through at the rate of a limit */
+#define PACING_INTERVAL 50
+#define MIN_CHUNK_SIZE 512
+#define MAX_CHUNK_SIZE (64 * 1024)
+
+struct _RestBandwidthLimit {
+  gint ref_count;
+  GMutex lock;
+  /* Bytes per second, 0 for no limit */
+  guint64 rate;
+  gsize chunk_size;
+  /* Below 0 when bytes are owed to waiting bodies */
+  double tokens;
+  gint64 refill_time;
+};
+
+static const char *message_limit_keys[] = {
+  "rest-upload-limit",
+  "rest-download-limit"
+};
+
+RestBandwidthLimit *
+_rest_bandwidth_limit_new (void)
+{
+  RestBandwidthLimit *limit = g_new0 (RestBandwidthLimit, 1);
+
+  limit->ref_count = 1;
+  g_mutex_init (&limit->lock);
+  limit->chunk_size = MAX_CHUNK_SIZE;
+  limit->tokens = G_MAXDOUBLE;
+
+  return limit;
+}
+
+RestBandwidthLimit *
+_rest_bandwidth_limit_ref (RestBandwidthLimit *limit)
+{
+  g_atomic_int_inc (&limit->ref_count);
+
+  return limit;
+}
+
+void
+_rest_bandwidth_limit_unref (RestBandwidthLimit *limit)
+{
+  if (!g_atomic_int_dec_and_test (&limit->ref_count))
+    return;
+
+  g_mutex_clear (&limit->lock);
+  g_free (limit);
+}
+
+/* Sets the bytes per second of @limit, 0 to lift it.  Bodies already under
+ * @limit follow the new rate from their next chunk. */
+void
+_rest_bandwidth_limit_set_rate (RestBandwidthLimit *limit,
+                                guint64             rate)
+{
+  g_mutex_lock (&limit->lock);
+
+  limit->rate = rate;
+  limit->chunk_size = rate ? CLAMP (rate * PACING_INTERVAL / 1000,
+                                    MIN_CHUNK_SIZE, MAX_CHUNK_SIZE)
+                           : MAX_CHUNK_SIZE;
+  limit->tokens = MIN (limit->tokens, limit->chunk_size);
+  limit->refill_time = g_get_monotonic_time ();
+
+  g_mutex_unlock (&limit->lock);
+}
+
+guint64
+_rest_bandwidth_limit_get_rate (RestBandwidthLimit *limit)
+{
+  guint64 rate;
+
+  g_mutex_lock (&limit->lock);
+  rate = limit->rate;
+  g_mutex_unlock (&limit->lock);
+
+  return rate;
+}
+
+/* Returns the limit shared by the bodies of all the proxies going in
+ * @direction */
+RestBandwidthLimit *
+_rest_bandwidth_get_global_limit (RestBandwidthDirection direction)
+{
+  static RestBandwidthLimit *limits[2];
+  static gsize initialized = 0;
+
+  if (g_once_init_enter (&initialized))
+    {
+      limits[REST_BANDWIDTH_UPLOAD] = _rest_bandwidth_limit_new ();
+      limits[REST_BANDWIDTH_DOWNLOAD] = _rest_bandwidth_limit_new ();
+      g_once_init_leave (&initialized, 1);
+    }
+
+  return limits[direction];
+}
+
+/* Puts the body of @message going in @direction under @limit, on top of
+ * the limits of its proxy */
+void
+_rest_bandwidth_set_message_limit (SoupMessage            *message,
+                                   RestBandwidthDirection  direction,
+                                   RestBandwidthLimit     *limit)
+{
+  g_object_set_data_full (G_OBJECT (message), message_limit_keys[direction],
+                          limit ? _rest_bandwidth_limit_ref (limit) : NULL,
+                          (GDestroyNotify) _rest_bandwidth_limit_unref);
+}
+
+RestBandwidthLimit *
+_rest_bandwidth_get_message_limit (SoupMessage            *message,
+                                   RestBandwidthDirection  direction)
+{
+  return g_object_get_data (G_OBJECT (message), message_limit_keys[direction]);
+}
+
+static void
+add_limit (GPtrArray          *limits,
+           RestBandwidthLimit *limit)
+{
+  if (limit && _rest_bandwidth_limit_get_rate (limit) > 0)
+    g_ptr_array_add (limits, _rest_bandwidth_limit_ref (limit));
+}
+
+/* Returns the limits the body of @message going in @direction is under:
+ * its own, @proxy_limit and the global one, or %NULL if none limits it */
+GPtrArray *
+_rest_bandwidth_get_limits (SoupMessage            *message,
+                            RestBandwidthDirection  direction,
+                            RestBandwidthLimit     *proxy_limit)
+{
+  GPtrArray *limits;
+
+  limits = g_ptr_array_new_with_free_func ((GDestroyNotify) _rest_bandwidth_limit_unref);
+  add_limit (limits, _rest_bandwidth_get_message_limit (message, direction));
+  add_limit (limits, proxy_limit);
+  add_limit (limits, _rest_bandwidth_get_global_limit (direction));
+
+  if (limits->len == 0)
+    g_clear_pointer (&limits, g_ptr_array_unref);
+
+  return limits;
+}
+
+/* Returns the most bytes to move at once under @limits */
+gsize
+_rest_bandwidth_get_chunk_size (GPtrArray *limits)
+{
+  gsize chunk_size = MAX_CHUNK_SIZE;
+
+  for (guint i = 0; i < limits->len; i++)
+    {
+      RestBandwidthLimit *limit = g_ptr_array_index (limits, i);
+
+      g_mutex_lock (&limit->lock);
+      chunk_size = MIN (chunk_size, limit->chunk_size);
+      g_mutex_unlock (&limit->lock);
+    }
+
+  return chunk_size;
+}
+
+/* Takes @bytes from @limit, and returns when they are there to take */
+static gint64
+limit_take (RestBandwidthLimit *limit,
+            gsize               bytes,
+            gint64              now)
+{
+  gint64 ready = now;
+
+  g_mutex_lock (&limit->lock);
+
+  if (limit->rate > 0)
+    {
+      limit->tokens = MIN (limit->tokens + (double) limit->rate * (now - limit->refill_time) / G_USEC_PER_SEC,
+                           limit->chunk_size);
+      limit->refill_time = now;
+      limit->tokens -= bytes;
+
+      if (limit->tokens < 0)
+        ready = now + -limit->tokens / limit->rate * G_USEC_PER_SEC;
+    }
+
+  g_mutex_unlock (&limit->lock);
+
+  return ready;
+}
+
+/* Counts @bytes moved under @limits, and returns the microseconds to wait
+ * before moving more */
+gint64
+_rest_bandwidth_reserve (GPtrArray *limits,
+                         gsize      bytes)
+{
+  gint64 now, ready;
+
+  now = g_get_monotonic_time ();
+  ready = now;
+  for (guint i = 0; i < limits->len; i++)
+    ready = MAX (ready, limit_take (g_ptr_array_index (limits, i), bytes, now));
+
+  return ready - now;
+}
+
+/*
+ * A stream reading its base stream under bandwidth limits: a chunk at a
+ * time, then waiting until the limits allow the next one.
+ */
+
+#define REST_TYPE_SHAPED_STREAM (rest_shaped_stream_get_type ())
+G_DECLARE_FINAL_TYPE (RestShapedStream, rest_shaped_stream, REST, SHAPED_STREAM, GFilterInputStream)
+
+struct _RestShapedStream
+{
+  GFilterInputStream parent_instance;
+
+  GPtrArray *limits;
+};
+
+G_DEFINE_TYPE (RestShapedStream, rest_shaped_stream, G_TYPE_FILTER_INPUT_STREAM)
+
+static gsize
+rest_shaped_stream_get_chunk (RestShapedStream *self,
+                              gsize             count)
+{
+  return MIN (count, _rest_bandwidth_get_chunk_size (self->limits));
+}
+
+static gssize
+rest_shaped_stream_read (GInputStream  *stream,
+                         void          *buffer,
+                         gsize          count,
+                         GCancellable  *cancellable,
+                         GError       **error)
+{
+  RestShapedStream *self = REST_SHAPED_STREAM (stream);
+  GInputStream *base = g_filter_input_stream_get_base_stream (G_FILTER_INPUT_STREAM (stream));
+  gssize n;
+  gint64 delay;
+
+  n = g_input_stream_read (base, buffer, rest_shaped_stream_get_chunk (self, count),
+                           cancellable, error);
+  if (n <= 0)
+    return n;
+
+  delay = _rest_bandwidth_reserve (self->limits, n);
+  if (delay > 0)
+    g_usleep (delay);
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return -1;
+
+  return n;
+}
+
+static gboolean
+rest_shaped_stream_ready_cb (GCancellable *cancellable,
+                             gpointer      user_data)
+{
+  GTask *task = user_data;
+  GError *error = NULL;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, &error))
+    g_task_return_error (task, error);
+  else
+    g_task_return_int (task, GPOINTER_TO_SIZE (g_task_get_task_data (task)));
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+rest_shaped_stream_base_read_cb (GObject      *source,
+                                 GAsyncResult *result,
+                                 gpointer      user_data)
+{
+  GTask *task = user_data;
+  RestShapedStream *self = g_task_get_source_object (task);
+  GSource *wait;
+  GError *error = NULL;
+  gint64 delay;
+  gssize n;
+
+  n = g_input_stream_read_finish (G_INPUT_STREAM (source), result, &error);
+  if (n < 0)
+    {
+      g_task_return_error (task, error);
+      g_object_unref (task);
+      return;
+    }
+
+  delay = n > 0 ? _rest_bandwidth_reserve (self->limits, n) : 0;
+  if (delay <= 0)
+    {
+      g_task_return_int (task, n);
+      g_object_unref (task);
+      return;
+    }
+
+  /* Wakes up early to give up if cancelled */
+  g_task_set_task_data (task, GSIZE_TO_POINTER (n), NULL);
+  wait = g_cancellable_source_new (g_task_get_cancellable (task));
+  g_source_set_ready_time (wait, g_get_monotonic_time () + delay);
+  g_source_set_callback (wait, (GSourceFunc) rest_shaped_stream_ready_cb,
+                         task, g_object_unref);
+  g_source_attach (wait, g_task_get_context (task));
+  g_source_unref (wait);
+}
+
+static void
+rest_shaped_stream_read_async (GInputStream        *stream,
+                               void                *buffer,
+                               gsize                count,
+                               int                  io_priority,
+                               GCancellable        *cancellable,
+                               GAsyncReadyCallback  callback,
+                               gpointer             user_data)
+{
+  RestShapedStream *self = REST_SHAPED_STREAM (stream);
+  GInputStream *base = g_filter_input_stream_get_base_stream (G_FILTER_INPUT_STREAM (stream));
+  GTask *task;
+
+  task = g_task_new (stream, cancellable, callback, user_data);
+  g_task_set_source_tag (task, rest_shaped_stream_read_async);
+  g_task_set_priority (task, io_priority);
+
+  g_input_stream_read_async (base, buffer, rest_shaped_stream_get_chunk (self, count),
+                             io_priority, cancellable,
+                             rest_shaped_stream_base_read_cb, task);
+}
+
+static gssize
+rest_shaped_stream_read_finish (GInputStream  *stream,
+                                GAsyncResult  *result,
+                                GError       **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, stream), -1);
+
+  return g_task_propagate_int (G_TASK (result), error);
+}
+
+static void
+rest_shaped_stream_finalize (GObject *object)
+{
+  RestShapedStream *self = REST_SHAPED_STREAM (object);
+
+  g_ptr_array_unref (self->limits);
+
+  G_OBJECT_CLASS (rest_shaped_stream_parent_class)->finalize (object);
+}
+
+static void
+rest_shaped_stream_class_init (RestShapedStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GInputStreamClass *stream_class = G_INPUT_STREAM_CLASS (klass);
+
+  object_class->finalize = rest_shaped_stream_finalize;
+
+  stream_class->read_fn = rest_shaped_stream_read;
+  stream_class->read_async = rest_shaped_stream_read_async;
+  stream_class->read_finish = rest_shaped_stream_read_finish;
+}
+
+static void
+rest_shaped_stream_init (RestShapedStream *self)
+{
+}
+
+/* Returns a stream reading @base under @limits */
+GInputStream *
+_rest_shaped_stream_new (GInputStream *base,
+                         GPtrArray    *limits)
+{
+  RestShapedStream *self;
+
+  self = g_object_new (REST_TYPE_SHAPED_STREAM,
+                       "base-stream", base,
+                       NULL);
+  self->limits = g_ptr_array_ref (limits);
+
+  return G_INPUT_STREAM (self);
+}
@@ -0,0 +1,1413 @@
+/*
+ * librest - RESTful web services access
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * The response cache of a proxy.  Successful GET responses are kept in memory
+ * as the message that received them and its body, keyed by the request line,
+ * which already holds the bound URL and the encoded parameters.  A fresh
+ * entry is handed out in place of sending the request; a stale one turns the
+ * request into a conditional one, and a 304 then serves the stored body.
+ *
+ * Only one variant is kept per key: a response whose Vary headers do not
+ * match the request is fetched again and replaces the stored one.  Entries
+ * are evicted least recently used first once the cache is over its size.
+ *
+ * Behind the memory there can be a store in a directory, which outlives the
+ * proxy.  Bodies are files named by the SHA-256 of their content, so equal
+ * responses share one, and are mapped rather than read when used.  An index
+ * key file holds a group per response, named by the SHA-256 of its key, with
+ * its headers, body and expiry.  Every file is written aside and renamed into
+ * place, and the index only after the body, so a crash loses at most the
+ * latest responses; bodies it never got to index are removed on loading.
+ *
+ * The files are written by a worker thread, which saves the index once for
+ * all the changes made while it was busy.  The cache holds a lock on the
+ * directory while it uses it; a second one finding it locked goes without
+ * the disk store rather than overwrite the index and remove the bodies of
+ * the first.
+ */
+
+#include <config.h>
+#include <string.h>
+#include <glib/gstdio.h>
+#ifdef G_OS_UNIX
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+#include "rest-private.h"
+
+/* Rough cost of an entry besides its body and headers */
+#define ENTRY_OVERHEAD 256
+
+#define INDEX_NAME "index"
+#define LOCK_NAME "lock"
+
+typedef struct {
+  volatile gint ref_count;
+  char *key;
+  SoupMessage *message;
+  GBytes *body;
+  /* The request headers named by Vary, and their values serialised */
+  char **vary_names;
+  char *vary_values;
+  /* Monotonic time the response goes stale at */
+  gint64 expires;
+  gsize size;
+  /* Position in the LRU queue, most recently used first */
+  GList link;
+} RestCacheEntry;
+
+struct _RestCache {
+  GMutex lock;
+  GHashTable *entries;
+  GQueue lru;
+  gsize size;
+  gsize max_size;
+
+  guint64 hits;
+  guint64 misses;
+  guint64 revalidations;
+
+  /* The disk store, its index is loaded on first use */
+  char *dir;
+  guint64 dir_max_size;
+  guint64 dir_size;
+  GKeyFile *index;
+  int lock_fd;
+  /* Set once another cache was found to hold the directory */
+  gboolean lock_failed;
+  /* Counts the clears, so that writes from before one are dropped */
+  guint generation;
+  /* Responses waiting to be written, and whether the index must be saved */
+  GQueue writes;
+  gboolean index_changed;
+  /* Set while the worker writes, signalled once it stops */
+  gboolean flushing;
+  GCond flushed;
+};
+
+/* A response waiting for the worker to write it to the disk store */
+typedef struct {
+  RestCacheEntry *entry;
+  char *headers;
+  /* The real time it expires at */
+  gint64 expires;
+  guint generation;
+} RestCacheWrite;
+
+static RestCacheEntry *
+rest_cache_entry_new (char        *key,
+                      SoupMessage *message,
+                      GBytes      *body,
+                      char       **vary_names,
+                      char        *vary_values,
+                      gint64       expires);
+
+static RestCacheEntry *
+rest_cache_entry_ref (RestCacheEntry *entry)
+{
+  g_atomic_int_inc (&entry->ref_count);
+  return entry;
+}
+
+static void
+rest_cache_entry_unref (RestCacheEntry *entry)
+{
+  if (!g_atomic_int_dec_and_test (&entry->ref_count))
+    return;
+
+  g_free (entry->key);
+  g_object_unref (entry->message);
+  g_bytes_unref (entry->body);
+  g_strfreev (entry->vary_names);
+  g_free (entry->vary_values);
+  g_free (entry);
+}
+
+static SoupMessageHeaders *
+get_request_headers (SoupMessage *message)
+{
+#ifdef WITH_SOUP_2
+  return message->request_headers;
+#else
+  return soup_message_get_request_headers (message);
+#endif
+}
+
+static SoupMessageHeaders *
+get_response_headers (SoupMessage *message)
+{
+#ifdef WITH_SOUP_2
+  return message->response_headers;
+#else
+  return soup_message_get_response_headers (message);
+#endif
+}
+
+static guint
+get_status (SoupMessage *message)
+{
+#ifdef WITH_SOUP_2
+  return message->status_code;
+#else
+  return _rest_message_get_status (message);
+#endif
+}
+
+#ifndef WITH_SOUP_2
+/*
+ * Only the session can set the status of a message in libsoup 3, so the
+ * messages rebuilt from the disk store carry theirs as data.
+ */
+guint
+_rest_message_get_status (SoupMessage *message)
+{
+  gpointer status = g_object_get_data (G_OBJECT (message), "rest-cache-status");
+
+  return status ? GPOINTER_TO_UINT (status) : soup_message_get_status (message);
+}
+
+const char *
+_rest_message_get_reason_phrase (SoupMessage *message)
+{
+  gpointer status = g_object_get_data (G_OBJECT (message), "rest-cache-status");
+
+  return status ? soup_status_get_phrase (GPOINTER_TO_UINT (status))
+                : soup_message_get_reason_phrase (message);
+}
+#endif
+
+/* Returns the seconds since the epoch of an HTTP date, or -1 */
+gint64
+_rest_parse_http_date (const char *value)
+{
+  gint64 time;
+#ifdef WITH_SOUP_2
+  SoupDate *date;
+
+  if (value == NULL || (date = soup_date_new_from_string (value)) == NULL)
+    return -1;
+  time = soup_date_to_time_t (date);
+  soup_date_free (date);
+#else
+  GDateTime *date;
+
+  if (value == NULL || (date = soup_date_time_new_from_http_string (value)) == NULL)
+    return -1;
+  time = g_date_time_to_unix (date);
+  g_date_time_unref (date);
+#endif
+
+  return time;
+}
+
+static char *
+make_key (SoupMessage *message)
+{
+  g_autofree char *uri = NULL;
+
+#ifdef WITH_SOUP_2
+  uri = soup_uri_to_string (soup_message_get_uri (message), FALSE);
+  return g_strconcat (message->method, " ", uri, NULL);
+#else
+  uri = g_uri_to_string (soup_message_get_uri (message));
+  return g_strconcat (soup_message_get_method (message), " ", uri, NULL);
+#endif
+}
+
+/* Whether @message may be answered from the cache at all.  Requests that are
+ * already conditional are left alone so the caller sees the 304 itself. */
+static gboolean
+is_cacheable_request (SoupMessage *message)
+{
+  SoupMessageHeaders *headers = get_request_headers (message);
+  const char *cache_control;
+  gboolean no_store = FALSE;
+
+#ifdef WITH_SOUP_2
+  if (g_strcmp0 (message->method, SOUP_METHOD_GET) != 0)
+#else
+  if (g_strcmp0 (soup_message_get_method (message), SOUP_METHOD_GET) != 0)
+#endif
+    return FALSE;
+
+  if (soup_message_headers_get_one (headers, "If-None-Match") ||
+      soup_message_headers_get_one (headers, "If-Modified-Since"))
+    return FALSE;
+
+  cache_control = soup_message_headers_get_list (headers, "Cache-Control");
+  if (cache_control)
+    {
+      GHashTable *directives = soup_header_parse_param_list (cache_control);
+
+      no_store = g_hash_table_contains (directives, "no-store");
+      soup_header_free_param_list (directives);
+    }
+
+  return !no_store;
+}
+
+/* Whether @message asks for a stored response to be revalidated even while
+ * it is fresh, with "no-cache" or "max-age=0" */
+static gboolean
+is_revalidation_request (SoupMessage *message)
+{
+  SoupMessageHeaders *headers = get_request_headers (message);
+  const char *cache_control;
+  gboolean revalidate = FALSE;
+
+  cache_control = soup_message_headers_get_list (headers, "Cache-Control");
+  if (cache_control)
+    {
+      GHashTable *directives = soup_header_parse_param_list (cache_control);
+      const char *max_age = g_hash_table_lookup (directives, "max-age");
+
+      revalidate = g_hash_table_contains (directives, "no-cache") ||
+                   (max_age && g_ascii_strtoull (max_age, NULL, 10) == 0);
+      soup_header_free_param_list (directives);
+    }
+  else
+    {
+      const char *pragma = soup_message_headers_get_list (headers, "Pragma");
+
+      revalidate = pragma && soup_header_contains (pragma, "no-cache");
+    }
+
+  return revalidate;
+}
+
+static char *
+serialize_vary (SoupMessageHeaders *headers,
+                char              **names)
+{
+  GString *values = g_string_new (NULL);
+
+  for (guint i = 0; names && names[i]; i++)
+    {
+      const char *value = soup_message_headers_get_list (headers, names[i]);
+
+      /* A missing header differs from an empty one */
+      if (value)
+        g_string_append_printf (values, "=%s", value);
+      g_string_append_c (values, '\n');
+    }
+
+  return g_string_free (values, FALSE);
+}
+
+/*
+ * Works out how long the response in @headers stays fresh, from
+ * Cache-Control or else Expires, less its Age.  Returns %FALSE if the
+ * response must not be stored.
+ */
+static gboolean
+get_freshness_lifetime (SoupMessageHeaders *headers,
+                        gint64             *lifetime)
+{
+  const char *value;
+  gboolean explicit = FALSE;
+  gint64 age;
+
+  *lifetime = 0;
+
+  value = soup_message_headers_get_list (headers, "Cache-Control");
+  if (value)
+    {
+      GHashTable *directives = soup_header_parse_param_list (value);
+      const char *max_age;
+
+      if (g_hash_table_contains (directives, "no-store"))
+        {
+          soup_header_free_param_list (directives);
+          return FALSE;
+        }
+
+      if (g_hash_table_contains (directives, "no-cache"))
+        {
+          explicit = TRUE;
+        }
+      else if ((max_age = g_hash_table_lookup (directives, "max-age")))
+        {
+          *lifetime = g_ascii_strtoll (max_age, NULL, 10);
+          explicit = TRUE;
+        }
+
+      soup_header_free_param_list (directives);
+    }
+
+  if (!explicit && (value = soup_message_headers_get_one (headers, "Expires")))
+    {
+      gint64 expires = _rest_parse_http_date (value);
+      gint64 date = _rest_parse_http_date (soup_message_headers_get_one (headers, "Date"));
+
+      if (date < 0)
+        date = g_get_real_time () / G_USEC_PER_SEC;
+
+      /* An invalid date means already expired */
+      if (expires >= 0)
+        *lifetime = expires - date;
+    }
+
+  value = soup_message_headers_get_one (headers, "Age");
+  if (value && (age = g_ascii_strtoll (value, NULL, 10)) > 0)
+    *lifetime -= age;
+
+  *lifetime = MAX (*lifetime, 0) * G_USEC_PER_SEC;
+
+  return TRUE;
+}
+
+static void
+add_header_size (const char *name,
+                 const char *value,
+                 gpointer    user_data)
+{
+  gsize *size = user_data;
+
+  *size += strlen (name) + strlen (value) + 4;
+}
+
+static void
+rest_cache_remove (RestCache      *cache,
+                   RestCacheEntry *entry)
+{
+  g_queue_unlink (&cache->lru, &entry->link);
+  cache->size -= entry->size;
+  /* Drops the reference of the table */
+  g_hash_table_remove (cache->entries, entry->key);
+}
+
+static void
+rest_cache_trim (RestCache *cache)
+{
+  while (cache->size > cache->max_size && cache->lru.tail)
+    rest_cache_remove (cache, cache->lru.tail->data);
+}
+
+/* Keeps a reference to @entry in memory if it fits */
+static void
+rest_cache_add (RestCache      *cache,
+                RestCacheEntry *entry)
+{
+  RestCacheEntry *old;
+
+  if (entry->size > cache->max_size)
+    return;
+
+  old = g_hash_table_lookup (cache->entries, entry->key);
+  if (old)
+    rest_cache_remove (cache, old);
+
+  g_hash_table_insert (cache->entries, entry->key, rest_cache_entry_ref (entry));
+  g_queue_push_head_link (&cache->lru, &entry->link);
+  cache->size += entry->size;
+  rest_cache_trim (cache);
+}
+
+static gboolean
+rest_cache_enabled (RestCache *cache)
+{
+  return cache->max_size > 0 || cache->dir != NULL;
+}
+
+static void
+append_header_line (const char *name,
+                    const char *value,
+                    gpointer    user_data)
+{
+  g_string_append_printf (user_data, "%s: %s\n", name, value);
+}
+
+static char *
+serialize_headers (SoupMessageHeaders *headers)
+{
+  GString *lines = g_string_new (NULL);
+
+  soup_message_headers_foreach (headers, append_header_line, lines);
+
+  return g_string_free (lines, FALSE);
+}
+
+/* Rebuilds the message that received a stored response */
+static SoupMessage *
+new_stored_message (const char *key,
+                    const char *headers)
+{
+  g_auto(GStrv) request = g_strsplit (key, " ", 2);
+  g_auto(GStrv) lines = NULL;
+  SoupMessageHeaders *response_headers;
+  SoupMessage *message;
+
+  if (g_strv_length (request) != 2 ||
+      (message = soup_message_new (request[0], request[1])) == NULL)
+    return NULL;
+
+  response_headers = get_response_headers (message);
+  lines = g_strsplit (headers ? headers : "", "\n", -1);
+  for (guint i = 0; lines[i]; i++)
+    {
+      char *colon = strchr (lines[i], ':');
+
+      if (colon == NULL)
+        continue;
+
+      *colon = '\0';
+      soup_message_headers_append (response_headers, lines[i], g_strchug (colon + 1));
+    }
+
+#ifdef WITH_SOUP_2
+  soup_message_set_status (message, SOUP_STATUS_OK);
+#else
+  g_object_set_data (G_OBJECT (message), "rest-cache-status",
+                     GUINT_TO_POINTER (SOUP_STATUS_OK));
+#endif
+
+  return message;
+}
+
+/* The disk store, always used with the lock held but for the files the
+ * worker writes */
+
+static char *
+rest_cache_disk_path (RestCache  *cache,
+                      const char *name)
+{
+  return g_build_filename (cache->dir, name, NULL);
+}
+
+static char *
+rest_cache_disk_group (const char *key)
+{
+  return g_compute_checksum_for_string (G_CHECKSUM_SHA256, key, -1);
+}
+
+/* Whether @name is a body, or one being written */
+static gboolean
+is_body_name (const char *name)
+{
+  guint i;
+
+  for (i = 0; i < 64; i++)
+    {
+      if (!g_ascii_isxdigit (name[i]))
+        return FALSE;
+    }
+
+  return name[i] == '\0' || name[i] == '.';
+}
+
+/* Whether the cache could take the lock on the directory, or already has it */
+static gboolean
+rest_cache_disk_lock (RestCache *cache)
+{
+#ifdef G_OS_UNIX
+  g_autofree char *path = NULL;
+  int fd;
+
+  if (cache->lock_fd >= 0)
+    return TRUE;
+
+  /* Not tried again on every lookup, the other cache keeps it */
+  if (cache->lock_failed)
+    return FALSE;
+
+  path = rest_cache_disk_path (cache, LOCK_NAME);
+  fd = g_open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return FALSE;
+
+  /* Locks taken with flock() are dropped by a crash too.  Where they aren't
+   * supported the directory is used all the same. */
+  if (flock (fd, LOCK_EX | LOCK_NB) < 0 && errno == EWOULDBLOCK)
+    {
+      REST_DEBUG (PROXY, "The cache directory %s is used by another cache, "
+                  "keeping responses in memory only", cache->dir);
+      close (fd);
+      cache->lock_failed = TRUE;
+      return FALSE;
+    }
+
+  cache->lock_fd = fd;
+#endif
+
+  return TRUE;
+}
+
+/* Loads the index, returns %FALSE if the store cannot be used */
+static gboolean
+rest_cache_disk_load (RestCache *cache)
+{
+  g_autofree char *path = NULL;
+  g_autoptr(GHashTable) bodies = NULL;
+  g_auto(GStrv) groups = NULL;
+  const char *name;
+  GDir *dir;
+
+  if (cache->index)
+    return TRUE;
+
+  if (!rest_cache_disk_lock (cache))
+    return FALSE;
+
+  cache->index = g_key_file_new ();
+  cache->dir_size = 0;
+
+  /* A missing or damaged index starts the store over */
+  path = rest_cache_disk_path (cache, INDEX_NAME);
+  g_key_file_load_from_file (cache->index, path, G_KEY_FILE_NONE, NULL);
+
+  bodies = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  groups = g_key_file_get_groups (cache->index, NULL);
+  for (guint i = 0; groups[i]; i++)
+    {
+      char *body = g_key_file_get_string (cache->index, groups[i], "body", NULL);
+
+      if (body)
+        g_hash_table_add (bodies, body);
+      cache->dir_size += g_key_file_get_uint64 (cache->index, groups[i], "size", NULL);
+    }
+
+  /* Remove what a crash left behind: bodies written but never indexed, and
+   * files that were not renamed into place */
+  dir = g_dir_open (cache->dir, 0, NULL);
+  while (dir && (name = g_dir_read_name (dir)))
+    {
+      if ((is_body_name (name) && !g_hash_table_contains (bodies, name)) ||
+          g_str_has_prefix (name, INDEX_NAME "."))
+        {
+          g_autofree char *file = rest_cache_disk_path (cache, name);
+
+          g_unlink (file);
+        }
+    }
+  if (dir)
+    g_dir_close (dir);
+
+  return TRUE;
+}
+
+static void
+rest_cache_write_free (RestCacheWrite *write)
+{
+  rest_cache_entry_unref (write->entry);
+  g_free (write->headers);
+  g_free (write);
+}
+
+/* Writes out @data, the index; may be called without the lock */
+static void
+rest_cache_disk_write_index (RestCache  *cache,
+                             const char *data,
+                             gsize       length)
+{
+  g_autofree char *path = rest_cache_disk_path (cache, INDEX_NAME);
+  GError *error = NULL;
+
+  if (!g_file_set_contents (path, data, length, &error))
+    {
+      REST_DEBUG (PROXY, "Cannot save the cache index: %s", error->message);
+      g_error_free (error);
+    }
+}
+
+static void rest_cache_disk_add (RestCache      *cache,
+                                 RestCacheWrite *write,
+                                 const char     *body);
+static gboolean rest_cache_disk_body_used (RestCache  *cache,
+                                           const char *body);
+
+static void
+rest_cache_disk_flush_thread (GTask        *task,
+                              gpointer      source_object,
+                              gpointer      task_data,
+                              GCancellable *cancellable)
+{
+  RestCache *cache = task_data;
+  RestCacheWrite *write;
+
+  g_mutex_lock (&cache->lock);
+
+  for (;;)
+    {
+      if ((write = g_queue_pop_head (&cache->writes)))
+        {
+          g_autofree char *body = NULL;
+          g_autofree char *path = NULL;
+          GError *error = NULL;
+          gboolean written = TRUE;
+
+          g_mutex_unlock (&cache->lock);
+
+          body = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, write->entry->body);
+          path = rest_cache_disk_path (cache, body);
+
+          /* An existing body has the same content by its name */
+          if (!g_file_test (path, G_FILE_TEST_EXISTS) &&
+              !g_file_set_contents (path,
+                                    g_bytes_get_data (write->entry->body, NULL),
+                                    g_bytes_get_size (write->entry->body),
+                                    &error))
+            {
+              REST_DEBUG (PROXY, "Cannot store a response: %s", error->message);
+              g_error_free (error);
+              written = FALSE;
+            }
+
+          g_mutex_lock (&cache->lock);
+
+          /* The cache was cleared while the body was written */
+          if (write->generation != cache->generation)
+            {
+              if (written && !rest_cache_disk_body_used (cache, body))
+                g_unlink (path);
+            }
+          else if (written)
+            {
+              rest_cache_disk_add (cache, write, body);
+            }
+          rest_cache_write_free (write);
+        }
+      else if (cache->index_changed)
+        {
+          g_autofree char *data = NULL;
+          gsize length;
+
+          data = g_key_file_to_data (cache->index, &length, NULL);
+          cache->index_changed = FALSE;
+
+          g_mutex_unlock (&cache->lock);
+          rest_cache_disk_write_index (cache, data, length);
+          g_mutex_lock (&cache->lock);
+        }
+      else
+        {
+          break;
+        }
+    }
+
+  cache->flushing = FALSE;
+  g_cond_broadcast (&cache->flushed);
+
+  g_mutex_unlock (&cache->lock);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+/* Has the worker write what is pending, unless it is at it already */
+static void
+rest_cache_disk_flush (RestCache *cache)
+{
+  GTask *task;
+
+  if (cache->flushing)
+    return;
+
+  cache->flushing = TRUE;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  g_task_set_source_tag (task, rest_cache_disk_flush);
+  g_task_set_task_data (task, cache, NULL);
+  g_task_run_in_thread (task, rest_cache_disk_flush_thread);
+  g_object_unref (task);
+}
+
+/* Saves the index, along with the other changes made before it is written */
+static void
+rest_cache_disk_save (RestCache *cache)
+{
+  cache->index_changed = TRUE;
+  rest_cache_disk_flush (cache);
+}
+
+/* Waits for the worker, saves the index and lets go of the directory */
+static void
+rest_cache_disk_unload (RestCache *cache)
+{
+  while (cache->flushing)
+    g_cond_wait (&cache->flushed, &cache->lock);
+
+  if (cache->index)
+    {
+      if (cache->index_changed)
+        {
+          g_autofree char *data = NULL;
+          gsize length;
+
+          data = g_key_file_to_data (cache->index, &length, NULL);
+          rest_cache_disk_write_index (cache, data, length);
+          cache->index_changed = FALSE;
+        }
+      g_clear_pointer (&cache->index, g_key_file_unref);
+    }
+
+#ifdef G_OS_UNIX
+  if (cache->lock_fd >= 0)
+    {
+      close (cache->lock_fd);
+      cache->lock_fd = -1;
+    }
+#endif
+}
+
+static gboolean
+rest_cache_disk_body_used (RestCache  *cache,
+                           const char *body)
+{
+  g_auto(GStrv) groups = g_key_file_get_groups (cache->index, NULL);
+
+  for (guint i = 0; groups[i]; i++)
+    {
+      g_autofree char *other = g_key_file_get_string (cache->index, groups[i], "body", NULL);
+
+      if (g_strcmp0 (other, body) == 0)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static void
+rest_cache_disk_remove (RestCache  *cache,
+                        const char *group)
+{
+  g_autofree char *body = g_key_file_get_string (cache->index, group, "body", NULL);
+  guint64 size = g_key_file_get_uint64 (cache->index, group, "size", NULL);
+
+  cache->dir_size -= MIN (size, cache->dir_size);
+  g_key_file_remove_group (cache->index, group, NULL);
+
+  /* Responses with the same content share the body */
+  if (body && !rest_cache_disk_body_used (cache, body))
+    {
+      g_autofree char *path = rest_cache_disk_path (cache, body);
+
+      g_unlink (path);
+    }
+}
+
+static gint
+compare_used (gconstpointer a,
+              gconstpointer b,
+              gpointer      user_data)
+{
+  GKeyFile *index = user_data;
+  gint64 used_a = g_key_file_get_int64 (index, *(char **) a, "used", NULL);
+  gint64 used_b = g_key_file_get_int64 (index, *(char **) b, "used", NULL);
+
+  return (used_a > used_b) - (used_a < used_b);
+}
+
+static void
+rest_cache_disk_trim (RestCache *cache)
+{
+  g_auto(GStrv) groups = NULL;
+  gsize n_groups;
+
+  if (cache->dir_size <= cache->dir_max_size)
+    return;
+
+  groups = g_key_file_get_groups (cache->index, &n_groups);
+  g_qsort_with_data (groups, n_groups, sizeof (char *), compare_used, cache->index);
+
+  for (gsize i = 0; i < n_groups && cache->dir_size > cache->dir_max_size; i++)
+    rest_cache_disk_remove (cache, groups[i]);
+}
+
+/* Returns a new entry for the response to @key in the store, or %NULL */
+static RestCacheEntry *
+rest_cache_disk_get (RestCache  *cache,
+                     const char *key)
+{
+  g_autofree char *group = NULL;
+  g_autofree char *body = NULL;
+  g_autofree char *path = NULL;
+  g_autofree char *headers = NULL;
+  GMappedFile *mapped;
+  SoupMessage *message = NULL;
+  RestCacheEntry *entry;
+  GBytes *bytes;
+  char *vary_values;
+  gint64 expires;
+
+  if (!rest_cache_disk_load (cache))
+    return NULL;
+
+  group = rest_cache_disk_group (key);
+  body = g_key_file_get_string (cache->index, group, "body", NULL);
+  if (body == NULL)
+    return NULL;
+
+  path = rest_cache_disk_path (cache, body);
+  headers = g_key_file_get_string (cache->index, group, "headers", NULL);
+
+  mapped = g_mapped_file_new (path, FALSE, NULL);
+  if (mapped)
+    message = new_stored_message (key, headers);
+
+  if (message == NULL)
+    {
+      /* The body went away behind our back */
+      g_clear_pointer (&mapped, g_mapped_file_unref);
+      rest_cache_disk_remove (cache, group);
+      rest_cache_disk_save (cache);
+      return NULL;
+    }
+
+  /* The bytes keep the file mapped for as long as the payload is used */
+  bytes = g_mapped_file_get_bytes (mapped);
+  g_mapped_file_unref (mapped);
+
+  vary_values = g_key_file_get_string (cache->index, group, "vary-values", NULL);
+  expires = g_key_file_get_int64 (cache->index, group, "expires", NULL);
+
+  entry = rest_cache_entry_new (g_strdup (key), message, bytes,
+                                g_key_file_get_string_list (cache->index, group,
+                                                            "vary-names", NULL, NULL),
+                                vary_values ? vary_values : g_strdup (""),
+                                g_get_monotonic_time () + expires - g_get_real_time ());
+  g_object_unref (message);
+  g_bytes_unref (bytes);
+
+  /* Saved with the next change to the index */
+  g_key_file_set_int64 (cache->index, group, "used", g_get_real_time ());
+
+  return entry;
+}
+
+/* Has the worker write @entry, which expires at the real time @expires, to
+ * the store */
+static void
+rest_cache_disk_put (RestCache      *cache,
+                     RestCacheEntry *entry,
+                     gint64          expires)
+{
+  RestCacheWrite *write;
+
+  if (g_bytes_get_size (entry->body) > cache->dir_max_size ||
+      !rest_cache_disk_load (cache))
+    return;
+
+  write = g_new0 (RestCacheWrite, 1);
+  write->entry = rest_cache_entry_ref (entry);
+  write->headers = serialize_headers (get_response_headers (entry->message));
+  write->expires = expires;
+  write->generation = cache->generation;
+  g_queue_push_tail (&cache->writes, write);
+
+  rest_cache_disk_flush (cache);
+}
+
+/* Indexes the response of @write, once the worker wrote its body to the
+ * file named @body */
+static void
+rest_cache_disk_add (RestCache      *cache,
+                     RestCacheWrite *write,
+                     const char     *body)
+{
+  RestCacheEntry *entry = write->entry;
+  g_autofree char *group = NULL;
+  gsize size = g_bytes_get_size (entry->body);
+
+  group = rest_cache_disk_group (entry->key);
+  if (g_key_file_has_group (cache->index, group))
+    rest_cache_disk_remove (cache, group);
+
+  g_key_file_set_string (cache->index, group, "key", entry->key);
+  g_key_file_set_string (cache->index, group, "body", body);
+  g_key_file_set_uint64 (cache->index, group, "size", size);
+  g_key_file_set_string (cache->index, group, "headers", write->headers);
+  g_key_file_set_int64 (cache->index, group, "expires", write->expires);
+  g_key_file_set_int64 (cache->index, group, "used", g_get_real_time ());
+  if (entry->vary_names)
+    g_key_file_set_string_list (cache->index, group, "vary-names",
+                                (const char * const *) entry->vary_names,
+                                g_strv_length (entry->vary_names));
+  g_key_file_set_string (cache->index, group, "vary-values", entry->vary_values);
+
+  cache->dir_size += size;
+  rest_cache_disk_trim (cache);
+  cache->index_changed = TRUE;
+}
+
+/* Saves the headers and expiry of @entry after a revalidation */
+static void
+rest_cache_disk_update (RestCache      *cache,
+                        RestCacheEntry *entry,
+                        gint64          expires)
+{
+  g_autofree char *group = NULL;
+  g_autofree char *headers = NULL;
+
+  if (!rest_cache_disk_load (cache))
+    return;
+
+  group = rest_cache_disk_group (entry->key);
+  if (!g_key_file_has_group (cache->index, group))
+    return;
+
+  headers = serialize_headers (get_response_headers (entry->message));
+  g_key_file_set_string (cache->index, group, "headers", headers);
+  g_key_file_set_int64 (cache->index, group, "expires", expires);
+  rest_cache_disk_save (cache);
+}
+
+RestCache *
+_rest_cache_new (void)
+{
+  RestCache *cache;
+
+  cache = g_new0 (RestCache, 1);
+  g_mutex_init (&cache->lock);
+  g_cond_init (&cache->flushed);
+  cache->entries = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                          (GDestroyNotify) rest_cache_entry_unref);
+  g_queue_init (&cache->lru);
+  g_queue_init (&cache->writes);
+  cache->lock_fd = -1;
+
+  return cache;
+}
+
+void
+_rest_cache_free (RestCache *cache)
+{
+  g_mutex_lock (&cache->lock);
+  rest_cache_disk_unload (cache);
+  g_mutex_unlock (&cache->lock);
+  g_free (cache->dir);
+
+  g_queue_init (&cache->lru);
+  g_hash_table_unref (cache->entries);
+  g_cond_clear (&cache->flushed);
+  g_mutex_clear (&cache->lock);
+  g_free (cache);
+}
+
+void
+_rest_cache_set_max_size (RestCache *cache,
+                          gsize      max_size)
+{
+  g_mutex_lock (&cache->lock);
+  cache->max_size = max_size;
+  rest_cache_trim (cache);
+  g_mutex_unlock (&cache->lock);
+}
+
+gsize
+_rest_cache_get_max_size (RestCache *cache)
+{
+  return cache->max_size;
+}
+
+void
+_rest_cache_set_dir (RestCache  *cache,
+                     const char *dir)
+{
+  g_mutex_lock (&cache->lock);
+
+  rest_cache_disk_unload (cache);
+
+  g_free (cache->dir);
+  cache->dir = g_strdup (dir);
+  cache->lock_failed = FALSE;
+  if (cache->dir)
+    g_mkdir_with_parents (cache->dir, 0700);
+
+  g_mutex_unlock (&cache->lock);
+}
+
+const char *
+_rest_cache_get_dir (RestCache *cache)
+{
+  return cache->dir;
+}
+
+void
+_rest_cache_set_dir_max_size (RestCache *cache,
+                              guint64    max_size)
+{
+  g_mutex_lock (&cache->lock);
+  cache->dir_max_size = max_size;
+  if (cache->index)
+    {
+      rest_cache_disk_trim (cache);
+      rest_cache_disk_save (cache);
+    }
+  g_mutex_unlock (&cache->lock);
+}
+
+guint64
+_rest_cache_get_dir_max_size (RestCache *cache)
+{
+  return cache->dir_max_size;
+}
+
+void
+_rest_cache_clear (RestCache *cache)
+{
+  g_mutex_lock (&cache->lock);
+  g_queue_init (&cache->lru);
+  g_hash_table_remove_all (cache->entries);
+  cache->size = 0;
+
+  if (cache->dir)
+    {
+      g_auto(GStrv) groups = NULL;
+      RestCacheWrite *write;
+
+      /* Also drops the one the worker may be writing */
+      cache->generation++;
+      while ((write = g_queue_pop_head (&cache->writes)))
+        rest_cache_write_free (write);
+
+      if (rest_cache_disk_load (cache))
+        {
+          groups = g_key_file_get_groups (cache->index, NULL);
+          for (guint i = 0; groups[i]; i++)
+            rest_cache_disk_remove (cache, groups[i]);
+          rest_cache_disk_save (cache);
+        }
+    }
+
+  g_mutex_unlock (&cache->lock);
+}
+
+void
+_rest_cache_get_stats (RestCache *cache,
+                       guint64   *hits,
+                       guint64   *misses,
+                       guint64   *revalidations)
+{
+  g_mutex_lock (&cache->lock);
+  if (hits)
+    *hits = cache->hits;
+  if (misses)
+    *misses = cache->misses;
+  if (revalidations)
+    *revalidations = cache->revalidations;
+  g_mutex_unlock (&cache->lock);
+}
+
+/*
+ * Looks @message up before it is sent.  Returns a new reference to the message
+ * holding the stored response, and its body in @body, if a fresh one is
+ * stored.  Otherwise returns %NULL, after making @message conditional if a
+ * stale response can be revalidated; _rest_cache_store() takes it from there.
+ */
+SoupMessage *
+_rest_cache_lookup (RestCache    *cache,
+                    SoupMessage  *message,
+                    GBytes      **body)
+{
+  g_autofree char *key = NULL;
+  g_autofree char *vary_values = NULL;
+  SoupMessageHeaders *request_headers;
+  SoupMessageHeaders *stored_headers;
+  RestCacheEntry *entry;
+  SoupMessage *response = NULL;
+  const char *etag, *last_modified;
+
+  if (!rest_cache_enabled (cache) || !is_cacheable_request (message))
+    return NULL;
+
+  key = make_key (message);
+  request_headers = get_request_headers (message);
+
+  g_mutex_lock (&cache->lock);
+
+  entry = g_hash_table_lookup (cache->entries, key);
+  if (entry)
+    {
+      rest_cache_entry_ref (entry);
+      g_queue_unlink (&cache->lru, &entry->link);
+      g_queue_push_head_link (&cache->lru, &entry->link);
+    }
+  else if (cache->dir && (entry = rest_cache_disk_get (cache, key)))
+    {
+      rest_cache_add (cache, entry);
+    }
+
+  if (entry == NULL)
+    goto out;
+
+  vary_values = serialize_vary (request_headers, entry->vary_names);
+  if (strcmp (vary_values, entry->vary_values) != 0)
+    goto out;
+
+  if (entry->expires > g_get_monotonic_time () && !is_revalidation_request (message))
+    {
+      cache->hits++;
+      response = g_object_ref (entry->message);
+      *body = g_bytes_ref (entry->body);
+      goto out;
+    }
+
+  stored_headers = get_response_headers (entry->message);
+  etag = soup_message_headers_get_one (stored_headers, "ETag");
+  last_modified = soup_message_headers_get_one (stored_headers, "Last-Modified");
+
+  if (etag)
+    soup_message_headers_replace (request_headers, "If-None-Match", etag);
+  if (last_modified)
+    soup_message_headers_replace (request_headers, "If-Modified-Since", last_modified);
+
+  if (etag || last_modified)
+    {
+      g_object_set_data_full (G_OBJECT (message), "rest-cache-entry",
+                              rest_cache_entry_ref (entry),
+                              (GDestroyNotify) rest_cache_entry_unref);
+      g_object_set_data (G_OBJECT (message), "rest-cache-conditional", GINT_TO_POINTER (TRUE));
+    }
+
+ out:
+  g_mutex_unlock (&cache->lock);
+
+  if (entry)
+    rest_cache_entry_unref (entry);
+
+  return response;
+}
+
+static void
+remove_header (const char *name,
+               const char *value,
+               gpointer    user_data)
+{
+  soup_message_headers_remove (user_data, name);
+}
+
+static void
+append_header (const char *name,
+               const char *value,
+               gpointer    user_data)
+{
+  soup_message_headers_append (user_data, name, value);
+}
+
+/* Headers of a 304 that describe it rather than the stored body */
+static gboolean
+is_framing_header (const char *name)
+{
+  return g_ascii_strcasecmp (name, "Content-Length") == 0 ||
+         g_ascii_strcasecmp (name, "Content-Encoding") == 0 ||
+         g_ascii_strcasecmp (name, "Transfer-Encoding") == 0;
+}
+
+static void
+update_headers (SoupMessageHeaders *stored,
+                SoupMessageHeaders *fresh)
+{
+  SoupMessageHeaders *update;
+  SoupMessageHeadersIter iter;
+  const char *name, *value;
+
+  update = soup_message_headers_new (SOUP_MESSAGE_HEADERS_RESPONSE);
+  soup_message_headers_iter_init (&iter, fresh);
+  while (soup_message_headers_iter_next (&iter, &name, &value))
+    {
+      if (!is_framing_header (name))
+        soup_message_headers_append (update, name, value);
+    }
+
+  soup_message_headers_foreach (update, remove_header, stored);
+  soup_message_headers_foreach (update, append_header, stored);
+#ifdef WITH_SOUP_2
+  soup_message_headers_free (update);
+#else
+  soup_message_headers_unref (update);
+#endif
+}
+
+static RestCacheEntry *
+rest_cache_entry_new (char        *key,
+                      SoupMessage *message,
+                      GBytes      *body,
+                      char       **vary_names,
+                      char        *vary_values,
+                      gint64       expires)
+{
+  RestCacheEntry *entry;
+
+  entry = g_new0 (RestCacheEntry, 1);
+  entry->ref_count = 1;
+  entry->key = key;
+  entry->message = g_object_ref (message);
+  entry->body = g_bytes_ref (body);
+  entry->vary_names = vary_names;
+  entry->vary_values = vary_values;
+  entry->expires = expires;
+  entry->link.data = entry;
+
+  entry->size = ENTRY_OVERHEAD + strlen (key) + g_bytes_get_size (body);
+  soup_message_headers_foreach (get_response_headers (message), add_header_size, &entry->size);
+
+  return entry;
+}
+
+static void
+rest_cache_insert (RestCache   *cache,
+                   SoupMessage *message,
+                   GBytes      *body,
+                   gint64       lifetime)
+{
+  RestCacheEntry *entry;
+  const char *vary;
+  char **vary_names = NULL;
+
+  vary = soup_message_headers_get_list (get_response_headers (message), "Vary");
+  if (vary && strchr (vary, '*'))
+    return;
+
+  if (vary)
+    {
+      GSList *names = soup_header_parse_list (vary);
+      GPtrArray *array = g_ptr_array_new ();
+
+      for (GSList *l = names; l; l = l->next)
+        g_ptr_array_add (array, g_strdup (l->data));
+      g_ptr_array_add (array, NULL);
+      vary_names = (char **) g_ptr_array_free (array, FALSE);
+      soup_header_free_list (names);
+    }
+
+  entry = rest_cache_entry_new (make_key (message), message, body, vary_names,
+                                serialize_vary (get_request_headers (message), vary_names),
+                                g_get_monotonic_time () + lifetime);
+
+  g_mutex_lock (&cache->lock);
+  rest_cache_add (cache, entry);
+  if (cache->dir)
+    rest_cache_disk_put (cache, entry, g_get_real_time () + lifetime);
+  g_mutex_unlock (&cache->lock);
+
+  rest_cache_entry_unref (entry);
+}
+
+static void
+remove_conditions (SoupMessageHeaders *request_headers)
+{
+  soup_message_headers_remove (request_headers, "If-None-Match");
+  soup_message_headers_remove (request_headers, "If-Modified-Since");
+}
+
+/*
+ * Takes back the conditions _rest_cache_lookup() added to @message, so that
+ * it is looked up again when it is sent once more.
+ */
+void
+_rest_cache_reset_message (SoupMessage *message)
+{
+  if (g_object_get_data (G_OBJECT (message), "rest-cache-conditional") == NULL)
+    return;
+
+  remove_conditions (get_request_headers (message));
+
+  g_object_set_data (G_OBJECT (message), "rest-cache-conditional", NULL);
+  g_object_set_data (G_OBJECT (message), "rest-cache-entry", NULL);
+}
+
+/*
+ * Removes from @copy, whose request headers were copied from @message, the
+ * conditions _rest_cache_lookup() added to @message.  The copy is looked up
+ * on its own when it is sent.
+ */
+void
+_rest_cache_reset_copy (SoupMessage *message,
+                        SoupMessage *copy)
+{
+  if (g_object_get_data (G_OBJECT (message), "rest-cache-conditional"))
+    remove_conditions (get_request_headers (copy));
+}
+
+/*
+ * Hands the response to @message, with @body, to the cache once it has been
+ * received.  Returns a new reference to the message holding the stored
+ * response if @message was revalidated with a 304, in which case @body is
+ * replaced by the stored one; otherwise returns %NULL.
+ */
+SoupMessage *
+_rest_cache_store (RestCache    *cache,
+                   SoupMessage  *message,
+                   GBytes      **body)
+{
+  RestCacheEntry *entry;
+  SoupMessage *response = NULL;
+  gint64 lifetime;
+
+  entry = g_object_steal_data (G_OBJECT (message), "rest-cache-entry");
+
+  /* A request we made conditional was cacheable when it was looked up */
+  if (entry == NULL && (!rest_cache_enabled (cache) || !is_cacheable_request (message)))
+    goto out;
+
+  if (entry && get_status (message) == SOUP_STATUS_NOT_MODIFIED)
+    {
+      g_autofree char *stored = NULL;
+      SoupMessage *updated;
+      SoupMessageHeaders *headers;
+
+      /* Lookups may still be reading the stored message's headers, so the
+       * new ones go on a copy that then replaces it */
+      g_mutex_lock (&cache->lock);
+      cache->revalidations++;
+      stored = serialize_headers (get_response_headers (entry->message));
+      updated = new_stored_message (entry->key, stored);
+      if (updated)
+        {
+          g_object_unref (entry->message);
+          entry->message = updated;
+        }
+      headers = get_response_headers (entry->message);
+      update_headers (headers, get_response_headers (message));
+      if (get_freshness_lifetime (headers, &lifetime))
+        {
+          entry->expires = g_get_monotonic_time () + lifetime;
+          if (cache->dir)
+            rest_cache_disk_update (cache, entry, g_get_real_time () + lifetime);
+        }
+      response = g_object_ref (entry->message);
+      g_mutex_unlock (&cache->lock);
+
+      g_bytes_unref (*body);
+      *body = g_bytes_ref (entry->body);
+      goto out;
+    }
+
+  g_mutex_lock (&cache->lock);
+  cache->misses++;
+  g_mutex_unlock (&cache->lock);
+
+  if (get_status (message) != SOUP_STATUS_OK ||
+      !get_freshness_lifetime (get_response_headers (message), &lifetime))
+    goto out;
+
+  /* Without a validator a stale response is of no use */
+  if (lifetime == 0 &&
+      !soup_message_headers_get_one (get_response_headers (message), "ETag") &&
+      !soup_message_headers_get_one (get_response_headers (message), "Last-Modified"))
+    goto out;
+
+  rest_cache_insert (cache, message, *body, lifetime);
+
+ out:
+  if (entry)
+    rest_cache_entry_unref (entry);
+
+  return response;
+}
@@ -0,0 +1,268 @@
+/*
+ * librest - RESTful web services access
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <config.h>
+#include "rest-call-template.h"
+#include "rest-private.h"
+#include "rest-proxy-call-private.h"
+
+/**
+ * SECTION:rest-call-template
+ * @short_description: Prepared calls for endpoints that are used repeatedly
+ * @see_also: #RestProxyCall, #RestProxy.
+ *
+ * A #RestCallTemplate holds everything about a call that stays the same from
+ * one request to the next.  The string parameters are form encoded once when
+ * they are added, and calls created with rest_call_template_new_call() share
+ * the #RestParam objects of the template instead of copying them.
+ *
+ * |[
+ * RestCallTemplate *template = rest_call_template_new (proxy, "GET", "search");
+ * rest_call_template_add_header (template, "Accept", "application/json");
+ * rest_call_template_add_param (template, "api_key", key);
+ *
+ * call = rest_call_template_new_call (template);
+ * rest_proxy_call_add_param (call, "q", query);
+ * rest_proxy_call_invoke_async (call, NULL, callback, NULL);
+ * ]|
+ *
+ * A template must not be modified while calls are being created from it in
+ * other threads.
+ */
+
+struct _RestCallTemplate
+{
+  volatile gint ref_count;
+
+  RestProxy *proxy;
+  char *method;
+  char *function;
+
+  /* Header names and values, alternating */
+  GPtrArray *headers;
+  RestParams *params;
+  /* The string parameters of params, form encoded */
+  GString *form;
+};
+
+G_DEFINE_BOXED_TYPE (RestCallTemplate, rest_call_template, rest_call_template_ref, rest_call_template_unref)
+
+/**
+ * rest_call_template_new:
+ * @proxy: the #RestProxy the calls are made on
+ * @method: (nullable): the HTTP method, or %NULL for GET
+ * @function: (nullable): the REST function, or %NULL
+ *
+ * Create a new #RestCallTemplate for calls to @function on @proxy.
+ *
+ * Returns: (transfer full): a new #RestCallTemplate
+ */
+RestCallTemplate *
+rest_call_template_new (RestProxy  *proxy,
+                        const char *method,
+                        const char *function)
+{
+  RestCallTemplate *self;
+
+  g_return_val_if_fail (REST_IS_PROXY (proxy), NULL);
+
+  self = g_slice_new0 (RestCallTemplate);
+  self->ref_count = 1;
+  self->proxy = g_object_ref (proxy);
+  self->method = g_strdup (method ? method : "GET");
+  self->function = g_strdup (function);
+  self->headers = g_ptr_array_new_with_free_func (g_free);
+  self->params = rest_params_new ();
+  self->form = g_string_new (NULL);
+
+  return self;
+}
+
+/**
+ * rest_call_template_ref:
+ * @self: a #RestCallTemplate
+ *
+ * Increments the reference count of @self by one.
+ *
+ * Returns: (transfer full): @self
+ */
+RestCallTemplate *
+rest_call_template_ref (RestCallTemplate *self)
+{
+  g_return_val_if_fail (self, NULL);
+  g_return_val_if_fail (self->ref_count > 0, NULL);
+
+  g_atomic_int_inc (&self->ref_count);
+
+  return self;
+}
+
+/**
+ * rest_call_template_unref:
+ * @self: a #RestCallTemplate
+ *
+ * Decrements the reference count of @self by one, freeing it when the
+ * reference count reaches zero.
+ */
+void
+rest_call_template_unref (RestCallTemplate *self)
+{
+  g_return_if_fail (self);
+  g_return_if_fail (self->ref_count > 0);
+
+  if (g_atomic_int_dec_and_test (&self->ref_count))
+    {
+      g_clear_object (&self->proxy);
+      g_free (self->method);
+      g_free (self->function);
+      g_ptr_array_unref (self->headers);
+      rest_params_unref (self->params);
+      g_string_free (self->form, TRUE);
+
+      g_slice_free (RestCallTemplate, self);
+    }
+}
+
+/**
+ * rest_call_template_add_header:
+ * @self: a #RestCallTemplate
+ * @header: the name of the header
+ * @value: the value of the header
+ *
+ * Add a header that is set on every call created from @self.
+ */
+void
+rest_call_template_add_header (RestCallTemplate *self,
+                               const char       *header,
+                               const char       *value)
+{
+  g_return_if_fail (self);
+  g_return_if_fail (header);
+  g_return_if_fail (value);
+
+  g_ptr_array_add (self->headers, g_strdup (header));
+  g_ptr_array_add (self->headers, g_strdup (value));
+}
+
+/**
+ * rest_call_template_add_param_full:
+ * @self: a #RestCallTemplate
+ * @param: (transfer full): a #RestParam
+ *
+ * Add a parameter that is set on every call created from @self.
+ */
+void
+rest_call_template_add_param_full (RestCallTemplate *self,
+                                   RestParam        *param)
+{
+  g_return_if_fail (self);
+  g_return_if_fail (param);
+
+  rest_params_add (self->params, param);
+  _rest_params_append_form (self->params, _rest_params_get_array (self->params)->len - 1, self->form);
+}
+
+/**
+ * rest_call_template_add_param:
+ * @self: a #RestCallTemplate
+ * @name: the name of the parameter
+ * @value: the value of the parameter
+ *
+ * Add a string parameter that is set on every call created from @self.
+ */
+void
+rest_call_template_add_param (RestCallTemplate *self,
+                              const char       *name,
+                              const char       *value)
+{
+  g_return_if_fail (self);
+
+  rest_call_template_add_param_full (self,
+                                     rest_param_new_string (name, REST_MEMORY_COPY, value));
+}
+
+/**
+ * rest_call_template_new_call:
+ * @self: a #RestCallTemplate
+ *
+ * Create a new call from @self.  The call is created with
+ * rest_proxy_new_call(), so proxies that override the call type still get
+ * their own subclass, and starts out with the method, function, headers and
+ * parameters of the template.  Further parameters and headers can be added
+ * to the call as usual.
+ *
+ * Returns: (transfer full): a new #RestProxyCall
+ */
+RestProxyCall *
+rest_call_template_new_call (RestCallTemplate *self)
+{
+  RestProxyCall *call;
+  RestParams *params;
+  GPtrArray *ours;
+
+  g_return_val_if_fail (self, NULL);
+
+  call = rest_proxy_new_call (self->proxy);
+  rest_proxy_call_set_method (call, self->method);
+  rest_proxy_call_set_function (call, self->function);
+
+  /* The call holds a reference on the template, so the header strings can
+   * be shared */
+  _rest_proxy_call_set_template (call, self);
+
+  for (guint i = 0; i + 1 < self->headers->len; i += 2)
+    rest_proxy_call_add_header_static (call,
+                                       g_ptr_array_index (self->headers, i),
+                                       g_ptr_array_index (self->headers, i + 1));
+
+  params = rest_proxy_call_get_params (call);
+  ours = _rest_params_get_array (self->params);
+  for (guint i = 0; i < ours->len; i++)
+    rest_params_add (params, rest_param_ref (g_ptr_array_index (ours, i)));
+
+  return call;
+}
+
+/*
+ * _rest_call_template_get_form:
+ * @self: a #RestCallTemplate
+ * @params: the parameters of a call created from @self
+ * @n_params: (out): the number of parameters covered by the returned form
+ *
+ * Returns: (nullable): the encoded template parameters if @params still
+ * starts with them, %NULL otherwise
+ */
+const char *
+_rest_call_template_get_form (RestCallTemplate *self,
+                              RestParams       *params,
+                              guint            *n_params)
+{
+  GPtrArray *ours = _rest_params_get_array (self->params);
+  GPtrArray *theirs = _rest_params_get_array (params);
+
+  *n_params = 0;
+
+  if (theirs->len < ours->len)
+    return NULL;
+
+  for (guint i = 0; i < ours->len; i++)
+    if (ours->pdata[i] != theirs->pdata[i])
+      return NULL;
+
+  *n_params = ours->len;
+  return self->form->str;
+}
@@ -0,0 +1,56 @@
+/*
+ * librest - RESTful web services access
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib-object.h>
+#include <rest/rest-param.h>
+#include <rest/rest-proxy.h>
+#include <rest/rest-proxy-call.h>
+
+G_BEGIN_DECLS
+
+#define REST_TYPE_CALL_TEMPLATE (rest_call_template_get_type ())
+
+/**
+ * RestCallTemplate:
+ *
+ * A prepared description of a call that is made over and over again.  The
+ * method, function, headers and parameters that never change are set up once
+ * and every call created from the template starts out with them.
+ */
+typedef struct _RestCallTemplate RestCallTemplate;
+
+GType             rest_call_template_get_type          (void) G_GNUC_CONST;
+RestCallTemplate *rest_call_template_new               (RestProxy        *proxy,
+                                                        const char       *method,
+                                                        const char       *function);
+RestCallTemplate *rest_call_template_ref               (RestCallTemplate *self);
+void              rest_call_template_unref             (RestCallTemplate *self);
+void              rest_call_template_add_header        (RestCallTemplate *self,
+                                                        const char       *header,
+                                                        const char       *value);
+void              rest_call_template_add_param         (RestCallTemplate *self,
+                                                        const char       *name,
+                                                        const char       *value);
+void              rest_call_template_add_param_full    (RestCallTemplate *self,
+                                                        RestParam        *param);
+RestProxyCall    *rest_call_template_new_call          (RestCallTemplate *self);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RestCallTemplate, rest_call_template_unref)
+
+G_END_DECLS
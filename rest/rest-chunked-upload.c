@@ -0,0 +1,1093 @@
+/*
+ * librest - RESTful web services access
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <config.h>
+#include <string.h>
+#include "rest-chunked-upload.h"
+#include "rest-xml-parser.h"
+#include "rest-private.h"
+
+/**
+ * SECTION:rest-chunked-upload
+ * @short_description: Resumable uploads of large files in parallel parts
+ * @see_also: #RestProxy, #RestProxyCall.
+ *
+ * rest_proxy_upload_chunked_async() splits a file into parts of a fixed size
+ * and uploads several of them at the same time.  A part that fails is sent
+ * again, and when a state file is given the parts that made it to the server
+ * are recorded in it, so that an upload interrupted by an error or a restart
+ * of the program continues where it stopped.
+ *
+ * How the parts are sent and put back together is up to a
+ * #RestUploadProtocol.  librest provides rest_upload_protocol_new_s3() for
+ * S3 style multipart uploads and rest_upload_protocol_new_tus() for tus
+ * servers with the concatenation extension; other protocols can subclass
+ * #RestUploadProtocol.
+ */
+
+#define UPLOAD_DEFAULT_PART_SIZE (8 * 1024 * 1024)
+#define UPLOAD_DEFAULT_PARALLEL 4
+#define UPLOAD_PART_MAX_RETRIES 3
+/* The longest wait before the first retry of a part, doubled for each one */
+#define UPLOAD_PART_RETRY_DELAY_MS 500
+
+G_DEFINE_TYPE (RestUploadProtocol, rest_upload_protocol, G_TYPE_OBJECT)
+
+static gboolean
+rest_upload_protocol_real_parse_finalize (RestUploadProtocol  *protocol,
+                                          RestProxyCall       *call,
+                                          GError             **error)
+{
+  return TRUE;
+}
+
+static void
+rest_upload_protocol_class_init (RestUploadProtocolClass *klass)
+{
+  klass->parse_finalize = rest_upload_protocol_real_parse_finalize;
+}
+
+static void
+rest_upload_protocol_init (RestUploadProtocol *self)
+{
+}
+
+/* S3 multipart uploads */
+
+#define REST_TYPE_S3_UPLOAD_PROTOCOL (rest_s3_upload_protocol_get_type ())
+G_DECLARE_FINAL_TYPE (RestS3UploadProtocol, rest_s3_upload_protocol, REST, S3_UPLOAD_PROTOCOL, RestUploadProtocol)
+
+struct _RestS3UploadProtocol
+{
+  RestUploadProtocol parent_instance;
+
+  char *key;
+};
+
+G_DEFINE_TYPE (RestS3UploadProtocol, rest_s3_upload_protocol, REST_TYPE_UPLOAD_PROTOCOL)
+
+/* Parses the XML document of @call, checking for an S3 error response */
+static RestXmlNode *
+rest_s3_parse_payload (RestProxyCall  *call,
+                       GError        **error)
+{
+  g_autoptr(RestXmlParser) parser = NULL;
+  RestXmlNode *root = NULL;
+
+  if (rest_proxy_call_get_payload (call))
+    {
+      parser = rest_xml_parser_new ();
+      root = rest_xml_parser_parse_from_data (parser,
+                                              rest_proxy_call_get_payload (call),
+                                              rest_proxy_call_get_payload_length (call));
+    }
+
+  if (root == NULL)
+    {
+      g_set_error_literal (error, REST_PROXY_ERROR, REST_PROXY_ERROR_FAILED,
+                           "Malformed XML in response");
+      return NULL;
+    }
+
+  if (g_strcmp0 (root->name, "Error") == 0)
+    {
+      RestXmlNode *message = rest_xml_node_find (root, "Message");
+
+      g_set_error (error, REST_PROXY_ERROR, REST_PROXY_ERROR_FAILED,
+                   "Upload failed: %s",
+                   message && message->content ? message->content : "unknown error");
+      rest_xml_node_unref (root);
+      return NULL;
+    }
+
+  return root;
+}
+
+static RestProxyCall *
+rest_s3_upload_protocol_new_create_call (RestUploadProtocol *protocol,
+                                         RestProxy          *proxy,
+                                         goffset             size)
+{
+  RestS3UploadProtocol *self = REST_S3_UPLOAD_PROTOCOL (protocol);
+  g_autofree char *function = g_strconcat (self->key, "?uploads", NULL);
+  RestProxyCall *call;
+
+  call = rest_proxy_new_call (proxy);
+  rest_proxy_call_set_method (call, "POST");
+  rest_proxy_call_set_function (call, function);
+
+  return call;
+}
+
+static char *
+rest_s3_upload_protocol_parse_create (RestUploadProtocol  *protocol,
+                                      RestProxyCall       *call,
+                                      GError             **error)
+{
+  RestXmlNode *root;
+  RestXmlNode *node;
+  char *upload_id = NULL;
+
+  root = rest_s3_parse_payload (call, error);
+  if (root == NULL)
+    return NULL;
+
+  node = rest_xml_node_find (root, "UploadId");
+  if (node && node->content)
+    upload_id = g_strdup (node->content);
+  else
+    g_set_error_literal (error, REST_PROXY_ERROR, REST_PROXY_ERROR_FAILED,
+                         "No UploadId in response");
+
+  rest_xml_node_unref (root);
+
+  return upload_id;
+}
+
+static RestProxyCall *
+rest_s3_upload_protocol_new_part_call (RestUploadProtocol *protocol,
+                                       RestProxy          *proxy,
+                                       const char         *upload_id,
+                                       guint               part,
+                                       goffset             offset,
+                                       GBytes             *data)
+{
+  RestS3UploadProtocol *self = REST_S3_UPLOAD_PROTOCOL (protocol);
+  g_autofree char *number = g_strdup_printf ("%u", part + 1);
+  RestProxyCall *call;
+
+  call = rest_proxy_new_call (proxy);
+  rest_proxy_call_set_method (call, "PUT");
+  rest_proxy_call_set_function (call, self->key);
+  rest_proxy_call_add_param (call, "partNumber", number);
+  rest_proxy_call_add_param (call, "uploadId", upload_id);
+  rest_proxy_call_set_body (call, "application/octet-stream", data);
+
+  return call;
+}
+
+static char *
+rest_s3_upload_protocol_parse_part (RestUploadProtocol  *protocol,
+                                    RestProxyCall       *call,
+                                    guint                part,
+                                    GError             **error)
+{
+  const char *etag;
+
+  etag = rest_proxy_call_lookup_response_header (call, "ETag");
+  if (etag == NULL)
+    {
+      g_set_error (error, REST_PROXY_ERROR, REST_PROXY_ERROR_FAILED,
+                   "No ETag for part %u", part + 1);
+      return NULL;
+    }
+
+  return g_strdup (etag);
+}
+
+static RestProxyCall *
+rest_s3_upload_protocol_new_finalize_call (RestUploadProtocol *protocol,
+                                           RestProxy          *proxy,
+                                           const char         *upload_id,
+                                           const char * const *tags,
+                                           guint               n_parts)
+{
+  RestS3UploadProtocol *self = REST_S3_UPLOAD_PROTOCOL (protocol);
+  g_autoptr(GBytes) bytes = NULL;
+  RestProxyCall *call;
+  GString *body;
+
+  body = g_string_new ("<CompleteMultipartUpload>");
+  for (guint i = 0; i < n_parts; i++)
+    {
+      g_autofree char *part = NULL;
+
+      part = g_markup_printf_escaped ("<Part><PartNumber>%u</PartNumber><ETag>%s</ETag></Part>",
+                                      i + 1, tags[i]);
+      g_string_append (body, part);
+    }
+  g_string_append (body, "</CompleteMultipartUpload>");
+  bytes = g_string_free_to_bytes (body);
+
+  call = rest_proxy_new_call (proxy);
+  rest_proxy_call_set_method (call, "POST");
+  rest_proxy_call_set_function (call, self->key);
+  rest_proxy_call_add_param (call, "uploadId", upload_id);
+  rest_proxy_call_set_body (call, "application/xml", bytes);
+
+  return call;
+}
+
+static gboolean
+rest_s3_upload_protocol_parse_finalize (RestUploadProtocol  *protocol,
+                                        RestProxyCall       *call,
+                                        GError             **error)
+{
+  RestXmlNode *root;
+
+  /* S3 reports errors that happen while the parts are assembled in the body
+   * of a successful response */
+  root = rest_s3_parse_payload (call, error);
+  if (root == NULL)
+    return FALSE;
+
+  rest_xml_node_unref (root);
+
+  return TRUE;
+}
+
+static void
+rest_s3_upload_protocol_finalize (GObject *object)
+{
+  RestS3UploadProtocol *self = REST_S3_UPLOAD_PROTOCOL (object);
+
+  g_free (self->key);
+
+  G_OBJECT_CLASS (rest_s3_upload_protocol_parent_class)->finalize (object);
+}
+
+static void
+rest_s3_upload_protocol_class_init (RestS3UploadProtocolClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  RestUploadProtocolClass *protocol_class = REST_UPLOAD_PROTOCOL_CLASS (klass);
+
+  object_class->finalize = rest_s3_upload_protocol_finalize;
+
+  protocol_class->new_create_call = rest_s3_upload_protocol_new_create_call;
+  protocol_class->parse_create = rest_s3_upload_protocol_parse_create;
+  protocol_class->new_part_call = rest_s3_upload_protocol_new_part_call;
+  protocol_class->parse_part = rest_s3_upload_protocol_parse_part;
+  protocol_class->new_finalize_call = rest_s3_upload_protocol_new_finalize_call;
+  protocol_class->parse_finalize = rest_s3_upload_protocol_parse_finalize;
+}
+
+static void
+rest_s3_upload_protocol_init (RestS3UploadProtocol *self)
+{
+}
+
+/**
+ * rest_upload_protocol_new_s3:
+ * @key: the function of the object to upload, relative to the proxy URL
+ *
+ * Creates a protocol for S3 style multipart uploads: the upload is started
+ * with a POST to @key?uploads, the parts are PUT with their number and the
+ * upload ID, and a POST with the list of part ETags completes it.  Parts
+ * except the last one must be at least 5 MiB for S3 itself.
+ *
+ * Requests are not signed; use a #RestProxy that adds the authorization the
+ * server expects.
+ *
+ * Returns: (transfer full): a new #RestUploadProtocol
+ */
+RestUploadProtocol *
+rest_upload_protocol_new_s3 (const char *key)
+{
+  RestS3UploadProtocol *self;
+
+  g_return_val_if_fail (key != NULL, NULL);
+
+  self = g_object_new (REST_TYPE_S3_UPLOAD_PROTOCOL, NULL);
+  self->key = g_strdup (key);
+
+  return REST_UPLOAD_PROTOCOL (self);
+}
+
+/* tus uploads with the concatenation extension */
+
+#define REST_TYPE_TUS_UPLOAD_PROTOCOL (rest_tus_upload_protocol_get_type ())
+G_DECLARE_FINAL_TYPE (RestTusUploadProtocol, rest_tus_upload_protocol, REST, TUS_UPLOAD_PROTOCOL, RestUploadProtocol)
+
+#define TUS_VERSION "1.0.0"
+
+struct _RestTusUploadProtocol
+{
+  RestUploadProtocol parent_instance;
+
+  char *endpoint;
+};
+
+G_DEFINE_TYPE (RestTusUploadProtocol, rest_tus_upload_protocol, REST_TYPE_UPLOAD_PROTOCOL)
+
+static RestProxyCall *
+rest_tus_upload_protocol_new_part_call (RestUploadProtocol *protocol,
+                                        RestProxy          *proxy,
+                                        const char         *upload_id,
+                                        guint               part,
+                                        goffset             offset,
+                                        GBytes             *data)
+{
+  RestTusUploadProtocol *self = REST_TUS_UPLOAD_PROTOCOL (protocol);
+  g_autofree char *length = g_strdup_printf ("%" G_GSIZE_FORMAT, g_bytes_get_size (data));
+  RestProxyCall *call;
+
+  /* Every part is a partial upload of its own, created together with its
+   * data */
+  call = rest_proxy_new_call (proxy);
+  rest_proxy_call_set_method (call, "POST");
+  rest_proxy_call_set_function (call, self->endpoint);
+  rest_proxy_call_add_header_static (call, "Tus-Resumable", TUS_VERSION);
+  rest_proxy_call_add_header_static (call, "Upload-Concat", "partial");
+  rest_proxy_call_add_header (call, "Upload-Length", length);
+  rest_proxy_call_set_body (call, "application/offset+octet-stream", data);
+
+  return call;
+}
+
+static char *
+rest_tus_upload_protocol_parse_part (RestUploadProtocol  *protocol,
+                                     RestProxyCall       *call,
+                                     guint                part,
+                                     GError             **error)
+{
+  const char *location;
+
+  location = rest_proxy_call_lookup_response_header (call, "Location");
+  if (location == NULL)
+    {
+      g_set_error (error, REST_PROXY_ERROR, REST_PROXY_ERROR_FAILED,
+                   "No Location for part %u", part + 1);
+      return NULL;
+    }
+
+  return g_strdup (location);
+}
+
+static RestProxyCall *
+rest_tus_upload_protocol_new_finalize_call (RestUploadProtocol *protocol,
+                                            RestProxy          *proxy,
+                                            const char         *upload_id,
+                                            const char * const *tags,
+                                            guint               n_parts)
+{
+  RestTusUploadProtocol *self = REST_TUS_UPLOAD_PROTOCOL (protocol);
+  g_autofree char *urls = g_strjoinv (" ", (char **) tags);
+  g_autofree char *concat = g_strconcat ("final;", urls, NULL);
+  RestProxyCall *call;
+
+  call = rest_proxy_new_call (proxy);
+  rest_proxy_call_set_method (call, "POST");
+  rest_proxy_call_set_function (call, self->endpoint);
+  rest_proxy_call_add_header_static (call, "Tus-Resumable", TUS_VERSION);
+  rest_proxy_call_add_header (call, "Upload-Concat", concat);
+
+  return call;
+}
+
+static void
+rest_tus_upload_protocol_finalize (GObject *object)
+{
+  RestTusUploadProtocol *self = REST_TUS_UPLOAD_PROTOCOL (object);
+
+  g_free (self->endpoint);
+
+  G_OBJECT_CLASS (rest_tus_upload_protocol_parent_class)->finalize (object);
+}
+
+static void
+rest_tus_upload_protocol_class_init (RestTusUploadProtocolClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  RestUploadProtocolClass *protocol_class = REST_UPLOAD_PROTOCOL_CLASS (klass);
+
+  object_class->finalize = rest_tus_upload_protocol_finalize;
+
+  protocol_class->new_part_call = rest_tus_upload_protocol_new_part_call;
+  protocol_class->parse_part = rest_tus_upload_protocol_parse_part;
+  protocol_class->new_finalize_call = rest_tus_upload_protocol_new_finalize_call;
+}
+
+static void
+rest_tus_upload_protocol_init (RestTusUploadProtocol *self)
+{
+}
+
+/**
+ * rest_upload_protocol_new_tus:
+ * @endpoint: the function of the tus creation endpoint, relative to the
+ *   proxy URL
+ *
+ * Creates a protocol for tus servers that support the creation-with-upload
+ * and concatenation extensions.  Every part is uploaded to @endpoint as a
+ * partial upload, and a final upload concatenating them is created at the
+ * end.
+ *
+ * Returns: (transfer full): a new #RestUploadProtocol
+ */
+RestUploadProtocol *
+rest_upload_protocol_new_tus (const char *endpoint)
+{
+  RestTusUploadProtocol *self;
+
+  g_return_val_if_fail (endpoint != NULL, NULL);
+
+  self = g_object_new (REST_TYPE_TUS_UPLOAD_PROTOCOL, NULL);
+  self->endpoint = g_strdup (endpoint);
+
+  return REST_UPLOAD_PROTOCOL (self);
+}
+
+/* The upload engine */
+
+typedef struct {
+  RestUploadProtocol *protocol;
+  GFile *file;
+  GFile *state_file;
+  RestProxyCallUploadCallback callback;
+  GObject *weak_object;
+  gpointer userdata;
+
+  goffset size;
+  guint64 mtime;
+  gsize part_size;
+  guint n_parts;
+  guint max_parallel;
+
+  gchar *upload_id;
+  /* The tag of every part that is on the server, NULL for the others */
+  gchar **tags;
+  goffset uploaded;
+  /* The next part to look at and the number of parts being uploaded */
+  guint next_part;
+  guint active;
+
+  /* Cancelled when a part fails for good, and with the cancellable of the
+   * task */
+  GCancellable *cancellable;
+  GCancellable *user_cancellable;
+  gulong cancel_id;
+  GError *error;
+} RestChunkedUploadClosure;
+
+typedef struct {
+  GTask *task;
+  guint index;
+  guint retries;
+  GInputStream *input;
+  guchar *buffer;
+  GBytes *data;
+  RestProxyCall *call;
+} RestUploadPart;
+
+static void _chunked_weak_notify_cb (gpointer  data,
+                                     GObject  *where_the_object_was);
+
+static void
+rest_chunked_upload_closure_free (RestChunkedUploadClosure *closure)
+{
+  if (closure->weak_object)
+    g_object_weak_unref (closure->weak_object, _chunked_weak_notify_cb, closure);
+
+  if (closure->cancel_id)
+    g_cancellable_disconnect (closure->user_cancellable, closure->cancel_id);
+  g_clear_object (&closure->user_cancellable);
+  g_clear_object (&closure->cancellable);
+
+  g_clear_object (&closure->protocol);
+  g_clear_object (&closure->file);
+  g_clear_object (&closure->state_file);
+  g_free (closure->upload_id);
+  g_strfreev (closure->tags);
+  g_clear_error (&closure->error);
+  g_slice_free (RestChunkedUploadClosure, closure);
+}
+
+static void
+rest_upload_part_free (RestUploadPart *part)
+{
+  g_clear_object (&part->input);
+  g_clear_pointer (&part->buffer, g_free);
+  g_clear_pointer (&part->data, g_bytes_unref);
+  g_clear_object (&part->call);
+  g_slice_free (RestUploadPart, part);
+}
+
+static void
+_chunked_weak_notify_cb (gpointer  data,
+                         GObject  *where_the_object_was)
+{
+  RestChunkedUploadClosure *closure = data;
+
+  /* Nobody is interested in the upload any more */
+  closure->weak_object = NULL;
+  g_cancellable_cancel (closure->cancellable);
+}
+
+static void
+_chunked_cancelled_cb (GCancellable *cancellable,
+                       GCancellable *parts_cancellable)
+{
+  g_cancellable_cancel (parts_cancellable);
+}
+
+static RestUploadProtocolClass *
+_chunked_get_protocol_class (RestChunkedUploadClosure *closure)
+{
+  return REST_UPLOAD_PROTOCOL_GET_CLASS (closure->protocol);
+}
+
+static goffset
+_chunked_part_offset (RestChunkedUploadClosure *closure,
+                      guint                     index)
+{
+  return (goffset) index * closure->part_size;
+}
+
+static gsize
+_chunked_part_length (RestChunkedUploadClosure *closure,
+                      guint                     index)
+{
+  return MIN ((goffset) closure->part_size,
+              closure->size - _chunked_part_offset (closure, index));
+}
+
+/*
+ * The state file is a key file with the file size, modification time, part
+ * size and protocol the upload was started with, the upload identifier and
+ * the tags of the parts that are on the server.  It is tiny, so it is read
+ * and written synchronously.  g_file_replace_contents() only replaces it once
+ * the new contents are complete, so a crash leaves the previous state.
+ */
+static void
+_chunked_save_state (RestChunkedUploadClosure *closure)
+{
+  g_autoptr(GKeyFile) state = NULL;
+  g_autofree char *data = NULL;
+  GError *error = NULL;
+  gsize length;
+
+  if (closure->state_file == NULL)
+    return;
+
+  state = g_key_file_new ();
+  g_key_file_set_string (state, "upload", "protocol", G_OBJECT_TYPE_NAME (closure->protocol));
+  g_key_file_set_int64 (state, "upload", "size", closure->size);
+  g_key_file_set_uint64 (state, "upload", "mtime", closure->mtime);
+  g_key_file_set_uint64 (state, "upload", "part-size", closure->part_size);
+  if (closure->upload_id)
+    g_key_file_set_string (state, "upload", "id", closure->upload_id);
+
+  for (guint i = 0; i < closure->n_parts; i++)
+    {
+      char key[16];
+
+      if (closure->tags[i] == NULL)
+        continue;
+
+      g_snprintf (key, sizeof (key), "%u", i);
+      g_key_file_set_string (state, "parts", key, closure->tags[i]);
+    }
+
+  data = g_key_file_to_data (state, &length, NULL);
+  if (!g_file_replace_contents (closure->state_file, data, length, NULL, FALSE,
+                                G_FILE_CREATE_NONE, NULL, NULL, &error))
+    {
+      REST_DEBUG (PROXY, "Could not save the upload state: %s", error->message);
+      g_error_free (error);
+    }
+}
+
+static void
+_chunked_load_state (RestChunkedUploadClosure *closure)
+{
+  g_autoptr(GKeyFile) state = NULL;
+  g_autofree char *data = NULL;
+  g_autofree char *protocol = NULL;
+  gsize length;
+
+  if (closure->state_file == NULL ||
+      !g_file_load_contents (closure->state_file, NULL, &data, &length, NULL, NULL))
+    return;
+
+  state = g_key_file_new ();
+  if (!g_key_file_load_from_data (state, data, length, G_KEY_FILE_NONE, NULL))
+    return;
+
+  /* Parts of another file, or of this one before it changed, are no use */
+  protocol = g_key_file_get_string (state, "upload", "protocol", NULL);
+  if (g_strcmp0 (protocol, G_OBJECT_TYPE_NAME (closure->protocol)) != 0 ||
+      g_key_file_get_int64 (state, "upload", "size", NULL) != closure->size ||
+      g_key_file_get_uint64 (state, "upload", "mtime", NULL) != closure->mtime ||
+      g_key_file_get_uint64 (state, "upload", "part-size", NULL) != closure->part_size)
+    return;
+
+  closure->upload_id = g_key_file_get_string (state, "upload", "id", NULL);
+
+  for (guint i = 0; i < closure->n_parts; i++)
+    {
+      char key[16];
+
+      g_snprintf (key, sizeof (key), "%u", i);
+      closure->tags[i] = g_key_file_get_string (state, "parts", key, NULL);
+      if (closure->tags[i])
+        closure->uploaded += _chunked_part_length (closure, i);
+    }
+}
+
+static void
+_chunked_return_error (GTask  *task,
+                       GError *error)
+{
+  g_task_return_error (task, error);
+  g_object_unref (task);
+}
+
+static void
+_chunked_finalized_cb (GObject      *source,
+                       GAsyncResult *result,
+                       gpointer      user_data)
+{
+  GTask *task = user_data;
+  RestChunkedUploadClosure *closure = g_task_get_task_data (task);
+  RestProxyCall *call = REST_PROXY_CALL (source);
+  GError *error = NULL;
+
+  if (!rest_proxy_call_invoke_finish (call, result, &error) ||
+      !_chunked_get_protocol_class (closure)->parse_finalize (closure->protocol, call, &error))
+    {
+      /* The state is kept, trying again only repeats the finalize step */
+      g_object_unref (call);
+      _chunked_return_error (task, error);
+      return;
+    }
+
+  g_object_unref (call);
+
+  if (closure->state_file)
+    g_file_delete (closure->state_file, NULL, NULL);
+
+  g_task_return_boolean (task, TRUE);
+  g_object_unref (task);
+}
+
+static void
+_chunked_parts_done (GTask *task)
+{
+  RestProxy *proxy = g_task_get_source_object (task);
+  RestChunkedUploadClosure *closure = g_task_get_task_data (task);
+  RestProxyCall *call;
+
+  if (closure->error)
+    {
+      _chunked_return_error (task, g_steal_pointer (&closure->error));
+      return;
+    }
+
+  call = _chunked_get_protocol_class (closure)->new_finalize_call (closure->protocol,
+                                                                    proxy,
+                                                                    closure->upload_id,
+                                                                    (const char * const *) closure->tags,
+                                                                    closure->n_parts);
+  rest_proxy_call_invoke_async (call, closure->cancellable, _chunked_finalized_cb, task);
+}
+
+static void _chunked_schedule (GTask *task);
+
+static void
+_part_finish (RestUploadPart *part,
+              GError         *error)
+{
+  GTask *task = part->task;
+  RestChunkedUploadClosure *closure = g_task_get_task_data (task);
+
+  if (error)
+    {
+      /* Stop the other parts, the upload failed */
+      if (closure->error == NULL)
+        closure->error = error;
+      else
+        g_error_free (error);
+      g_cancellable_cancel (closure->cancellable);
+    }
+
+  rest_upload_part_free (part);
+  closure->active--;
+
+  _chunked_schedule (task);
+}
+
+static void _part_send (RestUploadPart *part);
+
+static gboolean
+_part_resend_cb (GCancellable *cancellable,
+                 gpointer      user_data)
+{
+  RestUploadPart *part = user_data;
+  RestChunkedUploadClosure *closure = g_task_get_task_data (part->task);
+  GError *error = NULL;
+
+  if (g_cancellable_set_error_if_cancelled (closure->cancellable, &error))
+    _part_finish (part, error);
+  else
+    _part_send (part);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+_part_sent_cb (GObject      *source,
+               GAsyncResult *result,
+               gpointer      user_data)
+{
+  RestUploadPart *part = user_data;
+  RestChunkedUploadClosure *closure = g_task_get_task_data (part->task);
+  RestProxyCall *call = REST_PROXY_CALL (source);
+  GError *error = NULL;
+  char *tag;
+
+  if (!rest_proxy_call_invoke_finish (call, result, &error))
+    {
+      guint status = rest_proxy_call_get_status_code (call);
+
+      /* Server and connection errors may be transient, client errors will
+       * not go away */
+      if ((status == 0 || status >= 500) &&
+          part->retries < UPLOAD_PART_MAX_RETRIES &&
+          !g_cancellable_is_cancelled (closure->cancellable))
+        {
+          GSource *source;
+          guint delay;
+
+          part->retries++;
+          g_clear_error (&error);
+          g_clear_object (&part->call);
+
+          /* A random delay, so the parts that failed together don't all
+           * come back at once; cancelling the upload ends it early */
+          delay = g_random_int_range (0, (UPLOAD_PART_RETRY_DELAY_MS << (part->retries - 1)) + 1);
+          source = g_cancellable_source_new (closure->cancellable);
+          g_source_set_ready_time (source, g_get_monotonic_time () + delay * G_TIME_SPAN_MILLISECOND);
+          g_source_set_callback (source, (GSourceFunc) _part_resend_cb, part, NULL);
+          g_source_attach (source, g_main_context_get_thread_default ());
+          g_source_unref (source);
+          return;
+        }
+
+      _part_finish (part, error);
+      return;
+    }
+
+  tag = _chunked_get_protocol_class (closure)->parse_part (closure->protocol, call,
+                                                           part->index, &error);
+  if (tag == NULL)
+    {
+      _part_finish (part, error);
+      return;
+    }
+
+  closure->tags[part->index] = tag;
+  closure->uploaded += g_bytes_get_size (part->data);
+  _chunked_save_state (closure);
+
+  if (closure->callback)
+    closure->callback (call,
+                       closure->size,
+                       closure->uploaded,
+                       NULL,
+                       closure->weak_object,
+                       closure->userdata);
+
+  _part_finish (part, NULL);
+}
+
+static void
+_part_send (RestUploadPart *part)
+{
+  RestProxy *proxy = g_task_get_source_object (part->task);
+  RestChunkedUploadClosure *closure = g_task_get_task_data (part->task);
+
+  part->call = _chunked_get_protocol_class (closure)->new_part_call (closure->protocol,
+                                                                      proxy,
+                                                                      closure->upload_id,
+                                                                      part->index,
+                                                                      _chunked_part_offset (closure, part->index),
+                                                                      part->data);
+  rest_proxy_call_invoke_async (part->call, closure->cancellable, _part_sent_cb, part);
+}
+
+static void
+_part_read_cb (GObject      *source,
+               GAsyncResult *result,
+               gpointer      user_data)
+{
+  RestUploadPart *part = user_data;
+  RestChunkedUploadClosure *closure = g_task_get_task_data (part->task);
+  gsize length = _chunked_part_length (closure, part->index);
+  gsize bytes_read;
+  GError *error = NULL;
+
+  if (!g_input_stream_read_all_finish (G_INPUT_STREAM (source), result, &bytes_read, &error))
+    {
+      _part_finish (part, error);
+      return;
+    }
+
+  if (bytes_read != length)
+    {
+      _part_finish (part, g_error_new_literal (REST_PROXY_ERROR,
+                                               REST_PROXY_ERROR_FAILED,
+                                               "File changed during the upload"));
+      return;
+    }
+
+  g_clear_object (&part->input);
+  part->data = g_bytes_new_take (g_steal_pointer (&part->buffer), length);
+
+  _part_send (part);
+}
+
+static void
+_part_opened_cb (GObject      *source,
+                 GAsyncResult *result,
+                 gpointer      user_data)
+{
+  RestUploadPart *part = user_data;
+  RestChunkedUploadClosure *closure = g_task_get_task_data (part->task);
+  gsize length = _chunked_part_length (closure, part->index);
+  GError *error = NULL;
+
+  part->input = G_INPUT_STREAM (g_file_read_finish (G_FILE (source), result, &error));
+  if (part->input == NULL ||
+      !g_seekable_seek (G_SEEKABLE (part->input),
+                        _chunked_part_offset (closure, part->index),
+                        G_SEEK_SET, NULL, &error))
+    {
+      _part_finish (part, error);
+      return;
+    }
+
+  /* Only the parts being uploaded are held in memory */
+  part->buffer = g_malloc (length);
+  g_input_stream_read_all_async (part->input,
+                                 part->buffer,
+                                 length,
+                                 G_PRIORITY_DEFAULT,
+                                 closure->cancellable,
+                                 _part_read_cb,
+                                 part);
+}
+
+static void
+_chunked_schedule (GTask *task)
+{
+  RestChunkedUploadClosure *closure = g_task_get_task_data (task);
+
+  while (closure->error == NULL &&
+         closure->active < closure->max_parallel &&
+         closure->next_part < closure->n_parts)
+    {
+      guint index = closure->next_part++;
+      RestUploadPart *part;
+
+      /* Uploaded before the upload was resumed */
+      if (closure->tags[index])
+        continue;
+
+      part = g_slice_new0 (RestUploadPart);
+      part->task = task;
+      part->index = index;
+      closure->active++;
+
+      g_file_read_async (closure->file,
+                         G_PRIORITY_DEFAULT,
+                         closure->cancellable,
+                         _part_opened_cb,
+                         part);
+    }
+
+  if (closure->active == 0)
+    _chunked_parts_done (task);
+}
+
+static void
+_chunked_created_cb (GObject      *source,
+                     GAsyncResult *result,
+                     gpointer      user_data)
+{
+  GTask *task = user_data;
+  RestChunkedUploadClosure *closure = g_task_get_task_data (task);
+  RestProxyCall *call = REST_PROXY_CALL (source);
+  GError *error = NULL;
+
+  if (rest_proxy_call_invoke_finish (call, result, &error))
+    closure->upload_id = _chunked_get_protocol_class (closure)->parse_create (closure->protocol,
+                                                                              call, &error);
+  g_object_unref (call);
+
+  if (closure->upload_id == NULL)
+    {
+      _chunked_return_error (task, error);
+      return;
+    }
+
+  _chunked_save_state (closure);
+  _chunked_schedule (task);
+}
+
+static void
+_chunked_query_info_cb (GObject      *source,
+                        GAsyncResult *result,
+                        gpointer      user_data)
+{
+  GTask *task = user_data;
+  RestProxy *proxy = g_task_get_source_object (task);
+  RestChunkedUploadClosure *closure = g_task_get_task_data (task);
+  RestUploadProtocolClass *protocol_class = _chunked_get_protocol_class (closure);
+  g_autoptr(GFileInfo) info = NULL;
+  RestProxyCall *call = NULL;
+  GError *error = NULL;
+
+  info = g_file_query_info_finish (G_FILE (source), result, &error);
+  if (info == NULL)
+    {
+      _chunked_return_error (task, error);
+      return;
+    }
+
+  closure->size = g_file_info_get_size (info);
+  closure->mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+  closure->n_parts = MAX (1, (closure->size + closure->part_size - 1) / closure->part_size);
+  closure->tags = g_new0 (gchar *, closure->n_parts + 1);
+
+  _chunked_load_state (closure);
+
+  if (closure->upload_id == NULL && protocol_class->new_create_call)
+    call = protocol_class->new_create_call (closure->protocol, proxy, closure->size);
+
+  if (call)
+    rest_proxy_call_invoke_async (call, closure->cancellable, _chunked_created_cb, task);
+  else
+    _chunked_schedule (task);
+}
+
+/**
+ * rest_proxy_upload_chunked_async:
+ * @proxy: a #RestProxy
+ * @file: the #GFile to upload
+ * @protocol: the #RestUploadProtocol the server speaks
+ * @part_size: the size of the parts, or 0 for a default of 8 MiB
+ * @max_parallel: the number of parts to upload at the same time, or 0 for
+ *   a default of 4
+ * @state_file: (nullable): a #GFile to record the progress in, or %NULL
+ * @callback: (nullable) (scope notified) (closure userdata): a
+ *   #RestProxyCallUploadCallback to invoke when a part is uploaded, or %NULL
+ * @weak_object: (nullable): the #GObject to weakly reference and tie the
+ *   upload to, or %NULL
+ * @userdata: data to pass to @callback
+ * @cancellable: (nullable): an optional #GCancellable, or %NULL
+ * @ready_callback: (scope async) (closure user_data): callback to call when
+ *   the upload is finished
+ * @user_data: user data for @ready_callback
+ *
+ * Asynchronously upload @file in parts of @part_size bytes, up to
+ * @max_parallel of them at the same time, with @protocol.  A part that fails
+ * with a connection or server error is sent again, a few times at most,
+ * after a random delay that grows with every attempt.  Only the parts being
+ * uploaded are held in memory.
+ *
+ * @callback is invoked with the call of every part that was uploaded, the
+ * size of @file and the number of bytes on the server so far.  If
+ * @weak_object goes away the upload is cancelled.
+ *
+ * If @state_file is given, the upload identifier and the parts on the
+ * server are written to it as they complete.  Calling this function again
+ * with the same file, protocol, part size and state file after a failure,
+ * even from another process, only uploads the missing parts.  The state file
+ * is ignored if @file changed in the meantime, and deleted once the upload
+ * is complete.
+ */
+void
+rest_proxy_upload_chunked_async (RestProxy                    *proxy,
+                                 GFile                        *file,
+                                 RestUploadProtocol           *protocol,
+                                 gsize                         part_size,
+                                 guint                         max_parallel,
+                                 GFile                        *state_file,
+                                 RestProxyCallUploadCallback   callback,
+                                 GObject                      *weak_object,
+                                 gpointer                      userdata,
+                                 GCancellable                 *cancellable,
+                                 GAsyncReadyCallback           ready_callback,
+                                 gpointer                      user_data)
+{
+  RestChunkedUploadClosure *closure;
+  GTask *task;
+
+  g_return_if_fail (REST_IS_PROXY (proxy));
+  g_return_if_fail (G_IS_FILE (file));
+  g_return_if_fail (REST_IS_UPLOAD_PROTOCOL (protocol));
+  g_return_if_fail (state_file == NULL || G_IS_FILE (state_file));
+  g_return_if_fail (weak_object == NULL || G_IS_OBJECT (weak_object));
+  g_return_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
+
+  closure = g_slice_new0 (RestChunkedUploadClosure);
+  closure->protocol = g_object_ref (protocol);
+  closure->file = g_object_ref (file);
+  closure->state_file = state_file ? g_object_ref (state_file) : NULL;
+  closure->callback = callback;
+  closure->userdata = userdata;
+  closure->part_size = part_size ? part_size : UPLOAD_DEFAULT_PART_SIZE;
+  closure->max_parallel = max_parallel ? max_parallel : UPLOAD_DEFAULT_PARALLEL;
+
+  closure->cancellable = g_cancellable_new ();
+  if (cancellable)
+    {
+      closure->user_cancellable = g_object_ref (cancellable);
+      closure->cancel_id = g_cancellable_connect (cancellable,
+                                                  G_CALLBACK (_chunked_cancelled_cb),
+                                                  closure->cancellable,
+                                                  NULL);
+    }
+
+  if (weak_object)
+    {
+      closure->weak_object = weak_object;
+      g_object_weak_ref (weak_object, _chunked_weak_notify_cb, closure);
+    }
+
+  task = g_task_new (proxy, cancellable, ready_callback, user_data);
+  g_task_set_source_tag (task, rest_proxy_upload_chunked_async);
+  g_task_set_task_data (task, closure, (GDestroyNotify) rest_chunked_upload_closure_free);
+
+  g_file_query_info_async (file,
+                           G_FILE_ATTRIBUTE_STANDARD_SIZE "," G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                           G_FILE_QUERY_INFO_NONE,
+                           G_PRIORITY_DEFAULT,
+                           closure->cancellable,
+                           _chunked_query_info_cb,
+                           task);
+}
+
+/**
+ * rest_proxy_upload_chunked_finish:
+ * @proxy: a #RestProxy
+ * @result: the result from the #GAsyncReadyCallback
+ * @error: optional #GError
+ *
+ * Returns: %TRUE if the whole file was uploaded and assembled on the server
+ */
+gboolean
+rest_proxy_upload_chunked_finish (RestProxy     *proxy,
+                                  GAsyncResult  *result,
+                                  GError       **error)
+{
+  g_return_val_if_fail (REST_IS_PROXY (proxy), FALSE);
+  g_return_val_if_fail (g_task_is_valid (result, proxy), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
@@ -0,0 +1,103 @@
+/*
+ * librest - RESTful web services access
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib-object.h>
+#include <gio/gio.h>
+#include <rest/rest-proxy.h>
+
+G_BEGIN_DECLS
+
+#define REST_TYPE_UPLOAD_PROTOCOL rest_upload_protocol_get_type ()
+G_DECLARE_DERIVABLE_TYPE (RestUploadProtocol, rest_upload_protocol, REST, UPLOAD_PROTOCOL, GObject)
+
+/**
+ * RestUploadProtocolClass:
+ * @new_create_call: Returns the call that starts an upload of @size bytes on
+ * the server, or %NULL if the protocol does not need one.
+ * @parse_create: Returns the identifier of the upload from the response to
+ * the create call.
+ * @new_part_call: Returns the call that uploads @data, the part numbered
+ * @part starting at @offset in the file.  The call must not have been sent.
+ * @parse_part: Returns the tag the server gave the part, which is passed to
+ * @new_finalize_call, from the response to the part call.
+ * @new_finalize_call: Returns the call that assembles the @n_parts parts
+ * with @tags into the file.
+ * @parse_finalize: Checks the response to the finalize call.  Optional, the
+ * finalize call only has to succeed by default.
+ *
+ * The steps of a chunked upload protocol, used by
+ * rest_proxy_upload_chunked_async().  Every call is created on @proxy and
+ * sent with rest_proxy_call_invoke_async(); the response is only parsed if
+ * the call succeeded.
+ */
+struct _RestUploadProtocolClass
+{
+  /*< private >*/
+  GObjectClass parent_class;
+
+  /*< public >*/
+  RestProxyCall *(*new_create_call)   (RestUploadProtocol  *protocol,
+                                       RestProxy           *proxy,
+                                       goffset              size);
+  char          *(*parse_create)      (RestUploadProtocol  *protocol,
+                                       RestProxyCall       *call,
+                                       GError             **error);
+  RestProxyCall *(*new_part_call)     (RestUploadProtocol  *protocol,
+                                       RestProxy           *proxy,
+                                       const char          *upload_id,
+                                       guint                part,
+                                       goffset              offset,
+                                       GBytes              *data);
+  char          *(*parse_part)        (RestUploadProtocol  *protocol,
+                                       RestProxyCall       *call,
+                                       guint                part,
+                                       GError             **error);
+  RestProxyCall *(*new_finalize_call) (RestUploadProtocol  *protocol,
+                                       RestProxy           *proxy,
+                                       const char          *upload_id,
+                                       const char * const  *tags,
+                                       guint                n_parts);
+  gboolean       (*parse_finalize)    (RestUploadProtocol  *protocol,
+                                       RestProxyCall       *call,
+                                       GError             **error);
+
+  /*< private >*/
+  gpointer padding[8];
+};
+
+RestUploadProtocol *rest_upload_protocol_new_s3  (const char *key);
+RestUploadProtocol *rest_upload_protocol_new_tus (const char *endpoint);
+
+void     rest_proxy_upload_chunked_async  (RestProxy                    *proxy,
+                                           GFile                        *file,
+                                           RestUploadProtocol           *protocol,
+                                           gsize                         part_size,
+                                           guint                         max_parallel,
+                                           GFile                        *state_file,
+                                           RestProxyCallUploadCallback   callback,
+                                           GObject                      *weak_object,
+                                           gpointer                      userdata,
+                                           GCancellable                 *cancellable,
+                                           GAsyncReadyCallback           ready_callback,
+                                           gpointer                      user_data);
+gboolean rest_proxy_upload_chunked_finish (RestProxy                    *proxy,
+                                           GAsyncResult                 *result,
+                                           GError                      **error);
+
+G_END_DECLS
@@ -0,0 +1,131 @@
+/*
+ * librest - RESTful web services access
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Request headers are kept in a small array of name/value pairs.  Requests
+ * rarely carry more than a dozen headers, so a linear scan beats hashing,
+ * and static strings can be stored without copying them.
+ */
+
+#include <config.h>
+#include "rest-private.h"
+
+static void
+rest_header_clear (RestHeader *header)
+{
+  g_clear_pointer (&header->name_owned, g_free);
+  g_clear_pointer (&header->value_owned, g_free);
+}
+
+GArray *
+_rest_headers_new (void)
+{
+  GArray *headers;
+
+  headers = g_array_new (FALSE, FALSE, sizeof (RestHeader));
+  g_array_set_clear_func (headers, (GDestroyNotify) rest_header_clear);
+
+  return headers;
+}
+
+static gint
+rest_headers_find (GArray     *headers,
+                   const char *name)
+{
+  for (guint i = 0; i < headers->len; i++)
+    {
+      RestHeader *header = &g_array_index (headers, RestHeader, i);
+
+      if (g_ascii_strcasecmp (header->name, name) == 0)
+        return i;
+    }
+
+  return -1;
+}
+
+/*
+ * _rest_headers_set:
+ * @headers: an array from _rest_headers_new()
+ * @name: the header name
+ * @value: the header value
+ * @copy: whether @name and @value need to be copied
+ *
+ * Sets the header @name, replacing a previous value.  If @copy is %FALSE the
+ * strings must outlive @headers.
+ */
+void
+_rest_headers_set (GArray     *headers,
+                   const char *name,
+                   const char *value,
+                   gboolean    copy)
+{
+  RestHeader header = { NULL, };
+  gint pos;
+
+  if (copy)
+    {
+      header.name = header.name_owned = g_strdup (name);
+      header.value = header.value_owned = g_strdup (value);
+    }
+  else
+    {
+      header.name = name;
+      header.value = value;
+    }
+
+  pos = rest_headers_find (headers, name);
+  if (pos >= 0)
+    {
+      rest_header_clear (&g_array_index (headers, RestHeader, pos));
+      g_array_index (headers, RestHeader, pos) = header;
+    }
+  else
+    {
+      g_array_append_val (headers, header);
+    }
+}
+
+const char *
+_rest_headers_lookup (GArray     *headers,
+                      const char *name)
+{
+  gint pos = rest_headers_find (headers, name);
+
+  return pos >= 0 ? g_array_index (headers, RestHeader, pos).value : NULL;
+}
+
+void
+_rest_headers_remove (GArray     *headers,
+                      const char *name)
+{
+  gint pos = rest_headers_find (headers, name);
+
+  if (pos >= 0)
+    g_array_remove_index (headers, pos);
+}
+
+void
+_rest_headers_apply (GArray             *headers,
+                     SoupMessageHeaders *message_headers)
+{
+  for (guint i = 0; i < headers->len; i++)
+    {
+      RestHeader *header = &g_array_index (headers, RestHeader, i);
+
+      soup_message_headers_replace (message_headers, header->name, header->value);
+    }
+}
@@ -0,0 +1,465 @@
+/*
+ * librest - RESTful web services access
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * A multipart/form-data body that is produced while it is read.  The body is
+ * a list of pieces: literal data (boundaries, part headers, string values and
+ * in-memory values) and streamed parameters, which are only opened when the
+ * reader reaches them.  Only one part is ever being read, so the memory used
+ * does not depend on the size of the upload.
+ */
+
+#include <config.h>
+#include <string.h>
+#include "rest-private.h"
+
+#define REST_TYPE_MULTIPART_STREAM (rest_multipart_stream_get_type ())
+G_DECLARE_FINAL_TYPE (RestMultipartStream, rest_multipart_stream, REST, MULTIPART_STREAM, GInputStream)
+
+typedef struct {
+  /* Literal data, or NULL if the piece is a streamed parameter */
+  GBytes    *bytes;
+  RestParam *param;
+  goffset    length;
+} RestMultipartPiece;
+
+struct _RestMultipartStream
+{
+  GInputStream parent_instance;
+
+  GArray *pieces;
+  guint current;
+  /* Read position within the current piece */
+  goffset offset;
+  /* The value of the current piece, once it has been opened */
+  GInputStream *child;
+};
+
+G_DEFINE_TYPE (RestMultipartStream, rest_multipart_stream, G_TYPE_INPUT_STREAM)
+
+typedef struct {
+  void *buffer;
+  gsize count;
+} ReadData;
+
+static void
+rest_multipart_piece_clear (RestMultipartPiece *piece)
+{
+  g_clear_pointer (&piece->bytes, g_bytes_unref);
+  g_clear_pointer (&piece->param, rest_param_unref);
+}
+
+static void
+rest_multipart_stream_next_piece (RestMultipartStream *self)
+{
+  if (self->child)
+    {
+      g_input_stream_close (self->child, NULL, NULL);
+      g_clear_object (&self->child);
+    }
+
+  self->current++;
+  self->offset = 0;
+}
+
+/*
+ * Skips exhausted pieces and copies literal data into @buffer.  Returns the
+ * number of bytes copied, 0 at the end of the body, or -1 when the next data
+ * has to be read from a streamed parameter.
+ */
+static gssize
+rest_multipart_stream_fill (RestMultipartStream *self,
+                            void                *buffer,
+                            gsize                count)
+{
+  while (self->current < self->pieces->len)
+    {
+      RestMultipartPiece *piece = &g_array_index (self->pieces, RestMultipartPiece, self->current);
+
+      if (self->offset < piece->length)
+        {
+          gsize n;
+
+          if (piece->param)
+            return -1;
+
+          n = MIN (count, piece->length - self->offset);
+          memcpy (buffer, (const guint8 *) g_bytes_get_data (piece->bytes, NULL) + self->offset, n);
+          self->offset += n;
+
+          return n;
+        }
+
+      rest_multipart_stream_next_piece (self);
+    }
+
+  return 0;
+}
+
+static RestMultipartPiece *
+rest_multipart_stream_get_piece (RestMultipartStream *self)
+{
+  return &g_array_index (self->pieces, RestMultipartPiece, self->current);
+}
+
+/* Accounts for @n bytes read from the current streamed parameter */
+static gssize
+rest_multipart_stream_advance (RestMultipartStream  *self,
+                               gssize                n,
+                               GError              **error)
+{
+  RestMultipartPiece *piece = rest_multipart_stream_get_piece (self);
+
+  if (n == 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+                   "Parameter “%s” ended after %" G_GOFFSET_FORMAT " of %"
+                   G_GOFFSET_FORMAT " bytes",
+                   rest_param_get_name (piece->param), self->offset, piece->length);
+      return -1;
+    }
+
+  if (n > 0)
+    self->offset += n;
+
+  return n;
+}
+
+static gsize
+rest_multipart_stream_get_chunk (RestMultipartStream *self,
+                                 gsize                count)
+{
+  RestMultipartPiece *piece = rest_multipart_stream_get_piece (self);
+
+  return MIN ((goffset) count, piece->length - self->offset);
+}
+
+static gssize
+rest_multipart_stream_read (GInputStream  *stream,
+                            void          *buffer,
+                            gsize          count,
+                            GCancellable  *cancellable,
+                            GError       **error)
+{
+  RestMultipartStream *self = REST_MULTIPART_STREAM (stream);
+  gssize n;
+
+  n = rest_multipart_stream_fill (self, buffer, count);
+  if (n >= 0)
+    return n;
+
+  if (self->child == NULL)
+    {
+      self->child = _rest_param_open_stream (rest_multipart_stream_get_piece (self)->param,
+                                             cancellable, error);
+      if (self->child == NULL)
+        return -1;
+    }
+
+  n = g_input_stream_read (self->child, buffer,
+                           rest_multipart_stream_get_chunk (self, count),
+                           cancellable, error);
+
+  return rest_multipart_stream_advance (self, n, error);
+}
+
+static void
+rest_multipart_stream_child_read_cb (GObject      *source,
+                                     GAsyncResult *result,
+                                     gpointer      user_data)
+{
+  GTask *task = user_data;
+  RestMultipartStream *self = g_task_get_source_object (task);
+  GError *error = NULL;
+  gssize n;
+
+  n = g_input_stream_read_finish (G_INPUT_STREAM (source), result, &error);
+  n = rest_multipart_stream_advance (self, n, &error);
+
+  if (n < 0)
+    g_task_return_error (task, error);
+  else
+    g_task_return_int (task, n);
+
+  g_object_unref (task);
+}
+
+static void
+rest_multipart_stream_read_child (GTask *task)
+{
+  RestMultipartStream *self = g_task_get_source_object (task);
+  ReadData *data = g_task_get_task_data (task);
+
+  g_input_stream_read_async (self->child, data->buffer,
+                             rest_multipart_stream_get_chunk (self, data->count),
+                             g_task_get_priority (task),
+                             g_task_get_cancellable (task),
+                             rest_multipart_stream_child_read_cb,
+                             task);
+}
+
+static void
+rest_multipart_stream_file_read_cb (GObject      *source,
+                                    GAsyncResult *result,
+                                    gpointer      user_data)
+{
+  GTask *task = user_data;
+  RestMultipartStream *self = g_task_get_source_object (task);
+  GError *error = NULL;
+
+  self->child = G_INPUT_STREAM (g_file_read_finish (G_FILE (source), result, &error));
+  if (self->child == NULL)
+    {
+      g_task_return_error (task, error);
+      g_object_unref (task);
+      return;
+    }
+
+  rest_multipart_stream_read_child (task);
+}
+
+static void
+rest_multipart_stream_read_async (GInputStream        *stream,
+                                  void                *buffer,
+                                  gsize                count,
+                                  int                  io_priority,
+                                  GCancellable        *cancellable,
+                                  GAsyncReadyCallback  callback,
+                                  gpointer             user_data)
+{
+  RestMultipartStream *self = REST_MULTIPART_STREAM (stream);
+  RestParam *param;
+  ReadData *data;
+  GTask *task;
+  GFile *file;
+  gssize n;
+
+  task = g_task_new (stream, cancellable, callback, user_data);
+  g_task_set_source_tag (task, rest_multipart_stream_read_async);
+  g_task_set_priority (task, io_priority);
+
+  n = rest_multipart_stream_fill (self, buffer, count);
+  if (n >= 0)
+    {
+      g_task_return_int (task, n);
+      g_object_unref (task);
+      return;
+    }
+
+  data = g_new (ReadData, 1);
+  data->buffer = buffer;
+  data->count = count;
+  g_task_set_task_data (task, data, g_free);
+
+  if (self->child)
+    {
+      rest_multipart_stream_read_child (task);
+      return;
+    }
+
+  /* Files are opened asynchronously, streams are already open */
+  param = rest_multipart_stream_get_piece (self)->param;
+  file = _rest_param_get_file (param);
+  if (file)
+    {
+      g_file_read_async (file, io_priority, cancellable,
+                         rest_multipart_stream_file_read_cb, task);
+      return;
+    }
+
+  {
+    GError *error = NULL;
+
+    self->child = _rest_param_open_stream (param, cancellable, &error);
+    if (self->child == NULL)
+      {
+        g_task_return_error (task, error);
+        g_object_unref (task);
+        return;
+      }
+  }
+
+  rest_multipart_stream_read_child (task);
+}
+
+static gssize
+rest_multipart_stream_read_finish (GInputStream  *stream,
+                                   GAsyncResult  *result,
+                                   GError       **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, stream), -1);
+
+  return g_task_propagate_int (G_TASK (result), error);
+}
+
+static gboolean
+rest_multipart_stream_close (GInputStream  *stream,
+                             GCancellable  *cancellable,
+                             GError       **error)
+{
+  RestMultipartStream *self = REST_MULTIPART_STREAM (stream);
+  gboolean ret = TRUE;
+
+  if (self->child)
+    {
+      ret = g_input_stream_close (self->child, cancellable, error);
+      g_clear_object (&self->child);
+    }
+
+  return ret;
+}
+
+static void
+rest_multipart_stream_finalize (GObject *object)
+{
+  RestMultipartStream *self = REST_MULTIPART_STREAM (object);
+
+  g_clear_object (&self->child);
+  g_array_unref (self->pieces);
+
+  G_OBJECT_CLASS (rest_multipart_stream_parent_class)->finalize (object);
+}
+
+static void
+rest_multipart_stream_class_init (RestMultipartStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GInputStreamClass *stream_class = G_INPUT_STREAM_CLASS (klass);
+
+  object_class->finalize = rest_multipart_stream_finalize;
+
+  stream_class->read_fn = rest_multipart_stream_read;
+  stream_class->read_async = rest_multipart_stream_read_async;
+  stream_class->read_finish = rest_multipart_stream_read_finish;
+  stream_class->close_fn = rest_multipart_stream_close;
+}
+
+static void
+rest_multipart_stream_init (RestMultipartStream *self)
+{
+  self->pieces = g_array_new (FALSE, TRUE, sizeof (RestMultipartPiece));
+  g_array_set_clear_func (self->pieces, (GDestroyNotify) rest_multipart_piece_clear);
+}
+
+static void
+rest_multipart_stream_add_bytes (RestMultipartStream *self,
+                                 GBytes              *bytes)
+{
+  RestMultipartPiece piece = { NULL, };
+
+  piece.bytes = bytes;
+  piece.length = g_bytes_get_size (bytes);
+  g_array_append_val (self->pieces, piece);
+}
+
+/* Turns the literal data collected so far into a piece */
+static void
+rest_multipart_stream_flush (RestMultipartStream  *self,
+                             GString             **literal)
+{
+  rest_multipart_stream_add_bytes (self, g_string_free_to_bytes (*literal));
+  *literal = g_string_new (NULL);
+}
+
+/*
+ * _rest_multipart_stream_new:
+ * @params: the parameters to encode
+ * @content_type: (out): the content type of the body, including the boundary
+ * @length: (out): the length of the body
+ *
+ * Creates a stream that produces @params as multipart/form-data, in order.
+ * String parameters are copied into the part headers, the #GBytes of other
+ * in-memory parameters are referenced and streamed parameters are read when
+ * they are reached.
+ *
+ * Returns: (transfer full): a new #GInputStream
+ */
+GInputStream *
+_rest_multipart_stream_new (RestParams  *params,
+                            char       **content_type,
+                            goffset     *length)
+{
+  RestMultipartStream *self;
+  GString *literal;
+  RestParamsIter iter;
+  const char *name;
+  RestParam *param;
+  char *boundary;
+
+  self = g_object_new (REST_TYPE_MULTIPART_STREAM, NULL);
+  boundary = g_strdup_printf ("%08x%08x%08x%08x",
+                              g_random_int (), g_random_int (),
+                              g_random_int (), g_random_int ());
+  literal = g_string_new (NULL);
+
+  rest_params_iter_init (&iter, params);
+  while (rest_params_iter_next (&iter, &name, &param))
+    {
+      if (literal->len > 0 || self->pieces->len > 0)
+        g_string_append (literal, "\r\n");
+      g_string_append_printf (literal, "--%s\r\n", boundary);
+
+      g_string_append (literal, "Content-Disposition: form-data; ");
+      soup_header_g_string_append_param_quoted (literal, "name", name);
+      if (rest_param_get_file_name (param))
+        {
+          g_string_append (literal, "; ");
+          soup_header_g_string_append_param_quoted (literal, "filename",
+                                                    rest_param_get_file_name (param));
+        }
+      g_string_append (literal, "\r\n");
+
+      if (rest_param_is_string (param))
+        {
+          g_string_append (literal, "\r\n");
+          g_string_append (literal, rest_param_get_content (param));
+          continue;
+        }
+
+      g_string_append_printf (literal, "Content-Type: %s\r\n\r\n",
+                              rest_param_get_content_type (param));
+      rest_multipart_stream_flush (self, &literal);
+
+      if (rest_param_is_stream (param))
+        {
+          RestMultipartPiece piece = { NULL, };
+
+          piece.param = rest_param_ref (param);
+          piece.length = _rest_param_get_stream_length (param);
+          g_array_append_val (self->pieces, piece);
+        }
+      else
+        {
+          rest_multipart_stream_add_bytes (self, g_bytes_ref (rest_param_get_bytes (param)));
+        }
+    }
+
+  if (literal->len > 0 || self->pieces->len > 0)
+    g_string_append (literal, "\r\n");
+  g_string_append_printf (literal, "--%s--\r\n", boundary);
+  rest_multipart_stream_add_bytes (self, g_string_free_to_bytes (literal));
+
+  *length = 0;
+  for (guint i = 0; i < self->pieces->len; i++)
+    *length += g_array_index (self->pieces, RestMultipartPiece, i).length;
+
+  *content_type = g_strdup_printf ("%s; boundary=%s",
+                                   SOUP_FORM_MIME_TYPE_MULTIPART, boundary);
+  g_free (boundary);
+
+  return G_INPUT_STREAM (self);
+}
@@ -505,7 +505,7 @@ rest_oauth2_proxy_refresh_access_token (RestOAuth2Proxy *self,
 #else
   msg = soup_message_new_from_encoded_form (SOUP_METHOD_POST, priv->tokenurl, soup_form_encode_hash (params));
 #endif
-  payload = _rest_proxy_send_message (REST_PROXY (self), msg, NULL, error);
+  payload = _rest_proxy_send_message (REST_PROXY (self), msg, NULL, NULL, error);
   if (error && *error)
     {
       return FALSE;
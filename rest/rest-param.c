@@ -26,6 +26,7 @@
 #include <config.h>
 #include <string.h>
 #include "rest-param.h"
+#include "rest-private.h"
 
 /**
  * SECTION:rest-param
@@ -34,22 +35,23 @@
  * @see_also: #RestParams, #RestProxyCall.
  */
 
-/* Internal RestMemoryUse values */
-enum {
-  REST_MEMORY_OWNED = REST_MEMORY_COPY + 1
-};
-
 struct _RestParam {
   char          *name;
-  RestMemoryUse  use;
-  gconstpointer  data;
-  gsize          length;
+  /* The value, handed to libsoup as it is */
+  GBytes        *bytes;
   const char    *content_type;
   char          *filename;
 
   volatile gint  ref_count;
-  gpointer       owner;
-  GDestroyNotify owner_dnotify;
+
+  /* Set instead of bytes for parameters that are read when the request is
+   * sent */
+  GFile         *file;
+  GInputStream  *stream;
+  goffset        stream_length;
+  /* Where stream started, so it can be rewound if it is sent again */
+  goffset        stream_start;
+  gboolean       stream_used;
 };
 
 G_DEFINE_BOXED_TYPE (RestParam, rest_param, rest_param_ref, rest_param_unref)
@@ -81,32 +83,27 @@ rest_param_new_full (const char    *name,
                      const char    *filename)
 {
   RestParam *param;
+  GBytes *bytes;
 
   g_return_val_if_fail (name != NULL, NULL);
   g_return_val_if_fail (content_type != NULL, NULL);
   g_return_val_if_fail (data != NULL, NULL);
 
-  param = g_slice_new0 (RestParam);
-
-  if (use == REST_MEMORY_COPY) {
-    data = g_memdup2 (data, length);
-    use  = REST_MEMORY_TAKE;
+  switch (use) {
+  case REST_MEMORY_STATIC:
+    bytes = g_bytes_new_static (data, length);
+    break;
+  case REST_MEMORY_TAKE:
+    bytes = g_bytes_new_take ((gpointer)data, length);
+    break;
+  case REST_MEMORY_COPY:
+  default:
+    bytes = g_bytes_new (data, length);
+    break;
   }
 
-  param->name   = g_strdup (name);
-  param->use    = use;
-  param->data   = data;
-  param->length = length;
-
-  param->content_type = g_intern_string (content_type);
-  param->filename     = g_strdup (filename);
-
-  param->ref_count = 1;
-
-  if (use == REST_MEMORY_TAKE) {
-    param->owner         = (gpointer)data;
-    param->owner_dnotify = g_free;
-  }
+  param = rest_param_new_from_bytes (name, bytes, content_type, filename);
+  g_bytes_unref (bytes);
 
   return param;
 }
@@ -129,8 +126,9 @@ rest_param_new_full (const char    *name,
  *
  * If the parameter is a file upload it can be passed as @filename.
  *
- * When the #RestParam is freed, it will call @owner_dnotify, passing @owner to
- * it. This allows you to do something like this:
+ * When neither the #RestParam nor a request that sends it needs @data any
+ * more, @owner_dnotify is called with @owner. This allows you to do something
+ * like this:
  *
  * |[
  * GMappedFile *map = g_mapped_file_new (filename, FALSE, &error);
@@ -155,26 +153,174 @@ rest_param_new_with_owner (const char     *name,
                            GDestroyNotify  owner_dnotify)
 {
   RestParam *param;
+  GBytes *bytes;
 
   g_return_val_if_fail (name, NULL);
   g_return_val_if_fail (data, NULL);
   g_return_val_if_fail (content_type, NULL);
 
+  bytes = g_bytes_new_with_free_func (data, length, owner_dnotify, owner);
+  param = rest_param_new_from_bytes (name, bytes, content_type, filename);
+  g_bytes_unref (bytes);
+
+  return param;
+}
+
+/**
+ * rest_param_new_from_bytes:
+ * @name: the parameter name
+ * @bytes: the value
+ * @content_type: the content type of the data
+ * @filename: (nullable): the original filename, or %NULL
+ *
+ * Create a new #RestParam called @name with @bytes as the value.
+ * @content_type is the type of the data as a MIME type, for example
+ * "text/plain" for simple string parameters.  The parameter keeps a reference
+ * on @bytes and passes it on to the request without copying, which makes
+ * this the cheapest way to send data that is already held in a #GBytes:
+ *
+ * |[
+ * GMappedFile *map = g_mapped_file_new (filename, FALSE, &error);
+ * GBytes *bytes = g_mapped_file_get_bytes (map);
+ * RestParam *param = rest_param_new_from_bytes ("media", bytes,
+ *                                               "image/jpeg", filename);
+ * g_bytes_unref (bytes);
+ * g_mapped_file_unref (map);
+ * ]|
+ *
+ * Returns: a new #RestParam.
+ **/
+RestParam *
+rest_param_new_from_bytes (const char *name,
+                           GBytes     *bytes,
+                           const char *content_type,
+                           const char *filename)
+{
+  RestParam *param;
+
+  g_return_val_if_fail (name != NULL, NULL);
+  g_return_val_if_fail (bytes != NULL, NULL);
+  g_return_val_if_fail (content_type != NULL, NULL);
+
   param = g_slice_new0 (RestParam);
 
-  param->name = g_strdup (name);
+  param->name  = g_strdup (name);
+  param->bytes = g_bytes_ref (bytes);
+
+  param->content_type = g_intern_string (content_type);
+  param->filename     = g_strdup (filename);
+
+  param->ref_count = 1;
+
+  return param;
+}
+
+/**
+ * rest_param_new_from_stream:
+ * @name: the parameter name
+ * @stream: the #GInputStream to read the value from
+ * @length: the number of bytes that will be read from @stream
+ * @content_type: the content type of the data
+ * @filename: (nullable): the original filename, or %NULL
+ *
+ * Create a new #RestParam called @name whose value is read from @stream while
+ * the request is sent, so the value never has to be held in memory.  Exactly
+ * @length bytes are read; the request fails if @stream ends early.
+ *
+ * A stream can usually only be read once.  If @stream is seekable it is
+ * rewound to its current position whenever the parameter is sent again,
+ * otherwise sending it a second time fails.
+ *
+ * Returns: a new #RestParam.
+ **/
+RestParam *
+rest_param_new_from_stream (const char   *name,
+                            GInputStream *stream,
+                            goffset       length,
+                            const char   *content_type,
+                            const char   *filename)
+{
+  RestParam *param;
 
-  param->use    = REST_MEMORY_OWNED;
-  param->data   = data;
-  param->length = length;
+  g_return_val_if_fail (name != NULL, NULL);
+  g_return_val_if_fail (G_IS_INPUT_STREAM (stream), NULL);
+  g_return_val_if_fail (length >= 0, NULL);
+  g_return_val_if_fail (content_type != NULL, NULL);
+
+  param = g_slice_new0 (RestParam);
+
+  param->name = g_strdup (name);
 
   param->content_type = g_intern_string (content_type);
   param->filename     = g_strdup (filename);
 
   param->ref_count = 1;
 
-  param->owner         = owner;
-  param->owner_dnotify = owner_dnotify;
+  param->stream        = g_object_ref (stream);
+  param->stream_length = length;
+  if (G_IS_SEEKABLE (stream) && g_seekable_can_seek (G_SEEKABLE (stream)))
+    param->stream_start = g_seekable_tell (G_SEEKABLE (stream));
+  else
+    param->stream_start = -1;
+
+  return param;
+}
+
+/**
+ * rest_param_new_from_file:
+ * @name: the parameter name
+ * @file: the #GFile to upload
+ * @content_type: (nullable): the content type of the data, or %NULL to use
+ *   the type of @file
+ * @error: a #GError, or %NULL
+ *
+ * Create a new #RestParam called @name whose value is the contents of @file.
+ * The size of @file is looked up now, but its contents are only read while
+ * the request is sent, a block at a time.  The basename of @file is used as
+ * the file name of the parameter.
+ *
+ * Returns: a new #RestParam, or %NULL if @file could not be queried.
+ **/
+RestParam *
+rest_param_new_from_file (const char  *name,
+                          GFile       *file,
+                          const char  *content_type,
+                          GError     **error)
+{
+  g_autoptr(GFileInfo) info = NULL;
+  RestParam *param;
+
+  g_return_val_if_fail (name != NULL, NULL);
+  g_return_val_if_fail (G_IS_FILE (file), NULL);
+
+  info = g_file_query_info (file,
+                            G_FILE_ATTRIBUTE_STANDARD_SIZE ","
+                            G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE,
+                            G_FILE_QUERY_INFO_NONE,
+                            NULL, error);
+  if (info == NULL)
+    return NULL;
+
+  if (content_type == NULL)
+    {
+      g_autofree char *mime_type = NULL;
+
+      if (g_file_info_get_content_type (info))
+        mime_type = g_content_type_get_mime_type (g_file_info_get_content_type (info));
+      content_type = g_intern_string (mime_type ? mime_type : "application/octet-stream");
+    }
+
+  param = g_slice_new0 (RestParam);
+
+  param->name = g_strdup (name);
+
+  param->content_type = g_intern_string (content_type);
+  param->filename     = g_file_get_basename (file);
+
+  param->ref_count = 1;
+
+  param->file          = g_object_ref (file);
+  param->stream_length = g_file_info_get_size (info);
 
   return param;
 }
@@ -270,7 +416,91 @@ gboolean
 rest_param_is_string (RestParam *param)
 {
   g_return_val_if_fail (param != NULL, FALSE);
-  return param->content_type == g_intern_static_string ("text/plain");
+  return param->content_type == g_intern_static_string ("text/plain") &&
+         !rest_param_is_stream (param);
+}
+
+/**
+ * rest_param_is_stream:
+ * @param: a valid #RestParam
+ *
+ * Determine if the value of the parameter is read from a stream or a file
+ * while the request is sent, see rest_param_new_from_stream() and
+ * rest_param_new_from_file().  Such parameters have no content in memory.
+ *
+ * Returns: %TRUE if the parameter is streamed, %FALSE otherwise.
+ */
+gboolean
+rest_param_is_stream (RestParam *param)
+{
+  g_return_val_if_fail (param != NULL, FALSE);
+  return param->file != NULL || param->stream != NULL;
+}
+
+/*
+ * _rest_param_get_stream_length:
+ * @param: a streamed #RestParam
+ *
+ * Returns: the number of bytes the stream of @param provides
+ */
+goffset
+_rest_param_get_stream_length (RestParam *param)
+{
+  return param->stream_length;
+}
+
+/*
+ * _rest_param_get_file:
+ * @param: a streamed #RestParam
+ *
+ * Returns: (nullable) (transfer none): the file @param reads from, or %NULL
+ */
+GFile *
+_rest_param_get_file (RestParam *param)
+{
+  return param->file;
+}
+
+/*
+ * _rest_param_open_stream:
+ * @param: a streamed #RestParam
+ * @cancellable: a #GCancellable, or %NULL
+ * @error: a #GError, or %NULL
+ *
+ * Opens the value of @param for reading, rewinding a seekable stream that was
+ * read before.
+ *
+ * Returns: (transfer full): a #GInputStream positioned at the start of the
+ * value, or %NULL on error
+ */
+GInputStream *
+_rest_param_open_stream (RestParam     *param,
+                         GCancellable  *cancellable,
+                         GError       **error)
+{
+  if (param->file)
+    return G_INPUT_STREAM (g_file_read (param->file, cancellable, error));
+
+  g_return_val_if_fail (param->stream != NULL, NULL);
+
+  if (param->stream_used)
+    {
+      if (param->stream_start < 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                       "The stream of parameter “%s” can only be sent once",
+                       param->name);
+          return NULL;
+        }
+
+      if (!g_seekable_seek (G_SEEKABLE (param->stream), param->stream_start,
+                            G_SEEK_SET, cancellable, error))
+        return NULL;
+    }
+
+  param->stream_used = TRUE;
+
+  return g_object_ref (param->stream);
 }
 
 /**
@@ -278,7 +508,8 @@ rest_param_is_string (RestParam *param)
  * @param: a valid #RestParam
  *
  * Get the content of @param.  The content should be treated as read-only and
- * not modified in any way.
+ * not modified in any way.  Streamed parameters have no content in memory, so
+ * %NULL is returned for them.
  *
  * Returns: (transfer none): the content.
  **/
@@ -286,14 +517,36 @@ gconstpointer
 rest_param_get_content (RestParam *param)
 {
   g_return_val_if_fail (param != NULL, NULL);
-  return param->data;
+
+  if (param->bytes == NULL)
+    return NULL;
+
+  return g_bytes_get_data (param->bytes, NULL);
+}
+
+/**
+ * rest_param_get_bytes:
+ * @param: a valid #RestParam
+ *
+ * Get the content of @param as a #GBytes, without copying it.
+ *
+ * Returns: (transfer none) (nullable): the content, or %NULL for streamed
+ * parameters.
+ **/
+GBytes *
+rest_param_get_bytes (RestParam *param)
+{
+  g_return_val_if_fail (param != NULL, NULL);
+
+  return param->bytes;
 }
 
 /**
  * rest_param_get_content_length:
  * @param: a valid #RestParam
  *
- * Get the length of the content of @param.
+ * Get the length of the content of @param.  For streamed parameters this is
+ * the number of bytes read from the stream.
  *
  * Returns: the length of the content
  **/
@@ -302,7 +555,10 @@ rest_param_get_content_length (RestParam *param)
 {
   g_return_val_if_fail (param != NULL, 0);
 
-  return param->length;
+  if (rest_param_is_stream (param))
+    return param->stream_length;
+
+  return g_bytes_get_size (param->bytes);
 }
 
 /**
@@ -338,8 +594,9 @@ rest_param_unref (RestParam *param)
   g_return_if_fail (param);
 
   if (g_atomic_int_dec_and_test (&param->ref_count)) {
-    if (param->owner_dnotify)
-      param->owner_dnotify (param->owner);
+    g_clear_pointer (&param->bytes, g_bytes_unref);
+    g_clear_object (&param->file);
+    g_clear_object (&param->stream);
     g_free (param->name);
     g_free (param->filename);
 
@@ -26,7 +26,7 @@
 #ifndef _REST_PARAM
 #define _REST_PARAM
 
-#include <glib-object.h>
+#include <gio/gio.h>
 
 G_BEGIN_DECLS
 
@@ -70,14 +70,32 @@ RestParam *rest_param_new_with_owner (const char     *name,
                                       gpointer        owner,
                                       GDestroyNotify  owner_dnotify);
 
+RestParam *rest_param_new_from_bytes (const char *name,
+                                      GBytes     *bytes,
+                                      const char *content_type,
+                                      const char *filename);
+
+RestParam *rest_param_new_from_stream (const char   *name,
+                                       GInputStream *stream,
+                                       goffset       length,
+                                       const char   *content_type,
+                                       const char   *filename);
+
+RestParam *rest_param_new_from_file (const char  *name,
+                                     GFile       *file,
+                                     const char  *content_type,
+                                     GError     **error);
+
 
 gboolean rest_param_is_string (RestParam *param);
+gboolean rest_param_is_stream (RestParam *param);
 
 const char *rest_param_get_name (RestParam *param);
 const char *rest_param_get_content_type (RestParam *param);
 const char *rest_param_get_file_name (RestParam *param);
 gconstpointer rest_param_get_content (RestParam *param);
 gsize rest_param_get_content_length (RestParam *param);
+GBytes *rest_param_get_bytes (RestParam *param);
 
 RestParam *rest_param_ref (RestParam *param);
 void rest_param_unref (RestParam *param);
@@ -21,8 +21,10 @@
  */
 
 #include <config.h>
+#include <string.h>
 #include <glib-object.h>
 #include "rest-params.h"
+#include "rest-private.h"
 
 /**
  * SECTION:rest-params
@@ -30,6 +32,26 @@
  * @see_also: #RestParam, #RestProxyCall.
  */
 
+/*
+ * Parameters are kept in a #GPtrArray in insertion order, so appending and
+ * iterating are cheap.  The index maps a name to the first #RestParam with
+ * that name; the key is owned by the #RestParam itself.  Both live past the
+ * end of the public structure, whose list is no longer used but keeps its
+ * layout.
+ */
+typedef struct {
+  RestParams parent;
+
+  GPtrArray *params;
+  GHashTable *index;
+} RestParamsPrivate;
+
+static inline RestParamsPrivate *
+rest_params_get_private (RestParams *self)
+{
+  return (RestParamsPrivate *) self;
+}
+
 G_DEFINE_BOXED_TYPE (RestParams, rest_params, rest_params_ref, rest_params_unref)
 
 /**
@@ -42,13 +64,14 @@ G_DEFINE_BOXED_TYPE (RestParams, rest_params, rest_params_ref, rest_params_unref
 RestParams *
 rest_params_new (void)
 {
-  RestParams *self;
+  RestParamsPrivate *priv;
 
-  self = g_slice_new0 (RestParams);
-  self->ref_count = 1;
-  self->params = NULL;
+  priv = g_slice_new0 (RestParamsPrivate);
+  priv->parent.ref_count = 1;
+  priv->params = g_ptr_array_new_with_free_func ((GDestroyNotify) rest_param_unref);
+  priv->index = g_hash_table_new (g_str_hash, g_str_equal);
 
-  return self;
+  return &priv->parent;
 }
 
 /**
@@ -60,12 +83,15 @@ rest_params_new (void)
 void
 rest_params_free (RestParams *self)
 {
+  RestParamsPrivate *priv = rest_params_get_private (self);
+
   g_assert (self);
   g_assert_cmpint (self->ref_count, ==, 0);
 
-  g_list_free_full (g_steal_pointer (&self->params), (GDestroyNotify) rest_param_unref);
+  g_clear_pointer (&priv->index, g_hash_table_unref);
+  g_clear_pointer (&priv->params, g_ptr_array_unref);
 
-  g_slice_free (RestParams, self);
+  g_slice_free (RestParamsPrivate, priv);
 }
 
 /**
@@ -80,13 +106,15 @@ rest_params_free (RestParams *self)
 RestParams *
 rest_params_copy (RestParams *self)
 {
+  RestParamsPrivate *priv = rest_params_get_private (self);
   RestParams *copy;
 
   g_return_val_if_fail (self, NULL);
   g_return_val_if_fail (self->ref_count, NULL);
 
   copy = rest_params_new ();
-  copy->params = g_list_copy_deep (self->params, (GCopyFunc) rest_param_ref, NULL);
+  for (guint i = 0; i < priv->params->len; i++)
+    rest_params_add (copy, rest_param_ref (g_ptr_array_index (priv->params, i)));
 
   return copy;
 }
@@ -132,28 +160,24 @@ rest_params_unref (RestParams *self)
  * @params: a valid #RestParams
  * @param: (transfer full): a valid #RestParam
  *
- * Add @param to @params.
+ * Add @param to @params.  Parameters keep the order in which they were
+ * added, and several parameters may share the same name.
  **/
 void
 rest_params_add (RestParams *self,
                  RestParam  *param)
 {
+  RestParamsPrivate *priv = rest_params_get_private (self);
+  const char *name;
+
   g_return_if_fail (self);
   g_return_if_fail (param);
 
-  self->params = g_list_append (self->params, param);
-}
-
-static gint
-rest_params_find (gconstpointer self,
-                  gconstpointer name)
-{
-  const RestParam *e = self;
-  const char *n = name;
-  const char *n2 = rest_param_get_name ((RestParam *)e);
+  name = rest_param_get_name (param);
+  if (!g_hash_table_contains (priv->index, name))
+    g_hash_table_insert (priv->index, (gpointer) name, param);
 
-  if (g_strcmp0 (n2, n) == 0) return 0;
-  return -1;
+  g_ptr_array_add (priv->params, param);
 }
 
 /**
@@ -161,7 +185,8 @@ rest_params_find (gconstpointer self,
  * @params: a valid #RestParams
  * @name: a parameter name
  *
- * Return the #RestParam called @name, or %NULL if it doesn't exist.
+ * Return the #RestParam called @name, or %NULL if it doesn't exist.  If
+ * several parameters share @name, the one added first is returned.
  *
  * Returns: (transfer none) (nullable): a #RestParam or %NULL if the name
  * doesn't exist
@@ -170,10 +195,12 @@ RestParam *
 rest_params_get (RestParams *self,
                  const char *name)
 {
+  RestParamsPrivate *priv = rest_params_get_private (self);
+
   g_return_val_if_fail (self, NULL);
   g_return_val_if_fail (name, NULL);
 
-  return g_list_find_custom (self->params, name, rest_params_find)->data;
+  return g_hash_table_lookup (priv->index, name);
 }
 
 /**
@@ -181,19 +208,43 @@ rest_params_get (RestParams *self,
  * @params: a valid #RestParams
  * @name: a parameter name
  *
- * Remove the #RestParam called @name.
+ * Remove the #RestParam called @name.  If several parameters share @name,
+ * only the one added first is removed.
  **/
 void
 rest_params_remove (RestParams *self,
                     const char *name)
 {
-  GList *elem = NULL;
+  RestParamsPrivate *priv = rest_params_get_private (self);
+  RestParam *param;
+  guint pos;
 
   g_return_if_fail (self);
   g_return_if_fail (name);
 
-  elem = g_list_find_custom (self->params, name, rest_params_find);
-  self->params = g_list_remove (self->params, elem->data);
+  param = g_hash_table_lookup (priv->index, name);
+  if (param == NULL)
+    return;
+
+  g_hash_table_remove (priv->index, name);
+
+  if (!g_ptr_array_find (priv->params, param, &pos))
+    g_assert_not_reached ();
+
+  /* The removed parameter was the first with this name, so any other one
+   * can only come after it. */
+  for (guint i = pos + 1; i < priv->params->len; i++)
+    {
+      RestParam *next = g_ptr_array_index (priv->params, i);
+
+      if (g_str_equal (rest_param_get_name (next), name))
+        {
+          g_hash_table_insert (priv->index, (gpointer) rest_param_get_name (next), next);
+          break;
+        }
+    }
+
+  g_ptr_array_remove_index (priv->params, pos);
 }
 
 /**
@@ -208,11 +259,13 @@ rest_params_remove (RestParams *self,
 gboolean
 rest_params_are_strings (RestParams *self)
 {
+  RestParamsPrivate *priv = rest_params_get_private (self);
+
   g_return_val_if_fail (self, FALSE);
 
-  for (GList *cur = self->params; cur; cur = g_list_next (cur))
+  for (guint i = 0; i < priv->params->len; i++)
     {
-      if (!rest_param_is_string (cur->data))
+      if (!rest_param_is_string (g_ptr_array_index (priv->params, i)))
         return FALSE;
     }
 
@@ -234,16 +287,19 @@ rest_params_are_strings (RestParams *self)
 GHashTable *
 rest_params_as_string_hash_table (RestParams *self)
 {
+  RestParamsPrivate *priv = rest_params_get_private (self);
   GHashTable *strings;
 
   g_return_val_if_fail (self, NULL);
 
   strings = g_hash_table_new (g_str_hash, g_str_equal);
 
-  for (GList *cur = self->params; cur; cur = g_list_next (cur))
+  for (guint i = 0; i < priv->params->len; i++)
     {
-      if (rest_param_is_string (cur->data))
-        g_hash_table_insert (strings, (gpointer)rest_param_get_name (cur->data), (gpointer)rest_param_get_content (cur->data));
+      RestParam *param = g_ptr_array_index (priv->params, i);
+
+      if (rest_param_is_string (param))
+        g_hash_table_insert (strings, (gpointer)rest_param_get_name (param), (gpointer)rest_param_get_content (param));
     }
 
   return strings;
@@ -297,14 +353,16 @@ rest_params_iter_next (RestParamsIter  *iter,
                        const char     **name,
                        RestParam      **param)
 {
-  GList *cur = NULL;
+  RestParamsPrivate *priv;
+  RestParam *cur;
 
   g_return_val_if_fail (iter, FALSE);
 
+  priv = rest_params_get_private (iter->params);
+
   iter->position++;
-  cur = g_list_nth (iter->params->params, iter->position);
 
-  if (cur == NULL)
+  if ((guint) iter->position >= priv->params->len)
     {
       if (param)
         *param = NULL;
@@ -313,11 +371,139 @@ rest_params_iter_next (RestParamsIter  *iter,
       return FALSE;
     }
 
+  cur = g_ptr_array_index (priv->params, iter->position);
+
   if (param)
-    *param = cur->data;
+    *param = cur;
   if (name)
-    *name = rest_param_get_name (*param);
+    *name = rest_param_get_name (cur);
 
   return TRUE;
 }
 
+
+/*
+ * _rest_params_clear:
+ * @self: a valid #RestParams
+ *
+ * Removes all parameters from @self, keeping the allocated storage so it can
+ * be filled again cheaply.
+ */
+void
+_rest_params_clear (RestParams *self)
+{
+  RestParamsPrivate *priv = rest_params_get_private (self);
+
+  g_return_if_fail (self);
+
+  g_hash_table_remove_all (priv->index);
+  g_ptr_array_set_size (priv->params, 0);
+}
+
+/* Same escaping as libsoup's form encoding */
+static void
+append_form_encoded (GString    *str,
+                     const char *in)
+{
+  const guchar *s = (const guchar *) in;
+
+  while (*s)
+    {
+      if (*s == ' ')
+        g_string_append_c (str, '+');
+      else if (!g_ascii_isalnum (*s) && *s != '-' && *s != '_' && *s != '.')
+        g_string_append_printf (str, "%%%02X", (int) *s);
+      else
+        g_string_append_c (str, *s);
+      s++;
+    }
+}
+
+/*
+ * _rest_params_append_form:
+ * @self: a valid #RestParams
+ * @first: index of the first parameter to encode
+ * @form: the string to append to
+ *
+ * Appends the string parameters of @self from position @first onwards to
+ * @form as application/x-www-form-urlencoded data, in insertion order.
+ */
+void
+_rest_params_append_form (RestParams *self,
+                          guint       first,
+                          GString    *form)
+{
+  RestParamsPrivate *priv = rest_params_get_private (self);
+
+  g_return_if_fail (self);
+  g_return_if_fail (form);
+
+  for (guint i = first; i < priv->params->len; i++)
+    {
+      RestParam *param = g_ptr_array_index (priv->params, i);
+
+      if (!rest_param_is_string (param))
+        continue;
+
+      if (form->len > 0)
+        g_string_append_c (form, '&');
+      append_form_encoded (form, rest_param_get_name (param));
+      g_string_append_c (form, '=');
+      append_form_encoded (form, rest_param_get_content (param));
+    }
+}
+
+/*
+ * _rest_params_get_array:
+ * @self: a valid #RestParams
+ *
+ * Returns: (transfer none): the parameters of @self, in insertion order
+ */
+GPtrArray *
+_rest_params_get_array (RestParams *self)
+{
+  g_return_val_if_fail (self, NULL);
+
+  return rest_params_get_private (self)->params;
+}
+
+static int
+compare_param_names (gconstpointer a,
+                     gconstpointer b)
+{
+  return strcmp (rest_param_get_name (*(RestParam **) a),
+                 rest_param_get_name (*(RestParam **) b));
+}
+
+/*
+ * _rest_params_get_sorted_strings:
+ * @self: a valid #RestParams
+ *
+ * Gets the string parameters of @self sorted by name, as services that sign
+ * their requests want them.  Parameters sharing a name stay in the order
+ * they are sent.
+ *
+ * Returns: (transfer container): the #RestParam of the string parameters
+ */
+GPtrArray *
+_rest_params_get_sorted_strings (RestParams *self)
+{
+  RestParamsPrivate *priv = rest_params_get_private (self);
+  GPtrArray *strings;
+
+  g_return_val_if_fail (self, NULL);
+
+  strings = g_ptr_array_sized_new (priv->params->len);
+  for (guint i = 0; i < priv->params->len; i++)
+    {
+      RestParam *param = g_ptr_array_index (priv->params, i);
+
+      if (rest_param_is_string (param))
+        g_ptr_array_add (strings, param);
+    }
+
+  /* Stable, so that parameters sharing a name keep their order */
+  g_ptr_array_sort (strings, compare_param_names);
+
+  return strings;
+}
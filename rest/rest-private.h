@@ -56,6 +56,8 @@ void _rest_setup_debugging (void);
 
 gboolean _rest_proxy_get_binding_required (RestProxy *proxy);
 const gchar *_rest_proxy_get_bound_url (RestProxy *proxy);
+gchar *_rest_proxy_expand_url_valist (RestProxy *proxy,
+                                      va_list    params);
 void _rest_proxy_queue_message (RestProxy   *proxy,
                                 SoupMessage *message,
                                 GCancellable *cancellable,
@@ -66,6 +68,7 @@ void _rest_proxy_cancel_message (RestProxy   *proxy,
 GBytes *_rest_proxy_send_message (RestProxy    *proxy,
                                   SoupMessage  *message,
                                   GCancellable *cancellable,
+                                  SoupMessage **response,
                                   GError      **error);
 void _rest_proxy_send_message_async (RestProxy          *proxy,
                                      SoupMessage        *message,
@@ -76,6 +79,160 @@ GInputStream *_rest_proxy_send_message_finish (RestProxy    *proxy,
                                                GAsyncResult *result,
                                                GError      **error);
 
+typedef struct {
+  const char *name;
+  const char *value;
+  /* Set when name and value are copies owned by the header */
+  char *name_owned;
+  char *value_owned;
+} RestHeader;
+
+GArray     *_rest_headers_new    (void);
+void        _rest_headers_set    (GArray             *headers,
+                                  const char         *name,
+                                  const char         *value,
+                                  gboolean            copy);
+const char *_rest_headers_lookup (GArray             *headers,
+                                  const char         *name);
+void        _rest_headers_remove (GArray             *headers,
+                                  const char         *name);
+void        _rest_headers_apply  (GArray             *headers,
+                                  SoupMessageHeaders *message_headers);
+
+gint64   _rest_proxy_get_hedge_delay   (RestProxy *proxy);
+gboolean _rest_proxy_start_hedge       (RestProxy *proxy);
+void     _rest_proxy_record_latency    (RestProxy *proxy,
+                                        gint64     latency,
+                                        gboolean   hedge_won);
+
+void _rest_proxy_apply_default_headers (RestProxy          *proxy,
+                                        SoupMessageHeaders *message_headers);
+
+goffset       _rest_param_get_stream_length (RestParam     *param);
+GFile        *_rest_param_get_file          (RestParam     *param);
+GInputStream *_rest_param_open_stream       (RestParam     *param,
+                                             GCancellable  *cancellable,
+                                             GError       **error);
+
+GInputStream *_rest_multipart_stream_new (RestParams  *params,
+                                          char       **content_type,
+                                          goffset     *length);
+
+typedef struct _RestCache RestCache;
+
+RestCache   *_rest_cache_new          (void);
+void         _rest_cache_free         (RestCache    *cache);
+void         _rest_cache_set_max_size (RestCache    *cache,
+                                       gsize         max_size);
+gsize        _rest_cache_get_max_size (RestCache    *cache);
+void         _rest_cache_set_dir      (RestCache    *cache,
+                                       const char   *dir);
+const char  *_rest_cache_get_dir      (RestCache    *cache);
+void         _rest_cache_set_dir_max_size (RestCache *cache,
+                                           guint64    max_size);
+guint64      _rest_cache_get_dir_max_size (RestCache *cache);
+void         _rest_cache_clear        (RestCache    *cache);
+void         _rest_cache_get_stats    (RestCache    *cache,
+                                       guint64      *hits,
+                                       guint64      *misses,
+                                       guint64      *revalidations);
+SoupMessage *_rest_cache_lookup       (RestCache    *cache,
+                                       SoupMessage  *message,
+                                       GBytes      **body);
+SoupMessage *_rest_cache_store        (RestCache    *cache,
+                                       SoupMessage  *message,
+                                       GBytes      **body);
+void         _rest_cache_reset_message (SoupMessage *message);
+void         _rest_cache_reset_copy   (SoupMessage  *message,
+                                       SoupMessage  *copy);
+
+gint64       _rest_parse_http_date    (const char   *value);
+
+#ifndef WITH_SOUP_2
+guint       _rest_message_get_status        (SoupMessage *message);
+const char *_rest_message_get_reason_phrase (SoupMessage *message);
+void        _rest_message_set_request_bytes (SoupMessage *message,
+                                             const char  *content_type,
+                                             GBytes      *body);
+#endif
+
+gboolean _rest_method_is_idempotent (const char *method);
+
+typedef struct _RestRetryBudget RestRetryBudget;
+
+RestRetryBudget *_rest_retry_budget_new  (void);
+void             _rest_retry_budget_free (RestRetryBudget *budget);
+RestRetryBudget *_rest_proxy_get_retry_budget (RestProxy *proxy);
+gboolean _rest_retry_policy_next_attempt (RestRetryPolicy    *policy,
+                                          RestRetryBudget    *budget,
+                                          const char         *method,
+                                          guint               status,
+                                          SoupMessageHeaders *response_headers,
+                                          const GError       *error,
+                                          guint               attempt,
+                                          guint              *delay);
+gint64   _rest_parse_retry_after (const char *value);
+
+typedef struct _RestRateLimiter RestRateLimiter;
+
+RestRateLimiter *_rest_rate_limiter_new       (void);
+void             _rest_rate_limiter_free      (RestRateLimiter    *limiter);
+void             _rest_rate_limiter_set_limit (RestRateLimiter    *limiter,
+                                               const char         *host,
+                                               const char         *function,
+                                               double              rate,
+                                               guint               burst);
+gint64           _rest_rate_limiter_reserve   (RestRateLimiter    *limiter,
+                                               const char         *host,
+                                               const char         *function);
+void             _rest_rate_limiter_refund    (RestRateLimiter    *limiter,
+                                               const char         *host,
+                                               const char         *function);
+void             _rest_rate_limiter_update    (RestRateLimiter    *limiter,
+                                               const char         *host,
+                                               guint               status,
+                                               SoupMessageHeaders *headers);
+
+typedef enum {
+  REST_BANDWIDTH_UPLOAD,
+  REST_BANDWIDTH_DOWNLOAD
+} RestBandwidthDirection;
+
+typedef struct _RestBandwidthLimit RestBandwidthLimit;
+
+RestBandwidthLimit *_rest_bandwidth_limit_new         (void);
+RestBandwidthLimit *_rest_bandwidth_limit_ref         (RestBandwidthLimit     *limit);
+void                _rest_bandwidth_limit_unref       (RestBandwidthLimit     *limit);
+void                _rest_bandwidth_limit_set_rate    (RestBandwidthLimit     *limit,
+                                                       guint64                 rate);
+guint64             _rest_bandwidth_limit_get_rate    (RestBandwidthLimit     *limit);
+RestBandwidthLimit *_rest_bandwidth_get_global_limit  (RestBandwidthDirection  direction);
+void                _rest_bandwidth_set_message_limit (SoupMessage            *message,
+                                                       RestBandwidthDirection  direction,
+                                                       RestBandwidthLimit     *limit);
+RestBandwidthLimit *_rest_bandwidth_get_message_limit (SoupMessage            *message,
+                                                       RestBandwidthDirection  direction);
+GPtrArray          *_rest_bandwidth_get_limits        (SoupMessage            *message,
+                                                       RestBandwidthDirection  direction,
+                                                       RestBandwidthLimit     *proxy_limit);
+gsize               _rest_bandwidth_get_chunk_size    (GPtrArray              *limits);
+gint64              _rest_bandwidth_reserve           (GPtrArray              *limits,
+                                                       gsize                   bytes);
+GInputStream       *_rest_shaped_stream_new           (GInputStream           *base,
+                                                       GPtrArray              *limits);
+
+void _rest_tls_database_set_lazy (SoupSession *session,
+                                  const char  *ca_file);
+void _rest_tls_database_prepare  (SoupSession *session,
+                                  SoupMessage *message);
+
+void _rest_params_clear (RestParams *self);
+GPtrArray *_rest_params_get_array (RestParams *self);
+void _rest_params_append_form (RestParams *self,
+                               guint       first,
+                               GString    *form);
+GPtrArray *_rest_params_get_sorted_strings (RestParams *self);
+
 RestXmlNode *_rest_xml_node_new (void);
 void         _rest_xml_node_reverse_children_siblings (RestXmlNode *node);
 RestXmlNode *_rest_xml_node_prepend (RestXmlNode *cur_node,
@@ -26,11 +26,21 @@
 #include <rest/rest-proxy.h>
 #include <rest/rest-proxy-call.h>
 #include <rest/rest-params.h>
+#include <rest/rest-call-template.h>
 
 G_BEGIN_DECLS
 
 const char *rest_proxy_call_get_url (RestProxyCall *call);
 
+RestProxy *_rest_proxy_call_get_proxy (RestProxyCall *call);
+void _rest_proxy_call_set_proxy (RestProxyCall *call,
+                                 RestProxy     *proxy);
+void _rest_proxy_call_set_template (RestProxyCall    *call,
+                                    RestCallTemplate *call_template);
+const char *_rest_call_template_get_form (RestCallTemplate *self,
+                                          RestParams       *params,
+                                          guint            *n_params);
+
 G_END_DECLS
 
 #endif /* _REST_PROXY_CALL_PRIVATE */
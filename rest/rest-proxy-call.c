@@ -25,6 +25,7 @@
 #include <rest/rest-proxy-call.h>
 #include <rest/rest-params.h>
 #include <libsoup/soup.h>
+#include <string.h>
 
 #include "rest-private.h"
 #include "rest-proxy-auth-private.h"
@@ -41,6 +42,10 @@ struct _RestProxyCallAsyncClosure {
 typedef struct _RestProxyCallAsyncClosure RestProxyCallAsyncClosure;
 
 #define READ_BUFFER_SIZE 8192
+/* Without framing the buffer grows up to this while reads keep filling it */
+#define READ_BUFFER_MAX_ADAPTIVE_SIZE (256 * 1024)
+/* Records larger than this are treated as a broken stream */
+#define MAX_RECORD_SIZE (64 * 1024 * 1024)
 
 struct _RestProxyCallContinuousClosure {
   RestProxyCall *call;
@@ -48,10 +53,43 @@ struct _RestProxyCallContinuousClosure {
   GObject *weak_object;
   gpointer userdata;
   SoupMessage *message;
-  guchar buffer[READ_BUFFER_SIZE];
+  RestProxyCallFraming framing;
+  gchar *delimiter;
+  gsize delimiter_len;
+  guchar *buffer;
+  gsize buffer_size;
+  /* Data not passed on yet is at buffer[start, start + len) */
+  gsize start;
+  gsize len;
+  /* How much of that data is known not to contain the delimiter */
+  gsize scanned;
 };
 typedef struct _RestProxyCallContinuousClosure RestProxyCallContinuousClosure;
 
+#define EVENT_SOURCE_DEFAULT_RETRY_MS 3000
+/* How long reconnecting backs off to, unless the server asks for longer */
+#define EVENT_SOURCE_MAX_RETRY_MS (60 * 1000)
+
+struct _RestProxyCallEventSource {
+  RestProxyCall *call;
+  RestProxyCallEventCallback callback;
+  GObject *weak_object;
+  gpointer userdata;
+  /* The event being parsed; data has a newline after every line */
+  GString *data;
+  gchar *event_type;
+  gchar *last_event_id;
+  /* Prepared once; every connection sends a copy of it */
+  SoupMessage *prepared;
+  guint retry_ms;
+  guint reconnect_id;
+  /* Reconnections in a row that received nothing */
+  guint failures;
+  /* Set by rest_proxy_call_cancel() */
+  gboolean stopped;
+};
+typedef struct _RestProxyCallEventSource RestProxyCallEventSource;
+
 struct _RestProxyCallUploadClosure {
   RestProxyCall *call;
   RestProxyCallUploadCallback callback;
@@ -62,6 +100,72 @@ struct _RestProxyCallUploadClosure {
 };
 typedef struct _RestProxyCallUploadClosure RestProxyCallUploadClosure;
 
+#define DOWNLOAD_BUFFER_SIZE (64 * 1024)
+#define DOWNLOAD_VALIDATOR_ATTRIBUTE "xattr::librest-validator"
+
+struct _RestProxyCallDownloadClosure {
+  RestProxyCallDownloadCallback callback;
+  gpointer userdata;
+  GFile *file;
+  /* Prepared once, and copied for every request so a restart doesn't
+   * prepare the call again */
+  SoupMessage *prepared;
+  SoupMessage *message;
+  GInputStream *input;
+  GOutputStream *output;
+  /* Strong ETag or Last-Modified of the data in file */
+  gchar *validator;
+  /* What the download failed with, returned once file is closed */
+  GError *error;
+  /* Bytes of the body that were in file before the request */
+  goffset offset;
+  goffset downloaded;
+  goffset total;
+  guchar *buffer;
+};
+typedef struct _RestProxyCallDownloadClosure RestProxyCallDownloadClosure;
+
+#define SEGMENT_MIN_SIZE (256 * 1024)
+#define SEGMENT_MAX_RETRIES 3
+/* The most the first retry of a segment waits, doubled for each one after */
+#define SEGMENT_RETRY_DELAY_MS 500
+
+struct _RestDownloadSegment {
+  GTask *task;
+  /* The next byte to fetch and the last byte of the segment */
+  goffset start;
+  goffset end;
+  guint retries;
+  SoupMessage *message;
+  GInputStream *input;
+  GFileIOStream *io;
+  guchar *buffer;
+};
+typedef struct _RestDownloadSegment RestDownloadSegment;
+
+struct _RestProxyCallSegmentedClosure {
+  RestProxyCallDownloadCallback callback;
+  gpointer userdata;
+  GFile *file;
+  GIOStream *io;
+  /* Prepared once; the probe and every segment send a copy of it */
+  SoupMessage *prepared;
+  /* The request that finds the size of the body */
+  SoupMessage *message;
+  gchar *validator;
+  GCancellable *cancellable;
+  GCancellable *user_cancellable;
+  gulong cancel_id;
+  goffset total;
+  goffset downloaded;
+  RestDownloadSegment *segments;
+  guint n_segments;
+  guint pending;
+  /* The first error of a segment */
+  GError *error;
+};
+typedef struct _RestProxyCallSegmentedClosure RestProxyCallSegmentedClosure;
+
 
 
 #define GET_PRIVATE(o) ((RestProxyCallPrivate*)(rest_proxy_call_get_instance_private (REST_PROXY_CALL(o))))
@@ -69,12 +173,27 @@ typedef struct _RestProxyCallUploadClosure RestProxyCallUploadClosure;
 struct _RestProxyCallPrivate {
   gchar *method;
   gchar *function;
-  GHashTable *headers;
+  GArray *headers;
   RestParams *params;
+  /* Sent as is instead of the parameters, which then go in the URL */
+  GBytes *body;
+  gchar *body_content_type;
+  /* The URL format of the proxy bound for this call only */
+  gchar *bound_url;
   /* The real URL we're about to invoke */
   gchar *url;
 
+  /* The headers of the last response, read in place; its message and body
+   * aren't kept */
+  SoupMessageHeaders *response_message_headers;
+  /* Built on demand by rest_proxy_call_get_response_headers() */
   GHashTable *response_headers;
+
+  RestProxyCallEventSource *event_source;
+
+  RestProxyCallFraming continuous_framing;
+  gchar *continuous_delimiter;
+  gsize continuous_buffer_size;
   GBytes *payload;
   guint status_code;
   gchar *status_message;
@@ -83,8 +202,20 @@ struct _RestProxyCallPrivate {
   gulong cancel_sig;
 
   RestProxy *proxy;
+  RestCallTemplate *call_template;
+  /* Overrides the policy of the proxy when set */
+  RestRetryPolicy *retry_policy;
+
+  /* Where the call waits when its host is busy */
+  RestProxyCallPriority priority;
+  gchar *queue_group;
+
+  /* Byte rates of the bodies of the call, by #RestBandwidthDirection */
+  RestBandwidthLimit *bandwidth_limits[2];
 
   RestProxyCallAsyncClosure *cur_call_closure;
+  /* Tasks of the asynchronous functions not completed yet */
+  guint n_running_tasks;
 };
 typedef struct _RestProxyCallPrivate RestProxyCallPrivate;
 
@@ -94,7 +225,8 @@ G_DEFINE_TYPE_WITH_PRIVATE (RestProxyCall, rest_proxy_call, G_TYPE_OBJECT)
 enum
 {
   PROP_0 = 0,
-  PROP_PROXY
+  PROP_PROXY,
+  PROP_RETRY_POLICY
 };
 
 /**
@@ -118,6 +250,9 @@ rest_proxy_call_get_property (GObject    *object,
     case PROP_PROXY:
       g_value_set_object (value, priv->proxy);
       break;
+    case PROP_RETRY_POLICY:
+      g_value_set_object (value, priv->retry_policy);
+      break;
   default:
     G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
   }
@@ -135,11 +270,17 @@ rest_proxy_call_set_property (GObject      *object,
     case PROP_PROXY:
       priv->proxy = g_value_dup_object (value);
       break;
+    case PROP_RETRY_POLICY:
+      g_set_object (&priv->retry_policy, g_value_get_object (value));
+      break;
   default:
     G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
   }
 }
 
+static void set_response_message (RestProxyCallPrivate *priv,
+                                  SoupMessage          *message);
+
 static void
 rest_proxy_call_dispose (GObject *object)
 {
@@ -152,8 +293,11 @@ rest_proxy_call_dispose (GObject *object)
     }
 
   g_clear_pointer (&priv->params, rest_params_unref);
-  g_clear_pointer (&priv->headers, g_hash_table_unref);
-  g_clear_pointer (&priv->response_headers, g_hash_table_unref);
+  g_clear_pointer (&priv->body, g_bytes_unref);
+  g_clear_pointer (&priv->headers, g_array_unref);
+  set_response_message (priv, NULL);
+  g_clear_pointer (&priv->call_template, rest_call_template_unref);
+  g_clear_object (&priv->retry_policy);
   g_clear_object (&priv->proxy);
 
   G_OBJECT_CLASS (rest_proxy_call_parent_class)->dispose (object);
@@ -166,11 +310,17 @@ rest_proxy_call_finalize (GObject *object)
 
   g_free (priv->method);
   g_free (priv->function);
+  g_free (priv->body_content_type);
 
   g_clear_pointer (&priv->payload, g_bytes_unref);
   g_free (priv->status_message);
 
+  g_free (priv->bound_url);
   g_free (priv->url);
+  g_free (priv->continuous_delimiter);
+  g_free (priv->queue_group);
+  g_clear_pointer (&priv->bandwidth_limits[REST_BANDWIDTH_UPLOAD], _rest_bandwidth_limit_unref);
+  g_clear_pointer (&priv->bandwidth_limits[REST_BANDWIDTH_DOWNLOAD], _rest_bandwidth_limit_unref);
 
   G_OBJECT_CLASS (rest_proxy_call_parent_class)->finalize (object);
 }
@@ -192,6 +342,19 @@ rest_proxy_call_class_init (RestProxyCallClass *klass)
                                REST_TYPE_PROXY,
                                G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE);
   g_object_class_install_property (object_class, PROP_PROXY, pspec);
+
+  /**
+   * RestProxyCall:retry-policy:
+   *
+   * The #RestRetryPolicy of this call, or %NULL to use the
+   * #RestProxy:retry-policy of the proxy.
+   */
+  pspec = g_param_spec_object ("retry-policy",
+                               "retry-policy",
+                               "How this call is retried",
+                               REST_TYPE_RETRY_POLICY,
+                               G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class, PROP_RETRY_POLICY, pspec);
 }
 
 static void
@@ -203,14 +366,11 @@ rest_proxy_call_init (RestProxyCall *self)
 
   priv->params = rest_params_new ();
 
-  priv->headers = g_hash_table_new_full (g_str_hash,
-                                         g_str_equal,
-                                         g_free,
-                                         g_free);
-  priv->response_headers = g_hash_table_new_full (g_str_hash,
-                                                  g_str_equal,
-                                                  g_free,
-                                                  g_free);
+  priv->headers = _rest_headers_new ();
+
+  priv->continuous_buffer_size = READ_BUFFER_SIZE;
+
+  priv->priority = REST_PROXY_CALL_PRIORITY_NORMAL;
 }
 
 /**
@@ -252,6 +412,182 @@ rest_proxy_call_get_method (RestProxyCall *call)
   return GET_PRIVATE (call)->method;
 }
 
+/**
+ * rest_proxy_call_set_retry_policy:
+ * @call: The #RestProxyCall
+ * @policy: (nullable): a #RestRetryPolicy, or %NULL
+ *
+ * Retry @call as @policy says instead of following the
+ * #RestProxy:retry-policy of its proxy.  %NULL goes back to the policy of
+ * the proxy; to never retry the call, set a policy with a single attempt.
+ */
+void
+rest_proxy_call_set_retry_policy (RestProxyCall   *call,
+                                  RestRetryPolicy *policy)
+{
+  g_return_if_fail (REST_IS_PROXY_CALL (call));
+  g_return_if_fail (policy == NULL || REST_IS_RETRY_POLICY (policy));
+
+  g_object_set (call, "retry-policy", policy, NULL);
+}
+
+/**
+ * rest_proxy_call_get_retry_policy:
+ * @call: The #RestProxyCall
+ *
+ * Returns: (transfer none) (nullable): the #RestRetryPolicy set on @call, or
+ * %NULL if it follows the one of its proxy.
+ */
+RestRetryPolicy *
+rest_proxy_call_get_retry_policy (RestProxyCall *call)
+{
+  g_return_val_if_fail (REST_IS_PROXY_CALL (call), NULL);
+
+  return GET_PRIVATE (call)->retry_policy;
+}
+
+/**
+ * rest_proxy_call_set_priority:
+ * @call: The #RestProxyCall
+ * @priority: a #RestProxyCallPriority
+ *
+ * Set how soon @call is sent when other calls wait for the same host, see
+ * #RestProxy:max-host-requests.  Calls of the same priority are sent in
+ * the order they were made.
+ */
+void
+rest_proxy_call_set_priority (RestProxyCall         *call,
+                              RestProxyCallPriority  priority)
+{
+  g_return_if_fail (REST_IS_PROXY_CALL (call));
+  g_return_if_fail (priority <= REST_PROXY_CALL_PRIORITY_INTERACTIVE);
+
+  GET_PRIVATE (call)->priority = priority;
+}
+
+/**
+ * rest_proxy_call_get_priority:
+ * @call: The #RestProxyCall
+ *
+ * Returns: the #RestProxyCallPriority of @call
+ */
+RestProxyCallPriority
+rest_proxy_call_get_priority (RestProxyCall *call)
+{
+  g_return_val_if_fail (REST_IS_PROXY_CALL (call), REST_PROXY_CALL_PRIORITY_NORMAL);
+
+  return GET_PRIVATE (call)->priority;
+}
+
+/**
+ * rest_proxy_call_set_queue_group:
+ * @call: The #RestProxyCall
+ * @group: (nullable): the name of the group of @call
+ *
+ * Put @call in @group when it waits for its host.  Waiting groups of the
+ * same priority take turns, so that one caller making many calls doesn't
+ * hold up the others.  The calls without a group are one group.
+ */
+void
+rest_proxy_call_set_queue_group (RestProxyCall *call,
+                                 const char    *group)
+{
+  RestProxyCallPrivate *priv = GET_PRIVATE (call);
+
+  g_return_if_fail (REST_IS_PROXY_CALL (call));
+
+  g_free (priv->queue_group);
+  priv->queue_group = g_strdup (group);
+}
+
+/**
+ * rest_proxy_call_get_queue_group:
+ * @call: The #RestProxyCall
+ *
+ * Returns: (transfer none) (nullable): the group of @call, see
+ * rest_proxy_call_set_queue_group()
+ */
+const char *
+rest_proxy_call_get_queue_group (RestProxyCall *call)
+{
+  g_return_val_if_fail (REST_IS_PROXY_CALL (call), NULL);
+
+  return GET_PRIVATE (call)->queue_group;
+}
+
+static void
+set_bandwidth_limit (RestProxyCallPrivate   *priv,
+                     RestBandwidthDirection  direction,
+                     guint64                 rate)
+{
+  if (priv->bandwidth_limits[direction] == NULL)
+    {
+      if (rate == 0)
+        return;
+      priv->bandwidth_limits[direction] = _rest_bandwidth_limit_new ();
+    }
+
+  _rest_bandwidth_limit_set_rate (priv->bandwidth_limits[direction], rate);
+}
+
+static guint64
+get_bandwidth_limit (RestProxyCallPrivate   *priv,
+                     RestBandwidthDirection  direction)
+{
+  if (priv->bandwidth_limits[direction] == NULL)
+    return 0;
+
+  return _rest_bandwidth_limit_get_rate (priv->bandwidth_limits[direction]);
+}
+
+/**
+ * rest_proxy_call_set_bandwidth_limits:
+ * @call: The #RestProxyCall
+ * @upload_rate: the most bytes per second of the request body sent, or 0
+ * @download_rate: the most bytes per second of the response body received,
+ *   or 0
+ *
+ * Limit the rate at which the bodies of the asynchronous invocations of
+ * @call are moved, on top of the limits of its proxy, see
+ * rest_proxy_set_bandwidth_limits().  A rate of 0 removes the limit.
+ */
+void
+rest_proxy_call_set_bandwidth_limits (RestProxyCall *call,
+                                      guint64        upload_rate,
+                                      guint64        download_rate)
+{
+  RestProxyCallPrivate *priv = GET_PRIVATE (call);
+
+  g_return_if_fail (REST_IS_PROXY_CALL (call));
+
+  set_bandwidth_limit (priv, REST_BANDWIDTH_UPLOAD, upload_rate);
+  set_bandwidth_limit (priv, REST_BANDWIDTH_DOWNLOAD, download_rate);
+}
+
+/**
+ * rest_proxy_call_get_bandwidth_limits:
+ * @call: The #RestProxyCall
+ * @upload_rate: (out) (optional): return location for the upload limit
+ * @download_rate: (out) (optional): return location for the download limit
+ *
+ * Get the limits set with rest_proxy_call_set_bandwidth_limits(), in bytes
+ * per second, 0 meaning none.
+ */
+void
+rest_proxy_call_get_bandwidth_limits (RestProxyCall *call,
+                                      guint64       *upload_rate,
+                                      guint64       *download_rate)
+{
+  RestProxyCallPrivate *priv = GET_PRIVATE (call);
+
+  g_return_if_fail (REST_IS_PROXY_CALL (call));
+
+  if (upload_rate)
+    *upload_rate = get_bandwidth_limit (priv, REST_BANDWIDTH_UPLOAD);
+  if (download_rate)
+    *download_rate = get_bandwidth_limit (priv, REST_BANDWIDTH_DOWNLOAD);
+}
+
 /**
  * rest_proxy_call_set_function:
  * @call: The #RestProxyCall
@@ -295,6 +631,58 @@ rest_proxy_call_get_function (RestProxyCall *call)
 }
 
 
+/**
+ * rest_proxy_call_bind_valist:
+ * @call: The #RestProxyCall
+ * @params: the values for the URL format of the proxy
+ *
+ * Like rest_proxy_call_bind(), but takes a va_list.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+rest_proxy_call_bind_valist (RestProxyCall *call,
+                             va_list        params)
+{
+  RestProxyCallPrivate *priv = GET_PRIVATE (call);
+
+  g_return_val_if_fail (REST_IS_PROXY_CALL (call), FALSE);
+  g_return_val_if_fail (_rest_proxy_get_binding_required (priv->proxy), FALSE);
+
+  g_free (priv->bound_url);
+  priv->bound_url = _rest_proxy_expand_url_valist (priv->proxy, params);
+
+  return priv->bound_url != NULL;
+}
+
+/**
+ * rest_proxy_call_bind:
+ * @call: The #RestProxyCall
+ * @...: the values for the URL format of the proxy
+ *
+ * Bind the URL format of the proxy for this call only.  Unlike
+ * rest_proxy_bind() this leaves the proxy untouched, so calls on the same
+ * proxy can be bound differently and run at the same time.  A binding made
+ * here takes precedence over one made on the proxy.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+rest_proxy_call_bind (RestProxyCall *call,
+                      ...)
+{
+  gboolean res;
+  va_list params;
+
+  g_return_val_if_fail (REST_IS_PROXY_CALL (call), FALSE);
+
+  va_start (params, call);
+  res = rest_proxy_call_bind_valist (call, params);
+  va_end (params);
+
+  return res;
+}
+
 /**
  * rest_proxy_call_add_header:
  * @call: The #RestProxyCall
@@ -312,11 +700,34 @@ rest_proxy_call_add_header (RestProxyCall *call,
   RestProxyCallPrivate *priv = GET_PRIVATE (call);
 
   g_return_if_fail (REST_IS_PROXY_CALL (call));
+  g_return_if_fail (header != NULL);
+  g_return_if_fail (value != NULL);
+
+  _rest_headers_set (priv->headers, header, value, TRUE);
+}
+
+/**
+ * rest_proxy_call_add_header_static:
+ * @call: The #RestProxyCall
+ * @header: The name of the header to set
+ * @value: The value of the header
+ *
+ * Like rest_proxy_call_add_header(), but @header and @value are not copied.
+ * They must stay valid as long as @call uses them, which is the case for
+ * string literals and strings from g_intern_string().
+ */
+void
+rest_proxy_call_add_header_static (RestProxyCall *call,
+                                   const gchar   *header,
+                                   const gchar   *value)
+{
+  RestProxyCallPrivate *priv = GET_PRIVATE (call);
 
-  g_hash_table_insert (priv->headers,
-                       g_strdup (header),
-                       g_strdup (value));
+  g_return_if_fail (REST_IS_PROXY_CALL (call));
+  g_return_if_fail (header != NULL);
+  g_return_if_fail (value != NULL);
 
+  _rest_headers_set (priv->headers, header, value, FALSE);
 }
 
 /**
@@ -380,7 +791,7 @@ rest_proxy_call_lookup_header (RestProxyCall *call,
 {
   g_return_val_if_fail (REST_IS_PROXY_CALL (call), NULL);
 
-  return g_hash_table_lookup (GET_PRIVATE (call)->headers, header);
+  return _rest_headers_lookup (GET_PRIVATE (call)->headers, header);
 }
 
 /**
@@ -396,7 +807,7 @@ rest_proxy_call_remove_header (RestProxyCall *call,
 {
   g_return_if_fail (REST_IS_PROXY_CALL (call));
 
-  g_hash_table_remove (GET_PRIVATE (call)->headers, header);
+  _rest_headers_remove (GET_PRIVATE (call)->headers, header);
 }
 
 /**
@@ -540,19 +951,91 @@ rest_proxy_call_get_params (RestProxyCall *call)
   return GET_PRIVATE (call)->params;
 }
 
+/**
+ * rest_proxy_call_set_body:
+ * @call: The #RestProxyCall
+ * @content_type: (nullable): the content type of @body
+ * @body: (nullable): the request body, or %NULL to send the parameters again
+ *
+ * Send @body as the request body of @call instead of the encoded parameters.
+ * The parameters of @call are then added to the query string of the URL, as
+ * for a GET request.  This is for APIs that take raw data, such as file
+ * contents or a JSON document.  @body is not copied.
+ */
+void
+rest_proxy_call_set_body (RestProxyCall *call,
+                          const gchar   *content_type,
+                          GBytes        *body)
+{
+  RestProxyCallPrivate *priv = GET_PRIVATE (call);
+
+  g_return_if_fail (REST_IS_PROXY_CALL (call));
+
+  g_clear_pointer (&priv->body, g_bytes_unref);
+  g_clear_pointer (&priv->body_content_type, g_free);
+
+  if (body)
+    {
+      priv->body = g_bytes_ref (body);
+      priv->body_content_type = g_strdup (content_type ? content_type : "application/octet-stream");
+    }
+}
+
 
 
 static void _call_async_weak_notify_cb (gpointer *data,
                                         GObject  *dead_object);
 
+static SoupMessageHeaders *
+get_response_message_headers (RestProxyCallPrivate *priv)
+{
+  return priv->response_message_headers;
+}
+
 static void
-_populate_headers_hash_table (const gchar *name,
-                              const gchar *value,
-                              gpointer     userdata)
+copy_header (const char *name,
+             const char *value,
+             gpointer    user_data)
 {
-  GHashTable *headers = (GHashTable *)userdata;
+  soup_message_headers_append (user_data, name, value);
+}
 
-  g_hash_table_insert (headers, g_strdup (name), g_strdup (value));
+static void
+set_response_message (RestProxyCallPrivate *priv,
+                      SoupMessage          *message)
+{
+  g_clear_pointer (&priv->response_headers, g_hash_table_unref);
+#ifdef WITH_SOUP_2
+  /* libsoup 2 headers can't be shared, so they are copied once */
+  g_clear_pointer (&priv->response_message_headers, soup_message_headers_free);
+  if (message)
+    {
+      priv->response_message_headers = soup_message_headers_new (SOUP_MESSAGE_HEADERS_RESPONSE);
+      soup_message_headers_foreach (message->response_headers, copy_header,
+                                    priv->response_message_headers);
+    }
+#else
+  g_clear_pointer (&priv->response_message_headers, soup_message_headers_unref);
+  if (message)
+    priv->response_message_headers = soup_message_headers_ref (soup_message_get_response_headers (message));
+#endif
+}
+
+/* Take the status and the headers of the response from @message */
+static void
+set_response_status (RestProxyCallPrivate *priv,
+                     SoupMessage          *message)
+{
+  set_response_message (priv, message);
+
+  g_free (priv->status_message);
+#ifdef WITH_SOUP_2
+  priv->status_code = message->status_code;
+  priv->status_message = g_strdup (message->reason_phrase);
+#else
+  priv->status_code = _rest_message_get_status (message);
+  priv->status_message = g_strdup (_rest_message_get_reason_phrase (message));
+#endif
 }
 
 #ifdef WITH_SOUP_2
@@ -600,8 +1083,8 @@ _handle_error_from_message (SoupMessage *message, GError **error)
   }
   reason_phrase = message->reason_phrase;
 #else
-  status_code = soup_message_get_status (message);
-  reason_phrase = soup_message_get_reason_phrase (message);
+  status_code = _rest_message_get_status (message);
+  reason_phrase = _rest_message_get_reason_phrase (message);
 #endif
 
   if (status_code >= 200 && status_code < 300)
@@ -624,35 +1107,16 @@ static gboolean
 finish_call (RestProxyCall *call, SoupMessage *message, GBytes *payload, GError **error)
 {
   RestProxyCallPrivate *priv = GET_PRIVATE (call);
-  SoupMessageHeaders *response_headers;
 
   g_assert (call);
   g_assert (message);
   g_assert (payload);
 
-#ifdef WITH_SOUP_2
-  response_headers = message->response_headers;
-#else
-  response_headers = soup_message_get_response_headers (message);
-#endif
-
-  /* Convert the soup headers in to hash */
-  /* FIXME: Eeek..are you allowed duplicate headers? ... */
-  g_hash_table_remove_all (priv->response_headers);
-  soup_message_headers_foreach (response_headers,
-      (SoupMessageHeadersForeachFunc)_populate_headers_hash_table,
-      priv->response_headers);
+  /* The headers are read straight from the message when asked for */
+  set_response_status (priv, message);
 
   priv->payload = payload;
 
-#ifdef WITH_SOUP_2
-  priv->status_code = message->status_code;
-  priv->status_message = g_strdup (message->reason_phrase);
-#else
-  priv->status_code = soup_message_get_status (message);
-  priv->status_message = g_strdup (soup_message_get_reason_phrase (message));
-#endif
-
   return _handle_error_from_message (message, error);
 }
 
@@ -669,13 +1133,7 @@ _continuous_call_message_completed (SoupMessage *message,
   call = closure->call;
   priv = GET_PRIVATE (call);
 
-#ifdef WITH_SOUP_2
-  priv->status_code = message->status_code;
-  priv->status_message = g_strdup (message->reason_phrase);
-#else
-  priv->status_code = soup_message_get_status (message);
-  priv->status_message = g_strdup (soup_message_get_reason_phrase (message));
-#endif
+  set_response_status (priv, message);
 
   _handle_error_from_message (message, &error);
 
@@ -699,6 +1157,8 @@ _continuous_call_message_completed (SoupMessage *message,
   priv->cur_call_closure = NULL;
   g_object_unref (closure->call);
   g_object_unref (message);
+  g_free (closure->delimiter);
+  g_free (closure->buffer);
   g_slice_free (RestProxyCallContinuousClosure, closure);
 }
 
@@ -715,22 +1175,16 @@ _call_async_weak_notify_cb (gpointer *data,
   rest_proxy_call_cancel (closure->call);
 }
 
-static void
-set_header (gpointer key, gpointer value, gpointer user_data)
-{
-  const char *name = key;
-  SoupMessageHeaders *headers = user_data;
-
-  soup_message_headers_replace (headers, name, value);
-}
-
 static gboolean
 set_url (RestProxyCall *call)
 {
   RestProxyCallPrivate *priv = GET_PRIVATE (call);
   const gchar *bound_url;
 
-  bound_url =_rest_proxy_get_bound_url (priv->proxy);
+  if (priv->bound_url)
+    bound_url = priv->bound_url;
+  else
+    bound_url = _rest_proxy_get_bound_url (priv->proxy);
 
   if (_rest_proxy_get_binding_required (priv->proxy) && !bound_url)
   {
@@ -740,15 +1194,14 @@ set_url (RestProxyCall *call)
 
   g_free (priv->url);
 
-  /* FIXME: Perhaps excessive memory duplication */
   if (priv->function)
   {
     if (g_str_has_suffix (bound_url, "/")
           || g_str_has_prefix (priv->function, "/"))
     {
-      priv->url = g_strdup_printf ("%s%s", bound_url, priv->function);
+      priv->url = g_strconcat (bound_url, priv->function, NULL);
     } else {
-      priv->url = g_strdup_printf ("%s/%s", bound_url, priv->function);
+      priv->url = g_strconcat (bound_url, "/", priv->function, NULL);
     }
   } else {
     priv->url = g_strdup (bound_url);
@@ -794,37 +1247,379 @@ accept_certificate (RestProxyCall        *call,
 }
 #endif
 
-static SoupMessage *
-prepare_message (RestProxyCall *call, GError **error_out)
+static gchar *
+encode_params (RestProxyCall *call)
 {
   RestProxyCallPrivate *priv = GET_PRIVATE (call);
-  RestProxyCallClass *call_class;
-  const gchar *user_agent;
-  SoupMessage *message;
-  SoupMessageHeaders *request_headers;
-  GError *error = NULL;
+  const gchar *template_form = NULL;
+  guint first = 0;
+  GString *form;
 
-  call_class = REST_PROXY_CALL_GET_CLASS (call);
+  /* The template parameters are encoded already, as long as the call still
+   * starts with them */
+  if (priv->call_template)
+    template_form = _rest_call_template_get_form (priv->call_template,
+                                                  priv->params,
+                                                  &first);
 
-  /* Emit a warning if the caller is re-using RestProxyCall objects */
-  if (priv->url)
-  {
-    g_warning (G_STRLOC ": re-use of RestProxyCall %p, don't do this", call);
-  }
+  form = g_string_new (template_form);
+  _rest_params_append_form (priv->params, first, form);
 
-  /* Allow an overrideable prepare function that is called before every
-   * invocation so subclasses can do magic
-   */
-  if (call_class->prepare)
-  {
-    if (!call_class->prepare (call, &error))
-    {
-      g_propagate_error (error_out, error);
+  return g_string_free (form, FALSE);
+}
+
+#ifndef WITH_SOUP_2
+/*
+ * Sets @body as the request body of @message.  libsoup 3 consumes the body
+ * as it is sent, so it is kept to send again if the call is retried, and
+ * for the proxy to read it under its bandwidth limits.
+ */
+void
+_rest_message_set_request_bytes (SoupMessage *message,
+                                 const char  *content_type,
+                                 GBytes      *body)
+{
+  soup_message_set_request_body_from_bytes (message, content_type, body);
+  g_object_set_data_full (G_OBJECT (message), "rest-request-body",
+                          g_bytes_ref (body), (GDestroyNotify) g_bytes_unref);
+}
+#endif
+
+/* Whether @message can be sent again with the same body */
+static gboolean
+message_can_be_resent (SoupMessage *message)
+{
+#ifdef WITH_SOUP_2
+  /* The body is always in memory */
+  return TRUE;
+#else
+  return g_object_get_data (G_OBJECT (message), "rest-request-stream") == NULL;
+#endif
+}
+
+/* Gets @message ready to be sent again */
+static void
+rewind_message (SoupMessage *message)
+{
+#ifndef WITH_SOUP_2
+  GBytes *body = g_object_get_data (G_OBJECT (message), "rest-request-body");
+
+  if (body)
+    soup_message_set_request_body_from_bytes (message, NULL, body);
+#endif
+  /* The cache made it conditional on the response stored back then */
+  _rest_cache_reset_message (message);
+}
+
+/* Waits @delay milliseconds, or less if @cancellable is cancelled */
+static void
+wait_for_retry (guint         delay,
+                GCancellable *cancellable)
+{
+  GPollFD pollfd;
+  gint64 deadline, remaining;
+
+  if (!g_cancellable_make_pollfd (cancellable, &pollfd))
+    {
+      g_usleep (delay * G_TIME_SPAN_MILLISECOND);
+      return;
+    }
+
+  deadline = g_get_monotonic_time () + delay * G_TIME_SPAN_MILLISECOND;
+  while (!g_cancellable_is_cancelled (cancellable) &&
+         (remaining = deadline - g_get_monotonic_time ()) > 0)
+    g_poll (&pollfd, 1, (remaining + G_TIME_SPAN_MILLISECOND - 1) / G_TIME_SPAN_MILLISECOND);
+
+  g_cancellable_release_fd (cancellable);
+}
+
+#ifdef WITH_SOUP_2
+/* Counterpart of soup_message_new_from_encoded_form() in libsoup 3 */
+static SoupMessage *
+soup_message_new_from_encoded_form (const char *method,
+                                    const char *uri_string,
+                                    char       *encoded_form)
+{
+  SoupMessage *message = NULL;
+  SoupURI *uri;
+
+  uri = soup_uri_new (uri_string);
+  if (!uri)
+    {
+      g_free (encoded_form);
+      return NULL;
+    }
+
+  if (strcmp (method, "GET") == 0 ||
+      strcmp (method, "HEAD") == 0 ||
+      strcmp (method, "DELETE") == 0)
+    {
+      soup_uri_set_query (uri, encoded_form);
+      message = soup_message_new_from_uri (method, uri);
+      g_free (encoded_form);
+    }
+  else
+    {
+      message = soup_message_new_from_uri (method, uri);
+      soup_message_set_request (message, SOUP_FORM_MIME_TYPE_URLENCODED,
+                                SOUP_MEMORY_TAKE,
+                                encoded_form, strlen (encoded_form));
+    }
+
+  soup_uri_free (uri);
+
+  return message;
+}
+#endif
+
+/* Like soup_message_new_from_encoded_form(), keeping the body for retries */
+static SoupMessage *
+new_message_from_form (const char *method,
+                       const char *uri,
+                       char       *form)
+{
+#ifdef WITH_SOUP_2
+  return soup_message_new_from_encoded_form (method, uri, form);
+#else
+  SoupMessage *message;
+  GBytes *body;
+
+  if (strcmp (method, "GET") == 0 ||
+      strcmp (method, "HEAD") == 0 ||
+      strcmp (method, "DELETE") == 0)
+    return soup_message_new_from_encoded_form (method, uri, form);
+
+  message = soup_message_new (method, uri);
+  if (message == NULL)
+    {
+      g_free (form);
+      return NULL;
+    }
+
+  body = g_bytes_new_take (form, strlen (form));
+  _rest_message_set_request_bytes (message, SOUP_FORM_MIME_TYPE_URLENCODED, body);
+  g_bytes_unref (body);
+
+  return message;
+#endif
+}
+
+static gboolean
+has_stream_params (RestParams *params)
+{
+  RestParamsIter iter;
+  const char *name;
+  RestParam *param;
+
+  rest_params_iter_init (&iter, params);
+  while (rest_params_iter_next (&iter, &name, &param))
+    if (rest_param_is_stream (param))
+      return TRUE;
+
+  return FALSE;
+}
+
+/*
+ * Uses @stream as the request body of @message.  libsoup 2 can't send a body
+ * from a stream, so there the stream is read into memory first.
+ */
+static gboolean
+set_request_stream (SoupMessage   *message,
+                    const char    *content_type,
+                    GInputStream  *stream,
+                    goffset        content_len,
+                    GError       **error)
+{
+#ifdef WITH_SOUP_2
+  GOutputStream *output;
+  gsize size;
+
+  output = g_memory_output_stream_new_resizable ();
+  if (g_output_stream_splice (output, stream,
+                              G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+                              G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                              NULL, error) < 0)
+  {
+    g_object_unref (output);
+    return FALSE;
+  }
+
+  size = g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (output));
+  soup_message_set_request (message, content_type, SOUP_MEMORY_TAKE,
+                            g_memory_output_stream_steal_data (G_MEMORY_OUTPUT_STREAM (output)),
+                            size);
+  g_object_unref (output);
+#else
+  soup_message_set_request_body (message, content_type, stream, content_len);
+  /* A stream can only be read once, and only the proxy reads it */
+  g_object_set_data_full (G_OBJECT (message), "rest-request-stream",
+                          g_object_ref (stream), g_object_unref);
+#endif
+
+  return TRUE;
+}
+
+#ifndef WITH_SOUP_2
+static void
+connect_message_signals (RestProxyCall *call,
+                         SoupMessage   *message)
+{
+  g_signal_connect_swapped (message, "authenticate",
+                            G_CALLBACK (authenticate),
+                            call);
+  g_signal_connect_swapped (message, "accept-certificate",
+                            G_CALLBACK (accept_certificate),
+                            call);
+}
+#endif
+
+/* The priority of the messages of calls, by #RestProxyCallPriority */
+static const SoupMessagePriority soup_priorities[] = {
+  SOUP_MESSAGE_PRIORITY_LOW,
+  SOUP_MESSAGE_PRIORITY_NORMAL,
+  SOUP_MESSAGE_PRIORITY_HIGH
+};
+
+/* Makes @message wait as @priority in @group for its host, and under the
+ * rate limits of @function */
+static void
+set_message_schedule (SoupMessage         *message,
+                      SoupMessagePriority  priority,
+                      const char          *group,
+                      const char          *function)
+{
+  soup_message_set_priority (message, priority);
+  g_object_set_data_full (G_OBJECT (message), "rest-queue-group",
+                          g_strdup (group), g_free);
+  g_object_set_data_full (G_OBJECT (message), "rest-function",
+                          g_strdup (function), g_free);
+}
+
+static SoupMessage *
+prepare_message (RestProxyCall *call, GError **error_out)
+{
+  RestProxyCallPrivate *priv = GET_PRIVATE (call);
+  RestProxyCallClass *call_class;
+  SoupMessage *message;
+  SoupMessageHeaders *request_headers;
+  GError *error = NULL;
+  /* Before prepare, which may move it into the parameters */
+  g_autofree char *function = g_strdup (priv->function);
+
+  call_class = REST_PROXY_CALL_GET_CLASS (call);
+
+  /* Emit a warning if the caller is re-using RestProxyCall objects */
+  if (priv->url)
+  {
+    g_warning (G_STRLOC ": re-use of RestProxyCall %p, don't do this", call);
+  }
+
+  /* Allow an overrideable prepare function that is called before every
+   * invocation so subclasses can do magic
+   */
+  if (call_class->prepare)
+  {
+    if (!call_class->prepare (call, &error))
+    {
+      g_propagate_error (error_out, error);
       return NULL;
     }
   }
 
-  if (call_class->serialize_params) {
+  if (priv->body) {
+    gchar *form;
+    gchar *url;
+
+    if (!set_url (call))
+    {
+        g_set_error_literal (error_out,
+                             REST_PROXY_ERROR,
+                             REST_PROXY_ERROR_BINDING_REQUIRED,
+                             "URL is unbound");
+        return NULL;
+    }
+
+    form = encode_params (call);
+    if (*form == '\0')
+      url = g_strdup (priv->url);
+    else
+      url = g_strconcat (priv->url, strchr (priv->url, '?') ? "&" : "?", form, NULL);
+    g_free (form);
+
+    message = soup_message_new (priv->method, url);
+    g_free (url);
+    if (message == NULL) {
+        g_set_error (error_out,
+                     REST_PROXY_ERROR,
+                     REST_PROXY_ERROR_URL_INVALID,
+                     "URL '%s' is not valid",
+                     priv->url);
+        return NULL;
+    }
+
+#ifdef WITH_SOUP_2
+    {
+      SoupBuffer *buffer = soup_buffer_new_with_owner (g_bytes_get_data (priv->body, NULL),
+                                                       g_bytes_get_size (priv->body),
+                                                       g_bytes_ref (priv->body),
+                                                       (GDestroyNotify)g_bytes_unref);
+
+      soup_message_body_append_buffer (message->request_body, buffer);
+      soup_buffer_free (buffer);
+      soup_message_headers_set_content_type (message->request_headers,
+                                             priv->body_content_type, NULL);
+    }
+#else
+    _rest_message_set_request_bytes (message, priv->body_content_type, priv->body);
+#endif
+  } else if (call_class->serialize_params_stream) {
+    GInputStream *stream;
+    gchar *content_type;
+    goffset content_len;
+
+    if (!call_class->serialize_params_stream (call, &content_type,
+                                              &stream, &content_len, &error))
+    {
+      g_propagate_error (error_out, error);
+      return NULL;
+    }
+
+    /* Reset priv->url as the serialize_params_stream vcall may have called
+     * rest_proxy_call_set_function()
+     */
+    if (!set_url (call))
+    {
+        g_object_unref (stream);
+        g_free (content_type);
+        g_set_error_literal (error_out,
+                             REST_PROXY_ERROR,
+                             REST_PROXY_ERROR_BINDING_REQUIRED,
+                             "URL is unbound");
+        return NULL;
+    }
+
+    message = soup_message_new (priv->method, priv->url);
+    if (message == NULL) {
+        g_object_unref (stream);
+        g_free (content_type);
+        g_set_error_literal (error_out,
+                             REST_PROXY_ERROR,
+                             REST_PROXY_ERROR_FAILED,
+                             "Could not parse URI");
+        return NULL;
+    }
+
+    if (!set_request_stream (message, content_type, stream, content_len, error_out))
+    {
+        g_object_unref (message);
+        g_object_unref (stream);
+        g_free (content_type);
+        return NULL;
+    }
+
+    g_object_unref (stream);
+    g_free (content_type);
+  } else if (call_class->serialize_params) {
     gchar *content;
     gchar *content_type;
     gsize content_len;
@@ -868,13 +1663,13 @@ prepare_message (RestProxyCall *call, GError **error_out)
                               SOUP_MEMORY_TAKE, content, content_len);
 #else
     body = g_bytes_new_take (content, content_len);
-    soup_message_set_request_body_from_bytes (message, content_type, body);
+    _rest_message_set_request_bytes (message, content_type, body);
     g_bytes_unref (body);
 #endif
 
     g_free (content_type);
   } else if (rest_params_are_strings (priv->params)) {
-    GHashTable *hash;
+    gchar *form;
 
     if (!set_url (call))
     {
@@ -885,25 +1680,17 @@ prepare_message (RestProxyCall *call, GError **error_out)
         return NULL;
     }
 
-    hash = rest_params_as_string_hash_table (priv->params);
+    form = encode_params (call);
 
-#ifdef WITH_SOUP_2
-    if (g_hash_table_size (hash) == 0)
-      message = soup_message_new (priv->method, priv->url);
-    else
-      message = soup_form_request_new_from_hash (priv->method,
-                                                 priv->url,
-                                                 hash);
-#else
-    if (g_hash_table_size (hash) == 0)
-      message = soup_message_new (priv->method, priv->url);
+    if (*form == '\0')
+      {
+        g_free (form);
+        message = soup_message_new (priv->method, priv->url);
+      }
     else
-      message = soup_message_new_from_encoded_form (priv->method,
-                                                    priv->url,
-                                                    soup_form_encode_hash (hash));
-#endif
-
-    g_hash_table_unref (hash);
+      {
+        message = new_message_from_form (priv->method, priv->url, form);
+      }
 
     if (!message) {
         g_set_error (error_out,
@@ -914,6 +1701,43 @@ prepare_message (RestProxyCall *call, GError **error_out)
         return NULL;
     }
 
+  } else if (has_stream_params (priv->params)) {
+    GInputStream *stream;
+    gchar *content_type;
+    goffset content_len;
+
+    if (!set_url (call))
+    {
+        g_set_error_literal (error_out,
+                             REST_PROXY_ERROR,
+                             REST_PROXY_ERROR_BINDING_REQUIRED,
+                             "URL is unbound");
+        return NULL;
+    }
+
+    message = soup_message_new (SOUP_METHOD_POST, priv->url);
+    if (message == NULL) {
+        g_set_error (error_out,
+                     REST_PROXY_ERROR,
+                     REST_PROXY_ERROR_URL_INVALID,
+                     "URL '%s' is not valid",
+                     priv->url);
+        return NULL;
+    }
+
+    /* The parts are produced as the connection accepts data, so uploading
+     * files doesn't need memory for their contents */
+    stream = _rest_multipart_stream_new (priv->params, &content_type, &content_len);
+    if (!set_request_stream (message, content_type, stream, content_len, error_out))
+    {
+        g_object_unref (message);
+        g_object_unref (stream);
+        g_free (content_type);
+        return NULL;
+    }
+
+    g_object_unref (stream);
+    g_free (content_type);
   } else {
     SoupMultipart *mp;
     RestParamsIter iter;
@@ -928,27 +1752,24 @@ prepare_message (RestProxyCall *call, GError **error_out)
       if (rest_param_is_string (param)) {
         soup_multipart_append_form_string (mp, name, rest_param_get_content (param));
       } else {
+        GBytes *bytes = rest_param_get_bytes (param);
 #ifdef WITH_SOUP_2
-        SoupBuffer *sb = soup_buffer_new_with_owner (rest_param_get_content (param),
-                                                     rest_param_get_content_length (param),
-                                                     rest_param_ref (param),
-                                                     (GDestroyNotify)rest_param_unref);
-#else
-        GBytes *sb = g_bytes_new_with_free_func (rest_param_get_content (param),
-                                                 rest_param_get_content_length (param),
-                                                 (GDestroyNotify)rest_param_unref,
-                                                 rest_param_ref (param));
-#endif
+        SoupBuffer *sb = soup_buffer_new_with_owner (g_bytes_get_data (bytes, NULL),
+                                                     g_bytes_get_size (bytes),
+                                                     g_bytes_ref (bytes),
+                                                     (GDestroyNotify)g_bytes_unref);
 
         soup_multipart_append_form_file (mp, name,
                                          rest_param_get_file_name (param),
                                          rest_param_get_content_type (param),
                                          sb);
-
-#ifdef WITH_SOUP_2
         soup_buffer_free (sb);
 #else
-        g_bytes_unref (sb);
+        /* libsoup takes its own reference, the data isn't copied */
+        soup_multipart_append_form_file (mp, name,
+                                         rest_param_get_file_name (param),
+                                         rest_param_get_content_type (param),
+                                         bytes);
 #endif
       }
     }
@@ -966,7 +1787,15 @@ prepare_message (RestProxyCall *call, GError **error_out)
 #ifdef WITH_SOUP_2
     message = soup_form_request_new_from_multipart (priv->url, mp);
 #else
-    message = soup_message_new_from_multipart (priv->url, mp);
+    message = soup_message_new (SOUP_METHOD_POST, priv->url);
+    if (message)
+      {
+        GBytes *body;
+
+        soup_multipart_to_message (mp, soup_message_get_request_headers (message), &body);
+        _rest_message_set_request_bytes (message, NULL, body);
+        g_bytes_unref (body);
+      }
 #endif
 
     soup_multipart_free (mp);
@@ -976,44 +1805,400 @@ prepare_message (RestProxyCall *call, GError **error_out)
   request_headers = message->request_headers;
 #else
   request_headers = soup_message_get_request_headers (message);
-  g_signal_connect_swapped (message, "authenticate",
-                            G_CALLBACK (authenticate),
-                            call);
-  g_signal_connect_swapped (message, "accept-certificate",
-                            G_CALLBACK (accept_certificate),
-                            call);
+  connect_message_signals (call, message);
 #endif
 
 
-  /* Set the user agent, if one was set in the proxy */
-  user_agent = rest_proxy_get_user_agent (priv->proxy);
-  if (user_agent) {
-    soup_message_headers_append (request_headers, "User-Agent", user_agent);
-  }
+  /* The defaults of the proxy, including the user agent, come first so the
+   * call can override them */
+  _rest_proxy_apply_default_headers (priv->proxy, request_headers);
+  _rest_headers_apply (priv->headers, request_headers);
 
-  /* Set the headers */
-  g_hash_table_foreach (priv->headers, set_header, request_headers);
+  set_message_schedule (message, soup_priorities[priv->priority], priv->queue_group, function);
+  _rest_bandwidth_set_message_limit (message, REST_BANDWIDTH_UPLOAD,
+                                     priv->bandwidth_limits[REST_BANDWIDTH_UPLOAD]);
+  _rest_bandwidth_set_message_limit (message, REST_BANDWIDTH_DOWNLOAD,
+                                     priv->bandwidth_limits[REST_BANDWIDTH_DOWNLOAD]);
 
   return message;
 }
 
-static void
-_call_message_call_cancelled_cb (GCancellable  *cancellable,
-                                 RestProxyCall *call)
+/* Whether a copy of @message may be sent alongside it */
+static gboolean
+message_can_be_hedged (SoupMessage *message)
 {
-  rest_proxy_call_cancel (call);
+#ifdef WITH_SOUP_2
+  const char *method = message->method;
+#else
+  const char *method = soup_message_get_method (message);
+#endif
+
+  return _rest_method_is_idempotent (method) && message_can_be_resent (message);
 }
 
-static void
+/* Makes a message sending the same request as @message */
+static SoupMessage *
+copy_message (RestProxyCall *call,
+              SoupMessage   *message)
+{
+  SoupMessage *copy;
+#ifdef WITH_SOUP_2
+  SoupBuffer *buffer;
+
+  copy = soup_message_new_from_uri (message->method, soup_message_get_uri (message));
+  soup_message_headers_foreach (message->request_headers, copy_header,
+                                copy->request_headers);
+  buffer = soup_message_body_flatten (message->request_body);
+  soup_message_body_append_buffer (copy->request_body, buffer);
+  soup_buffer_free (buffer);
+#else
+  GBytes *body;
+
+  copy = soup_message_new_from_uri (soup_message_get_method (message),
+                                    soup_message_get_uri (message));
+  soup_message_headers_foreach (soup_message_get_request_headers (message),
+                                copy_header,
+                                soup_message_get_request_headers (copy));
+  body = g_object_get_data (G_OBJECT (message), "rest-request-body");
+  if (body)
+    _rest_message_set_request_bytes (copy, NULL, body);
+  connect_message_signals (call, copy);
+#endif
+  _rest_cache_reset_copy (message, copy);
+  set_message_schedule (copy,
+                        soup_message_get_priority (message),
+                        g_object_get_data (G_OBJECT (message), "rest-queue-group"),
+                        g_object_get_data (G_OBJECT (message), "rest-function"));
+  _rest_bandwidth_set_message_limit (copy, REST_BANDWIDTH_UPLOAD,
+                                     _rest_bandwidth_get_message_limit (message, REST_BANDWIDTH_UPLOAD));
+  _rest_bandwidth_set_message_limit (copy, REST_BANDWIDTH_DOWNLOAD,
+                                     _rest_bandwidth_get_message_limit (message, REST_BANDWIDTH_DOWNLOAD));
+
+  return copy;
+}
+
+static void
+_call_message_call_cancelled_cb (GCancellable  *cancellable,
+                                 RestProxyCall *call)
+{
+  rest_proxy_call_cancel (call);
+}
+
+/*
+ * Whether @message, sent for @call for the @attempt time, is sent again after
+ * @delay milliseconds.  @response is the message the response came in, or
+ * %NULL if @error kept it from coming.
+ */
+static gboolean
+should_retry (RestProxyCall *call,
+              SoupMessage   *message,
+              SoupMessage   *response,
+              const GError  *error,
+              guint          attempt,
+              guint         *delay)
+{
+  RestProxyCallPrivate *priv = GET_PRIVATE (call);
+  RestRetryPolicy *policy;
+  SoupMessageHeaders *headers = NULL;
+  const char *method;
+  guint status = 0;
+
+  policy = priv->retry_policy ? priv->retry_policy : rest_proxy_get_retry_policy (priv->proxy);
+  if (policy == NULL || !message_can_be_resent (message))
+    return FALSE;
+
+#ifdef WITH_SOUP_2
+  method = message->method;
+  if (response)
+    {
+      status = response->status_code;
+      headers = response->response_headers;
+    }
+#else
+  method = soup_message_get_method (message);
+  if (response)
+    {
+      status = _rest_message_get_status (response);
+      headers = soup_message_get_response_headers (response);
+    }
+#endif
+
+  return _rest_retry_policy_next_attempt (policy,
+                                          _rest_proxy_get_retry_budget (priv->proxy),
+                                          method, status, headers, error,
+                                          attempt, delay);
+}
+
+/* One sending of the message of a call, or of its hedge */
+typedef struct {
+  GTask *task;
+  SoupMessage *message;
+  /* Set when the attempt may be hedged, so each send can be cancelled */
+  GCancellable *cancellable;
+  gboolean hedge;
+  /* Set once another send of the attempt answered first */
+  gboolean abandoned;
+} RestProxyCallSend;
+
+typedef struct {
+  SoupMessage *message;
+  guint attempt;
+  /* The sends of the current attempt still in flight */
+  GList *sends;
+  /* Set when the attempt may be hedged, see RestProxy:hedge-delay */
+  gboolean hedgeable;
+  GSource *hedge_source;
+  gint64 start_time;
+  GCancellable *cancellable;
+  gulong cancelled_id;
+} RestProxyCallInvokeData;
+
+static void
+rest_proxy_call_send_free (RestProxyCallSend *send)
+{
+  g_object_unref (send->task);
+  g_object_unref (send->message);
+  g_clear_object (&send->cancellable);
+  g_free (send);
+}
+
+static void
+stop_hedge_timer (RestProxyCallInvokeData *data)
+{
+  if (data->hedge_source)
+    {
+      g_source_destroy (data->hedge_source);
+      g_clear_pointer (&data->hedge_source, g_source_unref);
+    }
+}
+
+static void
+rest_proxy_call_invoke_data_free (RestProxyCallInvokeData *data)
+{
+  stop_hedge_timer (data);
+  if (data->cancelled_id)
+    g_cancellable_disconnect (data->cancellable, data->cancelled_id);
+  g_clear_object (&data->cancellable);
+  g_object_unref (data->message);
+  g_free (data);
+}
+
+/* Hedged sends have cancellables of their own, cancelled with the call */
+static void
+invoke_cancelled_cb (GCancellable            *cancellable,
+                     RestProxyCallInvokeData *data)
+{
+  for (GList *l = data->sends; l; l = l->next)
+    {
+      RestProxyCallSend *send = l->data;
+
+      g_cancellable_cancel (send->cancellable);
+    }
+}
+
+static void _call_message_call_completed_cb (SoupMessage *message,
+                                             GBytes      *payload,
+                                             GError      *error,
+                                             gpointer     user_data);
+
+/* Sends @message for the current attempt of @task */
+static void
+start_send (RestProxyCall *call,
+            GTask         *task,
+            SoupMessage   *message,
+            gboolean       hedge)
+{
+  RestProxyCallPrivate *priv = GET_PRIVATE (call);
+  RestProxyCallInvokeData *data = g_task_get_task_data (task);
+  RestProxyCallSend *send;
+
+  send = g_new0 (RestProxyCallSend, 1);
+  send->task = g_object_ref (task);
+  send->message = g_object_ref (message);
+  send->hedge = hedge;
+  if (data->hedgeable)
+    send->cancellable = g_cancellable_new ();
+  data->sends = g_list_prepend (data->sends, send);
+
+  _rest_proxy_queue_message (priv->proxy,
+#ifdef WITH_SOUP_2
+                             /* Taken by the proxy; the task keeps its own for retries */
+                             g_object_ref (message),
+#else
+                             message,
+#endif
+                             send->cancellable ? send->cancellable : priv->cancellable,
+                             _call_message_call_completed_cb,
+                             send);
+}
+
+static gboolean
+hedge_timeout_cb (gpointer user_data)
+{
+  GTask *task = user_data;
+  RestProxyCall *call = g_task_get_source_object (task);
+  RestProxyCallPrivate *priv = GET_PRIVATE (call);
+  RestProxyCallInvokeData *data = g_task_get_task_data (task);
+  SoupMessage *hedge;
+
+  g_clear_pointer (&data->hedge_source, g_source_unref);
+
+  if (!_rest_proxy_start_hedge (priv->proxy))
+    return G_SOURCE_REMOVE;
+
+  hedge = copy_message (call, data->message);
+  /* Coalesced, it would only wait for the request it races */
+  g_object_set_data (G_OBJECT (hedge), "rest-hedge", GINT_TO_POINTER (TRUE));
+  start_send (call, task, hedge, TRUE);
+  g_object_unref (hedge);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Sends the message of @task once more */
+static void
+send_invoke_message (RestProxyCall *call,
+                     GTask         *task)
+{
+  RestProxyCallPrivate *priv = GET_PRIVATE (call);
+  RestProxyCallInvokeData *data = g_task_get_task_data (task);
+  gint64 delay = -1;
+
+  data->attempt++;
+  data->start_time = g_get_monotonic_time ();
+
+  if (message_can_be_hedged (data->message))
+    delay = _rest_proxy_get_hedge_delay (priv->proxy);
+
+  data->hedgeable = delay >= 0;
+  if (data->hedgeable)
+    {
+      data->hedge_source = g_timeout_source_new (delay);
+      g_source_set_callback (data->hedge_source, hedge_timeout_cb,
+                             g_object_ref (task), g_object_unref);
+      g_source_attach (data->hedge_source, g_main_context_get_thread_default ());
+
+      if (g_task_get_cancellable (task) && data->cancelled_id == 0)
+        {
+          data->cancellable = g_object_ref (g_task_get_cancellable (task));
+          data->cancelled_id = g_cancellable_connect (data->cancellable,
+                                                      G_CALLBACK (invoke_cancelled_cb),
+                                                      data, NULL);
+        }
+    }
+
+  start_send (call, task, data->message, FALSE);
+}
+
+static gboolean
+resend_invoke_message_cb (GCancellable *cancellable,
+                          gpointer      user_data)
+{
+  GTask *task = user_data;
+  RestProxyCallInvokeData *data = g_task_get_task_data (task);
+
+  if (!g_task_return_error_if_cancelled (task))
+    {
+      rewind_message (data->message);
+      send_invoke_message (g_task_get_source_object (task), task);
+    }
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Stops the sends of the attempt still in flight */
+static void
+abandon_sends (RestProxyCall           *call,
+               RestProxyCallInvokeData *data)
+{
+  RestProxyCallPrivate *priv = GET_PRIVATE (call);
+  GList *sends = g_steal_pointer (&data->sends);
+
+  for (GList *l = sends; l; l = l->next)
+    {
+      RestProxyCallSend *send = l->data;
+      SoupMessage *message = send->message;
+
+      send->abandoned = TRUE;
+      g_cancellable_cancel (send->cancellable);
+      /* libsoup 2 doesn't cancel queued messages with their cancellable,
+       * and finishes them here, freeing the send */
+      _rest_proxy_cancel_message (priv->proxy, message);
+    }
+
+  g_list_free (sends);
+}
+
+static void
 _call_message_call_completed_cb (SoupMessage *message,
                                  GBytes      *payload,
                                  GError      *error,
                                  gpointer     user_data)
 {
-  g_autoptr(GTask) task = user_data;
+  RestProxyCallSend *send = user_data;
+  g_autoptr(GTask) task = g_object_ref (send->task);
+  RestProxyCallInvokeData *data = g_task_get_task_data (task);
   RestProxyCall *call;
+  RestProxyCallPrivate *priv;
+  guint delay, status;
 
   call = REST_PROXY_CALL (g_task_get_source_object (task));
+  priv = GET_PRIVATE (call);
+
+  if (send->abandoned)
+    {
+      g_clear_pointer (&payload, g_bytes_unref);
+      g_clear_error (&error);
+      rest_proxy_call_send_free (send);
+      return;
+    }
+
+  data->sends = g_list_remove (data->sends, send);
+
+#ifdef WITH_SOUP_2
+  status = message->status_code;
+#else
+  status = _rest_message_get_status (message);
+#endif
+
+  /* A failed send, or a server error, leaves the answer to the other one
+   * still in flight */
+  if ((error || status >= 500) && data->sends &&
+      !g_cancellable_is_cancelled (g_task_get_cancellable (task)))
+    {
+      g_clear_pointer (&payload, g_bytes_unref);
+      g_clear_error (&error);
+      rest_proxy_call_send_free (send);
+      return;
+    }
+
+  stop_hedge_timer (data);
+  abandon_sends (call, data);
+  _rest_proxy_record_latency (priv->proxy,
+                              g_get_monotonic_time () - data->start_time,
+                              send->hedge);
+
+  if (should_retry (call, send->message, error ? NULL : message, error,
+                    data->attempt, &delay))
+    {
+      GSource *source;
+
+      g_clear_pointer (&payload, g_bytes_unref);
+      g_clear_error (&error);
+      rest_proxy_call_send_free (send);
+
+      /* Dispatched once the delay is over, or as soon as the call is
+       * cancelled */
+      source = g_cancellable_source_new (g_task_get_cancellable (task));
+      g_source_set_ready_time (source, g_get_monotonic_time () + delay * G_TIME_SPAN_MILLISECOND);
+      g_source_set_callback (source, (GSourceFunc) resend_invoke_message_cb,
+                             g_steal_pointer (&task), g_object_unref);
+      g_source_attach (source, g_main_context_get_thread_default ());
+      g_source_unref (source);
+      return;
+    }
+
+  rest_proxy_call_send_free (send);
 
   if (error)
     {
@@ -1029,6 +2214,36 @@ _call_message_call_completed_cb (SoupMessage *message,
     g_task_return_boolean (task, TRUE);
 }
 
+static void
+_call_task_completed_cb (GTask         *task,
+                         GParamSpec    *pspec,
+                         RestProxyCall *call)
+{
+  RestProxyCallPrivate *priv = GET_PRIVATE (call);
+
+  g_assert (priv->n_running_tasks > 0);
+  priv->n_running_tasks--;
+}
+
+/* Makes the task of an asynchronous function of @call, which keeps it from
+ * being reset until the task completes */
+static GTask *
+new_call_task (RestProxyCall       *call,
+               GCancellable        *cancellable,
+               GAsyncReadyCallback  callback,
+               gpointer             user_data)
+{
+  RestProxyCallPrivate *priv = GET_PRIVATE (call);
+  GTask *task;
+
+  task = g_task_new (call, cancellable, callback, user_data);
+  priv->n_running_tasks++;
+  g_signal_connect (task, "notify::completed",
+                    G_CALLBACK (_call_task_completed_cb), call);
+
+  return task;
+}
+
 /**
  * rest_proxy_call_invoke_async:
  * @call: a #RestProxyCall
@@ -1044,7 +2259,8 @@ rest_proxy_call_invoke_async (RestProxyCall      *call,
                               gpointer            user_data)
 {
   RestProxyCallPrivate *priv = GET_PRIVATE (call);
-  GTask *task;
+  g_autoptr(GTask) task = NULL;
+  RestProxyCallInvokeData *data;
   SoupMessage *message;
   GError *error = NULL;
 
@@ -1053,13 +2269,17 @@ rest_proxy_call_invoke_async (RestProxyCall      *call,
   g_assert (priv->proxy);
 
   message = prepare_message (call, &error);
-  task = g_task_new (call, cancellable, callback, user_data);
+  task = new_call_task (call, cancellable, callback, user_data);
   if (message == NULL)
     {
       g_task_return_error (task, error);
       return;
     }
 
+  data = g_new0 (RestProxyCallInvokeData, 1);
+  data->message = message;
+  g_task_set_task_data (task, data, (GDestroyNotify) rest_proxy_call_invoke_data_free);
+
   if (cancellable != NULL)
     {
       priv->cancel_sig = g_signal_connect (cancellable, "cancelled",
@@ -1067,11 +2287,7 @@ rest_proxy_call_invoke_async (RestProxyCall      *call,
       priv->cancellable = g_object_ref (cancellable);
     }
 
-  _rest_proxy_queue_message (priv->proxy,
-                             message,
-                             priv->cancellable,
-                             _call_message_call_completed_cb,
-                             task);
+  send_invoke_message (call, task);
 }
 
 /**
@@ -1094,117 +2310,444 @@ rest_proxy_call_invoke_finish (RestProxyCall  *call,
 }
 
 static void
-_continuous_call_read_cb (GObject      *source,
-                          GAsyncResult *result,
-                          gpointer      user_data)
+_call_stream_sent_cb (GObject      *source,
+                      GAsyncResult *result,
+                      gpointer      user_data)
 {
-  GInputStream *stream = G_INPUT_STREAM (source);
-  RestProxyCallContinuousClosure *closure = user_data;
-  RestProxyCallPrivate *priv = GET_PRIVATE (closure->call);
-  gssize bytes_read;
+  g_autoptr(GTask) task = user_data;
+  RestProxyCall *call = g_task_get_source_object (task);
+  SoupMessage *message = g_task_get_task_data (task);
+  GInputStream *stream;
   GError *error = NULL;
 
-  bytes_read = g_input_stream_read_finish (stream, result, &error);
-  if (bytes_read <= 0)
+  stream = _rest_proxy_send_message_finish (REST_PROXY (source), result, &error);
+  if (stream == NULL)
     {
-      _continuous_call_message_completed (closure->message, error, user_data);
+      g_task_return_error (task, error);
       return;
     }
 
-  closure->callback (closure->call,
-                     (gconstpointer)closure->buffer,
-                     bytes_read,
-                     NULL,
-                     closure->weak_object,
-                     closure->userdata);
-
-  g_input_stream_read_async (stream, closure->buffer, READ_BUFFER_SIZE, G_PRIORITY_DEFAULT,
-                             priv->cancellable, _continuous_call_read_cb, closure);
-}
-
-static void
-_continuous_call_message_sent_cb (GObject      *source,
-                                  GAsyncResult *result,
-                                  gpointer      user_data)
-{
-  RestProxy *proxy = REST_PROXY (source);
-  RestProxyCallContinuousClosure *closure = user_data;
-  RestProxyCallPrivate *priv = GET_PRIVATE (closure->call);
-  GInputStream *stream;
-  GError *error = NULL;
+  set_response_status (GET_PRIVATE (call), message);
+  g_clear_pointer (&GET_PRIVATE (call)->payload, g_bytes_unref);
 
-  stream = _rest_proxy_send_message_finish (proxy, result, &error);
-  if (!stream)
+  if (!_handle_error_from_message (message, &error))
     {
-      _continuous_call_message_completed (closure->message, error, user_data);
+      g_object_unref (stream);
+      g_task_return_error (task, error);
       return;
     }
 
-  g_input_stream_read_async (stream, closure->buffer, READ_BUFFER_SIZE, G_PRIORITY_DEFAULT,
-                             priv->cancellable, _continuous_call_read_cb, closure);
-  g_object_unref (stream);
+  g_task_return_pointer (task, stream, g_object_unref);
 }
 
-
 /**
- * rest_proxy_call_continuous: (skip)
- * @call: The #RestProxyCall
- * @callback: (closure userdata): a #RestProxyCallContinuousCallback to invoke when data is available
- * @weak_object: The #GObject to weakly reference and tie the lifecycle to
- * @userdata: data to pass to @callback
- * @error: (out) (allow-none): a #GError, or %NULL
- *
- * Asynchronously invoke @call but expect a continuous stream of content. This
- * means that the body data will not be accumulated and thus you cannot use
- * rest_proxy_call_get_payload()
- *
- * When there is data @callback will be called and when the connection is
- * closed or the stream ends @callback will also be called.
- *
- * If @weak_object is disposed during the call then this call will be
- * cancelled. If the call is cancelled then the callback will be invoked with
- * an error state.
- *
- * You may unref the call after calling this function since there is an
- * internal reference, or you may unref in the callback.
+ * rest_proxy_call_invoke_stream_async:
+ * @call: a #RestProxyCall
+ * @cancellable: (nullable): an optional #GCancellable that can be used to
+ *   cancel the call, or %NULL
+ * @callback: (scope async): callback to call when the response headers have
+ *   been received
+ * @user_data: user data for the callback
  *
- * Returns: %TRUE on success
+ * Asynchronously invoke @call without reading the response body.  Once the
+ * headers have arrived @callback is called, and
+ * rest_proxy_call_invoke_stream_finish() returns a stream to read the body
+ * from.  The status and the response headers are available on @call at that
+ * point, but rest_proxy_call_get_payload() is not.
  */
-gboolean
-rest_proxy_call_continuous (RestProxyCall                    *call,
-                            RestProxyCallContinuousCallback   callback,
-                            GObject                          *weak_object,
-                            gpointer                          userdata,
-                            GError                          **error)
+void
+rest_proxy_call_invoke_stream_async (RestProxyCall       *call,
+                                     GCancellable        *cancellable,
+                                     GAsyncReadyCallback  callback,
+                                     gpointer             user_data)
 {
   RestProxyCallPrivate *priv = GET_PRIVATE (call);
+  GTask *task;
   SoupMessage *message;
-  RestProxyCallContinuousClosure *closure;
+  GError *error = NULL;
 
-  g_return_val_if_fail (REST_IS_PROXY_CALL (call), FALSE);
+  g_return_if_fail (REST_IS_PROXY_CALL (call));
+  g_return_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
   g_assert (priv->proxy);
 
-  if (priv->cur_call_closure)
-  {
-    g_warning (G_STRLOC ": re-use of RestProxyCall %p, don't do this", call);
-    return FALSE;
-  }
-
-  message = prepare_message (call, error);
+  message = prepare_message (call, &error);
+  task = new_call_task (call, cancellable, callback, user_data);
+  g_task_set_source_tag (task, rest_proxy_call_invoke_stream_async);
   if (message == NULL)
-    return FALSE;
+    {
+      g_task_return_error (task, error);
+      g_object_unref (task);
+      return;
+    }
 
-  closure = g_slice_new0 (RestProxyCallContinuousClosure);
-  closure->call = g_object_ref (call);
-  closure->callback = callback;
-  closure->weak_object = weak_object;
-  closure->message = message;
-  closure->userdata = userdata;
+  g_task_set_task_data (task, message, g_object_unref);
 
-  priv->cur_call_closure = (RestProxyCallAsyncClosure *)closure;
+  _rest_proxy_send_message_async (priv->proxy,
+                                  message,
+                                  cancellable,
+                                  _call_stream_sent_cb,
+                                  task);
+}
 
-  /* Weakly reference this object. We remove our callback if it goes away. */
-  if (closure->weak_object)
+/**
+ * rest_proxy_call_invoke_stream_finish:
+ * @call: a #RestProxyCall
+ * @result: the result from the #GAsyncReadyCallback
+ * @error: optional #GError
+ *
+ * Finish a call started with rest_proxy_call_invoke_stream_async().  If the
+ * server answered with an error status %NULL is returned and @error is set,
+ * but the status and the headers can still be read from @call.
+ *
+ * Returns: (transfer full) (nullable): a #GInputStream with the response
+ *   body, or %NULL on error
+ */
+GInputStream *
+rest_proxy_call_invoke_stream_finish (RestProxyCall  *call,
+                                      GAsyncResult   *result,
+                                      GError        **error)
+{
+  g_return_val_if_fail (REST_IS_PROXY_CALL (call), NULL);
+  g_return_val_if_fail (g_task_is_valid (result, call), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void _continuous_call_read_cb (GObject      *source,
+                                      GAsyncResult *result,
+                                      gpointer      user_data);
+
+static const guchar *
+find_delimiter (const guchar *data,
+                gsize         len,
+                const gchar  *delimiter,
+                gsize         delimiter_len)
+{
+  const guchar *end = data + len;
+  const guchar *p = data;
+
+  while (end - p >= (gssize) delimiter_len &&
+         (p = memchr (p, delimiter[0], end - p - delimiter_len + 1)) != NULL)
+    {
+      if (memcmp (p, delimiter, delimiter_len) == 0)
+        return p;
+      p++;
+    }
+
+  return NULL;
+}
+
+/*
+ * Pass the complete records in the buffer to the callback, straight from the
+ * buffer.  At the end of the stream whatever is left is the last record.
+ */
+static gboolean
+_continuous_call_emit_records (RestProxyCallContinuousClosure  *closure,
+                               gboolean                         at_end,
+                               GError                         **error)
+{
+  while (closure->len > 0)
+    {
+      const guchar *data = closure->buffer + closure->start;
+      const guchar *end;
+      gsize record_len, skip;
+      guint32 prefix;
+
+      switch (closure->framing)
+        {
+        case REST_PROXY_CALL_FRAMING_NONE:
+        default:
+          record_len = skip = closure->len;
+          break;
+
+        case REST_PROXY_CALL_FRAMING_NEWLINE:
+        case REST_PROXY_CALL_FRAMING_DELIMITER:
+          end = find_delimiter (data + closure->scanned,
+                                closure->len - closure->scanned,
+                                closure->delimiter,
+                                closure->delimiter_len);
+          if (end == NULL && !at_end)
+            {
+              /* Part of the delimiter may already be here */
+              if (closure->len >= closure->delimiter_len)
+                closure->scanned = closure->len - closure->delimiter_len + 1;
+              return TRUE;
+            }
+
+          closure->scanned = 0;
+          if (end)
+            {
+              record_len = end - data;
+              skip = record_len + closure->delimiter_len;
+            }
+          else
+            {
+              record_len = skip = closure->len;
+            }
+
+          if (closure->framing == REST_PROXY_CALL_FRAMING_NEWLINE)
+            {
+              if (record_len > 0 && data[record_len - 1] == '\r')
+                record_len--;
+
+              /* Empty lines are keep-alives, not records */
+              if (record_len == 0)
+                {
+                  closure->start += skip;
+                  closure->len -= skip;
+                  continue;
+                }
+            }
+          break;
+
+        case REST_PROXY_CALL_FRAMING_LENGTH_PREFIX:
+          if (closure->len < sizeof (prefix))
+            goto incomplete;
+
+          memcpy (&prefix, data, sizeof (prefix));
+          record_len = GUINT32_FROM_BE (prefix);
+          if (record_len > MAX_RECORD_SIZE)
+            {
+              g_set_error (error,
+                           REST_PROXY_ERROR,
+                           REST_PROXY_ERROR_FAILED,
+                           "Record of %" G_GSIZE_FORMAT " bytes is too large",
+                           record_len);
+              return FALSE;
+            }
+
+          if (closure->len - sizeof (prefix) < record_len)
+            goto incomplete;
+
+          data += sizeof (prefix);
+          skip = record_len + sizeof (prefix);
+          break;
+        }
+
+      closure->start += skip;
+      closure->len -= skip;
+
+      closure->callback (closure->call,
+                         (const gchar *)data,
+                         record_len,
+                         NULL,
+                         closure->weak_object,
+                         closure->userdata);
+    }
+
+  closure->start = 0;
+  return TRUE;
+
+incomplete:
+  if (at_end)
+    {
+      g_set_error_literal (error,
+                           REST_PROXY_ERROR,
+                           REST_PROXY_ERROR_IO,
+                           "Stream ended in the middle of a record");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Make room after the pending data for the next read */
+static gboolean
+_continuous_call_prepare_buffer (RestProxyCallContinuousClosure  *closure,
+                                 GError                         **error)
+{
+  if (closure->start + closure->len < closure->buffer_size)
+    return TRUE;
+
+  if (closure->start > 0)
+    {
+      memmove (closure->buffer, closure->buffer + closure->start, closure->len);
+      closure->start = 0;
+      return TRUE;
+    }
+
+  /* A single record fills the whole buffer */
+  if (closure->buffer_size > MAX_RECORD_SIZE)
+    {
+      g_set_error_literal (error,
+                           REST_PROXY_ERROR,
+                           REST_PROXY_ERROR_FAILED,
+                           "Record is too large");
+      return FALSE;
+    }
+
+  closure->buffer_size *= 2;
+  closure->buffer = g_realloc (closure->buffer, closure->buffer_size);
+  return TRUE;
+}
+
+static void
+_continuous_call_read (GInputStream                   *stream,
+                       RestProxyCallContinuousClosure *closure)
+{
+  RestProxyCallPrivate *priv = GET_PRIVATE (closure->call);
+  gsize offset = closure->start + closure->len;
+
+  g_input_stream_read_async (stream,
+                             closure->buffer + offset,
+                             closure->buffer_size - offset,
+                             G_PRIORITY_DEFAULT,
+                             priv->cancellable,
+                             _continuous_call_read_cb,
+                             closure);
+}
+
+static void
+_continuous_call_read_cb (GObject      *source,
+                          GAsyncResult *result,
+                          gpointer      user_data)
+{
+  GInputStream *stream = G_INPUT_STREAM (source);
+  RestProxyCallContinuousClosure *closure = user_data;
+  gssize bytes_read;
+  gboolean filled;
+  GError *error = NULL;
+
+  bytes_read = g_input_stream_read_finish (stream, result, &error);
+  if (bytes_read < 0)
+    {
+      _continuous_call_message_completed (closure->message, error, user_data);
+      return;
+    }
+
+  if (bytes_read == 0)
+    {
+      _continuous_call_emit_records (closure, TRUE, &error);
+      _continuous_call_message_completed (closure->message, error, user_data);
+      return;
+    }
+
+  filled = closure->start + closure->len + bytes_read == closure->buffer_size;
+  closure->len += bytes_read;
+
+  if (!_continuous_call_emit_records (closure, FALSE, &error) ||
+      !_continuous_call_prepare_buffer (closure, &error))
+    {
+      _continuous_call_message_completed (closure->message, error, user_data);
+      return;
+    }
+
+  /* The data arrives faster than it is read, read more at once */
+  if (closure->framing == REST_PROXY_CALL_FRAMING_NONE && filled &&
+      closure->buffer_size < READ_BUFFER_MAX_ADAPTIVE_SIZE)
+    {
+      closure->buffer_size *= 2;
+      closure->buffer = g_realloc (closure->buffer, closure->buffer_size);
+    }
+
+  _continuous_call_read (stream, closure);
+}
+
+static void
+_continuous_call_message_sent_cb (GObject      *source,
+                                  GAsyncResult *result,
+                                  gpointer      user_data)
+{
+  RestProxy *proxy = REST_PROXY (source);
+  RestProxyCallContinuousClosure *closure = user_data;
+  GInputStream *stream;
+  GError *error = NULL;
+
+  stream = _rest_proxy_send_message_finish (proxy, result, &error);
+  if (!stream)
+    {
+      _continuous_call_message_completed (closure->message, error, user_data);
+      return;
+    }
+
+  _continuous_call_read (stream, closure);
+  g_object_unref (stream);
+}
+
+
+/**
+ * rest_proxy_call_set_continuous_framing:
+ * @call: The #RestProxyCall
+ * @framing: a #RestProxyCallFraming
+ * @delimiter: (nullable): the delimiter for
+ *   %REST_PROXY_CALL_FRAMING_DELIMITER, %NULL otherwise
+ *
+ * Set how rest_proxy_call_continuous() splits the response into records.
+ * Each record is passed to the callback on its own, without its delimiter
+ * or length prefix.  Records that arrive in one piece are passed straight
+ * from the read buffer without being copied.
+ */
+void
+rest_proxy_call_set_continuous_framing (RestProxyCall        *call,
+                                        RestProxyCallFraming  framing,
+                                        const gchar          *delimiter)
+{
+  RestProxyCallPrivate *priv = GET_PRIVATE (call);
+
+  g_return_if_fail (REST_IS_PROXY_CALL (call));
+  g_return_if_fail (framing != REST_PROXY_CALL_FRAMING_DELIMITER ||
+                    (delimiter != NULL && *delimiter != '\0'));
+
+  priv->continuous_framing = framing;
+  g_free (priv->continuous_delimiter);
+  priv->continuous_delimiter = g_strdup (delimiter);
+}
+
+/**
+ * rest_proxy_call_set_continuous_buffer_size:
+ * @call: The #RestProxyCall
+ * @buffer_size: the initial size of the read buffer in bytes
+ *
+ * Set the size of the buffer rest_proxy_call_continuous() reads into,
+ * 8 KiB by default.  The buffer grows when a record does not fit, and
+ * without framing when the data arrives faster than it is read.
+ */
+void
+rest_proxy_call_set_continuous_buffer_size (RestProxyCall *call,
+                                            gsize          buffer_size)
+{
+  g_return_if_fail (REST_IS_PROXY_CALL (call));
+  g_return_if_fail (buffer_size > 0);
+
+  GET_PRIVATE (call)->continuous_buffer_size = buffer_size;
+}
+
+/* Sends @message for @call and reads the response as a continuous stream.
+ * Takes @message.
+ */
+static void
+continuous_send (RestProxyCall                    *call,
+                 SoupMessage                      *message,
+                 RestProxyCallContinuousCallback   callback,
+                 GObject                          *weak_object,
+                 gpointer                          userdata)
+{
+  RestProxyCallPrivate *priv = GET_PRIVATE (call);
+  RestProxyCallContinuousClosure *closure;
+
+  closure = g_slice_new0 (RestProxyCallContinuousClosure);
+  closure->call = g_object_ref (call);
+  closure->callback = callback;
+  closure->weak_object = weak_object;
+  closure->message = message;
+  closure->userdata = userdata;
+  closure->framing = priv->continuous_framing;
+  if (closure->framing == REST_PROXY_CALL_FRAMING_NEWLINE)
+    closure->delimiter = g_strdup ("\n");
+  else if (closure->framing == REST_PROXY_CALL_FRAMING_DELIMITER)
+    closure->delimiter = g_strdup (priv->continuous_delimiter);
+  closure->delimiter_len = closure->delimiter ? strlen (closure->delimiter) : 0;
+  closure->buffer_size = priv->continuous_buffer_size;
+  closure->buffer = g_malloc (closure->buffer_size);
+
+  priv->cur_call_closure = (RestProxyCallAsyncClosure *)closure;
+
+  /* So that rest_proxy_call_cancel() can stop the reads */
+  if (priv->cancellable == NULL)
+    priv->cancellable = g_cancellable_new ();
+
+  /* Weakly reference this object. We remove our callback if it goes away. */
+  if (closure->weak_object)
   {
     g_object_weak_ref (closure->weak_object,
         (GWeakNotify)_call_async_weak_notify_cb,
@@ -1216,149 +2759,1626 @@ rest_proxy_call_continuous (RestProxyCall                    *call,
                                   priv->cancellable,
                                   _continuous_call_message_sent_cb,
                                   closure);
+}
+
+/**
+ * rest_proxy_call_continuous: (skip)
+ * @call: The #RestProxyCall
+ * @callback: (closure userdata): a #RestProxyCallContinuousCallback to invoke when data is available
+ * @weak_object: The #GObject to weakly reference and tie the lifecycle to
+ * @userdata: data to pass to @callback
+ * @error: (out) (allow-none): a #GError, or %NULL
+ *
+ * Asynchronously invoke @call but expect a continuous stream of content. This
+ * means that the body data will not be accumulated and thus you cannot use
+ * rest_proxy_call_get_payload()
+ *
+ * When there is data @callback will be called and when the connection is
+ * closed or the stream ends @callback will also be called, with %NULL data.
+ * How the data is split up between calls of @callback is set with
+ * rest_proxy_call_set_continuous_framing().
+ *
+ * If @weak_object is disposed during the call then this call will be
+ * cancelled. If the call is cancelled then the callback will be invoked with
+ * an error state.
+ *
+ * You may unref the call after calling this function since there is an
+ * internal reference, or you may unref in the callback.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+rest_proxy_call_continuous (RestProxyCall                    *call,
+                            RestProxyCallContinuousCallback   callback,
+                            GObject                          *weak_object,
+                            gpointer                          userdata,
+                            GError                          **error)
+{
+  RestProxyCallPrivate *priv = GET_PRIVATE (call);
+  SoupMessage *message;
+
+  g_return_val_if_fail (REST_IS_PROXY_CALL (call), FALSE);
+  g_assert (priv->proxy);
+
+  if (priv->cur_call_closure)
+  {
+    g_warning (G_STRLOC ": re-use of RestProxyCall %p, don't do this", call);
+    return FALSE;
+  }
+
+  message = prepare_message (call, error);
+  if (message == NULL)
+    return FALSE;
+
+  continuous_send (call, message, callback, weak_object, userdata);
   return TRUE;
 }
 
+static void _event_source_weak_notify_cb (gpointer  data,
+                                          GObject  *dead_object);
+
 static void
-_upload_call_message_completed_cb (SoupMessage *message,
-                                   GBytes      *payload,
-                                   GError      *error,
-                                   gpointer     user_data)
+rest_proxy_call_event_source_free (RestProxyCallEventSource *source)
 {
-  RestProxyCall *call;
-  RestProxyCallPrivate *priv;
-  RestProxyCallUploadClosure *closure;
+  if (source->weak_object)
+    g_object_weak_unref (source->weak_object,
+                         (GWeakNotify)_event_source_weak_notify_cb,
+                         source);
+  g_clear_handle_id (&source->reconnect_id, g_source_remove);
+  g_clear_object (&source->prepared);
+  g_string_free (source->data, TRUE);
+  g_free (source->event_type);
+  g_free (source->last_event_id);
+  g_slice_free (RestProxyCallEventSource, source);
+}
 
-  closure = (RestProxyCallUploadClosure *) user_data;
-  call = closure->call;
-  priv = GET_PRIVATE (call);
+/* Report the end of the stream and stop */
+static void
+_event_source_finish (RestProxyCallEventSource *source,
+                      const GError             *error)
+{
+  RestProxyCall *call = source->call;
+  RestProxyCallPrivate *priv = GET_PRIVATE (call);
 
-  finish_call (call, message, payload, &error);
+  priv->event_source = NULL;
 
-  closure->callback (closure->call,
-                     closure->uploaded,
-                     closure->uploaded,
-                     error,
-                     closure->weak_object,
-                     closure->userdata);
+  source->callback (call, NULL, NULL, NULL, error,
+                    source->weak_object, source->userdata);
 
-  g_clear_error (&error);
+  rest_proxy_call_event_source_free (source);
+  g_object_unref (call);
+}
 
-  /* Success. We don't need the weak reference any more */
-  if (closure->weak_object)
-  {
-    g_object_weak_unref (closure->weak_object,
-        (GWeakNotify)_call_async_weak_notify_cb,
-        closure);
-  }
+static void
+_event_source_dispatch (RestProxyCallEventSource *source)
+{
+  if (source->data->len > 0)
+    {
+      /* Drop the newline after the last data line */
+      g_string_truncate (source->data, source->data->len - 1);
+
+      source->callback (source->call,
+                        source->event_type ? source->event_type : "message",
+                        source->data->str,
+                        source->last_event_id,
+                        NULL,
+                        source->weak_object,
+                        source->userdata);
+    }
 
-  priv->cur_call_closure = NULL;
-  g_object_unref (closure->call);
-  g_slice_free (RestProxyCallUploadClosure, closure);
+  g_string_truncate (source->data, 0);
+  g_clear_pointer (&source->event_type, g_free);
 }
 
 static void
-_upload_call_message_wrote_data_cb (SoupMessage                *msg,
-#ifdef WITH_SOUP_2
-                                    SoupBuffer                 *chunk,
-#else
-                                    gsize                       chunk_size,
-#endif
-                                    RestProxyCallUploadClosure *closure)
+_event_source_process_line (RestProxyCallEventSource *source,
+                            const gchar              *line,
+                            gsize                     len)
 {
-#ifdef WITH_SOUP_2
-  gsize chunk_size = chunk->length;
-  goffset content_length = msg->request_body->length;
-#else
-  goffset content_length = soup_message_headers_get_content_length (soup_message_get_request_headers (msg));
-#endif
+  const gchar *colon, *value;
+  gsize field_len, value_len;
 
-  closure->uploaded = closure->uploaded + chunk_size;
+  if (len > 0 && line[len - 1] == '\r')
+    len--;
 
-  if (closure->uploaded < content_length)
-    closure->callback (closure->call,
-                       content_length,
-                       closure->uploaded,
-                       NULL,
-                       closure->weak_object,
-                       closure->userdata);
+  if (len == 0)
+    {
+      _event_source_dispatch (source);
+      return;
+    }
+
+  /* Comment, usually a keep-alive */
+  if (line[0] == ':')
+    return;
+
+  colon = memchr (line, ':', len);
+  if (colon)
+    {
+      field_len = colon - line;
+      value = colon + 1;
+      value_len = len - field_len - 1;
+      if (value_len > 0 && value[0] == ' ')
+        {
+          value++;
+          value_len--;
+        }
+    }
+  else
+    {
+      field_len = len;
+      value = "";
+      value_len = 0;
+    }
+
+#define FIELD_IS(name) (field_len == sizeof (name) - 1 && memcmp (line, name, field_len) == 0)
+  if (FIELD_IS ("data"))
+    {
+      g_string_append_len (source->data, value, value_len);
+      g_string_append_c (source->data, '\n');
+    }
+  else if (FIELD_IS ("event"))
+    {
+      g_free (source->event_type);
+      source->event_type = g_strndup (value, value_len);
+    }
+  else if (FIELD_IS ("id"))
+    {
+      if (memchr (value, '\0', value_len) == NULL)
+        {
+          g_free (source->last_event_id);
+          source->last_event_id = g_strndup (value, value_len);
+        }
+    }
+  else if (FIELD_IS ("retry"))
+    {
+      guint64 retry = 0;
+      gsize i;
+
+      for (i = 0; i < value_len && g_ascii_isdigit (value[i]); i++)
+        retry = MIN (retry * 10 + (value[i] - '0'), G_MAXUINT);
+
+      if (value_len > 0 && i == value_len)
+        source->retry_ms = retry;
+    }
+#undef FIELD_IS
+}
+
+static gboolean _event_source_connect (RestProxyCallEventSource  *source,
+                                       GError                   **error);
+
+static gboolean
+_event_source_reconnect_cb (gpointer user_data)
+{
+  RestProxyCallEventSource *source = user_data;
+  GError *error = NULL;
+
+  source->reconnect_id = 0;
+
+  if (!_event_source_connect (source, &error))
+    {
+      _event_source_finish (source, error);
+      g_error_free (error);
+    }
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Whether the connection ended in a way that is worth retrying */
+static gboolean
+_event_source_should_reconnect (RestProxyCallEventSource *source,
+                                const GError             *error)
+{
+  RestProxyCallPrivate *priv = GET_PRIVATE (source->call);
+
+  if (source->stopped)
+    return FALSE;
+
+  if (error == NULL)
+    return priv->status_code != SOUP_STATUS_NO_CONTENT;
+
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED) ||
+      g_error_matches (error, REST_PROXY_ERROR, REST_PROXY_ERROR_CANCELLED))
+    return FALSE;
+
+  /* An HTTP error means the server does not want us, except for gateways
+   * that could not reach it for the moment */
+  if (error->domain == REST_PROXY_ERROR && error->code >= 300)
+    return error->code == REST_PROXY_ERROR_HTTP_BAD_GATEWAY ||
+           error->code == REST_PROXY_ERROR_HTTP_SERVICE_UNAVAILABLE ||
+           error->code == REST_PROXY_ERROR_HTTP_GATEWAY_TIMEOUT;
+
+  return TRUE;
+}
+
+/* The delay the server asked for after a connection that worked.  Every
+ * attempt that fails after it doubles the delay, with some jitter so that
+ * the clients a server dropped together don't come back together. */
+static guint
+_event_source_get_reconnect_delay (RestProxyCallEventSource *source)
+{
+  guint64 max_delay = MAX (source->retry_ms, EVENT_SOURCE_MAX_RETRY_MS);
+  guint64 delay;
+
+  if (source->failures == 0)
+    return source->retry_ms;
+
+  delay = MAX (source->retry_ms, 1);
+  delay = MIN (delay << MIN (source->failures, 16), max_delay);
+
+  return delay / 2 + g_random_double () * (delay / 2);
+}
+
+static void
+_event_source_line_cb (RestProxyCall *call,
+                       const gchar   *buf,
+                       gsize          len,
+                       const GError  *error,
+                       GObject       *weak_object,
+                       gpointer       userdata)
+{
+  RestProxyCallEventSource *source = userdata;
+
+  if (buf != NULL)
+    {
+      /* The connection works, the next one waits as the server asked */
+      source->failures = 0;
+      _event_source_process_line (source, buf, len);
+      return;
+    }
+
+  /* An event that was not finished is dropped */
+  g_string_truncate (source->data, 0);
+  g_clear_pointer (&source->event_type, g_free);
+
+  if (!_event_source_should_reconnect (source, error))
+    {
+      _event_source_finish (source, error);
+      return;
+    }
+
+  source->reconnect_id = g_timeout_add (_event_source_get_reconnect_delay (source),
+                                        _event_source_reconnect_cb,
+                                        source);
+  source->failures++;
+}
+
+static gboolean
+_event_source_connect (RestProxyCallEventSource  *source,
+                       GError                   **error)
+{
+  RestProxyCall *call = source->call;
+  SoupMessage *message;
+  SoupMessageHeaders *request_headers;
+
+  /* Reconnecting must not prepare the call again */
+  if (source->prepared == NULL)
+    {
+      source->prepared = prepare_message (call, error);
+      if (source->prepared == NULL)
+        return FALSE;
+    }
+
+  message = copy_message (call, source->prepared);
+#ifdef WITH_SOUP_2
+  request_headers = message->request_headers;
+#else
+  request_headers = soup_message_get_request_headers (message);
+#endif
+  if (source->last_event_id && *source->last_event_id)
+    soup_message_headers_replace (request_headers, "Last-Event-ID", source->last_event_id);
+
+  continuous_send (call, message, _event_source_line_cb, NULL, source);
+  return TRUE;
+}
+
+static void
+_event_source_weak_notify_cb (gpointer  data,
+                              GObject  *dead_object)
+{
+  RestProxyCallEventSource *source = data;
+
+  source->weak_object = NULL;
+  rest_proxy_call_cancel (source->call);
+}
+
+/**
+ * rest_proxy_call_event_source: (skip)
+ * @call: The #RestProxyCall
+ * @callback: (closure userdata): a #RestProxyCallEventCallback to invoke
+ *   for every event
+ * @weak_object: The #GObject to weakly reference and tie the lifecycle to
+ * @userdata: data to pass to @callback
+ * @error: (out) (allow-none): a #GError, or %NULL
+ *
+ * Invoke @call as a subscription to a stream of Server-Sent Events, the
+ * text/event-stream format.  @callback is called for every complete event,
+ * with its type, its data and the last event ID seen.
+ *
+ * When the connection ends or fails, @call is sent again after the delay
+ * the server asked for with a retry field, or three seconds.  While the
+ * server can't be reached the delay doubles with every attempt, up to a
+ * minute or the delay the server asked for, and goes back down once a
+ * connection receives something.  The Last-Event-ID header tells the
+ * server where to continue.  The stream ends when the call is cancelled
+ * with rest_proxy_call_cancel(), when @weak_object is disposed, when the
+ * server answers 204 No Content and on HTTP errors other than 502, 503 and
+ * 504.  @callback is then called one
+ * last time with %NULL event and data, and with the error if there is one.
+ *
+ * As with rest_proxy_call_continuous() there is an internal reference on
+ * @call for as long as the stream runs.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+rest_proxy_call_event_source (RestProxyCall               *call,
+                              RestProxyCallEventCallback   callback,
+                              GObject                     *weak_object,
+                              gpointer                     userdata,
+                              GError                     **error)
+{
+  RestProxyCallPrivate *priv = GET_PRIVATE (call);
+  RestProxyCallEventSource *source;
+
+  g_return_val_if_fail (REST_IS_PROXY_CALL (call), FALSE);
+  g_return_val_if_fail (callback != NULL, FALSE);
+
+  if (priv->cur_call_closure || priv->event_source)
+    {
+      g_warning (G_STRLOC ": re-use of RestProxyCall %p, don't do this", call);
+      return FALSE;
+    }
+
+  source = g_slice_new0 (RestProxyCallEventSource);
+  source->call = g_object_ref (call);
+  source->callback = callback;
+  source->weak_object = weak_object;
+  source->userdata = userdata;
+  source->data = g_string_new (NULL);
+  source->retry_ms = EVENT_SOURCE_DEFAULT_RETRY_MS;
+
+  rest_proxy_call_add_header_static (call, "Accept", "text/event-stream");
+  rest_proxy_call_add_header_static (call, "Cache-Control", "no-cache");
+  rest_proxy_call_set_continuous_framing (call, REST_PROXY_CALL_FRAMING_DELIMITER, "\n");
+
+  if (!_event_source_connect (source, error))
+    {
+      source->weak_object = NULL;
+      rest_proxy_call_event_source_free (source);
+      g_object_unref (call);
+      return FALSE;
+    }
+
+  priv->event_source = source;
+
+  if (source->weak_object)
+    g_object_weak_ref (source->weak_object,
+                       (GWeakNotify)_event_source_weak_notify_cb,
+                       source);
+
+  return TRUE;
+}
+
+static void
+_upload_call_message_completed_cb (SoupMessage *message,
+                                   GBytes      *payload,
+                                   GError      *error,
+                                   gpointer     user_data)
+{
+  RestProxyCall *call;
+  RestProxyCallPrivate *priv;
+  RestProxyCallUploadClosure *closure;
+
+  closure = (RestProxyCallUploadClosure *) user_data;
+  call = closure->call;
+  priv = GET_PRIVATE (call);
+
+  finish_call (call, message, payload, &error);
+
+  closure->callback (closure->call,
+                     closure->uploaded,
+                     closure->uploaded,
+                     error,
+                     closure->weak_object,
+                     closure->userdata);
+
+  g_clear_error (&error);
+
+  /* Success. We don't need the weak reference any more */
+  if (closure->weak_object)
+  {
+    g_object_weak_unref (closure->weak_object,
+        (GWeakNotify)_call_async_weak_notify_cb,
+        closure);
+  }
+
+  priv->cur_call_closure = NULL;
+  g_object_unref (closure->call);
+  g_slice_free (RestProxyCallUploadClosure, closure);
+}
+
+static void
+_upload_call_message_wrote_data_cb (SoupMessage                *msg,
+#ifdef WITH_SOUP_2
+                                    SoupBuffer                 *chunk,
+#else
+                                    gsize                       chunk_size,
+#endif
+                                    RestProxyCallUploadClosure *closure)
+{
+#ifdef WITH_SOUP_2
+  gsize chunk_size = chunk->length;
+  goffset content_length = msg->request_body->length;
+#else
+  goffset content_length = soup_message_headers_get_content_length (soup_message_get_request_headers (msg));
+#endif
+
+  closure->uploaded = closure->uploaded + chunk_size;
+
+  if (closure->uploaded < content_length)
+    closure->callback (closure->call,
+                       content_length,
+                       closure->uploaded,
+                       NULL,
+                       closure->weak_object,
+                       closure->userdata);
+}
+
+/**
+ * rest_proxy_call_upload:
+ * @call: The #RestProxyCall
+ * @callback: (scope async): a #RestProxyCallUploadCallback to invoke when a chunk
+ *   of data was uploaded
+ * @weak_object: The #GObject to weakly reference and tie the lifecycle to
+ * @userdata: data to pass to @callback
+ * @error: a #GError, or %NULL
+ *
+ * Asynchronously invoke @call but expect to have the callback invoked every time a
+ * chunk of our request's body is written.
+ *
+ * When the callback is invoked with the uploaded byte count equaling the message
+ * byte count, the call has completed.
+ *
+ * If @weak_object is disposed during the call then this call will be
+ * cancelled. If the call is cancelled then the callback will be invoked with
+ * an error state.
+ *
+ * You may unref the call after calling this function since there is an
+ * internal reference, or you may unref in the callback.
+ */
+gboolean
+rest_proxy_call_upload (RestProxyCall                *call,
+                        RestProxyCallUploadCallback   callback,
+                        GObject                      *weak_object,
+                        gpointer                      userdata,
+                        GError                      **error)
+{
+  RestProxyCallPrivate *priv = GET_PRIVATE (call);
+  SoupMessage *message;
+  RestProxyCallUploadClosure *closure;
+
+  g_return_val_if_fail (REST_IS_PROXY_CALL (call), FALSE);
+  g_assert (priv->proxy);
+
+  if (priv->cur_call_closure)
+  {
+    g_warning (G_STRLOC ": re-use of RestProxyCall %p, don't do this", call);
+    return FALSE;
+  }
+
+  message = prepare_message (call, error);
+  if (message == NULL)
+    return FALSE;
+
+  closure = g_slice_new0 (RestProxyCallUploadClosure);
+  closure->call = g_object_ref (call);
+  closure->callback = callback;
+  closure->weak_object = weak_object;
+  closure->message = message;
+  closure->userdata = userdata;
+  closure->uploaded = 0;
+
+  priv->cur_call_closure = (RestProxyCallAsyncClosure *)closure;
+
+  /* Weakly reference this object. We remove our callback if it goes away. */
+  if (closure->weak_object)
+  {
+    g_object_weak_ref (closure->weak_object,
+        (GWeakNotify)_call_async_weak_notify_cb,
+        closure);
+  }
+
+  g_signal_connect (message,
+                    "wrote-body-data",
+                    (GCallback) _upload_call_message_wrote_data_cb,
+                    closure);
+
+  _rest_proxy_queue_message (priv->proxy,
+                             message,
+                             priv->cancellable,
+                             _upload_call_message_completed_cb,
+                             closure);
+  return TRUE;
+}
+
+static void
+rest_proxy_call_download_closure_free (RestProxyCallDownloadClosure *closure)
+{
+  g_clear_object (&closure->file);
+  g_clear_object (&closure->prepared);
+  g_clear_object (&closure->message);
+  g_clear_object (&closure->input);
+  g_clear_object (&closure->output);
+  g_free (closure->validator);
+  g_clear_error (&closure->error);
+  g_free (closure->buffer);
+  g_slice_free (RestProxyCallDownloadClosure, closure);
+}
+
+static void
+_download_report_progress (GTask *task)
+{
+  RestProxyCallDownloadClosure *closure = g_task_get_task_data (task);
+
+  if (closure->callback)
+    closure->callback (g_task_get_source_object (task),
+                       closure->total,
+                       closure->downloaded,
+                       closure->userdata);
+}
+
+static void _download_send (GTask *task);
+
+static void
+_download_closed_cb (GObject      *source,
+                     GAsyncResult *result,
+                     gpointer      user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  RestProxyCallDownloadClosure *closure = g_task_get_task_data (task);
+  GError *error = NULL;
+
+  if (!g_output_stream_close_finish (G_OUTPUT_STREAM (source), result, &error))
+    {
+      if (closure->error == NULL)
+        closure->error = error;
+      else
+        g_error_free (error);
+    }
+  else
+    {
+      /* Remember what was downloaded so an interrupted download is only
+       * resumed if the resource did not change.  A replaced file is only
+       * in place once closed, so the attribute can't be set before.  Not
+       * every file system can store it, in which case the download starts
+       * over. */
+      if (closure->validator)
+        g_file_set_attribute_string (closure->file, DOWNLOAD_VALIDATOR_ATTRIBUTE,
+                                     closure->validator, G_FILE_QUERY_INFO_NONE,
+                                     NULL, NULL);
+      else
+        g_file_set_attribute (closure->file, DOWNLOAD_VALIDATOR_ATTRIBUTE,
+                              G_FILE_ATTRIBUTE_TYPE_INVALID, NULL,
+                              G_FILE_QUERY_INFO_NONE, NULL, NULL);
+    }
+
+  if (closure->error)
+    g_task_return_error (task, g_steal_pointer (&closure->error));
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+/* Ends the download with @error, or successfully if %NULL, once what was
+ * written is closed, so that a failed download can be resumed */
+static void
+_download_finish (GTask  *task,
+                  GError *error)
+{
+  RestProxyCallDownloadClosure *closure = g_task_get_task_data (task);
+
+  if (closure->output == NULL)
+    {
+      if (error)
+        g_task_return_error (task, error);
+      else
+        g_task_return_boolean (task, TRUE);
+      g_object_unref (task);
+      return;
+    }
+
+  closure->error = error;
+  /* Not cancellable, the partial file must still be closed */
+  g_output_stream_close_async (closure->output,
+                               G_PRIORITY_DEFAULT,
+                               NULL,
+                               _download_closed_cb,
+                               task);
+}
+
+static void _download_read_cb (GObject      *source,
+                               GAsyncResult *result,
+                               gpointer      user_data);
+
+static void
+_download_written_cb (GObject      *source,
+                      GAsyncResult *result,
+                      gpointer      user_data)
+{
+  GTask *task = user_data;
+  RestProxyCallDownloadClosure *closure = g_task_get_task_data (task);
+  gsize written;
+  GError *error = NULL;
+
+  if (!g_output_stream_write_all_finish (G_OUTPUT_STREAM (source), result, &written, &error))
+    {
+      _download_finish (task, error);
+      return;
+    }
+
+  closure->downloaded += written;
+  _download_report_progress (task);
+
+  g_input_stream_read_async (closure->input,
+                             closure->buffer,
+                             DOWNLOAD_BUFFER_SIZE,
+                             G_PRIORITY_DEFAULT,
+                             g_task_get_cancellable (task),
+                             _download_read_cb,
+                             task);
+}
+
+static void
+_download_read_cb (GObject      *source,
+                   GAsyncResult *result,
+                   gpointer      user_data)
+{
+  GTask *task = user_data;
+  RestProxyCallDownloadClosure *closure = g_task_get_task_data (task);
+  gssize bytes_read;
+  GError *error = NULL;
+
+  bytes_read = g_input_stream_read_finish (G_INPUT_STREAM (source), result, &error);
+  if (bytes_read < 0)
+    {
+      _download_finish (task, error);
+      return;
+    }
+
+  if (bytes_read == 0)
+    {
+      _download_finish (task, NULL);
+      return;
+    }
+
+  g_output_stream_write_all_async (closure->output,
+                                   closure->buffer,
+                                   bytes_read,
+                                   G_PRIORITY_DEFAULT,
+                                   g_task_get_cancellable (task),
+                                   _download_written_cb,
+                                   task);
+}
+
+static void
+_download_opened_cb (GObject      *source,
+                     GAsyncResult *result,
+                     gpointer      user_data)
+{
+  GTask *task = user_data;
+  RestProxyCallDownloadClosure *closure = g_task_get_task_data (task);
+  GFileOutputStream *output;
+  GError *error = NULL;
+
+  if (closure->offset > 0)
+    output = g_file_append_to_finish (closure->file, result, &error);
+  else
+    output = g_file_replace_finish (closure->file, result, &error);
+
+  if (output == NULL)
+    {
+      g_task_return_error (task, error);
+      g_object_unref (task);
+      return;
+    }
+
+  closure->output = G_OUTPUT_STREAM (output);
+
+  closure->buffer = g_malloc (DOWNLOAD_BUFFER_SIZE);
+  _download_report_progress (task);
+
+  g_input_stream_read_async (closure->input,
+                             closure->buffer,
+                             DOWNLOAD_BUFFER_SIZE,
+                             G_PRIORITY_DEFAULT,
+                             g_task_get_cancellable (task),
+                             _download_read_cb,
+                             task);
+}
+
+/* Returns the strong ETag of a response, or else its Last-Modified date, as
+ * only those can be used in If-Range */
+static char *
+get_strong_validator (SoupMessageHeaders *headers)
+{
+  const char *etag = soup_message_headers_get_one (headers, "ETag");
+
+  if (etag && !g_str_has_prefix (etag, "W/"))
+    return g_strdup (etag);
+
+  return g_strdup (soup_message_headers_get_one (headers, "Last-Modified"));
+}
+
+/* Returns the length of the resource a 416 response gives in its
+ * Content-Range, or -1 */
+static goffset
+get_unsatisfied_range_length (SoupMessageHeaders *headers)
+{
+  const char *range = soup_message_headers_get_one (headers, "Content-Range");
+  char *end;
+  gint64 length;
+
+  if (range == NULL || !g_str_has_prefix (range, "bytes */"))
+    return -1;
+
+  range += strlen ("bytes */");
+  length = g_ascii_strtoll (range, &end, 10);
+  if (end == range || *end != '\0' || length < 0)
+    return -1;
+
+  return length;
+}
+
+static void
+_download_sent_cb (GObject      *source,
+                   GAsyncResult *result,
+                   gpointer      user_data)
+{
+  GTask *task = user_data;
+  RestProxyCall *call = g_task_get_source_object (task);
+  RestProxyCallPrivate *priv = GET_PRIVATE (call);
+  RestProxyCallDownloadClosure *closure = g_task_get_task_data (task);
+  SoupMessageHeaders *headers;
+  goffset start, end, length;
+  GError *error = NULL;
+
+  closure->input = _rest_proxy_send_message_finish (REST_PROXY (source), result, &error);
+  if (closure->input == NULL)
+    {
+      g_task_return_error (task, error);
+      g_object_unref (task);
+      return;
+    }
+
+  set_response_status (priv, closure->message);
+  g_clear_pointer (&priv->payload, g_bytes_unref);
+  headers = get_response_message_headers (priv);
+
+  if (priv->status_code == SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE &&
+      closure->offset > 0)
+    {
+      if (get_unsatisfied_range_length (headers) == closure->offset)
+        {
+          /* The file already holds the whole body */
+          closure->total = closure->downloaded = closure->offset;
+          _download_report_progress (task);
+          g_clear_object (&closure->input);
+          _download_finish (task, NULL);
+          return;
+        }
+
+      /* The partial file does not fit the resource, start over */
+      g_clear_object (&closure->input);
+      g_clear_object (&closure->message);
+      closure->offset = 0;
+      g_clear_pointer (&closure->validator, g_free);
+      _download_send (task);
+      return;
+    }
+
+  if (!_handle_error_from_message (closure->message, &error))
+    {
+      g_task_return_error (task, error);
+      g_object_unref (task);
+      return;
+    }
+
+  if (priv->status_code == SOUP_STATUS_PARTIAL_CONTENT)
+    {
+      if (!soup_message_headers_get_content_range (headers, &start, &end, &length) ||
+          start != closure->offset)
+        {
+          g_task_return_new_error (task,
+                                   REST_PROXY_ERROR,
+                                   REST_PROXY_ERROR_FAILED,
+                                   "Unexpected Content-Range in response");
+          g_object_unref (task);
+          return;
+        }
+
+      closure->total = length;
+    }
+  else
+    {
+      /* The server ignored the range or the resource changed, so the whole
+       * body follows */
+      closure->offset = 0;
+      closure->total = -1;
+      if (soup_message_headers_get_encoding (headers) == SOUP_ENCODING_CONTENT_LENGTH)
+        closure->total = soup_message_headers_get_content_length (headers);
+    }
+
+  closure->downloaded = closure->offset;
+
+  g_free (closure->validator);
+  closure->validator = get_strong_validator (headers);
+
+  if (closure->offset > 0)
+    g_file_append_to_async (closure->file,
+                            G_FILE_CREATE_NONE,
+                            G_PRIORITY_DEFAULT,
+                            g_task_get_cancellable (task),
+                            _download_opened_cb,
+                            task);
+  else
+    g_file_replace_async (closure->file,
+                          NULL,
+                          FALSE,
+                          G_FILE_CREATE_NONE,
+                          G_PRIORITY_DEFAULT,
+                          g_task_get_cancellable (task),
+                          _download_opened_cb,
+                          task);
+}
+
+static void
+_download_send (GTask *task)
+{
+  RestProxyCall *call = g_task_get_source_object (task);
+  RestProxyCallPrivate *priv = GET_PRIVATE (call);
+  RestProxyCallDownloadClosure *closure = g_task_get_task_data (task);
+  GError *error = NULL;
+
+  if (closure->prepared == NULL)
+    {
+      closure->prepared = prepare_message (call, &error);
+      if (closure->prepared == NULL)
+        {
+          g_task_return_error (task, error);
+          g_object_unref (task);
+          return;
+        }
+    }
+
+  /* Without a validator the partial file can't be told to still fit the
+   * resource */
+  if (closure->validator == NULL)
+    closure->offset = 0;
+
+  closure->message = copy_message (call, closure->prepared);
+  if (closure->offset > 0)
+    {
+      SoupMessageHeaders *request_headers;
+
+#ifdef WITH_SOUP_2
+      request_headers = closure->message->request_headers;
+#else
+      request_headers = soup_message_get_request_headers (closure->message);
+#endif
+      soup_message_headers_set_range (request_headers, closure->offset, -1);
+      soup_message_headers_replace (request_headers, "If-Range", closure->validator);
+    }
+
+  _rest_proxy_send_message_async (priv->proxy,
+                                  closure->message,
+                                  g_task_get_cancellable (task),
+                                  _download_sent_cb,
+                                  task);
+}
+
+static void
+_download_query_info_cb (GObject      *source,
+                         GAsyncResult *result,
+                         gpointer      user_data)
+{
+  GTask *task = user_data;
+  RestProxyCallDownloadClosure *closure = g_task_get_task_data (task);
+  g_autoptr(GFileInfo) info = NULL;
+  GError *error = NULL;
+
+  info = g_file_query_info_finish (G_FILE (source), result, &error);
+  if (info != NULL)
+    {
+      const char *validator = g_file_info_get_attribute_string (info, DOWNLOAD_VALIDATOR_ATTRIBUTE);
+
+      closure->offset = g_file_info_get_size (info);
+      /* Weak ETags may not be used in If-Range */
+      if (validator && !g_str_has_prefix (validator, "W/"))
+        closure->validator = g_strdup (validator);
+    }
+  else if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+    {
+      g_clear_error (&error);
+    }
+  else
+    {
+      g_task_return_error (task, error);
+      g_object_unref (task);
+      return;
+    }
+
+  _download_send (task);
+}
+
+/* Starts the download; @prepared is the already prepared message of @call,
+ * or %NULL to prepare it when the request is first sent.
+ */
+static void
+download_to_file (RestProxyCall                 *call,
+                  GFile                         *file,
+                  SoupMessage                   *prepared,
+                  RestProxyCallDownloadCallback  callback,
+                  gpointer                       userdata,
+                  GCancellable                  *cancellable,
+                  GAsyncReadyCallback            ready_callback,
+                  gpointer                       user_data)
+{
+  RestProxyCallDownloadClosure *closure;
+  GTask *task;
+
+  closure = g_slice_new0 (RestProxyCallDownloadClosure);
+  closure->file = g_object_ref (file);
+  if (prepared)
+    closure->prepared = g_object_ref (prepared);
+  closure->callback = callback;
+  closure->userdata = userdata;
+  closure->total = -1;
+
+  task = new_call_task (call, cancellable, ready_callback, user_data);
+  g_task_set_source_tag (task, rest_proxy_call_download_to_file_async);
+  g_task_set_task_data (task, closure, (GDestroyNotify) rest_proxy_call_download_closure_free);
+
+  g_file_query_info_async (file,
+                           G_FILE_ATTRIBUTE_STANDARD_SIZE "," DOWNLOAD_VALIDATOR_ATTRIBUTE,
+                           G_FILE_QUERY_INFO_NONE,
+                           G_PRIORITY_DEFAULT,
+                           cancellable,
+                           _download_query_info_cb,
+                           task);
+}
+
+/**
+ * rest_proxy_call_download_to_file_async:
+ * @call: a #RestProxyCall
+ * @file: the #GFile to write the response body to
+ * @callback: (nullable) (scope notified) (closure userdata): a
+ *   #RestProxyCallDownloadCallback to report progress to, or %NULL
+ * @userdata: data to pass to @callback
+ * @cancellable: (nullable): an optional #GCancellable, or %NULL
+ * @ready_callback: (scope async) (closure user_data): callback to call when
+ *   the download is finished
+ * @user_data: user data for @ready_callback
+ *
+ * Asynchronously invoke @call and write the response body to @file as it
+ * arrives, without accumulating it in memory.
+ *
+ * If @file already exists, it is taken to be the start of the body from an
+ * earlier, interrupted download and only the rest is requested with a Range
+ * header.  If-Range makes sure the server sends the whole body again if the
+ * resource changed since then, which takes a strong ETag or a Last-Modified
+ * date stored with @file; without one, the whole body is downloaded again.
+ * Servers that do not support ranges send the whole body too, in which case
+ * @file is overwritten.  A failed or cancelled download leaves the partial
+ * file behind, so calling this again resumes it.
+ *
+ * @callback is called whenever data has been written, with the total size
+ * of the body or -1 if it is not known, and the number of bytes in @file so
+ * far.
+ */
+void
+rest_proxy_call_download_to_file_async (RestProxyCall                 *call,
+                                        GFile                         *file,
+                                        RestProxyCallDownloadCallback  callback,
+                                        gpointer                       userdata,
+                                        GCancellable                  *cancellable,
+                                        GAsyncReadyCallback            ready_callback,
+                                        gpointer                       user_data)
+{
+  g_return_if_fail (REST_IS_PROXY_CALL (call));
+  g_return_if_fail (G_IS_FILE (file));
+  g_return_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
+  g_assert (GET_PRIVATE (call)->proxy);
+
+  download_to_file (call, file, NULL, callback, userdata,
+                    cancellable, ready_callback, user_data);
+}
+
+/**
+ * rest_proxy_call_download_to_file_finish:
+ * @call: a #RestProxyCall
+ * @result: the result from the #GAsyncReadyCallback
+ * @error: optional #GError
+ *
+ * Returns: %TRUE if the whole body was written to the file
+ */
+gboolean
+rest_proxy_call_download_to_file_finish (RestProxyCall  *call,
+                                         GAsyncResult   *result,
+                                         GError        **error)
+{
+  g_return_val_if_fail (REST_IS_PROXY_CALL (call), FALSE);
+  g_return_val_if_fail (g_task_is_valid (result, call), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static void
+rest_download_segment_clear (RestDownloadSegment *segment)
+{
+  g_clear_object (&segment->message);
+  g_clear_object (&segment->input);
+  g_clear_object (&segment->io);
+  g_clear_pointer (&segment->buffer, g_free);
+}
+
+static void
+rest_proxy_call_segmented_closure_free (RestProxyCallSegmentedClosure *closure)
+{
+  for (guint i = 0; i < closure->n_segments; i++)
+    rest_download_segment_clear (&closure->segments[i]);
+  g_free (closure->segments);
+
+  if (closure->cancel_id)
+    g_cancellable_disconnect (closure->user_cancellable, closure->cancel_id);
+  g_clear_object (&closure->user_cancellable);
+  g_clear_object (&closure->cancellable);
+
+  g_clear_object (&closure->file);
+  g_clear_object (&closure->prepared);
+  g_clear_object (&closure->message);
+  g_clear_object (&closure->io);
+  g_clear_error (&closure->error);
+  g_free (closure->validator);
+  g_slice_free (RestProxyCallSegmentedClosure, closure);
+}
+
+static void _segment_send (RestDownloadSegment *segment);
+
+static void
+_segment_done (RestDownloadSegment *segment,
+               GError              *error)
+{
+  GTask *task = segment->task;
+  RestProxyCallSegmentedClosure *closure = g_task_get_task_data (task);
+
+  rest_download_segment_clear (segment);
+
+  if (error)
+    {
+      /* Stop the other segments, the download failed */
+      if (closure->error == NULL)
+        closure->error = error;
+      else
+        g_error_free (error);
+      g_cancellable_cancel (closure->cancellable);
+    }
+
+  if (--closure->pending > 0)
+    return;
+
+  if (closure->error)
+    {
+      /* Report why the download failed rather than the cancellation */
+      g_task_return_error (task, g_steal_pointer (&closure->error));
+    }
+  else if (closure->downloaded != closure->total)
+    {
+      g_task_return_new_error (task,
+                               REST_PROXY_ERROR,
+                               REST_PROXY_ERROR_FAILED,
+                               "Downloaded %" G_GOFFSET_FORMAT " of %" G_GOFFSET_FORMAT " bytes",
+                               closure->downloaded, closure->total);
+    }
+  else
+    {
+      g_task_return_boolean (task, TRUE);
+    }
+
+  g_object_unref (task);
+}
+
+static gboolean
+_segment_resend_cb (GCancellable *cancellable,
+                    gpointer      user_data)
+{
+  RestDownloadSegment *segment = user_data;
+  RestProxyCallSegmentedClosure *closure = g_task_get_task_data (segment->task);
+  GError *error = NULL;
+
+  if (g_cancellable_set_error_if_cancelled (closure->cancellable, &error))
+    _segment_done (segment, error);
+  else
+    _segment_send (segment);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* A segment stopped early; fetch the rest of it again after a random delay
+ * that grows with every retry, unless that is pointless */
+static void
+_segment_failed (RestDownloadSegment *segment,
+                 GError              *error,
+                 gboolean             retry)
+{
+  RestProxyCallSegmentedClosure *closure = g_task_get_task_data (segment->task);
+
+  if (retry &&
+      segment->retries < SEGMENT_MAX_RETRIES &&
+      !g_cancellable_is_cancelled (closure->cancellable))
+    {
+      GSource *source;
+      guint delay;
+
+      segment->retries++;
+      g_clear_error (&error);
+      g_clear_object (&segment->message);
+      g_clear_object (&segment->input);
+
+      delay = g_random_int_range (0, (SEGMENT_RETRY_DELAY_MS << (segment->retries - 1)) + 1);
+      source = g_cancellable_source_new (closure->cancellable);
+      g_source_set_ready_time (source, g_get_monotonic_time () + delay * G_TIME_SPAN_MILLISECOND);
+      g_source_set_callback (source, (GSourceFunc) _segment_resend_cb, segment, NULL);
+      g_source_attach (source, g_main_context_get_thread_default ());
+      g_source_unref (source);
+      return;
+    }
+
+  _segment_done (segment, error);
+}
+
+static void _segment_read_cb (GObject      *source,
+                              GAsyncResult *result,
+                              gpointer      user_data);
+
+static void
+_segment_read (RestDownloadSegment *segment)
+{
+  RestProxyCallSegmentedClosure *closure = g_task_get_task_data (segment->task);
+
+  g_input_stream_read_async (segment->input,
+                             segment->buffer,
+                             MIN (DOWNLOAD_BUFFER_SIZE, segment->end - segment->start + 1),
+                             G_PRIORITY_DEFAULT,
+                             closure->cancellable,
+                             _segment_read_cb,
+                             segment);
+}
+
+static void
+_segment_written_cb (GObject      *source,
+                     GAsyncResult *result,
+                     gpointer      user_data)
+{
+  RestDownloadSegment *segment = user_data;
+  GTask *task = segment->task;
+  RestProxyCallSegmentedClosure *closure = g_task_get_task_data (task);
+  gsize written;
+  GError *error = NULL;
+
+  if (!g_output_stream_write_all_finish (G_OUTPUT_STREAM (source), result, &written, &error))
+    {
+      _segment_failed (segment, error, FALSE);
+      return;
+    }
+
+  segment->start += written;
+  closure->downloaded += written;
+
+  if (closure->callback)
+    closure->callback (g_task_get_source_object (task),
+                       closure->total,
+                       closure->downloaded,
+                       closure->userdata);
+
+  if (segment->start > segment->end)
+    _segment_done (segment, NULL);
+  else
+    _segment_read (segment);
+}
+
+static void
+_segment_read_cb (GObject      *source,
+                  GAsyncResult *result,
+                  gpointer      user_data)
+{
+  RestDownloadSegment *segment = user_data;
+  RestProxyCallSegmentedClosure *closure = g_task_get_task_data (segment->task);
+  gssize bytes_read;
+  GError *error = NULL;
+
+  bytes_read = g_input_stream_read_finish (G_INPUT_STREAM (source), result, &error);
+  if (bytes_read <= 0)
+    {
+      if (bytes_read == 0)
+        error = g_error_new_literal (REST_PROXY_ERROR,
+                                     REST_PROXY_ERROR_IO,
+                                     "Connection closed before the end of the segment");
+      _segment_failed (segment, error, TRUE);
+      return;
+    }
+
+  g_output_stream_write_all_async (g_io_stream_get_output_stream (G_IO_STREAM (segment->io)),
+                                   segment->buffer,
+                                   bytes_read,
+                                   G_PRIORITY_DEFAULT,
+                                   closure->cancellable,
+                                   _segment_written_cb,
+                                   segment);
+}
+
+static void
+_segment_sent_cb (GObject      *source,
+                  GAsyncResult *result,
+                  gpointer      user_data)
+{
+  RestDownloadSegment *segment = user_data;
+  SoupMessageHeaders *headers;
+  goffset start, end;
+  guint status;
+  GError *error = NULL;
+
+  segment->input = _rest_proxy_send_message_finish (REST_PROXY (source), result, &error);
+  if (segment->input == NULL)
+    {
+      _segment_failed (segment, error, TRUE);
+      return;
+    }
+
+#ifdef WITH_SOUP_2
+  status = segment->message->status_code;
+  headers = segment->message->response_headers;
+#else
+  status = soup_message_get_status (segment->message);
+  headers = soup_message_get_response_headers (segment->message);
+#endif
+
+  if (status == SOUP_STATUS_PARTIAL_CONTENT)
+    {
+      if (!soup_message_headers_get_content_range (headers, &start, &end, NULL) ||
+          start != segment->start || end != segment->end)
+        {
+          error = g_error_new_literal (REST_PROXY_ERROR,
+                                       REST_PROXY_ERROR_FAILED,
+                                       "Unexpected Content-Range in response");
+          _segment_failed (segment, error, FALSE);
+          return;
+        }
+
+      _segment_read (segment);
+      return;
+    }
+
+  if (!_handle_error_from_message (segment->message, &error))
+    {
+      /* Server errors may be transient, client errors will not go away */
+      _segment_failed (segment, error, status >= 500);
+      return;
+    }
+
+  /* The resource changed since the download started */
+  error = g_error_new_literal (REST_PROXY_ERROR,
+                               REST_PROXY_ERROR_FAILED,
+                               "Resource changed during the download");
+  _segment_failed (segment, error, FALSE);
+}
+
+static void
+_segment_send (RestDownloadSegment *segment)
+{
+  GTask *task = segment->task;
+  RestProxyCall *call = g_task_get_source_object (task);
+  RestProxyCallSegmentedClosure *closure = g_task_get_task_data (task);
+  SoupMessageHeaders *request_headers;
+
+  segment->message = copy_message (call, closure->prepared);
+#ifdef WITH_SOUP_2
+  request_headers = segment->message->request_headers;
+#else
+  request_headers = soup_message_get_request_headers (segment->message);
+#endif
+  soup_message_headers_set_range (request_headers, segment->start, segment->end);
+  if (closure->validator)
+    soup_message_headers_replace (request_headers, "If-Range", closure->validator);
+
+  _rest_proxy_send_message_async (GET_PRIVATE (call)->proxy,
+                                  segment->message,
+                                  closure->cancellable,
+                                  _segment_sent_cb,
+                                  segment);
+}
+
+static void
+_segment_opened_cb (GObject      *source,
+                    GAsyncResult *result,
+                    gpointer      user_data)
+{
+  RestDownloadSegment *segment = user_data;
+  GError *error = NULL;
+
+  segment->io = g_file_open_readwrite_finish (G_FILE (source), result, &error);
+  if (segment->io == NULL ||
+      !g_seekable_seek (G_SEEKABLE (segment->io), segment->start, G_SEEK_SET, NULL, &error))
+    {
+      _segment_failed (segment, error, FALSE);
+      return;
+    }
+
+  segment->buffer = g_malloc (DOWNLOAD_BUFFER_SIZE);
+  _segment_send (segment);
+}
+
+static void
+_segmented_created_cb (GObject      *source,
+                        GAsyncResult *result,
+                        gpointer      user_data)
+{
+  GTask *task = user_data;
+  RestProxyCallSegmentedClosure *closure = g_task_get_task_data (task);
+  goffset segment_size;
+  GError *error = NULL;
+
+  if (!g_io_stream_close_finish (closure->io, result, &error))
+    {
+      g_task_return_error (task, error);
+      g_object_unref (task);
+      return;
+    }
+
+  /* Segments smaller than this are not worth another connection */
+  closure->n_segments = CLAMP ((closure->total + SEGMENT_MIN_SIZE - 1) / SEGMENT_MIN_SIZE,
+                               1, closure->n_segments);
+  segment_size = closure->total / closure->n_segments;
+
+  closure->segments = g_new0 (RestDownloadSegment, closure->n_segments);
+  closure->pending = closure->n_segments;
+
+  for (guint i = 0; i < closure->n_segments; i++)
+    {
+      RestDownloadSegment *segment = &closure->segments[i];
+
+      segment->task = task;
+      segment->start = i * segment_size;
+      segment->end = i + 1 < closure->n_segments ? (i + 1) * segment_size - 1
+                                                 : closure->total - 1;
+
+      g_file_open_readwrite_async (closure->file,
+                                   G_PRIORITY_DEFAULT,
+                                   closure->cancellable,
+                                   _segment_opened_cb,
+                                   segment);
+    }
+}
+
+static void
+_segmented_replaced_cb (GObject      *source,
+                        GAsyncResult *result,
+                        gpointer      user_data)
+{
+  GTask *task = user_data;
+  RestProxyCallSegmentedClosure *closure = g_task_get_task_data (task);
+  GError *error = NULL;
+
+  closure->io = G_IO_STREAM (g_file_replace_readwrite_finish (closure->file, result, &error));
+  if (closure->io == NULL ||
+      !g_seekable_truncate (G_SEEKABLE (closure->io), closure->total, NULL, &error))
+    {
+      g_task_return_error (task, error);
+      g_object_unref (task);
+      return;
+    }
+
+  /* Replacing may go through a temporary file, which only takes the place of
+   * the file once it is closed */
+  g_io_stream_close_async (closure->io,
+                           G_PRIORITY_DEFAULT,
+                           closure->cancellable,
+                           _segmented_created_cb,
+                           task);
+}
+
+static void
+_segmented_fallback_cb (GObject      *source,
+                        GAsyncResult *result,
+                        gpointer      user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  GError *error = NULL;
+
+  if (rest_proxy_call_download_to_file_finish (REST_PROXY_CALL (source), result, &error))
+    g_task_return_boolean (task, TRUE);
+  else
+    g_task_return_error (task, error);
+}
+
+static void
+_segmented_probe_cb (GObject      *source,
+                     GAsyncResult *result,
+                     gpointer      user_data)
+{
+  GTask *task = user_data;
+  RestProxyCall *call = g_task_get_source_object (task);
+  RestProxyCallPrivate *priv = GET_PRIVATE (call);
+  RestProxyCallSegmentedClosure *closure = g_task_get_task_data (task);
+  g_autoptr(GInputStream) input = NULL;
+  SoupMessageHeaders *headers;
+  GError *error = NULL;
+
+  input = _rest_proxy_send_message_finish (REST_PROXY (source), result, &error);
+  if (input == NULL)
+    {
+      g_task_return_error (task, error);
+      g_object_unref (task);
+      return;
+    }
+
+  set_response_status (priv, closure->message);
+  g_clear_pointer (&priv->payload, g_bytes_unref);
+  headers = get_response_message_headers (priv);
+
+  if (!_handle_error_from_message (closure->message, &error))
+    {
+      g_task_return_error (task, error);
+      g_object_unref (task);
+      return;
+    }
+
+  if (priv->status_code != SOUP_STATUS_PARTIAL_CONTENT ||
+      !soup_message_headers_get_content_range (headers, NULL, NULL, &closure->total) ||
+      closure->total <= 0)
+    {
+      /* No ranges, so no segments either.  Start from scratch, the file
+       * must not be mistaken for a partial download. */
+      g_file_delete (closure->file, NULL, NULL);
+      download_to_file (call,
+                        closure->file,
+                        closure->prepared,
+                        closure->callback,
+                        closure->userdata,
+                        g_task_get_cancellable (task),
+                        _segmented_fallback_cb,
+                        task);
+      return;
+    }
+
+  closure->validator = get_strong_validator (headers);
+
+  g_file_replace_readwrite_async (closure->file,
+                                  NULL,
+                                  FALSE,
+                                  G_FILE_CREATE_NONE,
+                                  G_PRIORITY_DEFAULT,
+                                  closure->cancellable,
+                                  _segmented_replaced_cb,
+                                  task);
+}
+
+static void
+_segmented_cancelled_cb (GCancellable *cancellable,
+                         GCancellable *segments_cancellable)
+{
+  g_cancellable_cancel (segments_cancellable);
 }
 
 /**
- * rest_proxy_call_upload:
- * @call: The #RestProxyCall
- * @callback: (scope async): a #RestProxyCallUploadCallback to invoke when a chunk
- *   of data was uploaded
- * @weak_object: The #GObject to weakly reference and tie the lifecycle to
+ * rest_proxy_call_download_segmented_async:
+ * @call: a #RestProxyCall
+ * @file: the #GFile to write the response body to
+ * @n_segments: the number of segments to download in parallel
+ * @callback: (nullable) (scope notified) (closure userdata): a
+ *   #RestProxyCallDownloadCallback to report progress to, or %NULL
  * @userdata: data to pass to @callback
- * @error: a #GError, or %NULL
+ * @cancellable: (nullable): an optional #GCancellable, or %NULL
+ * @ready_callback: (scope async) (closure user_data): callback to call when
+ *   the download is finished
+ * @user_data: user data for @ready_callback
  *
- * Asynchronously invoke @call but expect to have the callback invoked every time a
- * chunk of our request's body is written.
- *
- * When the callback is invoked with the uploaded byte count equaling the message
- * byte count, the call has completed.
+ * Asynchronously download the response body of @call to @file, split into
+ * up to @n_segments ranges that are requested in parallel.  This helps on
+ * links where a single connection cannot use the available bandwidth.
  *
- * If @weak_object is disposed during the call then this call will be
- * cancelled. If the call is cancelled then the callback will be invoked with
- * an error state.
+ * The size of the body is found with a first request for a single byte.  The
+ * file is then created at its final size and each segment written at its
+ * offset.  A segment that fails is requested again from where it stopped, a
+ * few times at most and after a random delay that grows with every attempt.
+ * If the server does not support ranges this falls back to
+ * rest_proxy_call_download_to_file_async() on a new file.
  *
- * You may unref the call after calling this function since there is an
- * internal reference, or you may unref in the callback.
+ * The segments are sent through the #SoupSession of the proxy, so its
+ * limit on connections per host also limits the parallelism.  @file is
+ * always replaced, an existing file is not resumed.
  */
-gboolean
-rest_proxy_call_upload (RestProxyCall                *call,
-                        RestProxyCallUploadCallback   callback,
-                        GObject                      *weak_object,
-                        gpointer                      userdata,
-                        GError                      **error)
+void
+rest_proxy_call_download_segmented_async (RestProxyCall                 *call,
+                                          GFile                         *file,
+                                          guint                          n_segments,
+                                          RestProxyCallDownloadCallback  callback,
+                                          gpointer                       userdata,
+                                          GCancellable                  *cancellable,
+                                          GAsyncReadyCallback            ready_callback,
+                                          gpointer                       user_data)
 {
   RestProxyCallPrivate *priv = GET_PRIVATE (call);
-  SoupMessage *message;
-  RestProxyCallUploadClosure *closure;
+  RestProxyCallSegmentedClosure *closure;
+  SoupMessageHeaders *request_headers;
+  GError *error = NULL;
+  GTask *task;
 
-  g_return_val_if_fail (REST_IS_PROXY_CALL (call), FALSE);
+  g_return_if_fail (REST_IS_PROXY_CALL (call));
+  g_return_if_fail (G_IS_FILE (file));
+  g_return_if_fail (n_segments > 0);
+  g_return_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
   g_assert (priv->proxy);
 
-  if (priv->cur_call_closure)
-  {
-    g_warning (G_STRLOC ": re-use of RestProxyCall %p, don't do this", call);
-    return FALSE;
-  }
-
-  message = prepare_message (call, error);
-  if (message == NULL)
-    return FALSE;
-
-  closure = g_slice_new0 (RestProxyCallUploadClosure);
-  closure->call = g_object_ref (call);
+  closure = g_slice_new0 (RestProxyCallSegmentedClosure);
+  closure->file = g_object_ref (file);
+  closure->n_segments = n_segments;
   closure->callback = callback;
-  closure->weak_object = weak_object;
-  closure->message = message;
   closure->userdata = userdata;
-  closure->uploaded = 0;
 
-  priv->cur_call_closure = (RestProxyCallAsyncClosure *)closure;
+  /* Cancelled when a segment fails for good, or when the caller cancels */
+  closure->cancellable = g_cancellable_new ();
+  if (cancellable)
+    {
+      closure->user_cancellable = g_object_ref (cancellable);
+      closure->cancel_id = g_cancellable_connect (cancellable,
+                                                  G_CALLBACK (_segmented_cancelled_cb),
+                                                  closure->cancellable,
+                                                  NULL);
+    }
 
-  /* Weakly reference this object. We remove our callback if it goes away. */
-  if (closure->weak_object)
-  {
-    g_object_weak_ref (closure->weak_object,
-        (GWeakNotify)_call_async_weak_notify_cb,
-        closure);
-  }
+  task = new_call_task (call, cancellable, ready_callback, user_data);
+  g_task_set_source_tag (task, rest_proxy_call_download_segmented_async);
+  g_task_set_task_data (task, closure, (GDestroyNotify) rest_proxy_call_segmented_closure_free);
 
-  g_signal_connect (message,
-                    "wrote-body-data",
-                    (GCallback) _upload_call_message_wrote_data_cb,
-                    closure);
+  closure->prepared = prepare_message (call, &error);
+  if (closure->prepared == NULL)
+    {
+      g_task_return_error (task, error);
+      g_object_unref (task);
+      return;
+    }
 
-  _rest_proxy_queue_message (priv->proxy,
-                             message,
-                             priv->cancellable,
-                             _upload_call_message_completed_cb,
-                             closure);
-  return TRUE;
+  closure->message = copy_message (call, closure->prepared);
+#ifdef WITH_SOUP_2
+  request_headers = closure->message->request_headers;
+#else
+  request_headers = soup_message_get_request_headers (closure->message);
+#endif
+  soup_message_headers_set_range (request_headers, 0, 0);
+
+  _rest_proxy_send_message_async (priv->proxy,
+                                  closure->message,
+                                  closure->cancellable,
+                                  _segmented_probe_cb,
+                                  task);
+}
+
+/**
+ * rest_proxy_call_download_segmented_finish:
+ * @call: a #RestProxyCall
+ * @result: the result from the #GAsyncReadyCallback
+ * @error: optional #GError
+ *
+ * Returns: %TRUE if the whole body was written to the file
+ */
+gboolean
+rest_proxy_call_download_segmented_finish (RestProxyCall  *call,
+                                           GAsyncResult   *result,
+                                           GError        **error)
+{
+  g_return_val_if_fail (REST_IS_PROXY_CALL (call), FALSE);
+  g_return_val_if_fail (g_task_is_valid (result, call), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
 }
 
 /**
@@ -1381,9 +4401,24 @@ rest_proxy_call_cancel (RestProxyCall *call)
 
   closure = priv->cur_call_closure;
 
+  if (priv->event_source)
+    {
+      priv->event_source->stopped = TRUE;
+
+      /* Waiting to reconnect, so there is no request to cancel */
+      if (priv->event_source->reconnect_id)
+        {
+          g_autoptr(GError) error = g_error_new_literal (REST_PROXY_ERROR,
+                                                         REST_PROXY_ERROR_CANCELLED,
+                                                         "Cancelled");
+
+          _event_source_finish (priv->event_source, error);
+        }
+    }
+
   if (priv->cancellable)
     {
-      g_signal_handler_disconnect (priv->cancellable, priv->cancel_sig);
+      g_clear_signal_handler (&priv->cancel_sig, priv->cancellable);
 #ifndef WITH_SOUP_2
       if (!g_cancellable_is_cancelled (priv->cancellable))
               g_cancellable_cancel (priv->cancellable);
@@ -1401,6 +4436,68 @@ rest_proxy_call_cancel (RestProxyCall *call)
   return TRUE;
 }
 
+/**
+ * rest_proxy_call_reset:
+ * @call: The #RestProxyCall
+ *
+ * Reset @call so that it can be used for another request.  The method goes
+ * back to GET and the function, URL binding, headers, parameters and the
+ * response of the previous request are cleared.  The storage used for the
+ * headers and parameters is kept, so filling the call again is cheap.
+ * Subclasses clear their own state in #RestProxyCallClass.reset.
+ *
+ * A call that is still running cannot be reset, whichever function started
+ * it.  An asynchronous call runs until its callback has returned.
+ *
+ * Returns: %TRUE if @call was reset, %FALSE if it is still running
+ */
+gboolean
+rest_proxy_call_reset (RestProxyCall *call)
+{
+  RestProxyCallPrivate *priv = GET_PRIVATE (call);
+
+  g_return_val_if_fail (REST_IS_PROXY_CALL (call), FALSE);
+
+  if (priv->cur_call_closure || priv->event_source || priv->n_running_tasks > 0)
+    return FALSE;
+
+  if (priv->cancellable)
+    {
+      g_signal_handler_disconnect (priv->cancellable, priv->cancel_sig);
+      g_clear_object (&priv->cancellable);
+    }
+
+  if (g_strcmp0 (priv->method, "GET") != 0)
+    {
+      g_free (priv->method);
+      priv->method = g_strdup ("GET");
+    }
+
+  g_clear_pointer (&priv->function, g_free);
+  g_clear_pointer (&priv->bound_url, g_free);
+  g_clear_pointer (&priv->url, g_free);
+
+  g_array_set_size (priv->headers, 0);
+  _rest_params_clear (priv->params);
+  g_clear_pointer (&priv->body, g_bytes_unref);
+  g_clear_pointer (&priv->body_content_type, g_free);
+  g_clear_pointer (&priv->call_template, rest_call_template_unref);
+
+  set_response_message (priv, NULL);
+  g_clear_pointer (&priv->payload, g_bytes_unref);
+  g_clear_pointer (&priv->status_message, g_free);
+  priv->status_code = 0;
+
+  priv->continuous_framing = REST_PROXY_CALL_FRAMING_NONE;
+  g_clear_pointer (&priv->continuous_delimiter, g_free);
+  priv->continuous_buffer_size = READ_BUFFER_SIZE;
+
+  if (REST_PROXY_CALL_GET_CLASS (call)->reset)
+    REST_PROXY_CALL_GET_CLASS (call)->reset (call);
+
+  return TRUE;
+}
+
 /**
  * rest_proxy_call_sync:
  * @call: a #RestProxycall
@@ -1420,9 +4517,11 @@ rest_proxy_call_sync (RestProxyCall *call,
                       GError       **error_out)
 {
   RestProxyCallPrivate *priv = GET_PRIVATE (call);
-  SoupMessage *message;
+  SoupMessage *message, *response = NULL;
+  GError *error = NULL;
   gboolean ret;
   GBytes *payload;
+  guint attempt, delay;
 
   g_return_val_if_fail (REST_IS_PROXY_CALL (call), FALSE);
 
@@ -1430,15 +4529,36 @@ rest_proxy_call_sync (RestProxyCall *call,
   if (!message)
     return FALSE;
 
-  payload = _rest_proxy_send_message (priv->proxy, message, priv->cancellable, error_out);
+  for (attempt = 1; ; attempt++)
+    {
+      payload = _rest_proxy_send_message (priv->proxy, message, priv->cancellable, &response, &error);
+      if (!should_retry (call, message, payload ? response : NULL, error, attempt, &delay))
+        break;
+
+      if (payload)
+        {
+          g_clear_pointer (&payload, g_bytes_unref);
+          g_clear_object (&response);
+        }
+      g_clear_error (&error);
+
+      wait_for_retry (delay, priv->cancellable);
+      if (g_cancellable_set_error_if_cancelled (priv->cancellable, &error))
+        break;
+      rewind_message (message);
+    }
+
   if (!payload)
   {
+    g_propagate_error (error_out, error);
     g_object_unref (message);
     return FALSE;
   }
 
-  ret = finish_call (call, message, payload, error_out);
+  /* The response may come from the cache of the proxy */
+  ret = finish_call (call, response, payload, error_out);
 
+  g_object_unref (response);
   g_object_unref (message);
 
   return ret;
@@ -1450,43 +4570,208 @@ rest_proxy_call_sync (RestProxyCall *call,
  * @header: The name of the header to lookup.
  *
  * Get the string value of the header @header or %NULL if that header is not
- * present or there are no headers.
+ * present or there are no headers.  The name is matched case-insensitively.
+ * If the header appears more than once the last value is returned, see
+ * rest_proxy_call_response_headers_iter_init() to get all of them.
+ *
+ * Returns: (nullable): the header value. This string is owned by the
+ * #RestProxyCall and should not be freed.
  */
 const gchar *
 rest_proxy_call_lookup_response_header (RestProxyCall *call,
                                         const gchar   *header)
 {
   RestProxyCallPrivate *priv = GET_PRIVATE (call);
+  SoupMessageHeaders *headers;
 
   g_return_val_if_fail (REST_IS_PROXY_CALL (call), NULL);
+  g_return_val_if_fail (header != NULL, NULL);
 
-  if (!priv->response_headers)
-  {
+  headers = get_response_message_headers (priv);
+  if (!headers)
     return NULL;
-  }
 
-  return g_hash_table_lookup (priv->response_headers, header);
+  return soup_message_headers_get_one (headers, header);
+}
+
+/**
+ * rest_proxy_call_lookup_response_header_list:
+ * @call: The #RestProxyCall
+ * @header: The name of the header to lookup.
+ *
+ * Get all values of the header @header joined with ", ", as allowed for
+ * list-valued HTTP headers such as "Link".  The name is matched
+ * case-insensitively.
+ *
+ * Returns: (nullable): the header value, or %NULL if the header is not
+ * present. This string is owned by the #RestProxyCall and should not be
+ * freed.
+ */
+const gchar *
+rest_proxy_call_lookup_response_header_list (RestProxyCall *call,
+                                             const gchar   *header)
+{
+  RestProxyCallPrivate *priv = GET_PRIVATE (call);
+  SoupMessageHeaders *headers;
+
+  g_return_val_if_fail (REST_IS_PROXY_CALL (call), NULL);
+  g_return_val_if_fail (header != NULL, NULL);
+
+  headers = get_response_message_headers (priv);
+  if (!headers)
+    return NULL;
+
+  return soup_message_headers_get_list (headers, header);
+}
+
+G_STATIC_ASSERT (sizeof (SoupMessageHeadersIter) <= sizeof (((RestProxyCallHeadersIter *)NULL)->dummy));
+
+/**
+ * rest_proxy_call_response_headers_iter_init:
+ * @iter: an uninitialized #RestProxyCallHeadersIter
+ * @call: The #RestProxyCall
+ * @header: (nullable): the header name to iterate over, or %NULL for all
+ *   headers
+ *
+ * Initialize an iterator over the response headers of @call, in the order
+ * they were received.  If @header is given only the headers with that name,
+ * compared case-insensitively, are returned, so headers that appear several
+ * times such as "Set-Cookie" can be read one by one.  No strings are copied.
+ *
+ * The iterator becomes invalid when @call is reset or sent again.
+ */
+void
+rest_proxy_call_response_headers_iter_init (RestProxyCallHeadersIter *iter,
+                                            RestProxyCall            *call,
+                                            const gchar              *header)
+{
+  RestProxyCallPrivate *priv = GET_PRIVATE (call);
+  SoupMessageHeaders *headers;
+
+  g_return_if_fail (iter != NULL);
+  g_return_if_fail (REST_IS_PROXY_CALL (call));
+
+  iter->name = header;
+
+  headers = get_response_message_headers (priv);
+  iter->valid = headers != NULL;
+  if (headers)
+    soup_message_headers_iter_init ((SoupMessageHeadersIter *) iter->dummy, headers);
+}
+
+/**
+ * rest_proxy_call_response_headers_iter_next:
+ * @iter: an initialized #RestProxyCallHeadersIter
+ * @name: (out) (optional) (transfer none): a location to store the name
+ * @value: (out) (optional) (transfer none): a location to store the value
+ *
+ * Advances @iter to the next matching header.
+ *
+ * Returns: %FALSE if there are no more headers, %TRUE otherwise.
+ */
+gboolean
+rest_proxy_call_response_headers_iter_next (RestProxyCallHeadersIter  *iter,
+                                            const gchar              **name,
+                                            const gchar              **value)
+{
+  const char *cur_name;
+  const char *cur_value;
+
+  g_return_val_if_fail (iter != NULL, FALSE);
+
+  while (iter->valid)
+    {
+      if (!soup_message_headers_iter_next ((SoupMessageHeadersIter *) iter->dummy,
+                                           &cur_name, &cur_value))
+        {
+          iter->valid = FALSE;
+          break;
+        }
+
+      if (iter->name && g_ascii_strcasecmp (iter->name, cur_name) != 0)
+        continue;
+
+      if (name)
+        *name = cur_name;
+      if (value)
+        *value = cur_value;
+      return TRUE;
+    }
+
+  if (name)
+    *name = NULL;
+  if (value)
+    *value = NULL;
+  return FALSE;
+}
+
+static guint
+str_case_hash (gconstpointer key)
+{
+  const char *p = key;
+  guint h = 5381;
+
+  for (; *p; p++)
+    h = (h << 5) + h + g_ascii_tolower (*p);
+
+  return h;
+}
+
+static gboolean
+str_case_equal (gconstpointer a,
+                gconstpointer b)
+{
+  return g_ascii_strcasecmp (a, b) == 0;
+}
+
+static void
+_populate_headers_hash_table (const gchar *name,
+                              const gchar *value,
+                              gpointer     userdata)
+{
+  GHashTable *headers = (GHashTable *)userdata;
+
+  g_hash_table_insert (headers, g_strdup (name), g_strdup (value));
 }
 
 /**
  * rest_proxy_call_get_response_headers:
  * @call: The #RestProxyCall
  *
- * Returns: (transfer container) (element-type utf8 utf8): pointer to a hash
- * table of headers. This hash table must not be changed. You should call
- * g_hash_table_unref() when you have finished with it.
+ * Get a copy of the response headers as a hash table.  Header names are
+ * matched case-insensitively, and for headers that appear more than once
+ * only the last value is kept.  The table is only built when this function
+ * is first called; rest_proxy_call_lookup_response_header() and
+ * rest_proxy_call_response_headers_iter_init() read the headers without
+ * copying them.
+ *
+ * Returns: (transfer container) (element-type utf8 utf8) (nullable): pointer
+ * to a hash table of headers, or %NULL if there is no response yet. This hash
+ * table must not be changed. You should call g_hash_table_unref() when you
+ * have finished with it.
  */
 GHashTable *
 rest_proxy_call_get_response_headers (RestProxyCall *call)
 {
   RestProxyCallPrivate *priv = GET_PRIVATE (call);
+  SoupMessageHeaders *headers;
 
   g_return_val_if_fail (REST_IS_PROXY_CALL (call), NULL);
 
-  if (!priv->response_headers)
-  {
+  headers = get_response_message_headers (priv);
+  if (!headers)
     return NULL;
-  }
+
+  if (!priv->response_headers)
+    {
+      priv->response_headers = g_hash_table_new_full (str_case_hash,
+                                                      str_case_equal,
+                                                      g_free,
+                                                      g_free);
+      soup_message_headers_foreach (headers,
+                                    (SoupMessageHeadersForeachFunc)_populate_headers_hash_table,
+                                    priv->response_headers);
+    }
 
   return g_hash_table_ref (priv->response_headers);
 }
@@ -1594,6 +4879,69 @@ rest_proxy_call_serialize_params (RestProxyCall *call,
   return FALSE;
 }
 
+/**
+ * rest_proxy_call_serialize_params_stream:
+ * @call: The #RestProxyCall
+ * @content_type: (out): Content type of the payload
+ * @stream: (out) (transfer full): The payload
+ * @content_len: (out): Length of the payload, or -1 if it is unknown
+ * @error: a #GError, or %NULL
+ *
+ * Invoker for a virtual method to serialize the parameters for this
+ * #RestProxyCall as a stream.
+ *
+ * Returns: TRUE if the serialization was successful, FALSE otherwise.
+ */
+gboolean
+rest_proxy_call_serialize_params_stream (RestProxyCall  *call,
+                                         gchar         **content_type,
+                                         GInputStream  **stream,
+                                         goffset        *content_len,
+                                         GError        **error)
+{
+  RestProxyCallClass *call_class;
+
+  call_class = REST_PROXY_CALL_GET_CLASS (call);
+
+  if (call_class->serialize_params_stream)
+  {
+    return call_class->serialize_params_stream (call, content_type,
+                                                stream, content_len, error);
+  }
+
+  return FALSE;
+}
+
+RestProxy *
+_rest_proxy_call_get_proxy (RestProxyCall *call)
+{
+  return GET_PRIVATE (call)->proxy;
+}
+
+/* The proxy is construct-only for users of the API, but pooled calls drop
+ * their proxy while they sit in the pool so they don't keep it alive. */
+void
+_rest_proxy_call_set_proxy (RestProxyCall *call,
+                            RestProxy     *proxy)
+{
+  RestProxyCallPrivate *priv = GET_PRIVATE (call);
+
+  g_clear_object (&priv->proxy);
+  if (proxy)
+    priv->proxy = g_object_ref (proxy);
+}
+
+void
+_rest_proxy_call_set_template (RestProxyCall    *call,
+                               RestCallTemplate *call_template)
+{
+  RestProxyCallPrivate *priv = GET_PRIVATE (call);
+
+  g_clear_pointer (&priv->call_template, rest_call_template_unref);
+  if (call_template)
+    priv->call_template = rest_call_template_ref (call_template);
+}
+
 G_GNUC_INTERNAL const char *
 rest_proxy_call_get_url (RestProxyCall *call)
 {
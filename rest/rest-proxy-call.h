@@ -26,6 +26,7 @@
 #include <glib-object.h>
 #include <gio/gio.h>
 #include <rest/rest-params.h>
+#include <rest/rest-retry-policy.h>
 
 G_BEGIN_DECLS
 
@@ -44,6 +45,12 @@ G_DECLARE_DERIVABLE_TYPE (RestProxyCall, rest_proxy_call, REST, PROXY_CALL, GObj
  * call to be modified, for example to add a signature.
  * @serialize_params: Virtual function allowing custom serialization of the
  * parameters, for example when the API doesn't expect standard form content.
+ * @serialize_params_stream: Like @serialize_params, but produces the payload
+ * as a stream so that it doesn't have to be held in memory.  A @content_len
+ * of -1 means the length is unknown.  Takes precedence over
+ * @serialize_params.
+ * @reset: Virtual function called by rest_proxy_call_reset() once the call
+ * itself is reset, so that subclasses can clear their own state too.
  *
  * Class structure for #RestProxyCall for subclasses to implement specialised
  * behaviour.
@@ -58,10 +65,16 @@ struct _RestProxyCallClass {
                                 gchar **content,
                                 gsize *content_len,
                                 GError **error);
+  gboolean (*serialize_params_stream) (RestProxyCall *call,
+                                       gchar **content_type,
+                                       GInputStream **stream,
+                                       goffset *content_len,
+                                       GError **error);
+  void (*reset) (RestProxyCall *call);
 
   /*< private >*/
   /* padding for future expansion */
-  gpointer _padding_dummy[7];
+  gpointer _padding_dummy[5];
 };
 
 #define REST_PROXY_CALL_ERROR rest_proxy_call_error_quark ()
@@ -78,21 +91,90 @@ typedef enum {
 
 GQuark rest_proxy_call_error_quark (void);
 
+/**
+ * RestProxyCallFraming:
+ * @REST_PROXY_CALL_FRAMING_NONE: data is passed on as it is read
+ * @REST_PROXY_CALL_FRAMING_NEWLINE: records end with a newline, as in
+ *   newline delimited JSON.  A carriage return before the newline is
+ *   dropped, and empty lines are skipped.
+ * @REST_PROXY_CALL_FRAMING_DELIMITER: records end with a custom delimiter
+ * @REST_PROXY_CALL_FRAMING_LENGTH_PREFIX: records start with their length
+ *   as a 4 byte big endian integer
+ *
+ * How rest_proxy_call_continuous() splits the response into records.
+ */
+typedef enum {
+  REST_PROXY_CALL_FRAMING_NONE,
+  REST_PROXY_CALL_FRAMING_NEWLINE,
+  REST_PROXY_CALL_FRAMING_DELIMITER,
+  REST_PROXY_CALL_FRAMING_LENGTH_PREFIX
+} RestProxyCallFraming;
+
+/**
+ * RestProxyCallPriority:
+ * @REST_PROXY_CALL_PRIORITY_BACKGROUND: the call can wait for the others,
+ *   as a prefetch or a sync done in the background
+ * @REST_PROXY_CALL_PRIORITY_NORMAL: the default
+ * @REST_PROXY_CALL_PRIORITY_INTERACTIVE: someone waits for the call, which
+ *   goes before the others
+ *
+ * In which order calls waiting for their host are sent, see
+ * #RestProxy:max-host-requests.
+ */
+typedef enum {
+  REST_PROXY_CALL_PRIORITY_BACKGROUND,
+  REST_PROXY_CALL_PRIORITY_NORMAL,
+  REST_PROXY_CALL_PRIORITY_INTERACTIVE
+} RestProxyCallPriority;
+
 /* Functions for dealing with request */
 void rest_proxy_call_set_method (RestProxyCall *call,
                                  const gchar   *method);
 
 const char * rest_proxy_call_get_method (RestProxyCall *call);
 
+void rest_proxy_call_set_retry_policy (RestProxyCall   *call,
+                                       RestRetryPolicy *policy);
+
+RestRetryPolicy *rest_proxy_call_get_retry_policy (RestProxyCall *call);
+
+void rest_proxy_call_set_priority (RestProxyCall         *call,
+                                   RestProxyCallPriority  priority);
+
+RestProxyCallPriority rest_proxy_call_get_priority (RestProxyCall *call);
+
+void rest_proxy_call_set_queue_group (RestProxyCall *call,
+                                      const char    *group);
+
+const char * rest_proxy_call_get_queue_group (RestProxyCall *call);
+
+void rest_proxy_call_set_bandwidth_limits (RestProxyCall *call,
+                                           guint64        upload_rate,
+                                           guint64        download_rate);
+
+void rest_proxy_call_get_bandwidth_limits (RestProxyCall *call,
+                                           guint64       *upload_rate,
+                                           guint64       *download_rate);
+
 void rest_proxy_call_set_function (RestProxyCall *call,
                                    const gchar   *function);
 
 const char * rest_proxy_call_get_function (RestProxyCall *call);
 
+gboolean rest_proxy_call_bind (RestProxyCall *call,
+                               ...);
+
+gboolean rest_proxy_call_bind_valist (RestProxyCall *call,
+                                      va_list        params);
+
 void rest_proxy_call_add_header (RestProxyCall *call,
                                  const gchar   *header,
                                  const gchar   *value);
 
+void rest_proxy_call_add_header_static (RestProxyCall *call,
+                                        const gchar   *header,
+                                        const gchar   *value);
+
 G_GNUC_NULL_TERMINATED
 void rest_proxy_call_add_headers (RestProxyCall *call,
                                   ...);
@@ -128,6 +210,10 @@ void rest_proxy_call_remove_param (RestProxyCall *call,
 
 RestParams *rest_proxy_call_get_params (RestProxyCall *call);
 
+void rest_proxy_call_set_body (RestProxyCall *call,
+                               const gchar   *content_type,
+                               GBytes        *body);
+
 typedef void (*RestProxyCallAsyncCallback)(RestProxyCall *call,
                                            const GError  *error,
                                            GObject       *weak_object,
@@ -142,6 +228,15 @@ gboolean rest_proxy_call_invoke_finish (RestProxyCall *call,
                                         GAsyncResult  *result,
                                         GError       **error);
 
+void rest_proxy_call_invoke_stream_async (RestProxyCall       *call,
+                                          GCancellable        *cancellable,
+                                          GAsyncReadyCallback  callback,
+                                          gpointer             user_data);
+
+GInputStream *rest_proxy_call_invoke_stream_finish (RestProxyCall *call,
+                                                    GAsyncResult  *result,
+                                                    GError       **error);
+
 typedef void (*RestProxyCallContinuousCallback) (RestProxyCall *call,
                                                  const gchar   *buf,
                                                  gsize          len,
@@ -149,12 +244,33 @@ typedef void (*RestProxyCallContinuousCallback) (RestProxyCall *call,
                                                  GObject       *weak_object,
                                                  gpointer       userdata);
 
+void rest_proxy_call_set_continuous_framing (RestProxyCall        *call,
+                                             RestProxyCallFraming  framing,
+                                             const gchar          *delimiter);
+
+void rest_proxy_call_set_continuous_buffer_size (RestProxyCall *call,
+                                                 gsize          buffer_size);
+
 gboolean rest_proxy_call_continuous (RestProxyCall                    *call,
                                      RestProxyCallContinuousCallback   callback,
                                      GObject                          *weak_object,
                                      gpointer                          userdata,
                                      GError                          **error);
 
+typedef void (*RestProxyCallEventCallback) (RestProxyCall *call,
+                                            const gchar   *event,
+                                            const gchar   *data,
+                                            const gchar   *id,
+                                            const GError  *error,
+                                            GObject       *weak_object,
+                                            gpointer       userdata);
+
+gboolean rest_proxy_call_event_source (RestProxyCall               *call,
+                                       RestProxyCallEventCallback   callback,
+                                       GObject                     *weak_object,
+                                       gpointer                     userdata,
+                                       GError                     **error);
+
 typedef void (*RestProxyCallUploadCallback) (RestProxyCall *call,
                                              gsize          total,
                                              gsize          uploaded,
@@ -168,15 +284,74 @@ gboolean rest_proxy_call_upload (RestProxyCall                *call,
                                  gpointer                      userdata,
                                  GError                      **error);
 
+typedef void (*RestProxyCallDownloadCallback) (RestProxyCall *call,
+                                               goffset        total,
+                                               goffset        downloaded,
+                                               gpointer       userdata);
+
+void rest_proxy_call_download_to_file_async (RestProxyCall                 *call,
+                                             GFile                         *file,
+                                             RestProxyCallDownloadCallback  callback,
+                                             gpointer                       userdata,
+                                             GCancellable                  *cancellable,
+                                             GAsyncReadyCallback            ready_callback,
+                                             gpointer                       user_data);
+
+gboolean rest_proxy_call_download_to_file_finish (RestProxyCall  *call,
+                                                  GAsyncResult   *result,
+                                                  GError        **error);
+
+void rest_proxy_call_download_segmented_async (RestProxyCall                 *call,
+                                               GFile                         *file,
+                                               guint                          n_segments,
+                                               RestProxyCallDownloadCallback  callback,
+                                               gpointer                       userdata,
+                                               GCancellable                  *cancellable,
+                                               GAsyncReadyCallback            ready_callback,
+                                               gpointer                       user_data);
+
+gboolean rest_proxy_call_download_segmented_finish (RestProxyCall  *call,
+                                                    GAsyncResult   *result,
+                                                    GError        **error);
+
 gboolean rest_proxy_call_cancel (RestProxyCall *call);
 
+gboolean rest_proxy_call_reset (RestProxyCall *call);
+
 gboolean rest_proxy_call_sync (RestProxyCall *call, GError **error_out);
 
 /* Functions for dealing with responses */
 
+/**
+ * RestProxyCallHeadersIter:
+ *
+ * An iterator over the response headers of a #RestProxyCall, see
+ * rest_proxy_call_response_headers_iter_init().
+ */
+typedef struct _RestProxyCallHeadersIter RestProxyCallHeadersIter;
+
+struct _RestProxyCallHeadersIter
+{
+  /*< private >*/
+  gpointer dummy[3];
+  const gchar *name;
+  gboolean valid;
+};
+
 const gchar *rest_proxy_call_lookup_response_header (RestProxyCall *call,
                                                      const gchar   *header);
 
+const gchar *rest_proxy_call_lookup_response_header_list (RestProxyCall *call,
+                                                          const gchar   *header);
+
+void rest_proxy_call_response_headers_iter_init (RestProxyCallHeadersIter *iter,
+                                                 RestProxyCall            *call,
+                                                 const gchar              *header);
+
+gboolean rest_proxy_call_response_headers_iter_next (RestProxyCallHeadersIter  *iter,
+                                                     const gchar              **name,
+                                                     const gchar              **value);
+
 GHashTable *rest_proxy_call_get_response_headers (RestProxyCall *call);
 
 goffset rest_proxy_call_get_payload_length (RestProxyCall *call);
@@ -188,6 +363,11 @@ gboolean rest_proxy_call_serialize_params (RestProxyCall *call,
                                            gchar        **content,
                                            gsize         *content_len,
                                            GError       **error);
+gboolean rest_proxy_call_serialize_params_stream (RestProxyCall  *call,
+                                                  gchar         **content_type,
+                                                  GInputStream  **stream,
+                                                  goffset        *content_len,
+                                                  GError        **error);
 
 
 G_END_DECLS
@@ -29,25 +29,102 @@
 #include "rest-proxy-auth-private.h"
 #include "rest-proxy.h"
 #include "rest-private.h"
+#include "rest-proxy-call-private.h"
 
 
 typedef struct _RestProxyPrivate RestProxyPrivate;
 
+#define HEDGE_LATENCY_SAMPLES 128
+/* Below that the percentile means little, and hedge-delay is used */
+#define HEDGE_MIN_LATENCY_SAMPLES 16
+
 struct _RestProxyPrivate {
   gchar *url_format;
+  /* url_format split at each %s, or NULL if it needs printf */
+  gchar **url_segments;
+  gsize url_segments_len;
   gchar *url;
   gchar *user_agent;
   gchar *username;
   gchar *password;
   gboolean binding_required;
-  SoupSession *session;
   gboolean disable_cookies;
   char *ssl_ca_file;
-#ifndef WITH_SOUP_2
   gboolean ssl_strict;
+
+  /* Made on first use unless given or shared, guarded by session_lock */
+  GMutex session_lock;
+  SoupSession *session;
+  gboolean shared_session;
+  /* Whether the proxy made the session, and so configures it */
+  gboolean owns_session;
+#ifdef WITH_SOUP_2
+  gulong authenticate_id;
 #endif
+  guint max_conns;
+  guint max_conns_per_host;
+  guint idle_timeout;
+
+  GMutex call_pool_lock;
+  GPtrArray *call_pool;
+  guint call_pool_size;
+
+  /* Headers sent with every call, including the user agent */
+  GMutex default_headers_lock;
+  GArray *default_headers;
+
+  RestCache *cache;
+
+  gboolean coalesce_requests;
+  /* Requests in flight that identical calls wait for, by their key */
+  GRecMutex shared_requests_lock;
+  GHashTable *shared_requests;
+
+  RestRetryPolicy *retry_policy;
+  RestRetryBudget *retry_budget;
+
+  /* Requests in flight and waiting, by host, guarded by scheduler_lock */
+  GRecMutex scheduler_lock;
+  GHashTable *hosts;
+  guint max_host_requests;
+  gboolean adaptive_concurrency;
+  guint max_queue_time;
+  guint n_waiting;
+  guint64 n_dequeued;
+  gint64 queue_wait_time;
+
+  RestRateLimiter *rate_limiter;
+  /* Byte rates of the bodies of all the calls, by #RestBandwidthDirection */
+  RestBandwidthLimit *bandwidth_limits[2];
+
+  /* Hedging of slow calls, guarded by hedge_lock */
+  GMutex hedge_lock;
+  guint hedge_delay;
+  double hedge_percentile;
+  double hedge_budget;
+  guint64 hedgeable;
+  guint64 hedged;
+  guint64 hedges_won;
+  /* The latest latencies of calls, in a ring */
+  gint64 latencies[HEDGE_LATENCY_SAMPLES];
+  guint n_latencies;
+  guint next_latency;
 };
 
+#define DEFAULT_CALL_POOL_SIZE 16
+/* The defaults of libsoup */
+#define DEFAULT_MAX_CONNS 10
+#define DEFAULT_MAX_CONNS_PER_HOST 2
+#define DEFAULT_IDLE_TIMEOUT 60
+#define DEFAULT_CACHE_DIRECTORY_SIZE (64 * 1024 * 1024)
+#define DEFAULT_HEDGE_BUDGET 0.05
+/* The adaptive limit of a host starts there, and doesn't go over the other
+ * unless #RestProxy:max-host-requests is lower */
+#define ADAPTIVE_INITIAL_LIMIT 10
+#define ADAPTIVE_MAX_LIMIT 1000
+/* Responses after which the fastest of them becomes the baseline latency */
+#define ADAPTIVE_RTT_WINDOW 100
+
 
 G_DEFINE_TYPE_WITH_PRIVATE (RestProxy, rest_proxy, G_TYPE_OBJECT)
 
@@ -61,7 +138,26 @@ enum
   PROP_USERNAME,
   PROP_PASSWORD,
   PROP_SSL_STRICT,
-  PROP_SSL_CA_FILE
+  PROP_SSL_CA_FILE,
+  PROP_CALL_POOL_SIZE,
+  PROP_CACHE_SIZE,
+  PROP_CACHE_DIRECTORY,
+  PROP_CACHE_DIRECTORY_SIZE,
+  PROP_COALESCE_REQUESTS,
+  PROP_RETRY_POLICY,
+  PROP_HEDGE_DELAY,
+  PROP_HEDGE_PERCENTILE,
+  PROP_HEDGE_BUDGET,
+  PROP_MAX_HOST_REQUESTS,
+  PROP_ADAPTIVE_CONCURRENCY,
+  PROP_MAX_QUEUE_TIME,
+  PROP_UPLOAD_RATE,
+  PROP_DOWNLOAD_RATE,
+  PROP_SESSION,
+  PROP_SHARED_SESSION,
+  PROP_MAX_CONNS,
+  PROP_MAX_CONNS_PER_HOST,
+  PROP_IDLE_TIMEOUT
 };
 
 static gboolean       _rest_proxy_simple_run_valist (RestProxy  *proxy,
@@ -73,6 +169,15 @@ static RestProxyCall *_rest_proxy_new_call          (RestProxy  *proxy);
 static gboolean       _rest_proxy_bind_valist       (RestProxy  *proxy,
                                                      va_list     params);
 
+typedef struct _RestHostQueue RestHostQueue;
+
+static SoupSession   *rest_proxy_get_session        (RestProxy  *proxy);
+static void           rest_proxy_update_session     (RestProxy  *proxy,
+                                                     gboolean    tls_database);
+
+static void           rest_host_queue_free          (RestHostQueue *host);
+static void           rest_proxy_dispatch_hosts     (RestProxyPrivate *priv);
+
 /**
  * rest_proxy_error_quark:
  *
@@ -110,27 +215,128 @@ rest_proxy_get_property (GObject   *object,
     case PROP_PASSWORD:
       g_value_set_string (value, priv->password);
       break;
-    case PROP_SSL_STRICT: {
-#ifdef WITH_SOUP_2
-      gboolean ssl_strict;
-      g_object_get (G_OBJECT(priv->session),
-                    "ssl-strict", &ssl_strict,
-                    NULL);
-      g_value_set_boolean (value, ssl_strict);
-#else
+    case PROP_SSL_STRICT:
       g_value_set_boolean (value, priv->ssl_strict);
-#endif
       break;
-    }
     case PROP_SSL_CA_FILE:
       g_value_set_string (value, priv->ssl_ca_file);
       break;
+    case PROP_CALL_POOL_SIZE:
+      g_value_set_uint (value, priv->call_pool_size);
+      break;
+    case PROP_CACHE_SIZE:
+      g_value_set_uint64 (value, _rest_cache_get_max_size (priv->cache));
+      break;
+    case PROP_CACHE_DIRECTORY:
+      g_value_set_string (value, _rest_cache_get_dir (priv->cache));
+      break;
+    case PROP_CACHE_DIRECTORY_SIZE:
+      g_value_set_uint64 (value, _rest_cache_get_dir_max_size (priv->cache));
+      break;
+    case PROP_COALESCE_REQUESTS:
+      g_value_set_boolean (value, priv->coalesce_requests);
+      break;
+    case PROP_RETRY_POLICY:
+      g_value_set_object (value, priv->retry_policy);
+      break;
+    case PROP_HEDGE_DELAY:
+      g_value_set_uint (value, priv->hedge_delay);
+      break;
+    case PROP_HEDGE_PERCENTILE:
+      g_value_set_double (value, priv->hedge_percentile);
+      break;
+    case PROP_HEDGE_BUDGET:
+      g_value_set_double (value, priv->hedge_budget);
+      break;
+    case PROP_MAX_HOST_REQUESTS:
+      g_value_set_uint (value, priv->max_host_requests);
+      break;
+    case PROP_ADAPTIVE_CONCURRENCY:
+      g_value_set_boolean (value, priv->adaptive_concurrency);
+      break;
+    case PROP_MAX_QUEUE_TIME:
+      g_value_set_uint (value, priv->max_queue_time);
+      break;
+    case PROP_UPLOAD_RATE:
+      g_value_set_uint64 (value, _rest_bandwidth_limit_get_rate (priv->bandwidth_limits[REST_BANDWIDTH_UPLOAD]));
+      break;
+    case PROP_DOWNLOAD_RATE:
+      g_value_set_uint64 (value, _rest_bandwidth_limit_get_rate (priv->bandwidth_limits[REST_BANDWIDTH_DOWNLOAD]));
+      break;
+    case PROP_SESSION:
+      g_value_set_object (value, rest_proxy_get_session (self));
+      break;
+    case PROP_SHARED_SESSION:
+      g_value_set_boolean (value, priv->shared_session);
+      break;
+    case PROP_MAX_CONNS:
+      g_value_set_uint (value, priv->max_conns);
+      break;
+    case PROP_MAX_CONNS_PER_HOST:
+      g_value_set_uint (value, priv->max_conns_per_host);
+      break;
+    case PROP_IDLE_TIMEOUT:
+      g_value_set_uint (value, priv->idle_timeout);
+      break;
 
   default:
     G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
   }
 }
 
+/* Split @format into the literal text around each "%s" so binding only has to
+ * concatenate strings.  Returns %NULL if @format uses any other conversion,
+ * in which case binding falls back to printf. */
+static gchar **
+parse_url_format (const gchar *format,
+                  gsize       *literal_len)
+{
+  GPtrArray *segments;
+  GString *literal;
+  const gchar *p;
+
+  *literal_len = 0;
+
+  if (format == NULL)
+    return NULL;
+
+  segments = g_ptr_array_new_with_free_func (g_free);
+  literal = g_string_new (NULL);
+
+  for (p = format; *p; p++)
+    {
+      if (*p != '%')
+        {
+          g_string_append_c (literal, *p);
+        }
+      else if (p[1] == '%')
+        {
+          g_string_append_c (literal, '%');
+          p++;
+        }
+      else if (p[1] == 's')
+        {
+          *literal_len += literal->len;
+          g_ptr_array_add (segments, g_string_free (literal, FALSE));
+          literal = g_string_new (NULL);
+          p++;
+        }
+      else
+        {
+          g_string_free (literal, TRUE);
+          g_ptr_array_free (segments, TRUE);
+          *literal_len = 0;
+          return NULL;
+        }
+    }
+
+  *literal_len += literal->len;
+  g_ptr_array_add (segments, g_string_free (literal, FALSE));
+  g_ptr_array_add (segments, NULL);
+
+  return (gchar **) g_ptr_array_free (segments, FALSE);
+}
+
 static void
 rest_proxy_set_property (GObject      *object,
                          guint         property_id,
@@ -145,6 +351,10 @@ rest_proxy_set_property (GObject      *object,
       g_free (priv->url_format);
       priv->url_format = g_value_dup_string (value);
 
+      g_strfreev (priv->url_segments);
+      priv->url_segments = parse_url_format (priv->url_format,
+                                             &priv->url_segments_len);
+
       /* Clear the cached url */
       g_free (priv->url);
       priv->url = NULL;
@@ -159,6 +369,13 @@ rest_proxy_set_property (GObject      *object,
     case PROP_USER_AGENT:
       g_free (priv->user_agent);
       priv->user_agent = g_value_dup_string (value);
+
+      g_mutex_lock (&priv->default_headers_lock);
+      if (priv->user_agent)
+        _rest_headers_set (priv->default_headers, "User-Agent", priv->user_agent, TRUE);
+      else
+        _rest_headers_remove (priv->default_headers, "User-Agent");
+      g_mutex_unlock (&priv->default_headers_lock);
       break;
     case PROP_DISABLE_COOKIES:
       priv->disable_cookies = g_value_get_boolean (value);
@@ -172,17 +389,91 @@ rest_proxy_set_property (GObject      *object,
       priv->password = g_value_dup_string (value);
       break;
     case PROP_SSL_STRICT:
-#ifdef WITH_SOUP_2
-      g_object_set (G_OBJECT(priv->session),
-                    "ssl-strict", g_value_get_boolean (value),
-                    NULL);
-#else
       priv->ssl_strict = g_value_get_boolean (value);
-#endif
+      rest_proxy_update_session (self, FALSE);
       break;
     case PROP_SSL_CA_FILE:
       g_free(priv->ssl_ca_file);
       priv->ssl_ca_file = g_value_dup_string (value);
+      rest_proxy_update_session (self, TRUE);
+      break;
+    case PROP_CALL_POOL_SIZE:
+      g_mutex_lock (&priv->call_pool_lock);
+      priv->call_pool_size = g_value_get_uint (value);
+      if (priv->call_pool->len > priv->call_pool_size)
+        g_ptr_array_set_size (priv->call_pool, priv->call_pool_size);
+      g_mutex_unlock (&priv->call_pool_lock);
+      break;
+    case PROP_CACHE_SIZE:
+      _rest_cache_set_max_size (priv->cache, g_value_get_uint64 (value));
+      break;
+    case PROP_CACHE_DIRECTORY:
+      _rest_cache_set_dir (priv->cache, g_value_get_string (value));
+      break;
+    case PROP_CACHE_DIRECTORY_SIZE:
+      _rest_cache_set_dir_max_size (priv->cache, g_value_get_uint64 (value));
+      break;
+    case PROP_COALESCE_REQUESTS:
+      priv->coalesce_requests = g_value_get_boolean (value);
+      break;
+    case PROP_RETRY_POLICY:
+      g_set_object (&priv->retry_policy, g_value_get_object (value));
+      break;
+    case PROP_HEDGE_DELAY:
+      g_mutex_lock (&priv->hedge_lock);
+      priv->hedge_delay = g_value_get_uint (value);
+      g_mutex_unlock (&priv->hedge_lock);
+      break;
+    case PROP_HEDGE_PERCENTILE:
+      g_mutex_lock (&priv->hedge_lock);
+      priv->hedge_percentile = g_value_get_double (value);
+      g_mutex_unlock (&priv->hedge_lock);
+      break;
+    case PROP_HEDGE_BUDGET:
+      g_mutex_lock (&priv->hedge_lock);
+      priv->hedge_budget = g_value_get_double (value);
+      g_mutex_unlock (&priv->hedge_lock);
+      break;
+    case PROP_MAX_HOST_REQUESTS:
+      rest_proxy_set_max_host_requests (REST_PROXY (object), g_value_get_uint (value));
+      break;
+    case PROP_ADAPTIVE_CONCURRENCY:
+      g_rec_mutex_lock (&priv->scheduler_lock);
+      priv->adaptive_concurrency = g_value_get_boolean (value);
+      rest_proxy_dispatch_hosts (priv);
+      g_rec_mutex_unlock (&priv->scheduler_lock);
+      break;
+    case PROP_MAX_QUEUE_TIME:
+      g_rec_mutex_lock (&priv->scheduler_lock);
+      priv->max_queue_time = g_value_get_uint (value);
+      g_rec_mutex_unlock (&priv->scheduler_lock);
+      break;
+    case PROP_UPLOAD_RATE:
+      _rest_bandwidth_limit_set_rate (priv->bandwidth_limits[REST_BANDWIDTH_UPLOAD],
+                                      g_value_get_uint64 (value));
+      break;
+    case PROP_DOWNLOAD_RATE:
+      _rest_bandwidth_limit_set_rate (priv->bandwidth_limits[REST_BANDWIDTH_DOWNLOAD],
+                                      g_value_get_uint64 (value));
+      break;
+    case PROP_SESSION:
+      /* Construct-only, so it is set before anything uses the session */
+      priv->session = g_value_dup_object (value);
+      break;
+    case PROP_SHARED_SESSION:
+      priv->shared_session = g_value_get_boolean (value);
+      break;
+    case PROP_MAX_CONNS:
+      priv->max_conns = g_value_get_uint (value);
+      rest_proxy_update_session (self, FALSE);
+      break;
+    case PROP_MAX_CONNS_PER_HOST:
+      priv->max_conns_per_host = g_value_get_uint (value);
+      rest_proxy_update_session (self, FALSE);
+      break;
+    case PROP_IDLE_TIMEOUT:
+      priv->idle_timeout = g_value_get_uint (value);
+      rest_proxy_update_session (self, FALSE);
       break;
   default:
     G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
@@ -195,7 +486,20 @@ rest_proxy_dispose (GObject *object)
   RestProxy *self = REST_PROXY (object);
   RestProxyPrivate *priv = rest_proxy_get_instance_private (self);
 
+#ifdef WITH_SOUP_2
+  /* The session may outlive the proxy when it isn't its own */
+  if (priv->authenticate_id)
+    {
+      g_signal_handler_disconnect (priv->session, priv->authenticate_id);
+      priv->authenticate_id = 0;
+    }
+#endif
   g_clear_object (&priv->session);
+  g_clear_object (&priv->retry_policy);
+
+  g_mutex_lock (&priv->call_pool_lock);
+  g_ptr_array_set_size (priv->call_pool, 0);
+  g_mutex_unlock (&priv->call_pool_lock);
 
   G_OBJECT_CLASS (rest_proxy_parent_class)->dispose (object);
 }
@@ -215,6 +519,10 @@ authenticate (RestProxy   *self,
 
   g_assert (REST_IS_PROXY (self));
 
+  /* The messages of other proxies on a shared session aren't ours */
+  if (!priv->owns_session && g_object_get_data (G_OBJECT (msg), "rest-proxy") != self)
+    return;
+
   if (retrying)
     return;
 
@@ -223,15 +531,13 @@ authenticate (RestProxy   *self,
 #endif
 
 static void
-rest_proxy_constructed (GObject *object)
+add_session_features (SoupSession *session,
+                      gboolean     cookies)
 {
-  RestProxy *self = REST_PROXY (object);
-  RestProxyPrivate *priv = rest_proxy_get_instance_private (self);
-
-  if (!priv->disable_cookies) {
+  if (cookies) {
     SoupSessionFeature *cookie_jar =
       (SoupSessionFeature *)soup_cookie_jar_new ();
-    soup_session_add_feature (priv->session, cookie_jar);
+    soup_session_add_feature (session, cookie_jar);
     g_object_unref (cookie_jar);
   }
 
@@ -241,15 +547,123 @@ rest_proxy_constructed (GObject *object)
 #else
     SoupSessionFeature *logger = (SoupSessionFeature*)soup_logger_new (SOUP_LOGGER_LOG_HEADERS);
 #endif
-    soup_session_add_feature (priv->session, logger);
+    soup_session_add_feature (session, logger);
     g_object_unref (logger);
   }
+}
+
+/* Returns a new reference to the session the proxies made with
+ * #RestProxy:shared-session use, making it if none uses it yet.  Proxies
+ * with #RestProxy:disable-cookies set share one without a cookie jar. */
+static SoupSession *
+get_shared_session (gboolean cookies)
+{
+  static GMutex lock;
+  static GWeakRef shared[2];
+  SoupSession *session;
+
+  g_mutex_lock (&lock);
+
+  session = g_weak_ref_get (&shared[cookies]);
+  if (session == NULL)
+    {
+      session = soup_session_new ();
+      _rest_tls_database_set_lazy (session, NULL);
+      add_session_features (session, cookies);
+      g_weak_ref_set (&shared[cookies], session);
+    }
+
+  g_mutex_unlock (&lock);
+
+  return session;
+}
+
+/* Brings the session the proxy made in line with its properties, and with
+ * #RestProxy:ssl-ca-file as well if @tls_database.  Called with the session
+ * lock held. */
+static void
+configure_session (RestProxyPrivate *priv,
+                   gboolean          tls_database)
+{
+  /* libsoup 3 only takes the connection limits of a new session */
+  g_object_set (priv->session,
+#ifdef WITH_SOUP_2
+                "max-conns", priv->max_conns,
+                "max-conns-per-host", priv->max_conns_per_host,
+                "ssl-strict", priv->ssl_strict,
+#endif
+                "idle-timeout", priv->idle_timeout,
+                NULL);
+
+  if (tls_database)
+    _rest_tls_database_set_lazy (priv->session, priv->ssl_ca_file);
+}
+
+static void
+rest_proxy_update_session (RestProxy *proxy,
+                           gboolean   tls_database)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+
+  g_mutex_lock (&priv->session_lock);
+  if (priv->owns_session)
+    configure_session (priv, tls_database);
+  g_mutex_unlock (&priv->session_lock);
+}
+
+/* Returns the session of @proxy, making it on first use */
+static SoupSession *
+rest_proxy_get_session (RestProxy *proxy)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+  SoupSession *session;
+
+  g_mutex_lock (&priv->session_lock);
+
+  if (priv->session == NULL && priv->shared_session)
+    {
+      priv->session = get_shared_session (!priv->disable_cookies);
+    }
+  else if (priv->session == NULL)
+    {
+      priv->session = soup_session_new_with_options ("max-conns", priv->max_conns,
+                                                     "max-conns-per-host", priv->max_conns_per_host,
+                                                     NULL);
+      priv->owns_session = TRUE;
+      configure_session (priv, TRUE);
+      add_session_features (priv->session, !priv->disable_cookies);
+    }
+
+#ifdef WITH_SOUP_2
+  if (priv->authenticate_id == 0)
+    priv->authenticate_id = g_signal_connect_swapped (priv->session, "authenticate",
+                                                      G_CALLBACK (authenticate), proxy);
+#endif
+
+  session = priv->session;
+
+  g_mutex_unlock (&priv->session_lock);
+
+  return session;
+}
+
+/* Returns the session to send @message on for @proxy, with the TLS database
+ * it needs for it */
+static SoupSession *
+rest_proxy_get_message_session (RestProxy   *proxy,
+                                SoupMessage *message)
+{
+  SoupSession *session;
 
 #ifdef WITH_SOUP_2
-  /* session lifetime is same as self, no need to keep signalid */
-  g_signal_connect_swapped (priv->session, "authenticate",
-                            G_CALLBACK(authenticate), object);
+  /* Tells our messages from those of other proxies on the session */
+  g_object_set_data (G_OBJECT (message), "rest-proxy", proxy);
 #endif
+
+  session = rest_proxy_get_session (proxy);
+  _rest_tls_database_prepare (session, message);
+
+  return session;
 }
 
 static void
@@ -260,10 +674,32 @@ rest_proxy_finalize (GObject *object)
 
   g_free (priv->url);
   g_free (priv->url_format);
+  g_strfreev (priv->url_segments);
   g_free (priv->user_agent);
   g_free (priv->username);
   g_free (priv->password);
   g_free (priv->ssl_ca_file);
+  g_mutex_clear (&priv->session_lock);
+
+  g_ptr_array_unref (priv->call_pool);
+  g_mutex_clear (&priv->call_pool_lock);
+
+  g_array_unref (priv->default_headers);
+  g_mutex_clear (&priv->default_headers_lock);
+
+  _rest_cache_free (priv->cache);
+
+  g_hash_table_unref (priv->shared_requests);
+  g_rec_mutex_clear (&priv->shared_requests_lock);
+
+  _rest_retry_budget_free (priv->retry_budget);
+  g_mutex_clear (&priv->hedge_lock);
+
+  g_hash_table_unref (priv->hosts);
+  g_rec_mutex_clear (&priv->scheduler_lock);
+  _rest_rate_limiter_free (priv->rate_limiter);
+  _rest_bandwidth_limit_unref (priv->bandwidth_limits[REST_BANDWIDTH_UPLOAD]);
+  _rest_bandwidth_limit_unref (priv->bandwidth_limits[REST_BANDWIDTH_DOWNLOAD]);
 
   G_OBJECT_CLASS (rest_proxy_parent_class)->finalize (object);
 }
@@ -280,7 +716,6 @@ rest_proxy_class_init (RestProxyClass *klass)
   object_class->get_property = rest_proxy_get_property;
   object_class->set_property = rest_proxy_set_property;
   object_class->dispose = rest_proxy_dispose;
-  object_class->constructed = rest_proxy_constructed;
   object_class->finalize = rest_proxy_finalize;
 
   proxy_class->simple_run_valist = _rest_proxy_simple_run_valist;
@@ -350,6 +785,15 @@ rest_proxy_class_init (RestProxyClass *klass)
                                    PROP_SSL_STRICT,
                                    pspec);
 
+  /**
+   * RestProxy:ssl-ca-file:
+   *
+   * The file of the CA certificates the session made by the proxy trusts,
+   * rather than those of the system.  It is only read once the session
+   * opens a TLS connection, including one it is redirected to, and
+   * proxies using the same file share what was read.  A file modified
+   * since is read again for the next connection.
+   */
   pspec = g_param_spec_string ("ssl-ca-file",
                                "SSL CA file",
                                "File containing SSL CA certificates.",
@@ -358,66 +802,376 @@ rest_proxy_class_init (RestProxyClass *klass)
   g_object_class_install_property (object_class,
                                    PROP_SSL_CA_FILE,
                                    pspec);
-}
 
-static gboolean
-transform_ssl_ca_file_to_tls_database (GBinding     *binding,
-                                       const GValue *from_value,
-                                       GValue       *to_value,
-                                       gpointer      user_data)
-{
-  g_value_take_object (to_value,
-                       g_tls_file_database_new (g_value_get_string (from_value), NULL));
-  return TRUE;
-}
+  /**
+   * RestProxy:call-pool-size:
+   *
+   * The number of released calls the proxy keeps around for
+   * rest_proxy_acquire_call().  Setting it to 0 disables pooling.
+   */
+  pspec = g_param_spec_uint ("call-pool-size",
+                             "call-pool-size",
+                             "Number of idle calls kept for reuse",
+                             0, G_MAXUINT, DEFAULT_CALL_POOL_SIZE,
+                             G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class,
+                                   PROP_CALL_POOL_SIZE,
+                                   pspec);
 
-static gboolean
-transform_tls_database_to_ssl_ca_file (GBinding     *binding,
-                                       const GValue *from_value,
-                                       GValue       *to_value,
-                                       gpointer      user_data)
-{
-  GTlsDatabase *tls_database;
-  char *path = NULL;
+  /**
+   * RestProxy:cache-size:
+   *
+   * The number of bytes of responses the proxy keeps in memory to answer
+   * later GET calls with, see rest_proxy_set_cache_size().  0, the default,
+   * disables the cache.
+   */
+  pspec = g_param_spec_uint64 ("cache-size",
+                               "cache-size",
+                               "Size of the response cache in bytes",
+                               0, G_MAXSIZE, 0,
+                               G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class,
+                                   PROP_CACHE_SIZE,
+                                   pspec);
 
-  tls_database = g_value_get_object (from_value);
-  if (tls_database)
-    g_object_get (tls_database, "anchors", &path, NULL);
-  g_value_take_string (to_value, path);
-  return TRUE;
+  /**
+   * RestProxy:cache-directory:
+   *
+   * The directory the proxy stores responses to GET calls in, so they outlive
+   * it, or %NULL to only keep them in memory.  See
+   * rest_proxy_set_cache_directory().
+   */
+  pspec = g_param_spec_string ("cache-directory",
+                               "cache-directory",
+                               "Directory of the persistent response cache",
+                               NULL,
+                               G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class,
+                                   PROP_CACHE_DIRECTORY,
+                                   pspec);
+
+  /**
+   * RestProxy:cache-directory-size:
+   *
+   * The number of bytes of response bodies kept in
+   * #RestProxy:cache-directory.
+   */
+  pspec = g_param_spec_uint64 ("cache-directory-size",
+                               "cache-directory-size",
+                               "Size of the persistent response cache in bytes",
+                               0, G_MAXUINT64, DEFAULT_CACHE_DIRECTORY_SIZE,
+                               G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class,
+                                   PROP_CACHE_DIRECTORY_SIZE,
+                                   pspec);
+
+  /**
+   * RestProxy:coalesce-requests:
+   *
+   * Whether a GET or HEAD call waits for an identical request that is already
+   * in flight instead of sending its own.  Requests are identical when their
+   * method, URL with the parameters, and headers are.  Every call waiting
+   * for a request gets the same status, headers and payload.
+   *
+   * A call cancelled while it waits stops waiting; the request itself is
+   * only cancelled once no call waits for it.
+   */
+  pspec = g_param_spec_boolean ("coalesce-requests",
+                                "coalesce-requests",
+                                "Whether identical calls share one request",
+                                FALSE,
+                                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class,
+                                   PROP_COALESCE_REQUESTS,
+                                   pspec);
+
+  /**
+   * RestProxy:retry-policy:
+   *
+   * The #RestRetryPolicy deciding whether the calls of this proxy that fail
+   * are sent again, unless a call has its own #RestProxyCall:retry-policy.
+   * %NULL, the default, never retries.
+   */
+  pspec = g_param_spec_object ("retry-policy",
+                               "retry-policy",
+                               "How failed calls are retried",
+                               REST_TYPE_RETRY_POLICY,
+                               G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class,
+                                   PROP_RETRY_POLICY,
+                                   pspec);
+
+  /**
+   * RestProxy:hedge-delay:
+   *
+   * The milliseconds after which a call made with
+   * rest_proxy_call_invoke_async() that has not completed is sent a second
+   * time, the first response to arrive being used and the other request
+   * cancelled.  A transport error or a 5xx response waits for the other
+   * request instead.  Only calls with idempotent methods are hedged, and the
+   * second request is never coalesced with the first one, see
+   * #RestProxy:coalesce-requests.  0, the default, disables hedging unless
+   * #RestProxy:hedge-percentile is set.
+   */
+  pspec = g_param_spec_uint ("hedge-delay",
+                             "hedge-delay",
+                             "Milliseconds before a slow call is sent again",
+                             0, G_MAXUINT, 0,
+                             G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class,
+                                   PROP_HEDGE_DELAY,
+                                   pspec);
+
+  /**
+   * RestProxy:hedge-percentile:
+   *
+   * When not 0, calls are hedged once they take longer than this percentile
+   * of the latencies of the latest calls, 95 hedging the slowest 5% for
+   * instance.  #RestProxy:hedge-delay is used until enough calls were made.
+   */
+  pspec = g_param_spec_double ("hedge-percentile",
+                               "hedge-percentile",
+                               "Latency percentile after which calls are hedged",
+                               0.0, 100.0, 0.0,
+                               G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class,
+                                   PROP_HEDGE_PERCENTILE,
+                                   pspec);
+
+  /**
+   * RestProxy:hedge-budget:
+   *
+   * The largest part of the calls that may be hedged, which bounds the extra
+   * load hedging puts on the server.
+   */
+  pspec = g_param_spec_double ("hedge-budget",
+                               "hedge-budget",
+                               "Largest part of the calls that are hedged",
+                               0.0, 1.0, DEFAULT_HEDGE_BUDGET,
+                               G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class,
+                                   PROP_HEDGE_BUDGET,
+                                   pspec);
+
+  /**
+   * RestProxy:max-host-requests:
+   *
+   * The most requests sent to one host at a time by the asynchronous calls
+   * of this proxy.  Further calls wait in a queue, those with a higher
+   * priority first, see rest_proxy_call_set_priority(), and the calls of
+   * each group in turn within a priority, see
+   * rest_proxy_call_set_queue_group().  0, the default, doesn't limit them.
+   */
+  pspec = g_param_spec_uint ("max-host-requests",
+                             "max-host-requests",
+                             "Most requests in flight to one host",
+                             0, G_MAXUINT, 0,
+                             G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class,
+                                   PROP_MAX_HOST_REQUESTS,
+                                   pspec);
+
+  /**
+   * RestProxy:adaptive-concurrency:
+   *
+   * Whether the requests to each host are limited by how the host copes,
+   * rather than by #RestProxy:max-host-requests alone.  The limit of a host
+   * grows slowly while its responses come back fast, and shrinks quickly
+   * when they fail or take more than twice as long as the fastest ones
+   * lately, as requests then queue up on the host.  It never goes over
+   * #RestProxy:max-host-requests, when set.
+   */
+  pspec = g_param_spec_boolean ("adaptive-concurrency",
+                                "adaptive-concurrency",
+                                "Whether the requests to a host adapt to its latency",
+                                FALSE,
+                                G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class,
+                                   PROP_ADAPTIVE_CONCURRENCY,
+                                   pspec);
+
+  /**
+   * RestProxy:max-queue-time:
+   *
+   * The milliseconds a call may wait for its host before the host is deemed
+   * overloaded.  While the call waiting the longest has waited more than
+   * that, new calls that would have to wait fail at once with
+   * %REST_PROXY_ERROR_OVERLOADED instead of making the queue longer.  0,
+   * the default, never turns calls away.
+   */
+  pspec = g_param_spec_uint ("max-queue-time",
+                             "max-queue-time",
+                             "Milliseconds calls wait before new ones are turned away",
+                             0, G_MAXUINT, 0,
+                             G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class,
+                                   PROP_MAX_QUEUE_TIME,
+                                   pspec);
+
+  /**
+   * RestProxy:upload-rate:
+   *
+   * The most bytes per second of request bodies the asynchronous calls of
+   * this proxy send together.  The bodies are paced in small chunks rather
+   * than sent in bursts, so that other traffic on the link isn't starved.
+   * 0, the default, doesn't limit them.
+   */
+  pspec = g_param_spec_uint64 ("upload-rate",
+                               "upload-rate",
+                               "Most bytes per second of request bodies",
+                               0, G_MAXUINT64, 0,
+                               G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class,
+                                   PROP_UPLOAD_RATE,
+                                   pspec);
+
+  /**
+   * RestProxy:download-rate:
+   *
+   * The most bytes per second of response bodies the asynchronous calls of
+   * this proxy receive together, read as they are paced.  0, the default,
+   * doesn't limit them.
+   */
+  pspec = g_param_spec_uint64 ("download-rate",
+                               "download-rate",
+                               "Most bytes per second of response bodies",
+                               0, G_MAXUINT64, 0,
+                               G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class,
+                                   PROP_DOWNLOAD_RATE,
+                                   pspec);
+
+  /**
+   * RestProxy:session:
+   *
+   * The #SoupSession the proxy sends its calls on.  Unless one is given at
+   * construction, or #RestProxy:shared-session is set, the proxy makes its
+   * own the first time it needs it.
+   *
+   * A session given to the proxy is used as it is: the proxy adds no cookie
+   * jar to it, and #RestProxy:ssl-ca-file, #RestProxy:max-conns,
+   * #RestProxy:max-conns-per-host and #RestProxy:idle-timeout don't apply
+   * to it.  Proxies sharing a session share its connections, so keep-alive
+   * connections, TLS sessions and DNS lookups are reused across them.
+   */
+  pspec = g_param_spec_object ("session",
+                               "session",
+                               "The session calls are sent on",
+                               SOUP_TYPE_SESSION,
+                               G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class,
+                                   PROP_SESSION,
+                                   pspec);
+
+  /**
+   * RestProxy:shared-session:
+   *
+   * Whether the proxy sends its calls on the session all the proxies of the
+   * process with this property set share, rather than on one of its own.
+   * The shared session is made when first needed, with the defaults of
+   * libsoup, the system certificates and a cookie jar, and goes away with
+   * the last proxy using it.  Proxies with #RestProxy:disable-cookies set
+   * share a second session, without a cookie jar.  Like any session given
+   * to the proxy, the properties of the proxy that configure its session
+   * don't apply to it.
+   *
+   * Everything the session keeps is shared too: the cookies the servers set
+   * and the credentials libsoup caches once a server accepted them are used
+   * for the calls of every proxy on the session.  Proxies talking to the
+   * same server as different users must not share a session.
+   */
+  pspec = g_param_spec_boolean ("shared-session",
+                                "shared-session",
+                                "Whether to use the session shared by all proxies",
+                                FALSE,
+                                G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class,
+                                   PROP_SHARED_SESSION,
+                                   pspec);
+
+  /**
+   * RestProxy:max-conns:
+   *
+   * The most connections the session made by the proxy opens at a time.
+   * With libsoup 3 it only applies if set before the first call.
+   */
+  pspec = g_param_spec_uint ("max-conns",
+                             "max-conns",
+                             "Most connections open at a time",
+                             1, G_MAXUINT, DEFAULT_MAX_CONNS,
+                             G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class,
+                                   PROP_MAX_CONNS,
+                                   pspec);
+
+  /**
+   * RestProxy:max-conns-per-host:
+   *
+   * The most connections to one host the session made by the proxy opens
+   * at a time.  With libsoup 3 it only applies if set before the first
+   * call.
+   */
+  pspec = g_param_spec_uint ("max-conns-per-host",
+                             "max-conns-per-host",
+                             "Most connections to one host open at a time",
+                             1, G_MAXUINT, DEFAULT_MAX_CONNS_PER_HOST,
+                             G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class,
+                                   PROP_MAX_CONNS_PER_HOST,
+                                   pspec);
+
+  /**
+   * RestProxy:idle-timeout:
+   *
+   * The seconds the session made by the proxy keeps an unused connection
+   * open for the next call, 0 for as long as the server does.
+   */
+  pspec = g_param_spec_uint ("idle-timeout",
+                             "idle-timeout",
+                             "Seconds an idle connection is kept open",
+                             0, G_MAXUINT, DEFAULT_IDLE_TIMEOUT,
+                             G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+  g_object_class_install_property (object_class,
+                                   PROP_IDLE_TIMEOUT,
+                                   pspec);
 }
 
 static void
 rest_proxy_init (RestProxy *self)
 {
   RestProxyPrivate *priv = rest_proxy_get_instance_private (self);
-#ifdef REST_SYSTEM_CA_FILE
-  GTlsDatabase *tls_database;
-#endif
 
-#ifndef WITH_SOUP_2
   priv->ssl_strict = TRUE;
-#endif
 
-  priv->session = soup_session_new ();
-
-#ifdef REST_SYSTEM_CA_FILE
-  /* with ssl-strict (defaults TRUE) setting ssl-ca-file forces all
-   * certificates to be trusted */
-  tls_database = g_tls_file_database_new (REST_SYSTEM_CA_FILE, NULL);
-  if (tls_database) {
-          g_object_set (priv->session,
-                        "tls-database", tls_database,
-                        NULL);
-          g_object_unref (tls_database);
-  }
-#endif
-  g_object_bind_property_full (self, "ssl-ca-file",
-                               priv->session, "tls-database",
-                               G_BINDING_BIDIRECTIONAL,
-                               transform_ssl_ca_file_to_tls_database,
-                               transform_tls_database_to_ssl_ca_file,
-                               NULL, NULL);
+  g_mutex_init (&priv->session_lock);
+  priv->max_conns = DEFAULT_MAX_CONNS;
+  priv->max_conns_per_host = DEFAULT_MAX_CONNS_PER_HOST;
+  priv->idle_timeout = DEFAULT_IDLE_TIMEOUT;
+
+  g_mutex_init (&priv->call_pool_lock);
+  priv->call_pool = g_ptr_array_new_with_free_func (g_object_unref);
+  priv->call_pool_size = DEFAULT_CALL_POOL_SIZE;
+
+  priv->cache = _rest_cache_new ();
+  _rest_cache_set_dir_max_size (priv->cache, DEFAULT_CACHE_DIRECTORY_SIZE);
+
+  g_rec_mutex_init (&priv->shared_requests_lock);
+  priv->shared_requests = g_hash_table_new (g_str_hash, g_str_equal);
+
+  priv->retry_budget = _rest_retry_budget_new ();
+
+  g_mutex_init (&priv->hedge_lock);
+  priv->hedge_budget = DEFAULT_HEDGE_BUDGET;
+
+  g_rec_mutex_init (&priv->scheduler_lock);
+  priv->hosts = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                       g_free, (GDestroyNotify) rest_host_queue_free);
+  priv->rate_limiter = _rest_rate_limiter_new ();
+  priv->bandwidth_limits[REST_BANDWIDTH_UPLOAD] = _rest_bandwidth_limit_new ();
+  priv->bandwidth_limits[REST_BANDWIDTH_DOWNLOAD] = _rest_bandwidth_limit_new ();
+
+  g_mutex_init (&priv->default_headers_lock);
+  priv->default_headers = _rest_headers_new ();
 }
 
 /**
@@ -492,11 +1246,51 @@ _rest_proxy_bind_valist (RestProxy *proxy,
 
   g_free (priv->url);
 
-  priv->url = g_strdup_vprintf (priv->url_format, params);
+  priv->url = _rest_proxy_expand_url_valist (proxy, params);
 
   return TRUE;
 }
 
+/*
+ * _rest_proxy_expand_url_valist:
+ * @proxy: a #RestProxy
+ * @params: the values for the conversions in the URL format
+ *
+ * Expands the URL format of @proxy with @params without touching the URL
+ * bound on @proxy, so several calls can use different bindings at once.
+ *
+ * Returns: (transfer full): the expanded URL
+ */
+gchar *
+_rest_proxy_expand_url_valist (RestProxy *proxy,
+                               va_list    params)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+  GString *url;
+
+  g_return_val_if_fail (REST_IS_PROXY (proxy), NULL);
+  g_return_val_if_fail (priv->url_format != NULL, NULL);
+
+  if (priv->url_segments == NULL)
+    return g_strdup_vprintf (priv->url_format, params);
+
+  url = g_string_sized_new (priv->url_segments_len + 32);
+  for (gchar **segment = priv->url_segments; *segment; segment++)
+    {
+      g_string_append (url, *segment);
+
+      if (segment[1] != NULL)
+        {
+          const gchar *value = va_arg (params, const gchar *);
+
+          if (value)
+            g_string_append (url, value);
+        }
+    }
+
+  return g_string_free (url, FALSE);
+}
+
 
 gboolean
 rest_proxy_bind_valist (RestProxy *proxy,
@@ -543,167 +1337,1934 @@ rest_proxy_get_user_agent (RestProxy *proxy)
 }
 
 /**
- * rest_proxy_add_soup_feature:
+ * rest_proxy_add_default_header:
  * @proxy: The #RestProxy
- * @feature: A #SoupSessionFeature
- *
- * This method can be used to add specific features to the #SoupSession objects
- * that are used by librest for its HTTP connections. For example, if one needs
- * extensive control over the cookies which are used for the REST HTTP
- * communication, it's possible to get full access to libsoup cookie API by
- * using
- *
- *   <programlisting>
- *   RestProxy *proxy = g_object_new(REST_TYPE_PROXY,
- *                                   "url-format", url,
- *                                   "disable-cookies", TRUE,
- *                                   NULL);
- *   SoupSessionFeature *cookie_jar = SOUP_SESSION_FEATURE(soup_cookie_jar_new ());
- *   rest_proxy_add_soup_feature(proxy, cookie_jar);
- *   </programlisting>
+ * @header: The name of the header
+ * @value: The value of the header
  *
- * Since: 0.7.92
+ * Add a header that is sent with every call made through @proxy, replacing
+ * a previous default of the same name.  Headers added to a call take
+ * precedence over the defaults.  Setting "User-Agent" sets
+ * #RestProxy:user-agent.
  */
 void
-rest_proxy_add_soup_feature (RestProxy          *proxy,
+rest_proxy_add_default_header (RestProxy   *proxy,
+                               const gchar *header,
+                               const gchar *value)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+
+  g_return_if_fail (REST_IS_PROXY (proxy));
+  g_return_if_fail (header != NULL);
+  g_return_if_fail (value != NULL);
+
+  /* The property keeps the header */
+  if (g_ascii_strcasecmp (header, "User-Agent") == 0)
+    {
+      g_object_set (proxy, "user-agent", value, NULL);
+      return;
+    }
+
+  g_mutex_lock (&priv->default_headers_lock);
+  _rest_headers_set (priv->default_headers, header, value, TRUE);
+  g_mutex_unlock (&priv->default_headers_lock);
+}
+
+/**
+ * rest_proxy_remove_default_header:
+ * @proxy: The #RestProxy
+ * @header: The name of the header
+ *
+ * Remove a header added with rest_proxy_add_default_header().  Removing
+ * "User-Agent" unsets #RestProxy:user-agent.
+ */
+void
+rest_proxy_remove_default_header (RestProxy   *proxy,
+                                  const gchar *header)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+
+  g_return_if_fail (REST_IS_PROXY (proxy));
+  g_return_if_fail (header != NULL);
+
+  if (g_ascii_strcasecmp (header, "User-Agent") == 0)
+    {
+      g_object_set (proxy, "user-agent", NULL, NULL);
+      return;
+    }
+
+  g_mutex_lock (&priv->default_headers_lock);
+  _rest_headers_remove (priv->default_headers, header);
+  g_mutex_unlock (&priv->default_headers_lock);
+}
+
+void
+_rest_proxy_apply_default_headers (RestProxy          *proxy,
+                                   SoupMessageHeaders *message_headers)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+
+  g_mutex_lock (&priv->default_headers_lock);
+  _rest_headers_apply (priv->default_headers, message_headers);
+  g_mutex_unlock (&priv->default_headers_lock);
+}
+
+/**
+ * rest_proxy_add_soup_feature:
+ * @proxy: The #RestProxy
+ * @feature: A #SoupSessionFeature
+ *
+ * This method can be used to add specific features to the #SoupSession objects
+ * that are used by librest for its HTTP connections. For example, if one needs
+ * extensive control over the cookies which are used for the REST HTTP
+ * communication, it's possible to get full access to libsoup cookie API by
+ * using
+ *
+ *   <programlisting>
+ *   RestProxy *proxy = g_object_new(REST_TYPE_PROXY,
+ *                                   "url-format", url,
+ *                                   "disable-cookies", TRUE,
+ *                                   NULL);
+ *   SoupSessionFeature *cookie_jar = SOUP_SESSION_FEATURE(soup_cookie_jar_new ());
+ *   rest_proxy_add_soup_feature(proxy, cookie_jar);
+ *   </programlisting>
+ *
+ * When @proxy uses a session it shares, either given as #RestProxy:session
+ * or with #RestProxy:shared-session set, @feature is added to that session
+ * and applies to the calls of every proxy using it.
+ *
+ * Since: 0.7.92
+ */
+void
+rest_proxy_add_soup_feature (RestProxy          *proxy,
                              SoupSessionFeature *feature)
 {
   RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
 
-  g_return_if_fail (REST_IS_PROXY(proxy));
-  g_return_if_fail (feature != NULL);
-  g_return_if_fail (priv->session != NULL);
+  g_return_if_fail (REST_IS_PROXY(proxy));
+  g_return_if_fail (feature != NULL);
+
+  /* On a shared session the feature is there for all its proxies */
+  soup_session_add_feature (rest_proxy_get_session (proxy), feature);
+}
+
+static RestProxyCall *
+_rest_proxy_new_call (RestProxy *proxy)
+{
+  RestProxyCall *call;
+
+  call = g_object_new (REST_TYPE_PROXY_CALL,
+                       "proxy", proxy,
+                       NULL);
+
+  return call;
+}
+
+/**
+ * rest_proxy_new_call:
+ * @proxy: the #RestProxy
+ *
+ * Create a new #RestProxyCall for making a call to the web service.  This call
+ * is one-shot and should not be re-used for making multiple calls.
+ *
+ * Returns: (transfer full): a new #RestProxyCall.
+ */
+RestProxyCall *
+rest_proxy_new_call (RestProxy *proxy)
+{
+  RestProxyClass *proxy_class;
+
+  g_return_val_if_fail (REST_IS_PROXY (proxy), NULL);
+
+  proxy_class = REST_PROXY_GET_CLASS (proxy);
+  return proxy_class->new_call (proxy);
+}
+
+/**
+ * rest_proxy_acquire_call:
+ * @proxy: the #RestProxy
+ *
+ * Get a #RestProxyCall for making a call to the web service.  This behaves
+ * like rest_proxy_new_call(), but reuses a call given back with
+ * rest_proxy_release_call() if there is one, so issuing many requests does
+ * not create a new call object for each of them.
+ *
+ * Returns: (transfer full): a #RestProxyCall.
+ */
+RestProxyCall *
+rest_proxy_acquire_call (RestProxy *proxy)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+  RestProxyCall *call = NULL;
+
+  g_return_val_if_fail (REST_IS_PROXY (proxy), NULL);
+
+  g_mutex_lock (&priv->call_pool_lock);
+  if (priv->call_pool->len > 0)
+    call = g_ptr_array_steal_index_fast (priv->call_pool, priv->call_pool->len - 1);
+  g_mutex_unlock (&priv->call_pool_lock);
+
+  if (call)
+    {
+      _rest_proxy_call_set_proxy (call, proxy);
+      return call;
+    }
+
+  return rest_proxy_new_call (proxy);
+}
+
+/**
+ * rest_proxy_release_call:
+ * @proxy: the #RestProxy
+ * @call: (transfer full): a #RestProxyCall created by @proxy
+ *
+ * Give @call back to @proxy once it is finished with.  The call is reset with
+ * rest_proxy_call_reset() and kept for rest_proxy_acquire_call(), up to
+ * #RestProxy:call-pool-size calls.  A call that something else still holds
+ * a reference to, such as one that is still running, is only unreferenced.
+ */
+void
+rest_proxy_release_call (RestProxy     *proxy,
+                         RestProxyCall *call)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+
+  g_return_if_fail (REST_IS_PROXY (proxy));
+  g_return_if_fail (REST_IS_PROXY_CALL (call));
+  g_return_if_fail (_rest_proxy_call_get_proxy (call) == proxy);
+
+  /* Whoever holds the call would see it handed out again */
+  if (g_atomic_int_get (&G_OBJECT (call)->ref_count) > 1 ||
+      !rest_proxy_call_reset (call))
+    {
+      g_object_unref (call);
+      return;
+    }
+
+  /* Pooled calls don't reference the proxy, or the two would keep each
+   * other alive */
+  _rest_proxy_call_set_proxy (call, NULL);
+
+  g_mutex_lock (&priv->call_pool_lock);
+  if (priv->call_pool->len < priv->call_pool_size)
+    {
+      g_ptr_array_add (priv->call_pool, call);
+      call = NULL;
+    }
+  g_mutex_unlock (&priv->call_pool_lock);
+
+  if (call)
+    g_object_unref (call);
+}
+
+/**
+ * rest_proxy_set_cache_size:
+ * @proxy: the #RestProxy
+ * @max_size: the size of the cache in bytes, or 0 to disable it
+ *
+ * Keep up to @max_size bytes of responses to GET calls in memory.  A call
+ * whose response is stored and still fresh according to its Cache-Control or
+ * Expires headers completes without going to the server.  Once it is stale
+ * the call is sent with If-None-Match or If-Modified-Since, and the stored
+ * payload is used if the server answers that it has not changed.  A call
+ * that sends "Cache-Control: no-cache" or "max-age=0" itself is revalidated
+ * this way even while the stored response is fresh.
+ *
+ * Responses are keyed by method, URL with the parameters, and the request
+ * headers named by Vary.  The least recently used ones are dropped first
+ * when the cache is full.
+ */
+void
+rest_proxy_set_cache_size (RestProxy *proxy,
+                           gsize      max_size)
+{
+  g_return_if_fail (REST_IS_PROXY (proxy));
+
+  g_object_set (proxy, "cache-size", (guint64) max_size, NULL);
+}
+
+/**
+ * rest_proxy_get_cache_size:
+ * @proxy: the #RestProxy
+ *
+ * Returns: the size of the response cache in bytes, 0 if it is disabled.
+ */
+gsize
+rest_proxy_get_cache_size (RestProxy *proxy)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+
+  g_return_val_if_fail (REST_IS_PROXY (proxy), 0);
+
+  return _rest_cache_get_max_size (priv->cache);
+}
+
+/**
+ * rest_proxy_set_cache_directory:
+ * @proxy: the #RestProxy
+ * @directory: (nullable): the directory to store responses in, or %NULL
+ * @max_size: the size of the stored bodies in bytes
+ *
+ * Store responses to GET calls in @directory too, so a later proxy using the
+ * same directory can answer calls from them, under the same rules as the
+ * memory cache of rest_proxy_set_cache_size().  Stored payloads are mapped
+ * into memory instead of being read.  The responses used the least recently
+ * are removed once the bodies take more than @max_size bytes.
+ *
+ * Responses are written to @directory from a worker thread.  Only one proxy
+ * at a time can use @directory: it is locked for as long as a proxy uses it.
+ * A proxy that finds it locked only keeps responses in memory, and doesn't
+ * try the lock again until a directory is set on it again.
+ */
+void
+rest_proxy_set_cache_directory (RestProxy  *proxy,
+                                const char *directory,
+                                guint64     max_size)
+{
+  g_return_if_fail (REST_IS_PROXY (proxy));
+
+  g_object_set (proxy,
+                "cache-directory-size", max_size,
+                "cache-directory", directory,
+                NULL);
+}
+
+/**
+ * rest_proxy_clear_cache:
+ * @proxy: the #RestProxy
+ *
+ * Drop every response in the cache of @proxy, in memory and in
+ * #RestProxy:cache-directory.  The statistics are kept.
+ */
+void
+rest_proxy_clear_cache (RestProxy *proxy)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+
+  g_return_if_fail (REST_IS_PROXY (proxy));
+
+  _rest_cache_clear (priv->cache);
+}
+
+/**
+ * rest_proxy_get_cache_stats:
+ * @proxy: the #RestProxy
+ * @hits: (out) (optional): calls answered from the cache without a request
+ * @misses: (out) (optional): cacheable calls whose response was downloaded
+ * @revalidations: (out) (optional): calls answered from the cache after the
+ *   server confirmed the stored response
+ *
+ * Get how the cache of @proxy has done so far.
+ */
+void
+rest_proxy_get_cache_stats (RestProxy *proxy,
+                            guint64   *hits,
+                            guint64   *misses,
+                            guint64   *revalidations)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+
+  g_return_if_fail (REST_IS_PROXY (proxy));
+
+  _rest_cache_get_stats (priv->cache, hits, misses, revalidations);
+}
+
+/**
+ * rest_proxy_set_retry_policy:
+ * @proxy: the #RestProxy
+ * @policy: (nullable): a #RestRetryPolicy, or %NULL to never retry
+ *
+ * Set #RestProxy:retry-policy, which decides when calls that fail are sent
+ * again.  The calls of @proxy share one retry budget whatever their policy.
+ */
+void
+rest_proxy_set_retry_policy (RestProxy       *proxy,
+                             RestRetryPolicy *policy)
+{
+  g_return_if_fail (REST_IS_PROXY (proxy));
+  g_return_if_fail (policy == NULL || REST_IS_RETRY_POLICY (policy));
+
+  g_object_set (proxy, "retry-policy", policy, NULL);
+}
+
+/**
+ * rest_proxy_get_retry_policy:
+ * @proxy: the #RestProxy
+ *
+ * Returns: (transfer none) (nullable): the #RestRetryPolicy of @proxy, or
+ * %NULL if calls are not retried.
+ */
+RestRetryPolicy *
+rest_proxy_get_retry_policy (RestProxy *proxy)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+
+  g_return_val_if_fail (REST_IS_PROXY (proxy), NULL);
+
+  return priv->retry_policy;
+}
+
+/**
+ * rest_proxy_get_hedge_stats:
+ * @proxy: the #RestProxy
+ * @hedged: (out) (optional): calls that were sent a second time
+ * @won: (out) (optional): hedged calls answered by the second request
+ *
+ * Get how often hedging, see #RestProxy:hedge-delay, fired and paid off.
+ */
+void
+rest_proxy_get_hedge_stats (RestProxy *proxy,
+                            guint64   *hedged,
+                            guint64   *won)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+
+  g_return_if_fail (REST_IS_PROXY (proxy));
+
+  g_mutex_lock (&priv->hedge_lock);
+  if (hedged)
+    *hedged = priv->hedged;
+  if (won)
+    *won = priv->hedges_won;
+  g_mutex_unlock (&priv->hedge_lock);
+}
+
+static int
+compare_latencies (gconstpointer a,
+                   gconstpointer b,
+                   gpointer      user_data)
+{
+  gint64 latency_a = *(const gint64 *) a;
+  gint64 latency_b = *(const gint64 *) b;
+
+  return latency_a < latency_b ? -1 : latency_a > latency_b;
+}
+
+/* Returns the milliseconds after which a call is hedged, or -1 if it isn't */
+gint64
+_rest_proxy_get_hedge_delay (RestProxy *proxy)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+  gint64 delay = -1;
+
+  g_mutex_lock (&priv->hedge_lock);
+
+  if (priv->hedge_percentile > 0 && priv->n_latencies >= HEDGE_MIN_LATENCY_SAMPLES)
+    {
+      gint64 latencies[HEDGE_LATENCY_SAMPLES];
+      guint i;
+
+      memcpy (latencies, priv->latencies, priv->n_latencies * sizeof (gint64));
+      g_qsort_with_data (latencies, priv->n_latencies, sizeof (gint64),
+                         compare_latencies, NULL);
+      i = priv->hedge_percentile / 100 * (priv->n_latencies - 1);
+      delay = latencies[i] / G_TIME_SPAN_MILLISECOND;
+    }
+  else if (priv->hedge_delay > 0)
+    delay = priv->hedge_delay;
+
+  if (delay >= 0)
+    priv->hedgeable++;
+
+  g_mutex_unlock (&priv->hedge_lock);
+
+  return delay;
+}
+
+/* Whether the budget allows one more call to be hedged, which is counted */
+gboolean
+_rest_proxy_start_hedge (RestProxy *proxy)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+  gboolean allowed;
+
+  g_mutex_lock (&priv->hedge_lock);
+  allowed = priv->hedged + 1 <= priv->hedge_budget * priv->hedgeable;
+  if (allowed)
+    priv->hedged++;
+  g_mutex_unlock (&priv->hedge_lock);
+
+  return allowed;
+}
+
+/* Records the microseconds a call took, for #RestProxy:hedge-percentile */
+void
+_rest_proxy_record_latency (RestProxy *proxy,
+                            gint64     latency,
+                            gboolean   hedge_won)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+
+  g_mutex_lock (&priv->hedge_lock);
+
+  if (hedge_won)
+    priv->hedges_won++;
+
+  if (priv->hedge_percentile > 0)
+    {
+      priv->latencies[priv->next_latency] = latency;
+      priv->next_latency = (priv->next_latency + 1) % HEDGE_LATENCY_SAMPLES;
+      priv->n_latencies = MIN (priv->n_latencies + 1, HEDGE_LATENCY_SAMPLES);
+    }
+
+  g_mutex_unlock (&priv->hedge_lock);
+}
+
+RestRetryBudget *
+_rest_proxy_get_retry_budget (RestProxy *proxy)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+
+  return priv->retry_budget;
+}
+
+gboolean
+_rest_proxy_get_binding_required (RestProxy *proxy)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+
+  g_return_val_if_fail (REST_IS_PROXY (proxy), FALSE);
+
+  return priv->binding_required;
+}
+
+const gchar *
+_rest_proxy_get_bound_url (RestProxy *proxy)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+
+  g_return_val_if_fail (REST_IS_PROXY (proxy), NULL);
+
+  if (!priv->url && !priv->binding_required)
+    {
+      priv->url = g_strdup (priv->url_format);
+    }
+
+  return priv->url;
+}
+
+static gboolean
+_rest_proxy_simple_run_valist (RestProxy *proxy, 
+                               gchar     **payload, 
+                               goffset   *len,
+                               GError   **error,
+                               va_list    params)
+{
+  RestProxyCall *call;
+  gboolean ret;
+
+  g_return_val_if_fail (REST_IS_PROXY (proxy), FALSE);
+  g_return_val_if_fail (payload, FALSE);
+
+  call = rest_proxy_new_call (proxy);
+
+  rest_proxy_call_add_params_from_valist (call, params);
+
+  ret = rest_proxy_call_sync (call, error);
+  if (ret) {
+    *payload = g_strdup (rest_proxy_call_get_payload (call));
+    if (len) *len = rest_proxy_call_get_payload_length (call);
+  } else {
+    *payload = NULL;
+    if (len) *len = 0;
+  }
+ 
+  g_object_unref (call);
+
+  return ret;
+}
+
+gboolean
+rest_proxy_simple_run_valist (RestProxy *proxy, 
+                              char     **payload, 
+                              goffset   *len,
+                              GError   **error,
+                              va_list    params)
+{
+  RestProxyClass *proxy_class = REST_PROXY_GET_CLASS (proxy);
+  return proxy_class->simple_run_valist (proxy, payload, len, error, params);
+}
+
+gboolean
+rest_proxy_simple_run (RestProxy *proxy, 
+                       gchar    **payload,
+                       goffset   *len,
+                       GError   **error,
+                       ...)
+{
+  va_list params;
+  gboolean ret;
+
+  g_return_val_if_fail (REST_IS_PROXY (proxy), FALSE);
+  g_return_val_if_fail (payload, FALSE);
+
+  va_start (params, error);
+  ret = rest_proxy_simple_run_valist (proxy,
+                                      payload,
+                                      len,
+                                      error,
+                                      params);
+  va_end (params);
+
+  return ret;
+}
+
+/* Scheduling of the requests to each host, see #RestProxy:max-host-requests */
+
+#define N_PRIORITIES (SOUP_MESSAGE_PRIORITY_VERY_HIGH + 1)
+
+/* Called once the request may be sent, with the host whose slot it holds,
+ * or with an error if it was cancelled while waiting */
+typedef void (*RestScheduledFunc) (RestHostQueue *host,
+                                   GError        *error,
+                                   gpointer       user_data);
+
+struct _RestHostQueue {
+  guint active;
+  guint n_waiting;
+  guint64 n_rejected;
+  /* See #RestProxy:adaptive-concurrency */
+  double limit;
+  /* The fastest response lately, and the fastest of the current window */
+  gint64 min_rtt;
+  gint64 window_min_rtt;
+  guint n_samples;
+  /* When the limit was last decreased */
+  gint64 last_decrease;
+  /* For every priority, the groups with requests waiting, taking turns */
+  GQueue groups[N_PRIORITIES];
+};
+
+typedef struct {
+  char *name;
+  SoupMessagePriority priority;
+  GQueue waiting;
+} RestQueueGroup;
+
+typedef struct {
+  RestProxy *proxy;
+  SoupMessage *message;
+  RestHostQueue *host;
+  /* Set while the request waits */
+  RestQueueGroup *group;
+  gint64 queued_time;
+  GCancellable *cancellable;
+  gulong cancelled_id;
+  GMainContext *context;
+  /* Why the request won't be sent, when turned away */
+  GError *error;
+  RestScheduledFunc func;
+  gpointer user_data;
+} RestQueuedRequest;
+
+static void rest_proxy_release_host (RestProxy     *proxy,
+                                     RestHostQueue *host);
+
+static void
+rest_host_queue_free (RestHostQueue *host)
+{
+  /* Nothing waits once the proxy is gone */
+  g_free (host);
+}
+
+#ifdef WITH_SOUP_2
+static char *
+get_host_key (SoupURI *uri)
+{
+  return g_strdup_printf ("%s:%u", uri->host, uri->port);
+}
+#else
+static char *
+get_host_key (GUri *uri)
+{
+  int port = g_uri_get_port (uri);
+
+  if (port == -1)
+    port = g_strcmp0 (g_uri_get_scheme (uri), "https") == 0 ? 443 : 80;
+
+  return g_strdup_printf ("%s:%d", g_uri_get_host (uri), port);
+}
+#endif
+
+static const char *
+get_host_name (SoupMessage *message)
+{
+#ifdef WITH_SOUP_2
+  return soup_message_get_uri (message)->host;
+#else
+  return g_uri_get_host (soup_message_get_uri (message));
+#endif
+}
+
+/* Gives back the rate limit token of @message, which won't be sent */
+static void
+rest_proxy_refund_rate_limit (RestProxy   *proxy,
+                              SoupMessage *message)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+
+  _rest_rate_limiter_refund (priv->rate_limiter,
+                             get_host_name (message),
+                             g_object_get_data (G_OBJECT (message), "rest-function"));
+}
+
+/* Returns how many requests @host may have in flight, 0 if any number */
+static guint
+rest_host_queue_get_limit (RestProxyPrivate *priv,
+                           RestHostQueue    *host)
+{
+  guint limit;
+
+  if (!priv->adaptive_concurrency)
+    return priv->max_host_requests;
+
+  limit = (guint) host->limit;
+  if (priv->max_host_requests)
+    limit = MIN (limit, priv->max_host_requests);
+
+  return MAX (limit, 1);
+}
+
+static gboolean
+rest_host_queue_has_room (RestProxyPrivate *priv,
+                          RestHostQueue    *host)
+{
+  guint limit = rest_host_queue_get_limit (priv, host);
+
+  return limit == 0 || host->active < limit;
+}
+
+static gboolean
+queued_request_start_cb (gpointer user_data)
+{
+  RestQueuedRequest *queued = user_data;
+  GError *error = g_steal_pointer (&queued->error);
+
+  if (queued->cancellable)
+    g_cancellable_disconnect (queued->cancellable, queued->cancelled_id);
+
+  if (error == NULL &&
+      g_cancellable_set_error_if_cancelled (queued->cancellable, &error) &&
+      queued->host)
+    {
+      /* Cancelled as it was let through, the slot goes to the next one */
+      rest_proxy_release_host (queued->proxy, queued->host);
+      queued->host = NULL;
+    }
+
+  /* It never reaches the host, so it leaves the quota to others */
+  if (error)
+    rest_proxy_refund_rate_limit (queued->proxy, queued->message);
+
+  queued->func (queued->host, error, queued->user_data);
+
+  g_object_unref (queued->proxy);
+  g_object_unref (queued->message);
+  g_clear_object (&queued->cancellable);
+  g_main_context_unref (queued->context);
+  g_free (queued);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Runs @queued from its own main context, where it was scheduled */
+static void
+queued_request_start (RestQueuedRequest *queued)
+{
+  GSource *source;
+
+  source = g_idle_source_new ();
+  g_source_set_callback (source, queued_request_start_cb, queued, NULL);
+  g_source_attach (source, queued->context);
+  g_source_unref (source);
+}
+
+/* Returns when the request of @host waiting the longest was queued, or @now
+ * if none waits.  Called with the lock held. */
+static gint64
+rest_host_queue_get_oldest (RestHostQueue *host,
+                            gint64         now)
+{
+  gint64 oldest = now;
+
+  for (guint p = 0; p < N_PRIORITIES; p++)
+    {
+      for (GList *l = host->groups[p].head; l; l = l->next)
+        {
+          RestQueuedRequest *queued = g_queue_peek_head (&((RestQueueGroup *) l->data)->waiting);
+
+          oldest = MIN (oldest, queued->queued_time);
+        }
+    }
+
+  return oldest;
+}
+
+/* Takes the next waiting request of @host: the highest priority first, and
+ * within a priority, the groups in turn.  Called with the lock held. */
+static RestQueuedRequest *
+rest_host_queue_pop (RestProxyPrivate *priv,
+                     RestHostQueue    *host)
+{
+  for (int p = N_PRIORITIES - 1; p >= 0; p--)
+    {
+      RestQueueGroup *group = g_queue_pop_head (&host->groups[p]);
+      RestQueuedRequest *queued;
+
+      if (group == NULL)
+        continue;
+
+      queued = g_queue_pop_head (&group->waiting);
+      if (g_queue_is_empty (&group->waiting))
+        {
+          g_free (group->name);
+          g_free (group);
+        }
+      else
+        {
+          g_queue_push_tail (&host->groups[p], group);
+        }
+
+      queued->group = NULL;
+      host->n_waiting--;
+      priv->n_waiting--;
+      priv->n_dequeued++;
+      priv->queue_wait_time += g_get_monotonic_time () - queued->queued_time;
+
+      return queued;
+    }
+
+  return NULL;
+}
+
+/* Lets through the requests of @host that fit under the limit */
+static void
+rest_host_queue_dispatch (RestProxyPrivate *priv,
+                          RestHostQueue    *host)
+{
+  RestQueuedRequest *queued;
+
+  while (rest_host_queue_has_room (priv, host) &&
+         (queued = rest_host_queue_pop (priv, host)))
+    {
+      host->active++;
+      queued->host = host;
+      queued_request_start (queued);
+    }
+}
+
+static void
+queued_request_cancelled_cb (GCancellable      *cancellable,
+                             RestQueuedRequest *queued)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (queued->proxy);
+  RestQueueGroup *group;
+
+  g_rec_mutex_lock (&priv->scheduler_lock);
+
+  group = queued->group;
+  if (group == NULL)
+    {
+      /* Already let through */
+      g_rec_mutex_unlock (&priv->scheduler_lock);
+      return;
+    }
+
+  g_queue_remove (&group->waiting, queued);
+  if (g_queue_is_empty (&group->waiting))
+    {
+      g_queue_remove (&queued->host->groups[group->priority], group);
+      g_free (group->name);
+      g_free (group);
+    }
+  queued->group = NULL;
+  queued->host->n_waiting--;
+  queued->host = NULL;
+  priv->n_waiting--;
+
+  g_rec_mutex_unlock (&priv->scheduler_lock);
+
+  /* A handler cannot disconnect itself, so answer from the main loop */
+  queued_request_start (queued);
+}
+
+/* Queues @message for its host, see rest_proxy_schedule() */
+static void
+rest_proxy_enqueue (RestProxy         *proxy,
+                    SoupMessage       *message,
+                    GCancellable      *cancellable,
+                    RestScheduledFunc  func,
+                    gpointer           user_data)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+  SoupMessagePriority priority = soup_message_get_priority (message);
+  const char *name = g_object_get_data (G_OBJECT (message), "rest-queue-group");
+  RestQueuedRequest *queued;
+  RestQueueGroup *group = NULL;
+  RestHostQueue *host;
+  gint64 now;
+  char *key;
+
+  key = get_host_key (soup_message_get_uri (message));
+
+  g_rec_mutex_lock (&priv->scheduler_lock);
+
+  host = g_hash_table_lookup (priv->hosts, key);
+  if (host == NULL)
+    {
+      host = g_new0 (RestHostQueue, 1);
+      host->limit = ADAPTIVE_INITIAL_LIMIT;
+      g_hash_table_insert (priv->hosts, g_steal_pointer (&key), host);
+    }
+  g_free (key);
+
+  if (rest_host_queue_has_room (priv, host))
+    {
+      host->active++;
+      g_rec_mutex_unlock (&priv->scheduler_lock);
+      func (host, NULL, user_data);
+      return;
+    }
+
+  now = g_get_monotonic_time ();
+
+  queued = g_new0 (RestQueuedRequest, 1);
+  queued->proxy = g_object_ref (proxy);
+  queued->message = g_object_ref (message);
+  queued->queued_time = now;
+  queued->context = g_main_context_ref_thread_default ();
+  queued->func = func;
+  queued->user_data = user_data;
+
+  if (priv->max_queue_time &&
+      now - rest_host_queue_get_oldest (host, now) > priv->max_queue_time * G_TIME_SPAN_MILLISECOND)
+    {
+      host->n_rejected++;
+      g_rec_mutex_unlock (&priv->scheduler_lock);
+
+      queued->error = g_error_new (REST_PROXY_ERROR, REST_PROXY_ERROR_OVERLOADED,
+                                   "Too many requests are waiting for the host");
+      queued_request_start (queued);
+      return;
+    }
+
+  for (GList *l = host->groups[priority].head; l; l = l->next)
+    {
+      if (g_strcmp0 (((RestQueueGroup *) l->data)->name, name) == 0)
+        {
+          group = l->data;
+          break;
+        }
+    }
+
+  if (group == NULL)
+    {
+      group = g_new0 (RestQueueGroup, 1);
+      group->name = g_strdup (name);
+      group->priority = priority;
+      g_queue_push_tail (&host->groups[priority], group);
+    }
+
+  queued->host = host;
+  queued->group = group;
+  g_queue_push_tail (&group->waiting, queued);
+  host->n_waiting++;
+  priv->n_waiting++;
+
+  /* Called right away if already cancelled, hence the recursive lock */
+  if (cancellable)
+    {
+      queued->cancellable = g_object_ref (cancellable);
+      queued->cancelled_id = g_cancellable_connect (cancellable,
+                                                    G_CALLBACK (queued_request_cancelled_cb),
+                                                    queued, NULL);
+    }
+
+  g_rec_mutex_unlock (&priv->scheduler_lock);
+}
+
+/* A request held back by the rate limiter */
+typedef struct {
+  RestProxy *proxy;
+  SoupMessage *message;
+  GCancellable *cancellable;
+  RestScheduledFunc func;
+  gpointer user_data;
+} RestRateLimitedRequest;
+
+static gboolean
+rate_limited_request_ready_cb (GCancellable *cancellable,
+                               gpointer      user_data)
+{
+  RestRateLimitedRequest *limited = user_data;
+  GError *error = NULL;
+
+  if (g_cancellable_set_error_if_cancelled (limited->cancellable, &error))
+    {
+      /* It never reaches the host, so it leaves the quota to others */
+      rest_proxy_refund_rate_limit (limited->proxy, limited->message);
+      limited->func (NULL, error, limited->user_data);
+    }
+  else
+    rest_proxy_enqueue (limited->proxy, limited->message, limited->cancellable,
+                        limited->func, limited->user_data);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+rate_limited_request_free (RestRateLimitedRequest *limited)
+{
+  g_object_unref (limited->proxy);
+  g_object_unref (limited->message);
+  g_clear_object (&limited->cancellable);
+  g_free (limited);
+}
+
+/*
+ * Calls @func once @message may be sent without going over the rate limits
+ * or the requests allowed to its host, which may be at once.  The slot
+ * @func is given must be released with rest_proxy_release_host() when the
+ * request is over.
+ */
+static void
+rest_proxy_schedule (RestProxy         *proxy,
+                     SoupMessage       *message,
+                     GCancellable      *cancellable,
+                     RestScheduledFunc  func,
+                     gpointer           user_data)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+  RestRateLimitedRequest *limited;
+  GSource *source;
+  gint64 delay;
+
+  delay = _rest_rate_limiter_reserve (priv->rate_limiter,
+                                      get_host_name (message),
+                                      g_object_get_data (G_OBJECT (message), "rest-function"));
+  if (delay <= 0)
+    {
+      rest_proxy_enqueue (proxy, message, cancellable, func, user_data);
+      return;
+    }
+
+  limited = g_new0 (RestRateLimitedRequest, 1);
+  limited->proxy = g_object_ref (proxy);
+  limited->message = g_object_ref (message);
+  limited->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+  limited->func = func;
+  limited->user_data = user_data;
+
+  /* Wakes up early to give up if cancelled */
+  source = g_cancellable_source_new (cancellable);
+  g_source_set_ready_time (source, g_get_monotonic_time () + delay);
+  g_source_set_callback (source, (GSourceFunc) rate_limited_request_ready_cb,
+                         limited, (GDestroyNotify) rate_limited_request_free);
+  g_source_attach (source, g_main_context_get_thread_default ());
+  g_source_unref (source);
+}
+
+/**
+ * rest_proxy_set_rate_limit:
+ * @proxy: the #RestProxy
+ * @host: (nullable): the name of a host, or %NULL for any host without a
+ *   limit of its own
+ * @function: (nullable): a function, as given to
+ *   rest_proxy_call_set_function(), or %NULL for all the calls to the host
+ * @rate: the calls per second, 0 to remove the limit
+ * @burst: the most calls sent at once after a quiet time
+ *
+ * Limit the rate of the asynchronous calls of @proxy, which wait rather than
+ * go over it.  A call takes a token from the bucket of its host and, if its
+ * function has a limit, from the bucket of the function as well.
+ *
+ * The hosts are also listened to, whether they have a limit or not.  While a
+ * host says with X-RateLimit-Remaining that its quota is used up, calls to it
+ * wait for X-RateLimit-Reset; a 429 or 503 response with Retry-After holds
+ * them for that long.
+ *
+ * A call cancelled while it waits, for the rate limit or for room on its
+ * host, gives its token back, and so does a call turned away because too
+ * many wait for its host.
+ */
+void
+rest_proxy_set_rate_limit (RestProxy   *proxy,
+                           const gchar *host,
+                           const gchar *function,
+                           gdouble      rate,
+                           guint        burst)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+
+  g_return_if_fail (REST_IS_PROXY (proxy));
+  g_return_if_fail (rate >= 0);
+
+  _rest_rate_limiter_set_limit (priv->rate_limiter, host, function, rate, burst);
+}
+
+/**
+ * rest_proxy_set_bandwidth_limits:
+ * @proxy: the #RestProxy
+ * @upload_rate: the most bytes per second of request bodies, or 0
+ * @download_rate: the most bytes per second of response bodies, or 0
+ *
+ * Set #RestProxy:upload-rate and #RestProxy:download-rate at once.  The
+ * bodies of a call are also under the limits of the call, see
+ * rest_proxy_call_set_bandwidth_limits(), and those shared by all the
+ * proxies, see rest_proxy_set_global_bandwidth_limits().
+ *
+ * The calls made with rest_proxy_call_sync() aren't limited.
+ */
+void
+rest_proxy_set_bandwidth_limits (RestProxy *proxy,
+                                 guint64    upload_rate,
+                                 guint64    download_rate)
+{
+  g_return_if_fail (REST_IS_PROXY (proxy));
+
+  g_object_set (proxy,
+                "upload-rate", upload_rate,
+                "download-rate", download_rate,
+                NULL);
+}
+
+/**
+ * rest_proxy_get_bandwidth_limits:
+ * @proxy: the #RestProxy
+ * @upload_rate: (out) (optional): return location for #RestProxy:upload-rate
+ * @download_rate: (out) (optional): return location for
+ *   #RestProxy:download-rate
+ *
+ * Get the bandwidth limits of @proxy, 0 meaning none.
+ */
+void
+rest_proxy_get_bandwidth_limits (RestProxy *proxy,
+                                 guint64   *upload_rate,
+                                 guint64   *download_rate)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+
+  g_return_if_fail (REST_IS_PROXY (proxy));
+
+  if (upload_rate)
+    *upload_rate = _rest_bandwidth_limit_get_rate (priv->bandwidth_limits[REST_BANDWIDTH_UPLOAD]);
+  if (download_rate)
+    *download_rate = _rest_bandwidth_limit_get_rate (priv->bandwidth_limits[REST_BANDWIDTH_DOWNLOAD]);
+}
+
+/**
+ * rest_proxy_set_global_bandwidth_limits:
+ * @upload_rate: the most bytes per second of request bodies, or 0
+ * @download_rate: the most bytes per second of response bodies, or 0
+ *
+ * Limit the bytes per second moved by the asynchronous calls of all the
+ * proxies of the process together, whatever their own limits.  A rate of 0
+ * removes the limit.
+ */
+void
+rest_proxy_set_global_bandwidth_limits (guint64 upload_rate,
+                                        guint64 download_rate)
+{
+  _rest_bandwidth_limit_set_rate (_rest_bandwidth_get_global_limit (REST_BANDWIDTH_UPLOAD),
+                                  upload_rate);
+  _rest_bandwidth_limit_set_rate (_rest_bandwidth_get_global_limit (REST_BANDWIDTH_DOWNLOAD),
+                                  download_rate);
+}
+
+/* Returns the limits the body of @message going in @direction is under, or
+ * %NULL if it isn't */
+static GPtrArray *
+rest_proxy_get_message_bandwidth (RestProxy              *proxy,
+                                  SoupMessage            *message,
+                                  RestBandwidthDirection  direction)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+
+  return _rest_bandwidth_get_limits (message, direction, priv->bandwidth_limits[direction]);
+}
+
+/* Lets the rate limiter hear what the host said of its quota */
+static void
+rest_proxy_update_rate_limit (RestProxy   *proxy,
+                              SoupMessage *message)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+
+#ifdef WITH_SOUP_2
+  _rest_rate_limiter_update (priv->rate_limiter,
+                             get_host_name (message),
+                             message->status_code,
+                             message->response_headers);
+#else
+  _rest_rate_limiter_update (priv->rate_limiter,
+                             get_host_name (message),
+                             soup_message_get_status (message),
+                             soup_message_get_response_headers (message));
+#endif
+}
+
+/* Gives back the slot of a request to @host, letting the next one through */
+static void
+rest_proxy_release_host (RestProxy     *proxy,
+                         RestHostQueue *host)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+
+  g_rec_mutex_lock (&priv->scheduler_lock);
+  host->active--;
+  rest_host_queue_dispatch (priv, host);
+  g_rec_mutex_unlock (&priv->scheduler_lock);
+}
+
+/* Lets through what the limits allow now, on every host.  Called with the
+ * lock held. */
+static void
+rest_proxy_dispatch_hosts (RestProxyPrivate *priv)
+{
+  GHashTableIter iter;
+  RestHostQueue *host;
+
+  g_hash_table_iter_init (&iter, priv->hosts);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &host))
+    rest_host_queue_dispatch (priv, host);
+}
+
+/* Whether the response to @message, or @error, says the host struggles */
+static gboolean
+response_is_failure (SoupMessage  *message,
+                     const GError *error)
+{
+  guint status;
+
+  if (error)
+    return TRUE;
+
+#ifdef WITH_SOUP_2
+  status = message->status_code;
+  if (SOUP_STATUS_IS_TRANSPORT_ERROR (status))
+    return TRUE;
+#else
+  status = soup_message_get_status (message);
+#endif
+
+  return status == SOUP_STATUS_REQUEST_TIMEOUT ||
+         status == 429 || /* Too Many Requests */
+         status >= SOUP_STATUS_INTERNAL_SERVER_ERROR;
+}
+
+/*
+ * Adjusts the limit of @host to how it answered @message, sent at
+ * @send_time, in the way of AIMD congestion control: the limit grows by one
+ * for every round of responses that come back fast, and shrinks by a tenth
+ * once per round when they fail or are slow.  Requests sent before the last
+ * decrease saw the congestion it answered already, so they don't shrink the
+ * limit again.  Only limits that are used grow, so that a quiet host doesn't
+ * get a limit it never proved it can take.
+ */
+static void
+rest_proxy_sample_host (RestProxy     *proxy,
+                        RestHostQueue *host,
+                        gint64         send_time,
+                        SoupMessage   *message,
+                        const GError  *error)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+  gint64 rtt = g_get_monotonic_time () - send_time;
+  guint max_limit;
+
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    return;
+#ifdef WITH_SOUP_2
+  if (message->status_code == SOUP_STATUS_CANCELLED)
+    return;
+#endif
+
+  g_rec_mutex_lock (&priv->scheduler_lock);
+
+  if (!priv->adaptive_concurrency)
+    {
+      g_rec_mutex_unlock (&priv->scheduler_lock);
+      return;
+    }
+
+  /* The fastest of the previous window, so that the baseline follows a host
+   * that got slower for good */
+  if (host->min_rtt == 0 || rtt < host->min_rtt)
+    host->min_rtt = rtt;
+  if (host->window_min_rtt == 0 || rtt < host->window_min_rtt)
+    host->window_min_rtt = rtt;
+  if (++host->n_samples == ADAPTIVE_RTT_WINDOW)
+    {
+      host->min_rtt = host->window_min_rtt;
+      host->window_min_rtt = 0;
+      host->n_samples = 0;
+    }
+
+  max_limit = priv->max_host_requests ? priv->max_host_requests : ADAPTIVE_MAX_LIMIT;
+
+  if (response_is_failure (message, error) || rtt > host->min_rtt * 2)
+    {
+      if (send_time >= host->last_decrease)
+        {
+          host->limit = MAX (host->limit * 0.9, 1.0);
+          host->last_decrease = g_get_monotonic_time ();
+        }
+    }
+  else if (host->active * 2 >= host->limit)
+    host->limit = MIN (host->limit + 1.0 / host->limit, max_limit);
+
+  rest_host_queue_dispatch (priv, host);
+
+  g_rec_mutex_unlock (&priv->scheduler_lock);
+}
+
+/**
+ * rest_proxy_set_max_host_requests:
+ * @proxy: the #RestProxy
+ * @max_host_requests: the most requests to one host at a time, or 0
+ *
+ * Set #RestProxy:max-host-requests.  Raising it lets waiting calls through
+ * at once.
+ */
+void
+rest_proxy_set_max_host_requests (RestProxy *proxy,
+                                  guint      max_host_requests)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+
+  g_return_if_fail (REST_IS_PROXY (proxy));
+
+  g_rec_mutex_lock (&priv->scheduler_lock);
+  if (priv->max_host_requests == max_host_requests)
+    {
+      g_rec_mutex_unlock (&priv->scheduler_lock);
+      return;
+    }
+
+  priv->max_host_requests = max_host_requests;
+  rest_proxy_dispatch_hosts (priv);
+  g_rec_mutex_unlock (&priv->scheduler_lock);
+
+  g_object_notify (G_OBJECT (proxy), "max-host-requests");
+}
+
+/**
+ * rest_proxy_get_max_host_requests:
+ * @proxy: the #RestProxy
+ *
+ * Returns: the most requests sent to one host at a time, 0 if unlimited.
+ */
+guint
+rest_proxy_get_max_host_requests (RestProxy *proxy)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+
+  g_return_val_if_fail (REST_IS_PROXY (proxy), 0);
+
+  return priv->max_host_requests;
+}
+
+/**
+ * rest_proxy_get_queue_stats:
+ * @proxy: the #RestProxy
+ * @waiting: (out) (optional): calls waiting for their host now
+ * @dequeued: (out) (optional): calls that waited and were then sent
+ * @wait_time: (out) (optional): microseconds those calls waited in all
+ *
+ * Get how calls queue because of #RestProxy:max-host-requests.  Calls that
+ * didn't have to wait are not counted.
+ */
+void
+rest_proxy_get_queue_stats (RestProxy *proxy,
+                            guint     *waiting,
+                            guint64   *dequeued,
+                            gint64    *wait_time)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+
+  g_return_if_fail (REST_IS_PROXY (proxy));
+
+  g_rec_mutex_lock (&priv->scheduler_lock);
+  if (waiting)
+    *waiting = priv->n_waiting;
+  if (dequeued)
+    *dequeued = priv->n_dequeued;
+  if (wait_time)
+    *wait_time = priv->queue_wait_time;
+  g_rec_mutex_unlock (&priv->scheduler_lock);
+}
+
+/**
+ * rest_proxy_get_host_stats:
+ * @proxy: the #RestProxy
+ * @url: any URL of the host, such as the one of a call
+ * @limit: (out) (optional): the requests the host may have in flight now,
+ *   0 if any number
+ * @in_flight: (out) (optional): the requests in flight to the host
+ * @waiting: (out) (optional): the calls waiting for the host
+ * @rejected: (out) (optional): the calls turned away, see
+ *   #RestProxy:max-queue-time
+ *
+ * Get how the calls of @proxy to one host are scheduled, which shows how
+ * #RestProxy:adaptive-concurrency sees the host.
+ *
+ * Returns: %TRUE if @proxy made calls to the host of @url, %FALSE if not,
+ * in which case nothing is set.
+ */
+gboolean
+rest_proxy_get_host_stats (RestProxy   *proxy,
+                           const gchar *url,
+                           guint       *limit,
+                           guint       *in_flight,
+                           guint       *waiting,
+                           guint64     *rejected)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+  RestHostQueue *host;
+  char *key;
+#ifdef WITH_SOUP_2
+  SoupURI *uri;
+#else
+  GUri *uri;
+#endif
+
+  g_return_val_if_fail (REST_IS_PROXY (proxy), FALSE);
+  g_return_val_if_fail (url != NULL, FALSE);
+
+#ifdef WITH_SOUP_2
+  uri = soup_uri_new (url);
+  if (uri == NULL)
+    return FALSE;
+  key = get_host_key (uri);
+  soup_uri_free (uri);
+#else
+  uri = g_uri_parse (url, SOUP_HTTP_URI_FLAGS, NULL);
+  if (uri == NULL)
+    return FALSE;
+  key = get_host_key (uri);
+  g_uri_unref (uri);
+#endif
+
+  g_rec_mutex_lock (&priv->scheduler_lock);
+
+  host = g_hash_table_lookup (priv->hosts, key);
+  g_free (key);
+  if (host == NULL)
+    {
+      g_rec_mutex_unlock (&priv->scheduler_lock);
+      return FALSE;
+    }
+
+  if (limit)
+    *limit = rest_host_queue_get_limit (priv, host);
+  if (in_flight)
+    *in_flight = host->active;
+  if (waiting)
+    *waiting = host->n_waiting;
+  if (rejected)
+    *rejected = host->n_rejected;
+
+  g_rec_mutex_unlock (&priv->scheduler_lock);
+
+  return TRUE;
+}
+
+#ifndef WITH_SOUP_2
+static int
+get_io_priority (SoupMessage *message)
+{
+  SoupMessagePriority priority = soup_message_get_priority (message);
+
+  if (priority > SOUP_MESSAGE_PRIORITY_NORMAL)
+    return G_PRIORITY_HIGH;
+  if (priority < SOUP_MESSAGE_PRIORITY_NORMAL)
+    return G_PRIORITY_LOW;
+  return G_PRIORITY_DEFAULT;
+}
+#endif
+
+/* A request the calls asking for the same response wait for together, see
+ * #RestProxy:coalesce-requests */
+typedef struct {
+  char *key;
+  SoupMessage *message;
+  /* Cancels the request once no call waits for it any more */
+  GCancellable *cancellable;
+  GList *waiters;
+} RestSharedRequest;
+
+typedef struct {
+  RestProxy *proxy;
+  RestMessageFinishedCallback callback;
+  gpointer user_data;
+  /* The stored response and its body, when the cache answers, or the
+   * answer to a shared request for a call waiting in another context */
+  SoupMessage *response;
+  GBytes *body;
+  GError *error;
+  /* The shared request waited for, or sent when there is no callback */
+  RestSharedRequest *shared;
+  SoupMessage *message;
+  GCancellable *cancellable;
+  gulong cancelled_id;
+  /* Where a call waiting for a shared request is answered */
+  GMainContext *context;
+  /* The slot held for the request while it is sent, and since when */
+  RestHostQueue *host;
+  gint64 send_time;
+#ifndef WITH_SOUP_2
+  /* What the response body is read under, if limited */
+  GPtrArray *download_limits;
+#endif
+} RestMessageQueueData;
+
+static void
+rest_message_queue_data_free (RestMessageQueueData *data)
+{
+  g_object_unref (data->proxy);
+  g_clear_object (&data->response);
+  g_clear_pointer (&data->body, g_bytes_unref);
+  g_clear_error (&data->error);
+  g_clear_object (&data->message);
+  g_clear_object (&data->cancellable);
+  g_clear_pointer (&data->context, g_main_context_unref);
+#ifndef WITH_SOUP_2
+  g_clear_pointer (&data->download_limits, g_ptr_array_unref);
+#endif
+  g_free (data);
+}
+
+static void
+rest_shared_request_free (RestSharedRequest *shared)
+{
+  g_free (shared->key);
+  g_object_unref (shared->message);
+  g_object_unref (shared->cancellable);
+  g_free (shared);
+}
+
+static void
+append_key_header (const char *name,
+                   const char *value,
+                   gpointer    user_data)
+{
+  g_string_append_printf (user_data, "%s: %s\n", name, value);
+}
+
+/* Returns the key identical idempotent requests share, or %NULL if @message
+ * must be sent on its own */
+static char *
+get_shared_request_key (SoupMessage *message)
+{
+  const char *method;
+  GString *key;
+  char *uri;
+
+  /* A hedge races the request it copies, see RestProxy:hedge-delay */
+  if (g_object_get_data (G_OBJECT (message), "rest-hedge"))
+    return NULL;
+
+#ifdef WITH_SOUP_2
+  method = message->method;
+  uri = soup_uri_to_string (soup_message_get_uri (message), FALSE);
+#else
+  method = soup_message_get_method (message);
+  uri = g_uri_to_string (soup_message_get_uri (message));
+#endif
+
+  if (g_strcmp0 (method, SOUP_METHOD_GET) != 0 &&
+      g_strcmp0 (method, SOUP_METHOD_HEAD) != 0)
+    {
+      g_free (uri);
+      return NULL;
+    }
+
+  key = g_string_new (method);
+  g_string_append_printf (key, " %s\n", uri);
+#ifdef WITH_SOUP_2
+  soup_message_headers_foreach (message->request_headers, append_key_header, key);
+#else
+  soup_message_headers_foreach (soup_message_get_request_headers (message),
+                                append_key_header, key);
+#endif
+  g_free (uri);
+
+  return g_string_free (key, FALSE);
+}
+
+static gboolean
+shared_request_answer_idle_cb (gpointer user_data)
+{
+  RestMessageQueueData *waiter = user_data;
+
+  waiter->callback (waiter->response,
+                    g_steal_pointer (&waiter->body),
+                    g_steal_pointer (&waiter->error),
+                    waiter->user_data);
+  rest_message_queue_data_free (waiter);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+is_thread_default_context (GMainContext *context)
+{
+  GMainContext *current = g_main_context_ref_thread_default ();
+  gboolean same = current == context;
+
+  g_main_context_unref (current);
+
+  return same;
+}
+
+/* Hands the response to every call still waiting for @shared, in the
+ * context each one started from */
+static void
+shared_request_finished (RestProxy         *proxy,
+                         RestSharedRequest *shared,
+                         SoupMessage       *response,
+                         GBytes            *body,
+                         GError            *error)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+  GList *waiters;
+
+  g_rec_mutex_lock (&priv->shared_requests_lock);
+  if (g_hash_table_lookup (priv->shared_requests, shared->key) == shared)
+    g_hash_table_remove (priv->shared_requests, shared->key);
+  waiters = g_steal_pointer (&shared->waiters);
+  for (GList *l = waiters; l; l = l->next)
+    ((RestMessageQueueData *) l->data)->shared = NULL;
+  g_rec_mutex_unlock (&priv->shared_requests_lock);
+
+  for (GList *l = waiters; l; l = l->next)
+    {
+      RestMessageQueueData *waiter = l->data;
+
+      GSource *source;
+
+      if (waiter->cancellable)
+        g_cancellable_disconnect (waiter->cancellable, waiter->cancelled_id);
+
+      /* Every call gets the same payload, and its own error */
+      if (is_thread_default_context (waiter->context))
+        {
+          waiter->callback (response,
+                            body ? g_bytes_ref (body) : NULL,
+                            error ? g_error_copy (error) : NULL,
+                            waiter->user_data);
+          rest_message_queue_data_free (waiter);
+          continue;
+        }
+
+      g_set_object (&waiter->response, response);
+      waiter->body = body ? g_bytes_ref (body) : NULL;
+      waiter->error = error ? g_error_copy (error) : NULL;
+
+      source = g_idle_source_new ();
+      g_source_set_callback (source, shared_request_answer_idle_cb, waiter, NULL);
+      g_source_attach (source, waiter->context);
+      g_source_unref (source);
+    }
+
+  g_list_free (waiters);
+  g_clear_pointer (&body, g_bytes_unref);
+  g_clear_error (&error);
+  rest_shared_request_free (shared);
+}
+
+static gboolean
+shared_request_cancelled_idle_cb (gpointer user_data)
+{
+  RestMessageQueueData *waiter = user_data;
+  GError *error = NULL;
+
+  g_cancellable_disconnect (waiter->cancellable, waiter->cancelled_id);
+  g_cancellable_set_error_if_cancelled (waiter->cancellable, &error);
+  waiter->callback (waiter->message, NULL, error, waiter->user_data);
+  rest_message_queue_data_free (waiter);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* A call stops waiting for a shared request, which is cancelled in turn if
+ * it was the last one */
+static void
+shared_request_cancelled_cb (GCancellable *cancellable,
+                             gpointer      user_data)
+{
+  RestMessageQueueData *waiter = user_data;
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (waiter->proxy);
+  RestSharedRequest *shared;
+  GCancellable *abandoned = NULL;
+  SoupMessage *abandoned_message = NULL;
+  GSource *source;
+
+  g_rec_mutex_lock (&priv->shared_requests_lock);
+
+  shared = waiter->shared;
+  if (shared == NULL)
+    {
+      /* Already answered */
+      g_rec_mutex_unlock (&priv->shared_requests_lock);
+      return;
+    }
+
+  shared->waiters = g_list_remove (shared->waiters, waiter);
+  waiter->shared = NULL;
+
+  if (shared->waiters == NULL)
+    {
+      /* Later calls must not wait for a request about to be cancelled */
+      if (g_hash_table_lookup (priv->shared_requests, shared->key) == shared)
+        g_hash_table_remove (priv->shared_requests, shared->key);
+      abandoned = g_object_ref (shared->cancellable);
+      abandoned_message = g_object_ref (shared->message);
+    }
+
+  g_rec_mutex_unlock (&priv->shared_requests_lock);
+
+  if (abandoned)
+    {
+      /* Drops the request if it still waits for its host */
+      g_cancellable_cancel (abandoned);
+#ifdef WITH_SOUP_2
+      soup_session_cancel_message (rest_proxy_get_session (waiter->proxy), abandoned_message,
+                                   SOUP_STATUS_CANCELLED);
+#endif
+      g_object_unref (abandoned);
+      g_object_unref (abandoned_message);
+    }
+
+  /* A handler cannot disconnect itself, so answer from the main loop */
+  source = g_idle_source_new ();
+  g_source_set_callback (source, shared_request_cancelled_idle_cb, waiter, NULL);
+  g_source_attach (source, waiter->context);
+  g_source_unref (source);
+}
+
+/* Hands the response to @message to the callback, after letting the cache
+ * see it and maybe swap in a stored one */
+static void
+message_finished (RestMessageQueueData *data,
+                  SoupMessage          *message,
+                  GBytes               *body,
+                  GError               *error)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (data->proxy);
+  SoupMessage *response;
+
+  if (data->host)
+    {
+      rest_proxy_sample_host (data->proxy, data->host, data->send_time, message, error);
+      rest_proxy_release_host (data->proxy, g_steal_pointer (&data->host));
+    }
+
+  if (error == NULL)
+    rest_proxy_update_rate_limit (data->proxy, message);
+
+  if (error == NULL)
+    data->response = _rest_cache_store (priv->cache, message, &body);
+
+  response = data->response ? data->response : message;
+  if (data->shared)
+    shared_request_finished (data->proxy, data->shared, response, body, error);
+  else
+    data->callback (response, body, error, data->user_data);
 
-  soup_session_add_feature (priv->session, feature);
+  rest_message_queue_data_free (data);
 }
 
-static RestProxyCall *
-_rest_proxy_new_call (RestProxy *proxy)
+static gboolean
+cached_message_finished_cb (gpointer user_data)
 {
-  RestProxyCall *call;
+  RestMessageQueueData *data = user_data;
 
-  call = g_object_new (REST_TYPE_PROXY_CALL,
-                       "proxy", proxy,
-                       NULL);
+  data->callback (data->response, g_steal_pointer (&data->body), NULL, data->user_data);
+  rest_message_queue_data_free (data);
 
-  return call;
+  return G_SOURCE_REMOVE;
 }
 
-/**
- * rest_proxy_new_call:
- * @proxy: the #RestProxy
- *
- * Create a new #RestProxyCall for making a call to the web service.  This call
- * is one-shot and should not be re-used for making multiple calls.
- *
- * Returns: (transfer full): a new #RestProxyCall.
+#ifdef WITH_SOUP_2
+/*
+ * Paces the bodies of a message sent by libsoup 2, which reads and writes
+ * them itself: the message is paused after each chunk until the limits
+ * allow the next one.
  */
-RestProxyCall *
-rest_proxy_new_call (RestProxy *proxy)
+typedef struct {
+  SoupSession *session;
+  SoupMessage *message;
+  /* By #RestBandwidthDirection, %NULL when not limited */
+  GPtrArray *limits[2];
+  GSource *source;
+} RestShapedMessage;
+
+static void
+rest_shaped_message_free (RestShapedMessage *shaped)
 {
-  RestProxyClass *proxy_class;
+  g_signal_handlers_disconnect_by_data (shaped->message, shaped);
+  if (shaped->source)
+    {
+      g_source_destroy (shaped->source);
+      g_source_unref (shaped->source);
+    }
+  g_clear_pointer (&shaped->limits[REST_BANDWIDTH_UPLOAD], g_ptr_array_unref);
+  g_clear_pointer (&shaped->limits[REST_BANDWIDTH_DOWNLOAD], g_ptr_array_unref);
+  g_object_unref (shaped->session);
+  g_free (shaped);
+}
 
-  g_return_val_if_fail (REST_IS_PROXY (proxy), NULL);
+static gboolean
+shaped_message_resume_cb (GCancellable *cancellable,
+                          gpointer      user_data)
+{
+  RestShapedMessage *shaped = user_data;
 
-  proxy_class = REST_PROXY_GET_CLASS (proxy);
-  return proxy_class->new_call (proxy);
+  g_clear_pointer (&shaped->source, g_source_unref);
+  soup_session_unpause_message (shaped->session, shaped->message);
+
+  return G_SOURCE_REMOVE;
 }
 
-gboolean
-_rest_proxy_get_binding_required (RestProxy *proxy)
+static void
+shaped_message_pace (RestShapedMessage      *shaped,
+                     RestBandwidthDirection  direction,
+                     gsize                   bytes)
 {
-  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+  gint64 delay;
 
-  g_return_val_if_fail (REST_IS_PROXY (proxy), FALSE);
+  delay = _rest_bandwidth_reserve (shaped->limits[direction], bytes);
+  if (delay <= 0 || shaped->source)
+    return;
 
-  return priv->binding_required;
+  soup_session_pause_message (shaped->session, shaped->message);
+  shaped->source = g_cancellable_source_new (NULL);
+  g_source_set_ready_time (shaped->source, g_get_monotonic_time () + delay);
+  g_source_set_callback (shaped->source, (GSourceFunc) shaped_message_resume_cb,
+                         shaped, NULL);
+  g_source_attach (shaped->source, g_main_context_get_thread_default ());
 }
 
-const gchar *
-_rest_proxy_get_bound_url (RestProxy *proxy)
+static void
+shaped_message_wrote_body_data_cb (SoupMessage       *message,
+                                   SoupBuffer        *chunk,
+                                   RestShapedMessage *shaped)
 {
-  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+  shaped_message_pace (shaped, REST_BANDWIDTH_UPLOAD, chunk->length);
+}
 
-  g_return_val_if_fail (REST_IS_PROXY (proxy), NULL);
+static void
+shaped_message_got_chunk_cb (SoupMessage       *message,
+                             SoupBuffer        *chunk,
+                             RestShapedMessage *shaped)
+{
+  shaped_message_pace (shaped, REST_BANDWIDTH_DOWNLOAD, chunk->length);
+}
 
-  if (!priv->url && !priv->binding_required)
+/* Splits the request body of @message in pieces of @chunk_size, as libsoup
+ * writes a piece at a time */
+static void
+split_request_body (SoupMessage *message,
+                    gsize        chunk_size)
+{
+  SoupBuffer *buffer;
+
+  buffer = soup_message_body_flatten (message->request_body);
+  soup_message_body_truncate (message->request_body);
+  for (gsize offset = 0; offset < buffer->length; offset += chunk_size)
     {
-      priv->url = g_strdup (priv->url_format);
-    }
+      SoupBuffer *chunk;
 
-  return priv->url;
+      chunk = soup_buffer_new_subbuffer (buffer, offset,
+                                         MIN (chunk_size, buffer->length - offset));
+      soup_message_body_append_buffer (message->request_body, chunk);
+      soup_buffer_free (chunk);
+    }
+  soup_buffer_free (buffer);
 }
 
-static gboolean
-_rest_proxy_simple_run_valist (RestProxy *proxy, 
-                               gchar     **payload, 
-                               goffset   *len,
-                               GError   **error,
-                               va_list    params)
+/* Paces the request body of @message under its bandwidth limits, and the
+ * response body too if @response, when libsoup reads it */
+static void
+rest_proxy_shape_message (RestProxy   *proxy,
+                          SoupMessage *message,
+                          gboolean     response)
 {
-  RestProxyCall *call;
-  gboolean ret;
-
-  g_return_val_if_fail (REST_IS_PROXY (proxy), FALSE);
-  g_return_val_if_fail (payload, FALSE);
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+  GPtrArray *upload, *download = NULL;
+  RestShapedMessage *shaped;
 
-  call = rest_proxy_new_call (proxy);
+  upload = rest_proxy_get_message_bandwidth (proxy, message, REST_BANDWIDTH_UPLOAD);
+  if (response)
+    download = rest_proxy_get_message_bandwidth (proxy, message, REST_BANDWIDTH_DOWNLOAD);
 
-  rest_proxy_call_add_params_from_valist (call, params);
+  if (upload == NULL && download == NULL)
+    {
+      g_object_set_data (G_OBJECT (message), "rest-shaped-message", NULL);
+      return;
+    }
 
-  ret = rest_proxy_call_sync (call, error);
-  if (ret) {
-    *payload = g_strdup (rest_proxy_call_get_payload (call));
-    if (len) *len = rest_proxy_call_get_payload_length (call);
-  } else {
-    *payload = NULL;
-    if (len) *len = 0;
-  }
- 
-  g_object_unref (call);
+  shaped = g_new0 (RestShapedMessage, 1);
+  shaped->session = g_object_ref (rest_proxy_get_session (proxy));
+  shaped->message = message;
+  shaped->limits[REST_BANDWIDTH_UPLOAD] = upload;
+  shaped->limits[REST_BANDWIDTH_DOWNLOAD] = download;
+  /* Replaces the one of an earlier attempt */
+  g_object_set_data_full (G_OBJECT (message), "rest-shaped-message",
+                          shaped, (GDestroyNotify) rest_shaped_message_free);
 
-  return ret;
+  if (upload)
+    {
+      split_request_body (message, _rest_bandwidth_get_chunk_size (upload));
+      g_signal_connect (message, "wrote-body-data",
+                        G_CALLBACK (shaped_message_wrote_body_data_cb), shaped);
+    }
+  if (download)
+    g_signal_connect (message, "got-chunk",
+                      G_CALLBACK (shaped_message_got_chunk_cb), shaped);
 }
-
-gboolean
-rest_proxy_simple_run_valist (RestProxy *proxy, 
-                              char     **payload, 
-                              goffset   *len,
-                              GError   **error,
-                              va_list    params)
+#else
+/* Makes libsoup read the request body of @message under its bandwidth
+ * limits, if it has any */
+static void
+rest_proxy_shape_request (RestProxy   *proxy,
+                          SoupMessage *message)
 {
-  RestProxyClass *proxy_class = REST_PROXY_GET_CLASS (proxy);
-  return proxy_class->simple_run_valist (proxy, payload, len, error, params);
-}
+  SoupMessageHeaders *headers = soup_message_get_request_headers (message);
+  GInputStream *base, *shaped;
+  GPtrArray *limits;
+  GBytes *body;
+  goffset length = -1;
 
-gboolean
-rest_proxy_simple_run (RestProxy *proxy, 
-                       gchar    **payload,
-                       goffset   *len,
-                       GError   **error,
-                       ...)
-{
-  va_list params;
-  gboolean ret;
+  limits = rest_proxy_get_message_bandwidth (proxy, message, REST_BANDWIDTH_UPLOAD);
+  if (limits == NULL)
+    return;
 
-  g_return_val_if_fail (REST_IS_PROXY (proxy), FALSE);
-  g_return_val_if_fail (payload, FALSE);
+  body = g_object_get_data (G_OBJECT (message), "rest-request-body");
+  if (body)
+    base = g_memory_input_stream_new_from_bytes (body);
+  else
+    base = g_object_get_data (G_OBJECT (message), "rest-request-stream");
 
-  va_start (params, error);
-  ret = rest_proxy_simple_run_valist (proxy,
-                                      payload,
-                                      len,
-                                      error,
-                                      params);
-  va_end (params);
+  if (base == NULL)
+    {
+      /* No body, or one we can't get at */
+      g_ptr_array_unref (limits);
+      return;
+    }
 
-  return ret;
-}
+  if (soup_message_headers_get_encoding (headers) == SOUP_ENCODING_CONTENT_LENGTH)
+    length = soup_message_headers_get_content_length (headers);
 
-typedef struct {
-  RestMessageFinishedCallback callback;
-  gpointer user_data;
-} RestMessageQueueData;
+  shaped = _rest_shaped_stream_new (base, limits);
+  soup_message_set_request_body (message, NULL, shaped, length);
+  g_object_unref (shaped);
+  if (body)
+    g_object_unref (base);
+  g_ptr_array_unref (limits);
+}
+#endif
 
 #ifdef WITH_SOUP_2
 static void
@@ -715,10 +3276,10 @@ message_finished_cb (SoupSession *session,
   GBytes *body;
   GError *error = NULL;
 
+  g_object_set_data (G_OBJECT (message), "rest-shaped-message", NULL);
   body = g_bytes_new (message->response_body->data,
                       message->response_body->length);
-  data->callback (message, body, error, data->user_data);
-  g_free (data);
+  message_finished (data, message, body, error);
 }
 #else
 static void
@@ -732,11 +3293,154 @@ message_send_and_read_ready_cb (GObject      *source,
   GError *error = NULL;
 
   body = soup_session_send_and_read_finish (session, result, &error);
-  data->callback (soup_session_get_async_result_message (session, result), body, error, data->user_data);
-  g_free (data);
+  message_finished (data, soup_session_get_async_result_message (session, result), body, error);
+}
+
+static void
+message_body_spliced_cb (GObject      *source,
+                         GAsyncResult *result,
+                         gpointer      user_data)
+{
+  GOutputStream *output = G_OUTPUT_STREAM (source);
+  RestMessageQueueData *data = user_data;
+  GBytes *body = NULL;
+  GError *error = NULL;
+
+  if (g_output_stream_splice_finish (output, result, &error) >= 0)
+    body = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (output));
+  g_object_unref (output);
+  message_finished (data, data->message, body, error);
+}
+
+/* Reads the response body of a message whose download is limited */
+static void
+message_send_shaped_ready_cb (GObject      *source,
+                              GAsyncResult *result,
+                              gpointer      user_data)
+{
+  RestMessageQueueData *data = user_data;
+  GInputStream *stream, *shaped;
+  GOutputStream *output;
+  GError *error = NULL;
+
+  stream = soup_session_send_finish (SOUP_SESSION (source), result, &error);
+  if (stream == NULL)
+    {
+      message_finished (data, data->message, NULL, error);
+      return;
+    }
+
+  shaped = _rest_shaped_stream_new (stream, data->download_limits);
+  output = g_memory_output_stream_new_resizable ();
+  g_output_stream_splice_async (output, shaped,
+                                G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+                                G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                                get_io_priority (data->message),
+                                data->cancellable,
+                                message_body_spliced_cb,
+                                data);
+  g_object_unref (shaped);
+  g_object_unref (stream);
 }
 #endif
 
+static void
+send_scheduled_message (RestHostQueue *host,
+                        GError        *error,
+                        gpointer       user_data)
+{
+  RestMessageQueueData *data = user_data;
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (data->proxy);
+
+  if (error)
+    {
+      message_finished (data, data->message, NULL, error);
+      return;
+    }
+
+  data->host = host;
+  data->send_time = g_get_monotonic_time ();
+#ifdef WITH_SOUP_2
+  rest_proxy_shape_message (data->proxy, data->message, TRUE);
+  soup_session_queue_message (rest_proxy_get_message_session (data->proxy, data->message),
+                              g_object_ref (data->message),
+                              message_finished_cb,
+                              data);
+#else
+  rest_proxy_shape_request (data->proxy, data->message);
+  g_clear_pointer (&data->download_limits, g_ptr_array_unref);
+  data->download_limits = rest_proxy_get_message_bandwidth (data->proxy, data->message,
+                                                            REST_BANDWIDTH_DOWNLOAD);
+  if (data->download_limits)
+    {
+      soup_session_send_async (rest_proxy_get_message_session (data->proxy, data->message),
+                               data->message,
+                               get_io_priority (data->message),
+                               data->cancellable,
+                               message_send_shaped_ready_cb,
+                               data);
+      return;
+    }
+
+  soup_session_send_and_read_async (rest_proxy_get_message_session (data->proxy, data->message),
+                                    data->message,
+                                    get_io_priority (data->message),
+                                    data->cancellable,
+                                    message_send_and_read_ready_cb,
+                                    data);
+#endif
+}
+
+/*
+ * Makes the call of @data wait for the identical request in flight, if there
+ * is one, and returns %NULL.  Otherwise returns the data to send @message
+ * with, as a request later calls can wait for too.
+ */
+static RestMessageQueueData *
+rest_proxy_share_request (RestProxy            *proxy,
+                          SoupMessage          *message,
+                          char                 *key,
+                          RestMessageQueueData *data)
+{
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+  RestMessageQueueData *sender = NULL;
+  RestSharedRequest *shared;
+
+  data->message = g_object_ref (message);
+  data->context = g_main_context_ref_thread_default ();
+
+  g_rec_mutex_lock (&priv->shared_requests_lock);
+
+  shared = g_hash_table_lookup (priv->shared_requests, key);
+  if (shared == NULL)
+    {
+      shared = g_new0 (RestSharedRequest, 1);
+      shared->key = g_steal_pointer (&key);
+      shared->message = g_object_ref (message);
+      shared->cancellable = g_cancellable_new ();
+      g_hash_table_insert (priv->shared_requests, shared->key, shared);
+
+      sender = g_new0 (RestMessageQueueData, 1);
+      sender->proxy = g_object_ref (proxy);
+      sender->shared = shared;
+    }
+
+  shared->waiters = g_list_append (shared->waiters, data);
+  data->shared = shared;
+
+  /* Called right away if already cancelled, hence the recursive lock */
+  if (data->cancellable)
+    data->cancelled_id = g_cancellable_connect (data->cancellable,
+                                                G_CALLBACK (shared_request_cancelled_cb),
+                                                data, NULL);
+
+  g_rec_mutex_unlock (&priv->shared_requests_lock);
+
+  g_free (key);
+
+  return sender;
+}
+
 void
 _rest_proxy_queue_message (RestProxy                  *proxy,
                            SoupMessage                *message,
@@ -746,27 +3450,86 @@ _rest_proxy_queue_message (RestProxy                  *proxy,
 {
   RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
   RestMessageQueueData *data;
+  char *key;
 
   g_return_if_fail (REST_IS_PROXY (proxy));
   g_return_if_fail (SOUP_IS_MESSAGE (message));
 
   data = g_new0 (RestMessageQueueData, 1);
+  data->proxy = g_object_ref (proxy);
   data->callback = callback;
   data->user_data = user_data;
 
+  data->response = _rest_cache_lookup (priv->cache, message, &data->body);
+  if (data->response)
+    {
+      GSource *source;
+
 #ifdef WITH_SOUP_2
-  soup_session_queue_message (priv->session,
-                              message,
-                              message_finished_cb,
-                              data);
+      /* The message was given to us to queue */
+      g_object_unref (message);
+#endif
+      /* Answer from the main loop all the same, as a sent message would */
+      source = g_idle_source_new ();
+      g_source_set_callback (source, cached_message_finished_cb, data, NULL);
+      g_source_attach (source, g_main_context_get_thread_default ());
+      g_source_unref (source);
+      return;
+    }
+
+  if (priv->coalesce_requests &&
+      !g_cancellable_is_cancelled (cancellable) &&
+      (key = get_shared_request_key (message)))
+    {
+      if (cancellable)
+        data->cancellable = g_object_ref (cancellable);
+
+      data = rest_proxy_share_request (proxy, message, key, data);
+      if (data == NULL)
+        {
+#ifdef WITH_SOUP_2
+          g_object_unref (message);
+#endif
+          return;
+        }
+
+      cancellable = data->shared->cancellable;
+    }
+
+#ifdef WITH_SOUP_2
+  /* The message was given to us to queue */
+  data->message = message;
 #else
-  soup_session_send_and_read_async (priv->session,
-                                    message,
-                                    G_PRIORITY_DEFAULT,
-                                    cancellable,
-                                    message_send_and_read_ready_cb,
-                                    data);
+  data->message = g_object_ref (message);
 #endif
+  g_set_object (&data->cancellable, cancellable);
+
+  rest_proxy_schedule (proxy, message, cancellable, send_scheduled_message, data);
+}
+
+typedef struct {
+  RestProxy *proxy;
+  SoupMessage *message;
+  RestHostQueue *host;
+  gint64 send_time;
+} RestSendData;
+
+static void
+rest_send_data_free (RestSendData *data)
+{
+  if (data->host)
+    rest_proxy_release_host (data->proxy, data->host);
+  g_object_unref (data->proxy);
+  g_object_unref (data->message);
+  g_free (data);
+}
+
+/* The slot of a streamed response is held until the stream is gone */
+static void
+stream_finalized_cb (gpointer  user_data,
+                     GObject  *stream)
+{
+  rest_send_data_free (user_data);
 }
 
 static void
@@ -776,17 +3539,79 @@ message_send_ready_cb (GObject      *source,
 {
   SoupSession *session = SOUP_SESSION (source);
   GTask *task = user_data;
+  RestSendData *data = g_task_get_task_data (task);
   GInputStream *stream;
   GError *error = NULL;
 
   stream = soup_session_send_finish (session, result, &error);
+  /* The time to the headers of the response, as its body is streamed */
+  rest_proxy_sample_host (data->proxy, data->host, data->send_time, data->message, error);
   if (stream)
-    g_task_return_pointer (task, stream, g_object_unref);
+    {
+      RestSendData *slot;
+      GPtrArray *limits;
+
+      rest_proxy_update_rate_limit (data->proxy, data->message);
+
+      limits = rest_proxy_get_message_bandwidth (data->proxy, data->message,
+                                                 REST_BANDWIDTH_DOWNLOAD);
+      if (limits)
+        {
+          GInputStream *shaped = _rest_shaped_stream_new (stream, limits);
+
+          g_object_unref (stream);
+          stream = shaped;
+          g_ptr_array_unref (limits);
+        }
+
+      slot = g_new0 (RestSendData, 1);
+      slot->proxy = g_object_ref (data->proxy);
+      slot->message = g_object_ref (data->message);
+      slot->host = g_steal_pointer (&data->host);
+      g_object_weak_ref (G_OBJECT (stream), stream_finalized_cb, slot);
+      g_task_return_pointer (task, stream, g_object_unref);
+    }
   else
-    g_task_return_error (task, error);
+    {
+      rest_proxy_release_host (data->proxy, g_steal_pointer (&data->host));
+      g_task_return_error (task, error);
+    }
   g_object_unref (task);
 }
 
+static void
+send_scheduled_stream (RestHostQueue *host,
+                       GError        *error,
+                       gpointer       user_data)
+{
+  GTask *task = user_data;
+  RestSendData *data = g_task_get_task_data (task);
+  RestProxyPrivate *priv = rest_proxy_get_instance_private (data->proxy);
+
+  if (error)
+    {
+      g_task_return_error (task, error);
+      g_object_unref (task);
+      return;
+    }
+
+  data->host = host;
+  data->send_time = g_get_monotonic_time ();
+#ifdef WITH_SOUP_2
+  rest_proxy_shape_message (data->proxy, data->message, FALSE);
+#else
+  rest_proxy_shape_request (data->proxy, data->message);
+#endif
+  soup_session_send_async (rest_proxy_get_message_session (data->proxy, data->message),
+                           data->message,
+#ifndef WITH_SOUP_2
+                           get_io_priority (data->message),
+#endif
+                           g_task_get_cancellable (task),
+                           message_send_ready_cb,
+                           task);
+}
+
 void
 _rest_proxy_send_message_async (RestProxy          *proxy,
                                 SoupMessage        *message,
@@ -794,18 +3619,16 @@ _rest_proxy_send_message_async (RestProxy          *proxy,
                                 GAsyncReadyCallback callback,
                                 gpointer            user_data)
 {
-  RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
+  RestSendData *data;
   GTask *task;
 
+  data = g_new0 (RestSendData, 1);
+  data->proxy = g_object_ref (proxy);
+  data->message = g_object_ref (message);
+
   task = g_task_new (proxy, cancellable, callback, user_data);
-  soup_session_send_async (priv->session,
-                           message,
-#ifndef WITH_SOUP_2
-                           G_PRIORITY_DEFAULT,
-#endif
-                           cancellable,
-                           message_send_ready_cb,
-                           task);
+  g_task_set_task_data (task, data, (GDestroyNotify) rest_send_data_free);
+  rest_proxy_schedule (proxy, message, cancellable, send_scheduled_stream, task);
 }
 
 GInputStream *
@@ -826,34 +3649,58 @@ _rest_proxy_cancel_message (RestProxy   *proxy,
   g_return_if_fail (REST_IS_PROXY (proxy));
   g_return_if_fail (SOUP_IS_MESSAGE (message));
 
-  soup_session_cancel_message (priv->session,
+  soup_session_cancel_message (rest_proxy_get_session (proxy),
                                message,
                                SOUP_STATUS_CANCELLED);
 #endif
 }
 
+/*
+ * Sends @message and returns the body of the response.  If @response is not
+ * %NULL the cache of @proxy is used, and @response is set to a new reference
+ * to the message holding the response: @message, or one from the cache.
+ */
 GBytes *
 _rest_proxy_send_message (RestProxy    *proxy,
                           SoupMessage  *message,
                           GCancellable *cancellable,
+                          SoupMessage **response,
                           GError      **error)
 {
   RestProxyPrivate *priv = rest_proxy_get_instance_private (proxy);
-  GBytes *body;
+  GBytes *body = NULL;
 
   g_return_val_if_fail (REST_IS_PROXY (proxy), NULL);
   g_return_val_if_fail (SOUP_IS_MESSAGE (message), NULL);
 
+  if (response)
+    {
+      *response = _rest_cache_lookup (priv->cache, message, &body);
+      if (*response)
+        return body;
+    }
+
 #ifdef WITH_SOUP_2
-  soup_session_send_message (priv->session, message);
+  soup_session_send_message (rest_proxy_get_message_session (proxy, message), message);
   body = g_bytes_new (message->response_body->data,
                       message->response_body->length);
 #else
-  body = soup_session_send_and_read (priv->session,
+  body = soup_session_send_and_read (rest_proxy_get_message_session (proxy, message),
                                      message,
                                      cancellable,
                                      error);
 #endif
 
+  /* Not held back themselves, but what they hear holds back the others */
+  if (body)
+    rest_proxy_update_rate_limit (proxy, message);
+
+  if (response && body)
+    {
+      *response = _rest_cache_store (priv->cache, message, &body);
+      if (*response == NULL)
+        *response = g_object_ref (message);
+    }
+
   return body;
 }
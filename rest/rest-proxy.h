@@ -79,6 +79,8 @@ struct _RestProxyClass {
  * @REST_PROXY_ERROR_FAILED: Failure
  * @REST_PROXY_ERROR_URL_INVALID: Invalid URL
  * @REST_PROXY_ERROR_BINDING_REQUIRED: URL requires binding
+ * @REST_PROXY_ERROR_OVERLOADED: Turned away as the host is overloaded, see
+ *   #RestProxy:max-queue-time
  * @REST_PROXY_ERROR_HTTP_MULTIPLE_CHOICES: HTTP/Multiple choices
  * @REST_PROXY_ERROR_HTTP_MOVED_PERMANENTLY: HTTP/Moved permanently
  * @REST_PROXY_ERROR_HTTP_FOUND: HTTP/Found
@@ -123,6 +125,7 @@ typedef enum {
   REST_PROXY_ERROR_FAILED,
   REST_PROXY_ERROR_URL_INVALID,
   REST_PROXY_ERROR_BINDING_REQUIRED,
+  REST_PROXY_ERROR_OVERLOADED,
 
   REST_PROXY_ERROR_HTTP_MULTIPLE_CHOICES                = 300,
   REST_PROXY_ERROR_HTTP_MOVED_PERMANENTLY               = 301,
@@ -173,9 +176,60 @@ gboolean       rest_proxy_bind_valist             (RestProxy           *proxy,
 void           rest_proxy_set_user_agent          (RestProxy           *proxy,
                                                    const char          *user_agent);
 const gchar   *rest_proxy_get_user_agent          (RestProxy           *proxy);
+void           rest_proxy_add_default_header      (RestProxy           *proxy,
+                                                   const gchar         *header,
+                                                   const gchar         *value);
+void           rest_proxy_remove_default_header   (RestProxy           *proxy,
+                                                   const gchar         *header);
 void           rest_proxy_add_soup_feature        (RestProxy           *proxy,
                                                    SoupSessionFeature  *feature);
 RestProxyCall *rest_proxy_new_call                (RestProxy           *proxy);
+RestProxyCall *rest_proxy_acquire_call            (RestProxy           *proxy);
+void           rest_proxy_release_call            (RestProxy           *proxy,
+                                                   RestProxyCall       *call);
+void           rest_proxy_set_cache_size          (RestProxy           *proxy,
+                                                   gsize                max_size);
+gsize          rest_proxy_get_cache_size          (RestProxy           *proxy);
+void           rest_proxy_set_cache_directory     (RestProxy           *proxy,
+                                                   const char          *directory,
+                                                   guint64              max_size);
+void           rest_proxy_clear_cache             (RestProxy           *proxy);
+void           rest_proxy_get_cache_stats         (RestProxy           *proxy,
+                                                   guint64             *hits,
+                                                   guint64             *misses,
+                                                   guint64             *revalidations);
+void           rest_proxy_set_retry_policy        (RestProxy           *proxy,
+                                                   RestRetryPolicy     *policy);
+RestRetryPolicy *rest_proxy_get_retry_policy      (RestProxy           *proxy);
+void           rest_proxy_get_hedge_stats         (RestProxy           *proxy,
+                                                   guint64             *hedged,
+                                                   guint64             *won);
+void           rest_proxy_set_max_host_requests   (RestProxy           *proxy,
+                                                   guint                max_host_requests);
+guint          rest_proxy_get_max_host_requests   (RestProxy           *proxy);
+void           rest_proxy_get_queue_stats         (RestProxy           *proxy,
+                                                   guint               *waiting,
+                                                   guint64             *dequeued,
+                                                   gint64              *wait_time);
+void           rest_proxy_set_rate_limit          (RestProxy           *proxy,
+                                                   const gchar         *host,
+                                                   const gchar         *function,
+                                                   gdouble              rate,
+                                                   guint                burst);
+gboolean       rest_proxy_get_host_stats          (RestProxy           *proxy,
+                                                   const gchar         *url,
+                                                   guint               *limit,
+                                                   guint               *in_flight,
+                                                   guint               *waiting,
+                                                   guint64             *rejected);
+void           rest_proxy_set_bandwidth_limits    (RestProxy           *proxy,
+                                                   guint64              upload_rate,
+                                                   guint64              download_rate);
+void           rest_proxy_get_bandwidth_limits    (RestProxy           *proxy,
+                                                   guint64             *upload_rate,
+                                                   guint64             *download_rate);
+void           rest_proxy_set_global_bandwidth_limits (guint64          upload_rate,
+                                                       guint64          download_rate);
 gboolean       rest_proxy_simple_run              (RestProxy           *proxy,
                                                    gchar              **payload,
                                                    goffset             *len,
@@ -0,0 +1,355 @@
+/*
+ * librest - RESTful web services access
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * The rate limiter of a proxy.  Each host has a token bucket, and so has
+ * each function of a host with a limit of its own; a request takes a token
+ * from both.  A request that finds a bucket empty takes a token it is owed
+ * all the same, and is told how long to wait for it, so that the requests
+ * waiting are let through at the rate of the bucket in the order they came.
+ *
+ * The bucket of a host also follows what the host says of its quota: no
+ * more tokens than X-RateLimit-Remaining, none at all until
+ * X-RateLimit-Reset once it is 0, and none until Retry-After when the host
+ * turns a request away.  Hosts without a limit get a bucket for that alone.
+ */
+
+#include <config.h>
+#include <string.h>
+#include "rest-private.h"
+
+/* A reset larger than that is a Unix time rather than seconds from now */
+#define RESET_EPOCH_THRESHOLD 1000000000
+
+typedef struct {
+  double rate;
+  guint burst;
+} RestRateLimit;
+
+typedef struct {
+  char *host;
+  char *function;
+  /* Tokens per second, 0 for no limit */
+  double rate;
+  double burst;
+  /* Below 0 when tokens are owed to waiting requests */
+  double tokens;
+  gint64 refill_time;
+  /* Monotonic time before which nothing is sent, as the host said */
+  gint64 blocked_until;
+} RestTokenBucket;
+
+struct _RestRateLimiter {
+  GMutex lock;
+  /* By "host\nfunction", the host or the function being empty for any */
+  GHashTable *limits;
+  GHashTable *buckets;
+};
+
+static char *
+make_key (const char *host,
+          const char *function)
+{
+  return g_strconcat (host ? host : "", "\n", function ? function : "", NULL);
+}
+
+static void
+rest_token_bucket_free (RestTokenBucket *bucket)
+{
+  g_free (bucket->host);
+  g_free (bucket->function);
+  g_free (bucket);
+}
+
+RestRateLimiter *
+_rest_rate_limiter_new (void)
+{
+  RestRateLimiter *limiter = g_new0 (RestRateLimiter, 1);
+
+  g_mutex_init (&limiter->lock);
+  limiter->limits = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  limiter->buckets = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                            (GDestroyNotify) rest_token_bucket_free);
+
+  return limiter;
+}
+
+void
+_rest_rate_limiter_free (RestRateLimiter *limiter)
+{
+  g_hash_table_unref (limiter->limits);
+  g_hash_table_unref (limiter->buckets);
+  g_mutex_clear (&limiter->lock);
+  g_free (limiter);
+}
+
+/* Returns the limit of @function on @host: its own, or the one of every
+ * host.  Called with the lock held. */
+static RestRateLimit *
+find_limit (RestRateLimiter *limiter,
+            const char      *host,
+            const char      *function)
+{
+  RestRateLimit *limit;
+  char *key;
+
+  key = make_key (host, function);
+  limit = g_hash_table_lookup (limiter->limits, key);
+  g_free (key);
+  if (limit)
+    return limit;
+
+  key = make_key (NULL, function);
+  limit = g_hash_table_lookup (limiter->limits, key);
+  g_free (key);
+
+  return limit;
+}
+
+static void
+bucket_apply_limit (RestTokenBucket *bucket,
+                    RestRateLimit   *limit)
+{
+  bucket->rate = limit ? limit->rate : 0;
+  bucket->burst = limit ? MAX (limit->burst, 1) : 1;
+  bucket->tokens = MIN (bucket->tokens, bucket->burst);
+}
+
+/* Returns the bucket of @function on @host, or of the whole host if
+ * @function is %NULL, or %NULL if the function has no limit.  Called with
+ * the lock held. */
+static RestTokenBucket *
+get_bucket (RestRateLimiter *limiter,
+            const char      *host,
+            const char      *function)
+{
+  RestTokenBucket *bucket;
+  RestRateLimit *limit;
+  char *key;
+
+  key = make_key (host, function);
+  bucket = g_hash_table_lookup (limiter->buckets, key);
+  if (bucket)
+    {
+      g_free (key);
+      return bucket;
+    }
+
+  limit = find_limit (limiter, host, function);
+  if (function && limit == NULL)
+    {
+      g_free (key);
+      return NULL;
+    }
+
+  bucket = g_new0 (RestTokenBucket, 1);
+  bucket->host = g_strdup (host);
+  bucket->function = g_strdup (function);
+  bucket->tokens = G_MAXDOUBLE;
+  bucket->refill_time = g_get_monotonic_time ();
+  bucket_apply_limit (bucket, limit);
+  g_hash_table_insert (limiter->buckets, key, bucket);
+
+  return bucket;
+}
+
+/* Sets the requests per second @rate, and the most sent at once @burst, of
+ * the calls of @function to @host.  A %NULL @host stands for any host
+ * without a limit of its own, a %NULL @function for all the calls to the
+ * host.  A @rate of 0 removes the limit. */
+void
+_rest_rate_limiter_set_limit (RestRateLimiter *limiter,
+                              const char      *host,
+                              const char      *function,
+                              double           rate,
+                              guint            burst)
+{
+  GHashTableIter iter;
+  RestTokenBucket *bucket;
+
+  g_mutex_lock (&limiter->lock);
+
+  if (rate > 0)
+    {
+      RestRateLimit *limit = g_new0 (RestRateLimit, 1);
+
+      limit->rate = rate;
+      limit->burst = burst;
+      g_hash_table_replace (limiter->limits, make_key (host, function), limit);
+    }
+  else
+    {
+      char *key = make_key (host, function);
+
+      g_hash_table_remove (limiter->limits, key);
+      g_free (key);
+    }
+
+  /* The buckets keep what the hosts said, only their limits change */
+  g_hash_table_iter_init (&iter, limiter->buckets);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &bucket))
+    {
+      RestRateLimit *limit = find_limit (limiter, bucket->host, bucket->function);
+
+      if (bucket->function && limit == NULL)
+        g_hash_table_iter_remove (&iter);
+      else
+        bucket_apply_limit (bucket, limit);
+    }
+
+  g_mutex_unlock (&limiter->lock);
+}
+
+/* Takes a token from @bucket, and returns when it is there to take */
+static gint64
+bucket_take (RestTokenBucket *bucket,
+             gint64           now)
+{
+  gint64 ready = MAX (now, bucket->blocked_until);
+
+  if (bucket->rate <= 0)
+    return ready;
+
+  bucket->tokens = MIN (bucket->tokens + bucket->rate * (now - bucket->refill_time) / G_USEC_PER_SEC,
+                        bucket->burst);
+  bucket->refill_time = now;
+
+  if (bucket->tokens < 1)
+    ready = MAX (ready, now + (1 - bucket->tokens) / bucket->rate * G_USEC_PER_SEC);
+  bucket->tokens -= 1;
+
+  return ready;
+}
+
+/* Counts a request for @function to @host, and returns the microseconds it
+ * has to wait before it is sent */
+gint64
+_rest_rate_limiter_reserve (RestRateLimiter *limiter,
+                            const char      *host,
+                            const char      *function)
+{
+  RestTokenBucket *bucket;
+  gint64 now, ready;
+
+  g_mutex_lock (&limiter->lock);
+
+  now = g_get_monotonic_time ();
+  ready = bucket_take (get_bucket (limiter, host, NULL), now);
+  if (function && (bucket = get_bucket (limiter, host, function)))
+    ready = MAX (ready, bucket_take (bucket, now));
+
+  g_mutex_unlock (&limiter->lock);
+
+  return ready - now;
+}
+
+/* Gives back a token @bucket_take() took for a request that wasn't sent */
+static void
+bucket_refund (RestTokenBucket *bucket)
+{
+  if (bucket->rate > 0)
+    bucket->tokens = MIN (bucket->tokens + 1, bucket->burst);
+}
+
+/* Gives back what _rest_rate_limiter_reserve() counted for a request for
+ * @function to @host that was cancelled while it waited */
+void
+_rest_rate_limiter_refund (RestRateLimiter *limiter,
+                           const char      *host,
+                           const char      *function)
+{
+  RestTokenBucket *bucket;
+
+  g_mutex_lock (&limiter->lock);
+
+  bucket_refund (get_bucket (limiter, host, NULL));
+  if (function && (bucket = get_bucket (limiter, host, function)))
+    bucket_refund (bucket);
+
+  g_mutex_unlock (&limiter->lock);
+}
+
+static gboolean
+parse_uint (const char *value,
+            guint64    *result)
+{
+  char *end;
+
+  if (value == NULL || !g_ascii_isdigit (*value))
+    return FALSE;
+
+  *result = g_ascii_strtoull (value, &end, 10);
+
+  return *end == '\0' || g_ascii_isspace (*end);
+}
+
+static const char *
+get_header (SoupMessageHeaders *headers,
+            const char         *name)
+{
+  const char *value;
+  char *prefixed;
+
+  /* The IETF draft drops the X- */
+  prefixed = g_strconcat ("X-", name, NULL);
+  value = soup_message_headers_get_one (headers, prefixed);
+  g_free (prefixed);
+
+  return value ? value : soup_message_headers_get_one (headers, name);
+}
+
+/* Follows what the response of @host with @status and @headers says of its
+ * quota */
+void
+_rest_rate_limiter_update (RestRateLimiter    *limiter,
+                           const char         *host,
+                           guint               status,
+                           SoupMessageHeaders *headers)
+{
+  RestTokenBucket *bucket;
+  guint64 remaining, reset;
+  gint64 now, retry_after = -1;
+
+  if (status == 429 || status == SOUP_STATUS_SERVICE_UNAVAILABLE)
+    retry_after = _rest_parse_retry_after (soup_message_headers_get_one (headers, "Retry-After"));
+
+  g_mutex_lock (&limiter->lock);
+
+  now = g_get_monotonic_time ();
+  bucket = get_bucket (limiter, host, NULL);
+
+  if (parse_uint (get_header (headers, "RateLimit-Remaining"), &remaining))
+    {
+      if (remaining == 0 && parse_uint (get_header (headers, "RateLimit-Reset"), &reset))
+        {
+          if (reset > RESET_EPOCH_THRESHOLD)
+            reset = MAX ((gint64) reset - g_get_real_time () / G_USEC_PER_SEC, 0);
+          reset = MIN (reset, G_MAXINT64 / G_USEC_PER_SEC / 2);
+          bucket->blocked_until = MAX (bucket->blocked_until, now + (gint64) reset * G_USEC_PER_SEC);
+        }
+      else if (bucket->rate > 0)
+        {
+          bucket->tokens = MIN (bucket->tokens, remaining);
+        }
+    }
+
+  if (retry_after >= 0)
+    bucket->blocked_until = MAX (bucket->blocked_until,
+                                 now + MIN (retry_after, G_MAXINT64 / 2000) * 1000);
+
+  g_mutex_unlock (&limiter->lock);
+}
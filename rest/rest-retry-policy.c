@@ -0,0 +1,591 @@
+/*
+ * librest - RESTful web services access
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <config.h>
+#include <string.h>
+#include "rest-retry-policy.h"
+#include "rest-private.h"
+
+/**
+ * SECTION:rest-retry-policy
+ * @short_description: Sending failed calls again
+ * @see_also: #RestProxy, #RestProxyCall.
+ *
+ * A #RestRetryPolicy set on a #RestProxy, or on a single #RestProxyCall,
+ * makes calls that fail in a way that is likely to be temporary be sent
+ * again, up to #RestRetryPolicy:max-attempts times in all.  The same request
+ * is sent again, with the body that was prepared for the first attempt.
+ *
+ * Attempts are spaced by an exponential backoff with full jitter: before
+ * attempt n the call waits a random time between 0 and
+ * #RestRetryPolicy:initial-delay times 2^(n - 2), but no more than
+ * #RestRetryPolicy:max-delay.  When the server tells how long to wait with a
+ * Retry-After header that delay is used instead, and the call is not retried
+ * if it is longer than #RestRetryPolicy:max-delay.
+ *
+ * So that retries don't pile more load on a server that is already failing,
+ * the calls of a proxy share a retry budget: every failure the policy would
+ * retry takes a token, every other response gives back
+ * #RestRetryPolicy:token-ratio of one, and no call is retried while fewer
+ * than half of #RestRetryPolicy:max-tokens are left.
+ */
+
+#define DEFAULT_MAX_ATTEMPTS 3
+#define DEFAULT_INITIAL_DELAY 100
+#define DEFAULT_MAX_DELAY 10000
+#define DEFAULT_MAX_TOKENS 10
+#define DEFAULT_TOKEN_RATIO 0.1
+
+typedef struct {
+  guint max_attempts;
+  guint initial_delay;
+  guint max_delay;
+  gboolean retry_non_idempotent;
+  guint max_tokens;
+  double token_ratio;
+} RestRetryPolicyPrivate;
+
+G_DEFINE_TYPE_WITH_PRIVATE (RestRetryPolicy, rest_retry_policy, G_TYPE_OBJECT)
+
+enum
+{
+  PROP_0,
+  PROP_MAX_ATTEMPTS,
+  PROP_INITIAL_DELAY,
+  PROP_MAX_DELAY,
+  PROP_RETRY_NON_IDEMPOTENT,
+  PROP_MAX_TOKENS,
+  PROP_TOKEN_RATIO,
+  N_PROPS
+};
+
+static GParamSpec *properties[N_PROPS];
+
+struct _RestRetryBudget {
+  GMutex lock;
+  double tokens;
+  gboolean started;
+};
+
+gboolean
+_rest_method_is_idempotent (const char *method)
+{
+  static const char * const methods[] = {
+    "GET", "HEAD", "PUT", "DELETE", "OPTIONS", "TRACE",
+  };
+
+  for (guint i = 0; i < G_N_ELEMENTS (methods); i++)
+    if (g_strcmp0 (method, methods[i]) == 0)
+      return TRUE;
+
+  return FALSE;
+}
+
+static gboolean
+rest_retry_policy_real_is_retryable (RestRetryPolicy *policy,
+                                     const char      *method,
+                                     guint            status,
+                                     const GError    *error)
+{
+  RestRetryPolicyPrivate *priv = rest_retry_policy_get_instance_private (policy);
+
+  if (!priv->retry_non_idempotent && !_rest_method_is_idempotent (method))
+    return FALSE;
+
+  /* A call turned away to shed load must not come straight back */
+  if (error)
+    return !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED) &&
+           !g_error_matches (error, REST_PROXY_ERROR, REST_PROXY_ERROR_OVERLOADED);
+
+  switch (status)
+    {
+    case SOUP_STATUS_REQUEST_TIMEOUT:
+    case 429: /* Too Many Requests */
+    case SOUP_STATUS_INTERNAL_SERVER_ERROR:
+    case SOUP_STATUS_BAD_GATEWAY:
+    case SOUP_STATUS_SERVICE_UNAVAILABLE:
+    case SOUP_STATUS_GATEWAY_TIMEOUT:
+      return TRUE;
+    default:
+      /* libsoup 2 reports transport errors as statuses below 100 */
+      return status < 100 && status != SOUP_STATUS_CANCELLED;
+    }
+}
+
+static void
+rest_retry_policy_get_property (GObject    *object,
+                                guint       property_id,
+                                GValue     *value,
+                                GParamSpec *pspec)
+{
+  RestRetryPolicy *self = REST_RETRY_POLICY (object);
+  RestRetryPolicyPrivate *priv = rest_retry_policy_get_instance_private (self);
+
+  switch (property_id)
+    {
+    case PROP_MAX_ATTEMPTS:
+      g_value_set_uint (value, priv->max_attempts);
+      break;
+    case PROP_INITIAL_DELAY:
+      g_value_set_uint (value, priv->initial_delay);
+      break;
+    case PROP_MAX_DELAY:
+      g_value_set_uint (value, priv->max_delay);
+      break;
+    case PROP_RETRY_NON_IDEMPOTENT:
+      g_value_set_boolean (value, priv->retry_non_idempotent);
+      break;
+    case PROP_MAX_TOKENS:
+      g_value_set_uint (value, priv->max_tokens);
+      break;
+    case PROP_TOKEN_RATIO:
+      g_value_set_double (value, priv->token_ratio);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+static void
+rest_retry_policy_set_property (GObject      *object,
+                                guint         property_id,
+                                const GValue *value,
+                                GParamSpec   *pspec)
+{
+  RestRetryPolicy *self = REST_RETRY_POLICY (object);
+  RestRetryPolicyPrivate *priv = rest_retry_policy_get_instance_private (self);
+
+  switch (property_id)
+    {
+    case PROP_MAX_ATTEMPTS:
+      priv->max_attempts = g_value_get_uint (value);
+      break;
+    case PROP_INITIAL_DELAY:
+      priv->initial_delay = g_value_get_uint (value);
+      break;
+    case PROP_MAX_DELAY:
+      priv->max_delay = g_value_get_uint (value);
+      break;
+    case PROP_RETRY_NON_IDEMPOTENT:
+      priv->retry_non_idempotent = g_value_get_boolean (value);
+      break;
+    case PROP_MAX_TOKENS:
+      priv->max_tokens = g_value_get_uint (value);
+      break;
+    case PROP_TOKEN_RATIO:
+      priv->token_ratio = g_value_get_double (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+static void
+rest_retry_policy_class_init (RestRetryPolicyClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->get_property = rest_retry_policy_get_property;
+  object_class->set_property = rest_retry_policy_set_property;
+
+  klass->is_retryable = rest_retry_policy_real_is_retryable;
+
+  /**
+   * RestRetryPolicy:max-attempts:
+   *
+   * How many times a call is sent at most, the first attempt included.
+   */
+  properties[PROP_MAX_ATTEMPTS] =
+    g_param_spec_uint ("max-attempts",
+                       "max-attempts",
+                       "Number of attempts at most",
+                       1, G_MAXUINT, DEFAULT_MAX_ATTEMPTS,
+                       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * RestRetryPolicy:initial-delay:
+   *
+   * The longest wait before the second attempt, in milliseconds.  It doubles
+   * with every attempt after that.
+   */
+  properties[PROP_INITIAL_DELAY] =
+    g_param_spec_uint ("initial-delay",
+                       "initial-delay",
+                       "Longest wait before the first retry in milliseconds",
+                       0, G_MAXUINT, DEFAULT_INITIAL_DELAY,
+                       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * RestRetryPolicy:max-delay:
+   *
+   * The longest wait before any attempt, in milliseconds, including the
+   * delays asked for by Retry-After.
+   */
+  properties[PROP_MAX_DELAY] =
+    g_param_spec_uint ("max-delay",
+                       "max-delay",
+                       "Longest wait before a retry in milliseconds",
+                       0, G_MAXUINT, DEFAULT_MAX_DELAY,
+                       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * RestRetryPolicy:retry-non-idempotent:
+   *
+   * Whether calls with methods that are not idempotent, such as POST and
+   * PATCH, are retried too.  The server may have acted on a request whose
+   * response was lost, so this is only safe for APIs that tolerate requests
+   * done twice.
+   */
+  properties[PROP_RETRY_NON_IDEMPOTENT] =
+    g_param_spec_boolean ("retry-non-idempotent",
+                          "retry-non-idempotent",
+                          "Whether non-idempotent methods are retried",
+                          FALSE,
+                          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * RestRetryPolicy:max-tokens:
+   *
+   * The size of the retry budget of a proxy.  Retries stop while half of it
+   * is spent, and the budget starts full.
+   */
+  properties[PROP_MAX_TOKENS] =
+    g_param_spec_uint ("max-tokens",
+                       "max-tokens",
+                       "Size of the retry budget",
+                       0, G_MAXUINT, DEFAULT_MAX_TOKENS,
+                       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * RestRetryPolicy:token-ratio:
+   *
+   * The part of a token given back to the retry budget by every response
+   * that is not a failure worth retrying.
+   */
+  properties[PROP_TOKEN_RATIO] =
+    g_param_spec_double ("token-ratio",
+                         "token-ratio",
+                         "Tokens given back to the retry budget per success",
+                         0.0, G_MAXDOUBLE, DEFAULT_TOKEN_RATIO,
+                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (object_class, N_PROPS, properties);
+}
+
+static void
+rest_retry_policy_init (RestRetryPolicy *self)
+{
+  RestRetryPolicyPrivate *priv = rest_retry_policy_get_instance_private (self);
+
+  priv->max_attempts = DEFAULT_MAX_ATTEMPTS;
+  priv->initial_delay = DEFAULT_INITIAL_DELAY;
+  priv->max_delay = DEFAULT_MAX_DELAY;
+  priv->max_tokens = DEFAULT_MAX_TOKENS;
+  priv->token_ratio = DEFAULT_TOKEN_RATIO;
+}
+
+/**
+ * rest_retry_policy_new:
+ *
+ * Create a retry policy with the default settings: three attempts, delays of
+ * 100 milliseconds doubling up to 10 seconds, and only idempotent methods
+ * retried.
+ *
+ * Returns: (transfer full): a new #RestRetryPolicy
+ */
+RestRetryPolicy *
+rest_retry_policy_new (void)
+{
+  return g_object_new (REST_TYPE_RETRY_POLICY, NULL);
+}
+
+/**
+ * rest_retry_policy_set_max_attempts:
+ * @policy: a #RestRetryPolicy
+ * @max_attempts: the number of attempts, at least 1
+ *
+ * Set #RestRetryPolicy:max-attempts.
+ */
+void
+rest_retry_policy_set_max_attempts (RestRetryPolicy *policy,
+                                    guint            max_attempts)
+{
+  g_return_if_fail (REST_IS_RETRY_POLICY (policy));
+  g_return_if_fail (max_attempts > 0);
+
+  g_object_set (policy, "max-attempts", max_attempts, NULL);
+}
+
+/**
+ * rest_retry_policy_get_max_attempts:
+ * @policy: a #RestRetryPolicy
+ *
+ * Returns: the number of times a call is sent at most.
+ */
+guint
+rest_retry_policy_get_max_attempts (RestRetryPolicy *policy)
+{
+  RestRetryPolicyPrivate *priv = rest_retry_policy_get_instance_private (policy);
+
+  g_return_val_if_fail (REST_IS_RETRY_POLICY (policy), 0);
+
+  return priv->max_attempts;
+}
+
+/**
+ * rest_retry_policy_set_delays:
+ * @policy: a #RestRetryPolicy
+ * @initial_delay: the longest wait before the first retry, in milliseconds
+ * @max_delay: the longest wait before any retry, in milliseconds
+ *
+ * Set #RestRetryPolicy:initial-delay and #RestRetryPolicy:max-delay.
+ */
+void
+rest_retry_policy_set_delays (RestRetryPolicy *policy,
+                              guint            initial_delay,
+                              guint            max_delay)
+{
+  g_return_if_fail (REST_IS_RETRY_POLICY (policy));
+
+  g_object_set (policy,
+                "initial-delay", initial_delay,
+                "max-delay", max_delay,
+                NULL);
+}
+
+/**
+ * rest_retry_policy_get_delays:
+ * @policy: a #RestRetryPolicy
+ * @initial_delay: (out) (optional): the longest wait before the first retry
+ * @max_delay: (out) (optional): the longest wait before any retry
+ *
+ * Get the bounds of the waits between attempts, in milliseconds.
+ */
+void
+rest_retry_policy_get_delays (RestRetryPolicy *policy,
+                              guint           *initial_delay,
+                              guint           *max_delay)
+{
+  RestRetryPolicyPrivate *priv = rest_retry_policy_get_instance_private (policy);
+
+  g_return_if_fail (REST_IS_RETRY_POLICY (policy));
+
+  if (initial_delay)
+    *initial_delay = priv->initial_delay;
+  if (max_delay)
+    *max_delay = priv->max_delay;
+}
+
+/**
+ * rest_retry_policy_set_retry_non_idempotent:
+ * @policy: a #RestRetryPolicy
+ * @retry_non_idempotent: whether to retry any method
+ *
+ * Set #RestRetryPolicy:retry-non-idempotent.
+ */
+void
+rest_retry_policy_set_retry_non_idempotent (RestRetryPolicy *policy,
+                                            gboolean         retry_non_idempotent)
+{
+  g_return_if_fail (REST_IS_RETRY_POLICY (policy));
+
+  g_object_set (policy, "retry-non-idempotent", retry_non_idempotent, NULL);
+}
+
+/**
+ * rest_retry_policy_get_retry_non_idempotent:
+ * @policy: a #RestRetryPolicy
+ *
+ * Returns: whether calls with methods that are not idempotent are retried.
+ */
+gboolean
+rest_retry_policy_get_retry_non_idempotent (RestRetryPolicy *policy)
+{
+  RestRetryPolicyPrivate *priv = rest_retry_policy_get_instance_private (policy);
+
+  g_return_val_if_fail (REST_IS_RETRY_POLICY (policy), FALSE);
+
+  return priv->retry_non_idempotent;
+}
+
+/**
+ * rest_retry_policy_set_budget:
+ * @policy: a #RestRetryPolicy
+ * @max_tokens: the size of the retry budget
+ * @token_ratio: the part of a token given back by every success
+ *
+ * Set #RestRetryPolicy:max-tokens and #RestRetryPolicy:token-ratio.  With a
+ * @max_tokens of 0 retries are never held back.
+ */
+void
+rest_retry_policy_set_budget (RestRetryPolicy *policy,
+                              guint            max_tokens,
+                              double           token_ratio)
+{
+  g_return_if_fail (REST_IS_RETRY_POLICY (policy));
+
+  g_object_set (policy,
+                "max-tokens", max_tokens,
+                "token-ratio", token_ratio,
+                NULL);
+}
+
+/**
+ * rest_retry_policy_is_retryable:
+ * @policy: a #RestRetryPolicy
+ * @method: the HTTP method of the request
+ * @status: the HTTP status of the response, or 0 if there was none
+ * @error: (nullable): the error that prevented a response, or %NULL
+ *
+ * Returns: whether a request that failed this way may be sent again.
+ */
+gboolean
+rest_retry_policy_is_retryable (RestRetryPolicy *policy,
+                                const char      *method,
+                                guint            status,
+                                const GError    *error)
+{
+  g_return_val_if_fail (REST_IS_RETRY_POLICY (policy), FALSE);
+  g_return_val_if_fail (method != NULL, FALSE);
+
+  return REST_RETRY_POLICY_GET_CLASS (policy)->is_retryable (policy, method, status, error);
+}
+
+RestRetryBudget *
+_rest_retry_budget_new (void)
+{
+  RestRetryBudget *budget = g_new0 (RestRetryBudget, 1);
+
+  g_mutex_init (&budget->lock);
+
+  return budget;
+}
+
+void
+_rest_retry_budget_free (RestRetryBudget *budget)
+{
+  g_mutex_clear (&budget->lock);
+  g_free (budget);
+}
+
+/* Counts a failure, or a success, and returns whether retries are allowed */
+static gboolean
+rest_retry_budget_update (RestRetryBudget *budget,
+                          gboolean         failed,
+                          guint            max_tokens,
+                          double           token_ratio)
+{
+  gboolean allowed;
+
+  if (max_tokens == 0)
+    return TRUE;
+
+  g_mutex_lock (&budget->lock);
+
+  if (!budget->started)
+    {
+      budget->tokens = max_tokens;
+      budget->started = TRUE;
+    }
+
+  if (failed)
+    budget->tokens = MAX (budget->tokens - 1, 0);
+  else
+    budget->tokens = MIN (budget->tokens + token_ratio, max_tokens);
+
+  allowed = budget->tokens > max_tokens / 2.0;
+
+  g_mutex_unlock (&budget->lock);
+
+  return allowed;
+}
+
+/* Returns the milliseconds to wait from a Retry-After header, or -1 */
+gint64
+_rest_parse_retry_after (const char *value)
+{
+  guint64 seconds;
+  gint64 date;
+  char *end;
+
+  if (value == NULL)
+    return -1;
+
+  if (g_ascii_isdigit (*value))
+    {
+      seconds = g_ascii_strtoull (value, &end, 10);
+      if (*end != '\0' && !g_ascii_isspace (*end))
+        return -1;
+      return MIN (seconds, G_MAXINT64 / 1000) * 1000;
+    }
+
+  date = _rest_parse_http_date (value);
+  if (date < 0)
+    return -1;
+
+  return MAX (date * 1000 - g_get_real_time () / 1000, 0);
+}
+
+/*
+ * Decides whether the request with @method, which got @status and
+ * @response_headers or failed with @error on its attempt number @attempt, is
+ * sent again.  If so, stores the milliseconds to wait first in @delay.
+ * Every outcome is counted in @budget.
+ */
+gboolean
+_rest_retry_policy_next_attempt (RestRetryPolicy    *policy,
+                                 RestRetryBudget    *budget,
+                                 const char         *method,
+                                 guint               status,
+                                 SoupMessageHeaders *response_headers,
+                                 const GError       *error,
+                                 guint               attempt,
+                                 guint              *delay)
+{
+  RestRetryPolicyPrivate *priv = rest_retry_policy_get_instance_private (policy);
+  gboolean retryable;
+  gint64 retry_after;
+  guint64 backoff;
+
+  retryable = rest_retry_policy_is_retryable (policy, method, status, error);
+  if (!rest_retry_budget_update (budget, retryable,
+                                 priv->max_tokens, priv->token_ratio))
+    return FALSE;
+
+  if (!retryable || attempt >= priv->max_attempts)
+    return FALSE;
+
+  retry_after = -1;
+  if (response_headers)
+    retry_after = _rest_parse_retry_after (soup_message_headers_get_one (response_headers,
+                                                                         "Retry-After"));
+  if (retry_after >= 0)
+    {
+      /* Coming back earlier would only fail again */
+      if (retry_after > priv->max_delay)
+        return FALSE;
+      *delay = retry_after;
+      return TRUE;
+    }
+
+  /* Full jitter: anywhere between nothing and the exponential backoff */
+  backoff = (guint64) priv->initial_delay << MIN (attempt - 1, 32);
+  backoff = MIN (backoff, priv->max_delay);
+  *delay = g_random_double () * (backoff + 1);
+
+  return TRUE;
+}
@@ -0,0 +1,74 @@
+/*
+ * librest - RESTful web services access
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define REST_TYPE_RETRY_POLICY rest_retry_policy_get_type ()
+G_DECLARE_DERIVABLE_TYPE (RestRetryPolicy, rest_retry_policy, REST, RETRY_POLICY, GObject)
+
+/**
+ * RestRetryPolicyClass:
+ * @is_retryable: Returns whether a request with @method that got the HTTP
+ * status @status, or no response at all because of @error, may be sent
+ * again.  The default accepts the methods that are idempotent, unless
+ * #RestRetryPolicy:retry-non-idempotent is set, and retries transport
+ * errors and the statuses 408, 429, 500, 502, 503 and 504.  Calls that
+ * failed with %REST_PROXY_ERROR_OVERLOADED are not retried.
+ *
+ * How a #RestRetryPolicy decides which failures are worth another attempt.
+ */
+struct _RestRetryPolicyClass
+{
+  /*< private >*/
+  GObjectClass parent_class;
+
+  /*< public >*/
+  gboolean (*is_retryable) (RestRetryPolicy *policy,
+                            const char      *method,
+                            guint            status,
+                            const GError    *error);
+
+  /*< private >*/
+  gpointer padding[8];
+};
+
+RestRetryPolicy *rest_retry_policy_new                      (void);
+void             rest_retry_policy_set_max_attempts         (RestRetryPolicy *policy,
+                                                             guint            max_attempts);
+guint            rest_retry_policy_get_max_attempts         (RestRetryPolicy *policy);
+void             rest_retry_policy_set_delays               (RestRetryPolicy *policy,
+                                                             guint            initial_delay,
+                                                             guint            max_delay);
+void             rest_retry_policy_get_delays               (RestRetryPolicy *policy,
+                                                             guint           *initial_delay,
+                                                             guint           *max_delay);
+void             rest_retry_policy_set_retry_non_idempotent (RestRetryPolicy *policy,
+                                                             gboolean         retry_non_idempotent);
+gboolean         rest_retry_policy_get_retry_non_idempotent (RestRetryPolicy *policy);
+void             rest_retry_policy_set_budget               (RestRetryPolicy *policy,
+                                                             guint            max_tokens,
+                                                             double           token_ratio);
+gboolean         rest_retry_policy_is_retryable             (RestRetryPolicy *policy,
+                                                             const char      *method,
+                                                             guint            status,
+                                                             const GError    *error);
+
+G_END_DECLS
@@ -0,0 +1,220 @@
+/*
+ * librest - RESTful web services access
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * The TLS databases sessions check certificates with.  Parsing a bundle of
+ * CA certificates takes long and makes a large database, so one is loaded
+ * per file for the whole process, and shared for as long as sessions use it
+ * and the file isn't modified.  A session is only given its database when
+ * it opens a TLS connection, which many never do, and the file is looked up
+ * again for every connection after that so that a modified one is used.
+ */
+
+#include <config.h>
+#include "rest-private.h"
+
+#define SOURCE_KEY "rest-tls-ca-file"
+
+typedef struct {
+  GWeakRef database;
+  /* Of the file the database was loaded from, in microseconds */
+  guint64 mtime;
+} RestTlsCacheEntry;
+
+typedef struct {
+  /* %NULL for the certificates of the system */
+  char *ca_file;
+  /* The database the session was last given */
+  GTlsDatabase *database;
+} RestTlsSource;
+
+/* Guards the cache, and the databases of the sessions */
+static GMutex cache_lock;
+/* Paths to RestTlsCacheEntry */
+static GHashTable *cache;
+
+static void
+rest_tls_cache_entry_free (RestTlsCacheEntry *entry)
+{
+  g_weak_ref_clear (&entry->database);
+  g_free (entry);
+}
+
+static void
+rest_tls_source_free (RestTlsSource *source)
+{
+  g_free (source->ca_file);
+  g_clear_object (&source->database);
+  g_free (source);
+}
+
+static gboolean
+get_mtime (const char *path,
+           guint64    *mtime,
+           GError    **error)
+{
+  g_autoptr(GFile) file = g_file_new_for_path (path);
+  g_autoptr(GFileInfo) info = NULL;
+
+  info = g_file_query_info (file,
+                            G_FILE_ATTRIBUTE_TIME_MODIFIED ","
+                            G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC,
+                            G_FILE_QUERY_INFO_NONE, NULL, error);
+  if (info == NULL)
+    return FALSE;
+
+  *mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED) * G_USEC_PER_SEC +
+           g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC);
+
+  return TRUE;
+}
+
+/* Called with the cache lock held */
+static GTlsDatabase *
+lookup_file_database (const char  *path,
+                      GError     **error)
+{
+  RestTlsCacheEntry *entry;
+  GTlsDatabase *database = NULL;
+  guint64 mtime;
+
+  if (!get_mtime (path, &mtime, error))
+    return NULL;
+
+  if (cache == NULL)
+    cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                   (GDestroyNotify) rest_tls_cache_entry_free);
+
+  entry = g_hash_table_lookup (cache, path);
+  if (entry && entry->mtime == mtime)
+    database = g_weak_ref_get (&entry->database);
+  if (database)
+    return database;
+
+  database = g_tls_file_database_new (path, error);
+  if (database == NULL)
+    return NULL;
+
+  if (entry == NULL)
+    {
+      entry = g_new0 (RestTlsCacheEntry, 1);
+      g_weak_ref_init (&entry->database, NULL);
+      g_hash_table_insert (cache, g_strdup (path), entry);
+    }
+  /* Sessions still using the database of an older file keep it */
+  g_weak_ref_set (&entry->database, database);
+  entry->mtime = mtime;
+
+  return database;
+}
+
+/* Returns a new reference to the database of the certificates in @ca_file,
+ * or those of the system if %NULL.  Called with the cache lock held. */
+static GTlsDatabase *
+lookup_database (const char  *ca_file,
+                 GError     **error)
+{
+#ifdef REST_SYSTEM_CA_FILE
+  if (ca_file == NULL)
+    ca_file = REST_SYSTEM_CA_FILE;
+#else
+  /* Already one for the whole process */
+  if (ca_file == NULL)
+    return g_tls_backend_get_default_database (g_tls_backend_get_default ());
+#endif
+
+  return lookup_file_database (ca_file, error);
+}
+
+/*
+ * Makes @session check certificates with the database of @ca_file, or of
+ * the system if %NULL, on the TLS connections it opens from now on.  The
+ * database isn't loaded until the first one.
+ */
+void
+_rest_tls_database_set_lazy (SoupSession *session,
+                             const char  *ca_file)
+{
+  RestTlsSource *source = g_new0 (RestTlsSource, 1);
+
+  source->ca_file = g_strdup (ca_file);
+
+  g_mutex_lock (&cache_lock);
+  g_object_set_data_full (G_OBJECT (session), SOURCE_KEY,
+                          source, (GDestroyNotify) rest_tls_source_free);
+  g_mutex_unlock (&cache_lock);
+}
+
+/* Hands the database to a connection about to start its handshake.  It is
+ * looked up every time, as the file may have been modified since the last
+ * connection. */
+static void
+network_event_cb (SoupMessage        *message,
+                  GSocketClientEvent  event,
+                  GIOStream          *connection,
+                  SoupSession        *session)
+{
+  RestTlsSource *source;
+  g_autoptr(GTlsDatabase) database = NULL;
+  g_autoptr(GError) error = NULL;
+
+  if (event != G_SOCKET_CLIENT_TLS_HANDSHAKING || !G_IS_TLS_CONNECTION (connection))
+    return;
+
+  g_mutex_lock (&cache_lock);
+
+  source = g_object_get_data (G_OBJECT (session), SOURCE_KEY);
+  if (source)
+    {
+      database = lookup_database (source->ca_file, &error);
+      if (error)
+        REST_DEBUG (PROXY, "Cannot load the TLS database: %s", error->message);
+
+      g_tls_connection_set_database (G_TLS_CONNECTION (connection), database);
+
+      /* So that connections libsoup opens without telling us start out
+       * with it too */
+      if (database != source->database)
+        {
+          g_set_object (&source->database, database);
+          g_object_set (session, "tls-database", database, NULL);
+        }
+    }
+
+  g_mutex_unlock (&cache_lock);
+}
+
+/*
+ * Has the database set with _rest_tls_database_set_lazy() given to every
+ * TLS connection @session opens for @message, including those it is
+ * redirected to.
+ */
+void
+_rest_tls_database_prepare (SoupSession *session,
+                            SoupMessage *message)
+{
+  if (g_object_get_data (G_OBJECT (session), SOURCE_KEY) == NULL)
+    return;
+
+  /* Messages are sent again on retries */
+  if (g_signal_handler_find (message, G_SIGNAL_MATCH_FUNC | G_SIGNAL_MATCH_DATA,
+                             0, 0, NULL, network_event_cb, session))
+    return;
+
+  g_signal_connect_object (message, "network-event",
+                           G_CALLBACK (network_event_cb), session, 0);
+}
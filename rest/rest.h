@@ -25,6 +25,8 @@
 G_BEGIN_DECLS
 
 #define REST_INSIDE
+# include <rest/rest-call-template.h>
+# include <rest/rest-chunked-upload.h>
 # include <rest/rest-enum-types.h>
 # include <rest/rest-oauth2-proxy.h>
 # include <rest/rest-oauth2-proxy-call.h>
@@ -34,6 +36,7 @@ G_BEGIN_DECLS
 # include <rest/rest-proxy.h>
 # include <rest/rest-proxy-auth.h>
 # include <rest/rest-proxy-call.h>
+# include <rest/rest-retry-policy.h>
 # include <rest/rest-utils.h>
 # include <rest/rest-xml-node.h>
 # include <rest/rest-xml-parser.h>
@@ -0,0 +1,256 @@
+/*
+ * librest - RESTful web services access
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <config.h>
+
+#include <libsoup/soup.h>
+#include <rest/rest-proxy.h>
+#include "helper/test-server.h"
+
+#define SLOW_MS 300
+
+/* /slow takes its time, /broken fails at once and /slow-broken after a while.
+ * The server answers one request at a time. */
+static guint
+handle_request (const char *path)
+{
+  if (g_str_equal (path, "/broken"))
+    return SOUP_STATUS_SERVICE_UNAVAILABLE;
+
+  g_usleep (SLOW_MS * G_TIME_SPAN_MILLISECOND);
+
+  if (g_str_equal (path, "/slow-broken"))
+    return SOUP_STATUS_SERVICE_UNAVAILABLE;
+
+  return SOUP_STATUS_OK;
+}
+
+#ifdef WITH_SOUP_2
+static void
+server_callback (SoupServer        *server,
+                 SoupMessage       *msg,
+                 const gchar       *path,
+                 GHashTable        *query,
+                 SoupClientContext *client,
+                 gpointer           user_data)
+{
+  soup_message_set_status (msg, handle_request (path));
+}
+#else
+static void
+server_callback (SoupServer        *server,
+                 SoupServerMessage *msg,
+                 const char        *path,
+                 GHashTable        *query,
+                 gpointer           user_data)
+{
+  soup_server_message_set_status (msg, handle_request (path), NULL);
+}
+#endif
+
+typedef struct {
+  RestProxyCall *call;
+  gboolean done;
+  GError *error;
+} CallState;
+
+static void
+invoke_cb (GObject      *source,
+           GAsyncResult *result,
+           gpointer      user_data)
+{
+  CallState *state = user_data;
+
+  rest_proxy_call_invoke_finish (REST_PROXY_CALL (source), result, &state->error);
+  state->done = TRUE;
+}
+
+static void
+start_call (RestProxy  *proxy,
+            const char *function,
+            CallState  *state)
+{
+  state->call = rest_proxy_new_call (proxy);
+  rest_proxy_call_set_function (state->call, function);
+  rest_proxy_call_invoke_async (state->call, NULL, invoke_cb, state);
+}
+
+static void
+wait_call (CallState *state)
+{
+  while (!state->done)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+clear_call (CallState *state)
+{
+  g_clear_object (&state->call);
+  g_clear_error (&state->error);
+}
+
+static gboolean
+timeout_cb (gpointer user_data)
+{
+  *(gboolean *) user_data = TRUE;
+  return G_SOURCE_REMOVE;
+}
+
+static void
+sleep_loop (guint ms)
+{
+  gboolean done = FALSE;
+
+  g_timeout_add (ms, timeout_cb, &done);
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+shed_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = NULL;
+  CallState states[3] = { { 0, }, };
+  guint64 rejected;
+  gint64 start;
+
+  proxy = g_object_new (REST_TYPE_PROXY,
+                        "url-format", data,
+                        "max-host-requests", 1,
+                        "max-queue-time", 50,
+                        NULL);
+
+  start_call (proxy, "slow", &states[0]);
+  start_call (proxy, "slow", &states[1]);
+  sleep_loop (100);
+
+  /* The second call waited too long, the third one is turned away */
+  start = g_get_monotonic_time ();
+  start_call (proxy, "slow", &states[2]);
+  wait_call (&states[2]);
+  g_assert_error (states[2].error, REST_PROXY_ERROR, REST_PROXY_ERROR_OVERLOADED);
+  g_assert_cmpint (g_get_monotonic_time () - start, <, SLOW_MS * G_TIME_SPAN_MILLISECOND);
+  g_assert_false (states[0].done);
+
+  wait_call (&states[0]);
+  wait_call (&states[1]);
+  g_assert_no_error (states[0].error);
+  g_assert_no_error (states[1].error);
+
+  g_assert_true (rest_proxy_get_host_stats (proxy, data, NULL, NULL, NULL, &rejected));
+  g_assert_cmpint (rejected, ==, 1);
+
+  for (guint i = 0; i < G_N_ELEMENTS (states); i++)
+    clear_call (&states[i]);
+}
+
+static void
+adaptive_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = NULL;
+  guint limit, in_flight, waiting;
+
+  proxy = g_object_new (REST_TYPE_PROXY,
+                        "url-format", data,
+                        "adaptive-concurrency", TRUE,
+                        NULL);
+
+  g_assert_false (rest_proxy_get_host_stats (proxy, data, &limit, NULL, NULL, NULL));
+
+  /* Every failure takes a tenth off the limit */
+  for (guint i = 0; i < 10; i++)
+    {
+      CallState state = { 0, };
+
+      start_call (proxy, "broken", &state);
+      wait_call (&state);
+      g_assert_error (state.error, REST_PROXY_ERROR, SOUP_STATUS_SERVICE_UNAVAILABLE);
+      clear_call (&state);
+    }
+
+  g_assert_true (rest_proxy_get_host_stats (proxy, data, &limit, &in_flight, &waiting, NULL));
+  g_assert_cmpint (limit, ==, 3);
+  g_assert_cmpint (in_flight, ==, 0);
+  g_assert_cmpint (waiting, ==, 0);
+
+  /* Never below one, though */
+  for (guint i = 0; i < 20; i++)
+    {
+      CallState state = { 0, };
+
+      start_call (proxy, "broken", &state);
+      wait_call (&state);
+      clear_call (&state);
+    }
+
+  g_assert_true (rest_proxy_get_host_stats (proxy, data, &limit, NULL, NULL, NULL));
+  g_assert_cmpint (limit, ==, 1);
+}
+
+static void
+burst_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = NULL;
+  CallState states[3] = { { 0, }, };
+  guint limit;
+
+  proxy = g_object_new (REST_TYPE_PROXY,
+                        "url-format", data,
+                        "adaptive-concurrency", TRUE,
+                        NULL);
+
+  for (guint i = 0; i < G_N_ELEMENTS (states); i++)
+    start_call (proxy, "slow-broken", &states[i]);
+
+  for (guint i = 0; i < G_N_ELEMENTS (states); i++)
+    {
+      wait_call (&states[i]);
+      g_assert_error (states[i].error, REST_PROXY_ERROR, SOUP_STATUS_SERVICE_UNAVAILABLE);
+      clear_call (&states[i]);
+    }
+
+  /* Sent together, the failed requests shrink the limit once */
+  g_assert_true (rest_proxy_get_host_stats (proxy, data, &limit, NULL, NULL, NULL));
+  g_assert_cmpint (limit, ==, 9);
+}
+
+int
+main (int     argc,
+      gchar **argv)
+{
+  SoupServer *server;
+  gchar *uri;
+  gint ret;
+
+  g_test_init (&argc, &argv, NULL);
+
+  server = test_server_new ();
+  soup_server_add_handler (server, NULL, server_callback, NULL, NULL);
+  test_server_run_in_thread (server);
+  uri = test_server_get_uri (server, "http", NULL);
+
+  g_test_add_data_func ("/adaptive/shed", uri, shed_test);
+  g_test_add_data_func ("/adaptive/limit", uri, adaptive_test);
+  g_test_add_data_func ("/adaptive/burst", uri, burst_test);
+
+  ret = g_test_run ();
+
+  g_free (uri);
+
+  return ret;
+}
@@ -0,0 +1,249 @@
+/*
+ * librest - RESTful web services access
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <libsoup/soup.h>
+#include <rest/rest-proxy.h>
+#include "helper/test-server.h"
+
+#define BODY_SIZE 50000
+/* A body takes about 450ms at that rate, the first 50ms going at once */
+#define RATE 100000
+#define MIN_TIME (300 * G_TIME_SPAN_MILLISECOND)
+
+static char download_body[BODY_SIZE];
+
+/* /download answers with BODY_SIZE bytes, /upload with the size of the
+ * body it got */
+static void
+handle_request (const char         *path,
+                gsize               request_length,
+                SoupMessageBody    *response_body)
+{
+  if (g_str_equal (path, "/download"))
+    {
+      soup_message_body_append (response_body, SOUP_MEMORY_STATIC,
+                                download_body, sizeof (download_body));
+    }
+  else
+    {
+      char *length = g_strdup_printf ("%" G_GSIZE_FORMAT, request_length);
+
+      soup_message_body_append (response_body, SOUP_MEMORY_TAKE,
+                                length, strlen (length));
+    }
+}
+
+#ifdef WITH_SOUP_2
+static void
+server_callback (SoupServer        *server,
+                 SoupMessage       *msg,
+                 const gchar       *path,
+                 GHashTable        *query,
+                 SoupClientContext *client,
+                 gpointer           user_data)
+{
+  handle_request (path, msg->request_body->length, msg->response_body);
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+}
+#else
+static void
+server_callback (SoupServer        *server,
+                 SoupServerMessage *msg,
+                 const char        *path,
+                 GHashTable        *query,
+                 gpointer           user_data)
+{
+  handle_request (path,
+                  soup_server_message_get_request_body (msg)->length,
+                  soup_server_message_get_response_body (msg));
+  soup_server_message_set_status (msg, SOUP_STATUS_OK, NULL);
+}
+#endif
+
+static void
+invoke_cb (GObject      *source,
+           GAsyncResult *result,
+           gpointer      user_data)
+{
+  gboolean *done = user_data;
+  GError *error = NULL;
+
+  rest_proxy_call_invoke_finish (REST_PROXY_CALL (source), result, &error);
+  g_assert_no_error (error);
+  *done = TRUE;
+}
+
+/* Downloads the body of /download with @call, and returns how long it took */
+static gint64
+run_download (RestProxyCall *call)
+{
+  gboolean done = FALSE;
+  gint64 start;
+
+  rest_proxy_call_set_function (call, "download");
+
+  start = g_get_monotonic_time ();
+  rest_proxy_call_invoke_async (call, NULL, invoke_cb, &done);
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpint (rest_proxy_call_get_payload_length (call), ==, BODY_SIZE);
+
+  return g_get_monotonic_time () - start;
+}
+
+static void
+download_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = rest_proxy_new (data, FALSE);
+  g_autoptr(RestProxyCall) call = rest_proxy_new_call (proxy);
+  guint64 download_rate;
+
+  rest_proxy_set_bandwidth_limits (proxy, 0, RATE);
+  g_object_get (proxy, "download-rate", &download_rate, NULL);
+  g_assert_cmpint (download_rate, ==, RATE);
+
+  g_assert_cmpint (run_download (call), >=, MIN_TIME);
+}
+
+static void
+call_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = rest_proxy_new (data, FALSE);
+  g_autoptr(RestProxyCall) limited = rest_proxy_new_call (proxy);
+  g_autoptr(RestProxyCall) unlimited = rest_proxy_new_call (proxy);
+  guint64 upload_rate, download_rate;
+  gint64 limited_time;
+
+  rest_proxy_call_set_bandwidth_limits (limited, 0, RATE);
+  rest_proxy_call_get_bandwidth_limits (limited, &upload_rate, &download_rate);
+  g_assert_cmpint (upload_rate, ==, 0);
+  g_assert_cmpint (download_rate, ==, RATE);
+
+  limited_time = run_download (limited);
+  g_assert_cmpint (limited_time, >=, MIN_TIME);
+
+  /* The limit of a call is its own */
+  g_assert_cmpint (run_download (unlimited), <, limited_time);
+}
+
+static void
+global_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = rest_proxy_new (data, FALSE);
+  g_autoptr(RestProxyCall) call = rest_proxy_new_call (proxy);
+
+  rest_proxy_set_global_bandwidth_limits (0, RATE);
+  g_assert_cmpint (run_download (call), >=, MIN_TIME);
+  rest_proxy_set_global_bandwidth_limits (0, 0);
+}
+
+typedef struct {
+  gboolean done;
+  guint n_progress;
+  gsize uploaded;
+  gsize total;
+} UploadState;
+
+static void
+upload_cb (RestProxyCall *call,
+           gsize          total,
+           gsize          uploaded,
+           const GError  *error,
+           GObject       *weak_object,
+           gpointer       user_data)
+{
+  UploadState *state = user_data;
+
+  g_assert_no_error (error);
+  g_assert_cmpint (uploaded, >=, state->uploaded);
+  state->uploaded = uploaded;
+  state->total = total;
+
+  if (uploaded == total)
+    state->done = TRUE;
+  else
+    state->n_progress++;
+}
+
+static void
+upload_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = rest_proxy_new (data, FALSE);
+  g_autoptr(RestProxyCall) call = rest_proxy_new_call (proxy);
+  g_autoptr(GError) error = NULL;
+  g_autofree char *value = NULL;
+  g_autofree char *expected = NULL;
+  UploadState state = { FALSE, 0, 0, 0 };
+  gint64 start;
+
+  rest_proxy_set_bandwidth_limits (proxy, RATE, 0);
+
+  value = g_strnfill (BODY_SIZE, 'a');
+  rest_proxy_call_set_method (call, "POST");
+  rest_proxy_call_set_function (call, "upload");
+  rest_proxy_call_add_param (call, "data", value);
+
+  start = g_get_monotonic_time ();
+  g_assert_true (rest_proxy_call_upload (call, upload_cb, NULL, &state, &error));
+  g_assert_no_error (error);
+  while (!state.done)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpint (g_get_monotonic_time () - start, >=, MIN_TIME);
+
+  /* The body went out in paced chunks, each of them reported */
+  g_assert_cmpint (state.n_progress, >, 1);
+  g_assert_cmpint (state.uploaded, ==, strlen ("data=") + BODY_SIZE);
+  expected = g_strdup_printf ("%" G_GSIZE_FORMAT, state.uploaded);
+  g_assert_cmpint (rest_proxy_call_get_payload_length (call), ==, strlen (expected));
+  g_assert_cmpmem (rest_proxy_call_get_payload (call), strlen (expected),
+                   expected, strlen (expected));
+}
+
+int
+main (int     argc,
+      gchar **argv)
+{
+  SoupServer *server;
+  gchar *uri;
+  gint ret;
+
+  g_test_init (&argc, &argv, NULL);
+
+  memset (download_body, 'x', sizeof (download_body));
+
+  server = test_server_new ();
+  soup_server_add_handler (server, NULL, server_callback, NULL, NULL);
+  test_server_run_in_thread (server);
+  uri = test_server_get_uri (server, "http", NULL);
+
+  g_test_add_data_func ("/bandwidth/download", uri, download_test);
+  g_test_add_data_func ("/bandwidth/call", uri, call_test);
+  g_test_add_data_func ("/bandwidth/global", uri, global_test);
+  g_test_add_data_func ("/bandwidth/upload", uri, upload_test);
+
+  ret = g_test_run ();
+
+  g_free (uri);
+
+  return ret;
+}
@@ -0,0 +1,533 @@
+/*
+ * librest - RESTful web services access
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <glib/gstdio.h>
+#include <libsoup/soup.h>
+#include <rest/rest-proxy.h>
+#include "helper/test-server.h"
+
+#define ETAG "\"v1\""
+#define BIG_SIZE 4096
+
+static char *uri;
+
+/* Requests seen per path, the server runs in its own thread */
+static GMutex lock;
+static GHashTable *requests;
+static guint n_not_modified;
+
+static guint
+get_requests (const char *path)
+{
+  guint n;
+
+  g_mutex_lock (&lock);
+  n = GPOINTER_TO_UINT (g_hash_table_lookup (requests, path));
+  g_mutex_unlock (&lock);
+
+  return n;
+}
+
+/*
+ * /fresh is fresh for a minute, /etag must be revalidated with its ETag,
+ * /current is fresh for a minute but can be revalidated, /nostore must not be stored, /vary varies on Accept-Language and /big/ is
+ * a large fresh response.  Every body tells how many requests the path saw.
+ */
+static guint
+handle_request (const char         *path,
+                SoupMessageHeaders *request_headers,
+                SoupMessageHeaders *response_headers,
+                char              **body)
+{
+  const char *language;
+  guint n;
+
+  g_mutex_lock (&lock);
+  n = GPOINTER_TO_UINT (g_hash_table_lookup (requests, path)) + 1;
+  g_hash_table_insert (requests, g_strdup (path), GUINT_TO_POINTER (n));
+  g_mutex_unlock (&lock);
+
+  *body = NULL;
+
+  if (g_str_equal (path, "/fresh"))
+    {
+      soup_message_headers_replace (response_headers, "Cache-Control", "max-age=60");
+    }
+  else if (g_str_equal (path, "/etag"))
+    {
+      soup_message_headers_replace (response_headers, "Cache-Control", "no-cache");
+      soup_message_headers_replace (response_headers, "ETag", ETAG);
+
+      if (g_strcmp0 (soup_message_headers_get_one (request_headers, "If-None-Match"), ETAG) == 0)
+        {
+          g_mutex_lock (&lock);
+          n_not_modified++;
+          g_mutex_unlock (&lock);
+          return SOUP_STATUS_NOT_MODIFIED;
+        }
+    }
+  else if (g_str_equal (path, "/current"))
+    {
+      soup_message_headers_replace (response_headers, "Cache-Control", "max-age=60");
+      soup_message_headers_replace (response_headers, "ETag", ETAG);
+
+      if (g_strcmp0 (soup_message_headers_get_one (request_headers, "If-None-Match"), ETAG) == 0)
+        return SOUP_STATUS_NOT_MODIFIED;
+    }
+  else if (g_str_equal (path, "/nostore"))
+    {
+      soup_message_headers_replace (response_headers, "Cache-Control", "no-store, max-age=60");
+    }
+  else if (g_str_equal (path, "/vary"))
+    {
+      soup_message_headers_replace (response_headers, "Cache-Control", "max-age=60");
+      soup_message_headers_replace (response_headers, "Vary", "Accept-Language");
+      language = soup_message_headers_get_one (request_headers, "Accept-Language");
+      *body = g_strdup_printf ("%s %u", language ? language : "none", n);
+      return SOUP_STATUS_OK;
+    }
+  else if (g_str_has_prefix (path, "/big/"))
+    {
+      soup_message_headers_replace (response_headers, "Cache-Control", "max-age=60");
+      *body = g_strnfill (BIG_SIZE, path[5]);
+      return SOUP_STATUS_OK;
+    }
+  else
+    {
+      return SOUP_STATUS_NOT_FOUND;
+    }
+
+  *body = g_strdup_printf ("%s %u", path, n);
+  return SOUP_STATUS_OK;
+}
+
+#ifdef WITH_SOUP_2
+static void
+server_callback (SoupServer        *server,
+                 SoupMessage       *msg,
+                 const gchar       *path,
+                 GHashTable        *query,
+                 SoupClientContext *client,
+                 gpointer           user_data)
+{
+  char *body;
+  guint status;
+
+  status = handle_request (path, msg->request_headers, msg->response_headers, &body);
+  if (body)
+    soup_message_body_append (msg->response_body, SOUP_MEMORY_TAKE, body, strlen (body));
+  soup_message_set_status (msg, status);
+}
+#else
+static void
+server_callback (SoupServer        *server,
+                 SoupServerMessage *msg,
+                 const char        *path,
+                 GHashTable        *query,
+                 gpointer           user_data)
+{
+  char *body;
+  guint status;
+
+  status = handle_request (path,
+                           soup_server_message_get_request_headers (msg),
+                           soup_server_message_get_response_headers (msg),
+                           &body);
+  if (body)
+    soup_message_body_append (soup_server_message_get_response_body (msg),
+                              SOUP_MEMORY_TAKE, body, strlen (body));
+  soup_server_message_set_status (msg, status, NULL);
+}
+#endif
+
+static RestProxy *
+new_proxy (gsize cache_size)
+{
+  RestProxy *proxy;
+
+  proxy = rest_proxy_new (uri, FALSE);
+  rest_proxy_set_cache_size (proxy, cache_size);
+  g_assert_cmpuint (rest_proxy_get_cache_size (proxy), ==, cache_size);
+
+  return proxy;
+}
+
+static char *
+fetch (RestProxy  *proxy,
+       const char *function,
+       const char *language)
+{
+  RestProxyCall *call;
+  GError *error = NULL;
+  char *payload;
+
+  call = rest_proxy_new_call (proxy);
+  rest_proxy_call_set_function (call, function);
+  if (language)
+    rest_proxy_call_add_header (call, "Accept-Language", language);
+
+  rest_proxy_call_sync (call, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (rest_proxy_call_get_status_code (call), ==, SOUP_STATUS_OK);
+
+  payload = g_strndup (rest_proxy_call_get_payload (call),
+                       rest_proxy_call_get_payload_length (call));
+  g_object_unref (call);
+
+  return payload;
+}
+
+typedef struct {
+  gboolean done;
+  GError *error;
+} InvokeState;
+
+static void
+invoke_cb (GObject      *source,
+           GAsyncResult *result,
+           gpointer      user_data)
+{
+  InvokeState *state = user_data;
+
+  rest_proxy_call_invoke_finish (REST_PROXY_CALL (source), result, &state->error);
+  state->done = TRUE;
+}
+
+static char *
+fetch_async (RestProxy  *proxy,
+             const char *function)
+{
+  RestProxyCall *call;
+  InvokeState state = { 0, };
+  char *payload;
+
+  call = rest_proxy_new_call (proxy);
+  rest_proxy_call_set_function (call, function);
+  rest_proxy_call_invoke_async (call, NULL, invoke_cb, &state);
+
+  while (!state.done)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_no_error (state.error);
+  g_assert_cmpint (rest_proxy_call_get_status_code (call), ==, SOUP_STATUS_OK);
+  g_assert_cmpstr (rest_proxy_call_lookup_response_header (call, "Cache-Control"), !=, NULL);
+
+  payload = g_strndup (rest_proxy_call_get_payload (call),
+                       rest_proxy_call_get_payload_length (call));
+  g_object_unref (call);
+
+  return payload;
+}
+
+static void
+assert_stats (RestProxy *proxy,
+              guint64    hits,
+              guint64    misses,
+              guint64    revalidations)
+{
+  guint64 h, m, r;
+
+  rest_proxy_get_cache_stats (proxy, &h, &m, &r);
+  g_assert_cmpuint (h, ==, hits);
+  g_assert_cmpuint (m, ==, misses);
+  g_assert_cmpuint (r, ==, revalidations);
+}
+
+static void
+fresh_test (void)
+{
+  g_autoptr(RestProxy) proxy = new_proxy (1024 * 1024);
+  g_autofree char *first = NULL;
+  g_autofree char *second = NULL;
+  g_autofree char *third = NULL;
+  guint before = get_requests ("/fresh");
+
+  first = fetch (proxy, "fresh", NULL);
+  second = fetch (proxy, "fresh", NULL);
+  third = fetch_async (proxy, "fresh");
+
+  g_assert_cmpstr (first, ==, second);
+  g_assert_cmpstr (first, ==, third);
+  g_assert_cmpuint (get_requests ("/fresh"), ==, before + 1);
+  assert_stats (proxy, 2, 1, 0);
+
+  rest_proxy_clear_cache (proxy);
+  g_free (first);
+  first = fetch (proxy, "fresh", NULL);
+  g_assert_cmpstr (first, !=, second);
+  g_assert_cmpuint (get_requests ("/fresh"), ==, before + 2);
+}
+
+static void
+revalidate_test (void)
+{
+  g_autoptr(RestProxy) proxy = new_proxy (1024 * 1024);
+  g_autofree char *first = NULL;
+  g_autofree char *second = NULL;
+  g_autofree char *third = NULL;
+  guint before = get_requests ("/etag");
+
+  first = fetch (proxy, "etag", NULL);
+  second = fetch (proxy, "etag", NULL);
+  third = fetch_async (proxy, "etag");
+
+  /* Every call goes to the server, which only sends the body once */
+  g_assert_cmpstr (first, ==, second);
+  g_assert_cmpstr (first, ==, third);
+  g_assert_cmpuint (get_requests ("/etag"), ==, before + 3);
+  g_assert_cmpuint (n_not_modified, ==, 2);
+  assert_stats (proxy, 0, 1, 2);
+}
+
+static void
+no_cache_request_test (void)
+{
+  g_autoptr(RestProxy) proxy = new_proxy (1024 * 1024);
+  g_autofree char *first = NULL;
+  g_autofree char *second = NULL;
+  const char *directives[] = { "no-cache", "max-age=0" };
+  guint before = get_requests ("/current");
+
+  first = fetch (proxy, "current", NULL);
+  second = fetch (proxy, "current", NULL);
+  g_assert_cmpstr (first, ==, second);
+  g_assert_cmpuint (get_requests ("/current"), ==, before + 1);
+
+  /* The stored response is still fresh, but the caller wants it checked */
+  for (guint i = 0; i < G_N_ELEMENTS (directives); i++)
+    {
+      g_autoptr(RestProxyCall) call = rest_proxy_new_call (proxy);
+      g_autofree char *payload = NULL;
+      GError *error = NULL;
+
+      rest_proxy_call_set_function (call, "current");
+      rest_proxy_call_add_header (call, "Cache-Control", directives[i]);
+      rest_proxy_call_sync (call, &error);
+      g_assert_no_error (error);
+      g_assert_cmpint (rest_proxy_call_get_status_code (call), ==, SOUP_STATUS_OK);
+      payload = g_strndup (rest_proxy_call_get_payload (call),
+                           rest_proxy_call_get_payload_length (call));
+      g_assert_cmpstr (payload, ==, first);
+      g_assert_cmpuint (get_requests ("/current"), ==, before + 2 + i);
+    }
+
+  assert_stats (proxy, 1, 1, 2);
+}
+
+static void
+no_store_test (void)
+{
+  g_autoptr(RestProxy) proxy = new_proxy (1024 * 1024);
+  g_autofree char *first = NULL;
+  g_autofree char *second = NULL;
+
+  first = fetch (proxy, "nostore", NULL);
+  second = fetch (proxy, "nostore", NULL);
+
+  g_assert_cmpstr (first, !=, second);
+  assert_stats (proxy, 0, 2, 0);
+}
+
+static void
+vary_test (void)
+{
+  g_autoptr(RestProxy) proxy = new_proxy (1024 * 1024);
+  g_autofree char *en = NULL;
+  g_autofree char *en_again = NULL;
+  g_autofree char *fr = NULL;
+
+  en = fetch (proxy, "vary", "en");
+  en_again = fetch (proxy, "vary", "en");
+  fr = fetch (proxy, "vary", "fr");
+
+  g_assert_cmpstr (en, ==, en_again);
+  g_assert_true (g_str_has_prefix (fr, "fr "));
+  assert_stats (proxy, 1, 2, 0);
+}
+
+static void
+eviction_test (void)
+{
+  /* Room for one big response only */
+  g_autoptr(RestProxy) proxy = new_proxy (BIG_SIZE * 3 / 2);
+  g_autofree char *a = NULL;
+  g_autofree char *b = NULL;
+  g_autofree char *a_again = NULL;
+
+  a = fetch (proxy, "big/a", NULL);
+  b = fetch (proxy, "big/b", NULL);
+  a_again = fetch (proxy, "big/a", NULL);
+
+  g_assert_cmpstr (a, ==, a_again);
+  g_assert_cmpuint (get_requests ("/big/a"), ==, 2);
+  assert_stats (proxy, 0, 3, 0);
+}
+
+static void
+directory_test (void)
+{
+  g_autofree char *dir = NULL;
+  g_autofree char *orphan = NULL;
+  g_autofree char *index = NULL;
+  g_autofree char *lock_file = NULL;
+  g_autofree char *first = NULL;
+  g_autofree char *second = NULL;
+  g_autofree char *etag = NULL;
+  g_autofree char *etag_again = NULL;
+  RestProxy *proxy;
+  GError *error = NULL;
+  guint fresh = get_requests ("/fresh");
+  guint revalidated = n_not_modified;
+
+  dir = g_dir_make_tmp ("rest-cache-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  /* Only on disk, so the second proxy can only answer from there */
+  proxy = new_proxy (0);
+  rest_proxy_set_cache_directory (proxy, dir, 1024 * 1024);
+  first = fetch (proxy, "fresh", NULL);
+  etag = fetch (proxy, "etag", NULL);
+  assert_stats (proxy, 0, 2, 0);
+  g_object_unref (proxy);
+
+  index = g_build_filename (dir, "index", NULL);
+  lock_file = g_build_filename (dir, "lock", NULL);
+  g_assert_true (g_file_test (index, G_FILE_TEST_EXISTS));
+
+  /* A body a crash left unindexed is cleaned up */
+  orphan = g_build_filename (dir, "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef", NULL);
+  g_file_set_contents (orphan, "lost", -1, &error);
+  g_assert_no_error (error);
+
+  proxy = new_proxy (1024 * 1024);
+  rest_proxy_set_cache_directory (proxy, dir, 1024 * 1024);
+  second = fetch (proxy, "fresh", NULL);
+  etag_again = fetch (proxy, "etag", NULL);
+
+  g_assert_cmpstr (first, ==, second);
+  g_assert_cmpstr (etag, ==, etag_again);
+  g_assert_cmpuint (get_requests ("/fresh"), ==, fresh + 1);
+  g_assert_cmpuint (n_not_modified, ==, revalidated + 1);
+  g_assert_false (g_file_test (orphan, G_FILE_TEST_EXISTS));
+  assert_stats (proxy, 1, 0, 1);
+
+  rest_proxy_clear_cache (proxy);
+  g_object_unref (proxy);
+
+  g_unlink (index);
+  g_unlink (lock_file);
+  g_assert_cmpint (g_rmdir (dir), ==, 0);
+}
+
+static void
+directory_lock_test (void)
+{
+  g_autofree char *dir = NULL;
+  g_autofree char *index = NULL;
+  g_autofree char *lock_file = NULL;
+  g_autofree char *first = NULL;
+  g_autofree char *second = NULL;
+  g_autofree char *third = NULL;
+  RestProxy *owner, *proxy;
+  GError *error = NULL;
+  guint fresh;
+
+  dir = g_dir_make_tmp ("rest-cache-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  owner = new_proxy (0);
+  rest_proxy_set_cache_directory (owner, dir, 1024 * 1024);
+  first = fetch (owner, "fresh", NULL);
+
+  /* The directory is taken, so this proxy stores nothing */
+  fresh = get_requests ("/fresh");
+  proxy = new_proxy (0);
+  rest_proxy_set_cache_directory (proxy, dir, 1024 * 1024);
+  second = fetch (proxy, "fresh", NULL);
+  g_assert_cmpstr (first, !=, second);
+  g_assert_cmpuint (get_requests ("/fresh"), ==, fresh + 1);
+  g_object_unref (proxy);
+
+  /* Until its owner is done with it */
+  g_object_unref (owner);
+  proxy = new_proxy (0);
+  rest_proxy_set_cache_directory (proxy, dir, 1024 * 1024);
+  third = fetch (proxy, "fresh", NULL);
+  g_assert_cmpstr (first, ==, third);
+  g_assert_cmpuint (get_requests ("/fresh"), ==, fresh + 1);
+
+  rest_proxy_clear_cache (proxy);
+  g_object_unref (proxy);
+
+  index = g_build_filename (dir, "index", NULL);
+  lock_file = g_build_filename (dir, "lock", NULL);
+  g_unlink (index);
+  g_unlink (lock_file);
+  g_assert_cmpint (g_rmdir (dir), ==, 0);
+}
+
+static void
+disabled_test (void)
+{
+  g_autoptr(RestProxy) proxy = new_proxy (0);
+  g_autofree char *first = NULL;
+  g_autofree char *second = NULL;
+
+  first = fetch (proxy, "fresh", NULL);
+  second = fetch (proxy, "fresh", NULL);
+
+  g_assert_cmpstr (first, !=, second);
+  assert_stats (proxy, 0, 0, 0);
+}
+
+int
+main (int     argc,
+      gchar **argv)
+{
+  SoupServer *server;
+  gint ret;
+
+  g_test_init (&argc, &argv, NULL);
+
+  requests = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  server = test_server_new ();
+  soup_server_add_handler (server, NULL, server_callback, NULL, NULL);
+  test_server_run_in_thread (server);
+  uri = test_server_get_uri (server, "http", NULL);
+
+  g_test_add_func ("/cache/fresh", fresh_test);
+  g_test_add_func ("/cache/revalidate", revalidate_test);
+  g_test_add_func ("/cache/no-cache-request", no_cache_request_test);
+  g_test_add_func ("/cache/no-store", no_store_test);
+  g_test_add_func ("/cache/vary", vary_test);
+  g_test_add_func ("/cache/eviction", eviction_test);
+  g_test_add_func ("/cache/directory", directory_test);
+  g_test_add_func ("/cache/directory-lock", directory_lock_test);
+  g_test_add_func ("/cache/disabled", disabled_test);
+
+  ret = g_test_run ();
+
+  g_free (uri);
+  g_hash_table_unref (requests);
+
+  return ret;
+}
@@ -0,0 +1,180 @@
+/*
+ * librest - RESTful web services access
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/*
+ * Compares building calls with rest_proxy_new_call() and adding the same
+ * headers and parameters every time against stamping them out of a
+ * RestCallTemplate, both on their own and when sent to a local server.
+ */
+
+#include <config.h>
+#include <libsoup/soup.h>
+#include <rest/rest-proxy.h>
+#include <rest/rest-call-template.h>
+#include "helper/test-server.h"
+
+#define N_STATIC 20
+#define N_BUILD 100000
+#define N_SEND 2000
+
+#ifdef WITH_SOUP_2
+static void
+server_callback (SoupServer        *server,
+                 SoupMessage       *msg,
+                 const gchar       *path,
+                 GHashTable        *query,
+                 SoupClientContext *client,
+                 gpointer           user_data)
+{
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+}
+#else
+static void
+server_callback (SoupServer        *server,
+                 SoupServerMessage *msg,
+                 const char        *path,
+                 GHashTable        *query,
+                 gpointer           user_data)
+{
+  soup_server_message_set_status (msg, SOUP_STATUS_OK, NULL);
+}
+#endif
+
+static RestProxyCall *
+new_plain_call (RestProxy *proxy,
+                guint      i)
+{
+  RestProxyCall *call;
+  g_autofree char *value = g_strdup_printf ("%u", i);
+
+  call = rest_proxy_new_call (proxy);
+  rest_proxy_call_set_method (call, "GET");
+  rest_proxy_call_set_function (call, "poll");
+
+  for (guint j = 0; j < N_STATIC / 2; j++)
+    {
+      g_autofree char *name = g_strdup_printf ("X-Static-%u", j);
+      rest_proxy_call_add_header (call, name, "static header value");
+    }
+
+  for (guint j = 0; j < N_STATIC; j++)
+    {
+      g_autofree char *name = g_strdup_printf ("static%u", j);
+      rest_proxy_call_add_param (call, name, "static parameter value");
+    }
+
+  rest_proxy_call_add_param (call, "cursor", value);
+
+  return call;
+}
+
+static RestProxyCall *
+new_template_call (RestCallTemplate *call_template,
+                   guint             i)
+{
+  RestProxyCall *call;
+  g_autofree char *value = g_strdup_printf ("%u", i);
+
+  call = rest_call_template_new_call (call_template);
+  rest_proxy_call_add_param (call, "cursor", value);
+
+  return call;
+}
+
+static RestCallTemplate *
+create_template (RestProxy *proxy)
+{
+  RestCallTemplate *call_template;
+
+  call_template = rest_call_template_new (proxy, "GET", "poll");
+
+  for (guint j = 0; j < N_STATIC / 2; j++)
+    {
+      g_autofree char *name = g_strdup_printf ("X-Static-%u", j);
+      rest_call_template_add_header (call_template, name, "static header value");
+    }
+
+  for (guint j = 0; j < N_STATIC; j++)
+    {
+      g_autofree char *name = g_strdup_printf ("static%u", j);
+      rest_call_template_add_param (call_template, name, "static parameter value");
+    }
+
+  return call_template;
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  g_autoptr(RestProxy) proxy = NULL;
+  g_autoptr(RestCallTemplate) call_template = NULL;
+  g_autoptr(GTimer) timer = NULL;
+  g_autofree gchar *uri = NULL;
+  SoupServer *server;
+  gdouble plain, templated;
+
+  server = test_server_new ();
+  soup_server_add_handler (server, NULL, server_callback, NULL, NULL);
+  test_server_run_in_thread (server);
+  uri = test_server_get_uri (server, "http", NULL);
+
+  proxy = rest_proxy_new (uri, FALSE);
+  call_template = create_template (proxy);
+  timer = g_timer_new ();
+
+  g_timer_start (timer);
+  for (guint i = 0; i < N_BUILD; i++)
+    g_object_unref (new_plain_call (proxy, i));
+  plain = g_timer_elapsed (timer, NULL);
+
+  g_timer_start (timer);
+  for (guint i = 0; i < N_BUILD; i++)
+    g_object_unref (new_template_call (call_template, i));
+  templated = g_timer_elapsed (timer, NULL);
+
+  g_print ("build %u calls:  new_call %8.4fs  template %8.4fs  (%.1fx)\n",
+           N_BUILD, plain, templated, plain / templated);
+
+  g_timer_start (timer);
+  for (guint i = 0; i < N_SEND; i++)
+    {
+      g_autoptr(RestProxyCall) call = new_plain_call (proxy, i);
+      g_autoptr(GError) error = NULL;
+
+      rest_proxy_call_sync (call, &error);
+      g_assert_no_error (error);
+    }
+  plain = g_timer_elapsed (timer, NULL);
+
+  g_timer_start (timer);
+  for (guint i = 0; i < N_SEND; i++)
+    {
+      g_autoptr(RestProxyCall) call = new_template_call (call_template, i);
+      g_autoptr(GError) error = NULL;
+
+      rest_proxy_call_sync (call, &error);
+      g_assert_no_error (error);
+    }
+  templated = g_timer_elapsed (timer, NULL);
+
+  g_print ("send %u calls:   new_call %8.4fs  template %8.4fs  (%.1fx)\n",
+           N_SEND, plain, templated, plain / templated);
+
+  return 0;
+}
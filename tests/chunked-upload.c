@@ -0,0 +1,479 @@
+/*
+ * librest - RESTful web services access
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <glib/gstdio.h>
+#include <libsoup/soup.h>
+#include <rest/rest-proxy.h>
+#include <rest/rest-chunked-upload.h>
+#include "helper/test-server.h"
+
+#define FILE_SIZE (1024 * 1024 + 123)
+#define PART_SIZE (128 * 1024)
+#define N_PARTS 9
+#define UPLOAD_ID "upload-1"
+
+static char *contents;
+
+/* What the server saw, the server runs in its own thread */
+static GMutex lock;
+static GHashTable *parts;
+static GBytes *assembled;
+static guint n_creates;
+static guint n_part_requests;
+/* The part that fails, with which status and how many more times */
+static guint fail_part;
+static guint fail_status;
+static guint fail_remaining;
+
+static void
+reset_server (void)
+{
+  g_mutex_lock (&lock);
+  g_hash_table_remove_all (parts);
+  g_clear_pointer (&assembled, g_bytes_unref);
+  n_creates = 0;
+  n_part_requests = 0;
+  fail_part = 0;
+  fail_remaining = 0;
+  g_mutex_unlock (&lock);
+}
+
+/* Concatenates the parts with @keys */
+static GBytes *
+assemble (char **keys)
+{
+  GByteArray *array = g_byte_array_new ();
+
+  for (guint i = 0; keys[i]; i++)
+    {
+      GBytes *part = g_hash_table_lookup (parts, keys[i]);
+
+      if (part == NULL)
+        {
+          g_byte_array_unref (array);
+          return NULL;
+        }
+
+      g_byte_array_append (array, g_bytes_get_data (part, NULL), g_bytes_get_size (part));
+    }
+
+  return g_byte_array_free_to_bytes (array);
+}
+
+/* An S3 stand-in at /bucket/object */
+static guint
+handle_s3 (const char          *method,
+           GHashTable          *query,
+           GBytes              *body,
+           SoupMessageHeaders  *response_headers,
+           char               **response)
+{
+  const char *upload_id = query ? g_hash_table_lookup (query, "uploadId") : NULL;
+  const char *number = query ? g_hash_table_lookup (query, "partNumber") : NULL;
+
+  if (g_str_equal (method, "POST") && upload_id == NULL)
+    {
+      n_creates++;
+      *response = g_strdup ("<InitiateMultipartUploadResult>"
+                            "<UploadId>" UPLOAD_ID "</UploadId>"
+                            "</InitiateMultipartUploadResult>");
+      return SOUP_STATUS_OK;
+    }
+
+  if (g_strcmp0 (upload_id, UPLOAD_ID) != 0)
+    return SOUP_STATUS_NOT_FOUND;
+
+  if (g_str_equal (method, "PUT") && number)
+    {
+      g_autofree char *etag = g_strdup_printf ("\"etag-%s\"", number);
+
+      n_part_requests++;
+      if (atoi (number) == fail_part && fail_remaining > 0)
+        {
+          fail_remaining--;
+          return fail_status;
+        }
+
+      g_hash_table_replace (parts, g_strdup (number), g_bytes_ref (body));
+      soup_message_headers_replace (response_headers, "ETag", etag);
+      return SOUP_STATUS_OK;
+    }
+
+  if (g_str_equal (method, "POST"))
+    {
+      GPtrArray *keys = g_ptr_array_new_with_free_func (g_free);
+      g_autofree char *xml = g_strndup (g_bytes_get_data (body, NULL), g_bytes_get_size (body));
+      guint status = SOUP_STATUS_OK;
+
+      /* Every part has to be listed with its ETag */
+      for (guint i = 1; i <= g_hash_table_size (parts); i++)
+        {
+          g_autofree char *listed = g_strdup_printf ("<PartNumber>%u</PartNumber>"
+                                                     "<ETag>&quot;etag-%u&quot;</ETag>", i, i);
+
+          if (strstr (xml, listed) == NULL)
+            status = SOUP_STATUS_BAD_REQUEST;
+          g_ptr_array_add (keys, g_strdup_printf ("%u", i));
+        }
+      g_ptr_array_add (keys, NULL);
+
+      if (status == SOUP_STATUS_OK)
+        {
+          g_clear_pointer (&assembled, g_bytes_unref);
+          assembled = assemble ((char **) keys->pdata);
+          *response = g_strdup ("<CompleteMultipartUploadResult>"
+                                "<Key>object</Key>"
+                                "</CompleteMultipartUploadResult>");
+        }
+
+      g_ptr_array_unref (keys);
+      return status;
+    }
+
+  return SOUP_STATUS_METHOD_NOT_ALLOWED;
+}
+
+/* A tus stand-in with the concatenation extension at /files */
+static guint
+handle_tus (SoupMessageHeaders *request_headers,
+            GBytes             *body,
+            SoupMessageHeaders *response_headers)
+{
+  const char *concat = soup_message_headers_get_one (request_headers, "Upload-Concat");
+
+  if (g_strcmp0 (soup_message_headers_get_one (request_headers, "Tus-Resumable"), "1.0.0") != 0)
+    return SOUP_STATUS_PRECONDITION_FAILED;
+
+  if (g_strcmp0 (concat, "partial") == 0)
+    {
+      char *location = g_strdup_printf ("/files/p%u", ++n_part_requests);
+
+      g_hash_table_replace (parts, location, g_bytes_ref (body));
+      soup_message_headers_replace (response_headers, "Location", location);
+      return SOUP_STATUS_CREATED;
+    }
+
+  if (concat && g_str_has_prefix (concat, "final;"))
+    {
+      g_auto(GStrv) keys = g_strsplit (concat + strlen ("final;"), " ", -1);
+
+      g_clear_pointer (&assembled, g_bytes_unref);
+      assembled = assemble (keys);
+      return assembled ? SOUP_STATUS_CREATED : SOUP_STATUS_BAD_REQUEST;
+    }
+
+  return SOUP_STATUS_BAD_REQUEST;
+}
+
+static guint
+handle_upload (const char          *method,
+               const char          *path,
+               GHashTable          *query,
+               SoupMessageHeaders  *request_headers,
+               GBytes              *body,
+               SoupMessageHeaders  *response_headers,
+               char               **response)
+{
+  guint status = SOUP_STATUS_NOT_FOUND;
+
+  g_mutex_lock (&lock);
+  if (g_str_equal (path, "/bucket/object"))
+    status = handle_s3 (method, query, body, response_headers, response);
+  else if (g_str_equal (path, "/files") && g_str_equal (method, "POST"))
+    status = handle_tus (request_headers, body, response_headers);
+  g_mutex_unlock (&lock);
+
+  return status;
+}
+
+#ifdef WITH_SOUP_2
+static void
+server_callback (SoupServer        *server,
+                 SoupMessage       *msg,
+                 const gchar       *path,
+                 GHashTable        *query,
+                 SoupClientContext *client,
+                 gpointer           user_data)
+{
+  SoupBuffer *buffer;
+  GBytes *body;
+  char *response = NULL;
+  guint status;
+
+  buffer = soup_message_body_flatten (msg->request_body);
+  body = soup_buffer_get_as_bytes (buffer);
+  soup_buffer_free (buffer);
+
+  status = handle_upload (msg->method, path, query,
+                          msg->request_headers, body,
+                          msg->response_headers, &response);
+  g_bytes_unref (body);
+
+  if (response)
+    soup_message_set_response (msg, "application/xml", SOUP_MEMORY_TAKE,
+                               response, strlen (response));
+  soup_message_set_status (msg, status);
+}
+#else
+static void
+server_callback (SoupServer        *server,
+                 SoupServerMessage *msg,
+                 const char        *path,
+                 GHashTable        *query,
+                 gpointer           user_data)
+{
+  GBytes *body;
+  char *response = NULL;
+  guint status;
+
+  body = soup_message_body_flatten (soup_server_message_get_request_body (msg));
+  status = handle_upload (soup_server_message_get_method (msg), path, query,
+                          soup_server_message_get_request_headers (msg), body,
+                          soup_server_message_get_response_headers (msg), &response);
+  g_bytes_unref (body);
+
+  if (response)
+    soup_server_message_set_response (msg, "application/xml", SOUP_MEMORY_TAKE,
+                                      response, strlen (response));
+  soup_server_message_set_status (msg, status, NULL);
+}
+#endif
+
+typedef struct {
+  gsize total;
+  gsize uploaded;
+  gboolean done;
+  GError *error;
+} UploadState;
+
+static void
+progress_cb (RestProxyCall *call,
+             gsize          total,
+             gsize          uploaded,
+             const GError  *error,
+             GObject       *weak_object,
+             gpointer       userdata)
+{
+  UploadState *state = userdata;
+
+  g_assert_true (REST_IS_PROXY_CALL (call));
+  g_assert_no_error (error);
+  g_assert_cmpuint (uploaded, >, state->uploaded);
+  state->total = total;
+  state->uploaded = uploaded;
+}
+
+static void
+upload_ready_cb (GObject      *source,
+                 GAsyncResult *result,
+                 gpointer      user_data)
+{
+  UploadState *state = user_data;
+
+  rest_proxy_upload_chunked_finish (REST_PROXY (source), result, &state->error);
+  state->done = TRUE;
+}
+
+static void
+upload (RestProxy          *proxy,
+        RestUploadProtocol *protocol,
+        GFile              *file,
+        guint               max_parallel,
+        GFile              *state_file,
+        UploadState        *state)
+{
+  rest_proxy_upload_chunked_async (proxy, file, protocol, PART_SIZE, max_parallel,
+                                   state_file, progress_cb, NULL, state,
+                                   NULL, upload_ready_cb, state);
+
+  while (!state->done)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static GFile *
+create_file (const char *contents,
+             gsize       len)
+{
+  g_autofree char *path = NULL;
+  GError *error = NULL;
+  int fd;
+
+  fd = g_file_open_tmp ("rest-upload-XXXXXX", &path, &error);
+  g_assert_no_error (error);
+  g_close (fd, NULL);
+
+  if (contents)
+    g_file_set_contents (path, contents, len, &error);
+  else
+    g_unlink (path);
+  g_assert_no_error (error);
+
+  return g_file_new_for_path (path);
+}
+
+static void
+assert_assembled (void)
+{
+  g_mutex_lock (&lock);
+  g_assert_nonnull (assembled);
+  g_assert_cmpmem (g_bytes_get_data (assembled, NULL), g_bytes_get_size (assembled),
+                   contents, FILE_SIZE);
+  g_mutex_unlock (&lock);
+}
+
+static void
+s3_test (gconstpointer data)
+{
+  RestProxy *proxy = (RestProxy *)data;
+  g_autoptr(RestUploadProtocol) protocol = rest_upload_protocol_new_s3 ("bucket/object");
+  g_autoptr(GFile) file = create_file (contents, FILE_SIZE);
+  g_autoptr(GFile) state_file = create_file (NULL, 0);
+  UploadState state = { 0, };
+
+  reset_server ();
+  upload (proxy, protocol, file, 3, state_file, &state);
+
+  g_assert_no_error (state.error);
+  g_assert_cmpuint (state.total, ==, FILE_SIZE);
+  g_assert_cmpuint (state.uploaded, ==, FILE_SIZE);
+  g_assert_cmpuint (n_creates, ==, 1);
+  g_assert_cmpuint (n_part_requests, ==, N_PARTS);
+  g_assert_false (g_file_query_exists (state_file, NULL));
+  assert_assembled ();
+
+  g_file_delete (file, NULL, NULL);
+}
+
+static void
+retry_test (gconstpointer data)
+{
+  RestProxy *proxy = (RestProxy *)data;
+  g_autoptr(RestUploadProtocol) protocol = rest_upload_protocol_new_s3 ("bucket/object");
+  g_autoptr(GFile) file = create_file (contents, FILE_SIZE);
+  UploadState state = { 0, };
+
+  reset_server ();
+  fail_part = 2;
+  fail_status = SOUP_STATUS_SERVICE_UNAVAILABLE;
+  fail_remaining = 2;
+
+  upload (proxy, protocol, file, 3, NULL, &state);
+
+  g_assert_no_error (state.error);
+  g_assert_cmpuint (n_part_requests, ==, N_PARTS + 2);
+  assert_assembled ();
+
+  g_file_delete (file, NULL, NULL);
+}
+
+static void
+resume_test (gconstpointer data)
+{
+  RestProxy *proxy = (RestProxy *)data;
+  g_autoptr(RestUploadProtocol) protocol = rest_upload_protocol_new_s3 ("bucket/object");
+  g_autoptr(GFile) file = create_file (contents, FILE_SIZE);
+  g_autoptr(GFile) state_file = create_file (NULL, 0);
+  UploadState state = { 0, };
+
+  reset_server ();
+  /* A client error is not retried, so the upload stops at part 5 */
+  fail_part = 5;
+  fail_status = SOUP_STATUS_BAD_REQUEST;
+  fail_remaining = 1;
+
+  upload (proxy, protocol, file, 1, state_file, &state);
+
+  g_assert_error (state.error, REST_PROXY_ERROR, REST_PROXY_ERROR_HTTP_BAD_REQUEST);
+  g_clear_error (&state.error);
+  g_assert_cmpuint (state.uploaded, ==, 4 * PART_SIZE);
+  g_assert_true (g_file_query_exists (state_file, NULL));
+
+  /* Starting again only sends the parts from 5 on, to the same upload */
+  state.done = FALSE;
+  n_part_requests = 0;
+  upload (proxy, protocol, file, 1, state_file, &state);
+
+  g_assert_no_error (state.error);
+  g_assert_cmpuint (state.uploaded, ==, FILE_SIZE);
+  g_assert_cmpuint (n_creates, ==, 1);
+  g_assert_cmpuint (n_part_requests, ==, N_PARTS - 4);
+  g_assert_false (g_file_query_exists (state_file, NULL));
+  assert_assembled ();
+
+  g_file_delete (file, NULL, NULL);
+}
+
+static void
+tus_test (gconstpointer data)
+{
+  RestProxy *proxy = (RestProxy *)data;
+  g_autoptr(RestUploadProtocol) protocol = rest_upload_protocol_new_tus ("files");
+  g_autoptr(GFile) file = create_file (contents, FILE_SIZE);
+  UploadState state = { 0, };
+
+  reset_server ();
+  upload (proxy, protocol, file, 4, NULL, &state);
+
+  g_assert_no_error (state.error);
+  g_assert_cmpuint (state.uploaded, ==, FILE_SIZE);
+  g_assert_cmpuint (n_part_requests, ==, N_PARTS);
+  assert_assembled ();
+
+  g_file_delete (file, NULL, NULL);
+}
+
+int
+main (int     argc,
+      gchar **argv)
+{
+  RestProxy *proxy;
+  SoupServer *server;
+  gchar *uri;
+  gint ret;
+
+  g_test_init (&argc, &argv, NULL);
+
+  contents = g_malloc (FILE_SIZE);
+  for (gsize i = 0; i < FILE_SIZE; i++)
+    contents[i] = 'a' + (i * 7 + i / 251) % 26;
+  parts = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_bytes_unref);
+
+  server = test_server_new ();
+  soup_server_add_handler (server, NULL, server_callback, NULL, NULL);
+  test_server_run_in_thread (server);
+  uri = test_server_get_uri (server, "http", NULL);
+
+  proxy = rest_proxy_new (uri, FALSE);
+
+  g_test_add_data_func ("/chunked-upload/s3", proxy, s3_test);
+  g_test_add_data_func ("/chunked-upload/retry", proxy, retry_test);
+  g_test_add_data_func ("/chunked-upload/resume", proxy, resume_test);
+  g_test_add_data_func ("/chunked-upload/tus", proxy, tus_test);
+
+  ret = g_test_run ();
+
+  g_object_unref (proxy);
+  g_free (uri);
+  g_free (contents);
+
+  return ret;
+}
@@ -0,0 +1,270 @@
+/*
+ * librest - RESTful web services access
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <libsoup/soup.h>
+#include <rest/rest-proxy.h>
+#include "helper/test-server.h"
+
+#define N_CALLS 5
+
+/* The server runs in its own thread */
+static volatile gint n_requests;
+
+/* Answers slowly, so the calls of a test are all in flight together */
+static char *
+handle_request (const char         *path,
+                SoupMessageHeaders *request_headers)
+{
+  const char *language;
+  guint n;
+
+  n = g_atomic_int_add (&n_requests, 1) + 1;
+  g_usleep (G_USEC_PER_SEC / 5);
+
+  language = soup_message_headers_get_one (request_headers, "Accept-Language");
+
+  return g_strdup_printf ("%s %s %u", path, language ? language : "none", n);
+}
+
+#ifdef WITH_SOUP_2
+static void
+server_callback (SoupServer        *server,
+                 SoupMessage       *msg,
+                 const gchar       *path,
+                 GHashTable        *query,
+                 SoupClientContext *client,
+                 gpointer           user_data)
+{
+  char *body = handle_request (path, msg->request_headers);
+
+  soup_message_body_append (msg->response_body, SOUP_MEMORY_TAKE, body, strlen (body));
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+}
+#else
+static void
+server_callback (SoupServer        *server,
+                 SoupServerMessage *msg,
+                 const char        *path,
+                 GHashTable        *query,
+                 gpointer           user_data)
+{
+  char *body = handle_request (path, soup_server_message_get_request_headers (msg));
+
+  soup_message_body_append (soup_server_message_get_response_body (msg),
+                            SOUP_MEMORY_TAKE, body, strlen (body));
+  soup_server_message_set_status (msg, SOUP_STATUS_OK, NULL);
+}
+#endif
+
+typedef struct {
+  RestProxyCall *call;
+  GCancellable *cancellable;
+  gboolean done;
+  GError *error;
+} CallState;
+
+static void
+invoke_cb (GObject      *source,
+           GAsyncResult *result,
+           gpointer      user_data)
+{
+  CallState *state = user_data;
+
+  rest_proxy_call_invoke_finish (REST_PROXY_CALL (source), result, &state->error);
+  state->done = TRUE;
+}
+
+static void
+start_call (RestProxy  *proxy,
+            const char *method,
+            const char *language,
+            CallState  *state)
+{
+  state->call = rest_proxy_new_call (proxy);
+  state->cancellable = g_cancellable_new ();
+  rest_proxy_call_set_method (state->call, method);
+  rest_proxy_call_set_function (state->call, "resource");
+  if (language)
+    rest_proxy_call_add_header (state->call, "Accept-Language", language);
+
+  rest_proxy_call_invoke_async (state->call, state->cancellable, invoke_cb, state);
+}
+
+static void
+wait_calls (CallState *states,
+            guint      n_states)
+{
+  for (guint i = 0; i < n_states; i++)
+    {
+      while (!states[i].done)
+        g_main_context_iteration (NULL, TRUE);
+    }
+}
+
+static void
+clear_calls (CallState *states,
+             guint      n_states)
+{
+  for (guint i = 0; i < n_states; i++)
+    {
+      g_clear_object (&states[i].call);
+      g_clear_object (&states[i].cancellable);
+      g_clear_error (&states[i].error);
+    }
+}
+
+static RestProxy *
+new_proxy (const char *uri)
+{
+  return g_object_new (REST_TYPE_PROXY,
+                       "url-format", uri,
+                       "coalesce-requests", TRUE,
+                       NULL);
+}
+
+static void
+coalesce_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = new_proxy (data);
+  CallState states[N_CALLS] = { { 0, }, };
+
+  g_atomic_int_set (&n_requests, 0);
+
+  for (guint i = 0; i < N_CALLS; i++)
+    start_call (proxy, "GET", NULL, &states[i]);
+  wait_calls (states, N_CALLS);
+
+  g_assert_cmpint (g_atomic_int_get (&n_requests), ==, 1);
+  for (guint i = 0; i < N_CALLS; i++)
+    {
+      g_assert_no_error (states[i].error);
+      g_assert_cmpint (rest_proxy_call_get_status_code (states[i].call), ==, SOUP_STATUS_OK);
+      /* The very same payload */
+      g_assert_true (rest_proxy_call_get_payload (states[i].call) ==
+                     rest_proxy_call_get_payload (states[0].call));
+    }
+
+  clear_calls (states, N_CALLS);
+}
+
+static void
+distinct_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = new_proxy (data);
+  CallState states[4] = { { 0, }, };
+
+  g_atomic_int_set (&n_requests, 0);
+
+  /* Other headers, and methods that are not idempotent, are sent apart */
+  start_call (proxy, "GET", "en", &states[0]);
+  start_call (proxy, "GET", "fr", &states[1]);
+  start_call (proxy, "POST", NULL, &states[2]);
+  start_call (proxy, "POST", NULL, &states[3]);
+  wait_calls (states, G_N_ELEMENTS (states));
+
+  g_assert_cmpint (g_atomic_int_get (&n_requests), ==, 4);
+  for (guint i = 0; i < G_N_ELEMENTS (states); i++)
+    g_assert_no_error (states[i].error);
+
+  clear_calls (states, G_N_ELEMENTS (states));
+}
+
+static void
+cancel_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = new_proxy (data);
+  CallState states[3] = { { 0, }, };
+
+  g_atomic_int_set (&n_requests, 0);
+
+  for (guint i = 0; i < G_N_ELEMENTS (states); i++)
+    start_call (proxy, "GET", NULL, &states[i]);
+
+  /* The others still get the response */
+  g_cancellable_cancel (states[0].cancellable);
+  wait_calls (states, G_N_ELEMENTS (states));
+
+  g_assert_error (states[0].error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_no_error (states[1].error);
+  g_assert_no_error (states[2].error);
+  g_assert_true (rest_proxy_call_get_payload (states[1].call) ==
+                 rest_proxy_call_get_payload (states[2].call));
+  g_assert_cmpint (g_atomic_int_get (&n_requests), ==, 1);
+
+  clear_calls (states, G_N_ELEMENTS (states));
+}
+
+static void
+context_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = new_proxy (data);
+  g_autoptr(GMainContext) context = g_main_context_new ();
+  CallState states[2] = { { 0, }, };
+
+  g_atomic_int_set (&n_requests, 0);
+
+  start_call (proxy, "GET", NULL, &states[0]);
+  g_main_context_push_thread_default (context);
+  start_call (proxy, "GET", NULL, &states[1]);
+  g_main_context_pop_thread_default (context);
+
+  /* The second call is answered in the context it was started from */
+  wait_calls (states, 1);
+  g_assert_null (rest_proxy_call_get_payload (states[1].call));
+
+  while (!states[1].done)
+    g_main_context_iteration (context, TRUE);
+
+  g_assert_no_error (states[0].error);
+  g_assert_no_error (states[1].error);
+  g_assert_true (rest_proxy_call_get_payload (states[0].call) ==
+                 rest_proxy_call_get_payload (states[1].call));
+  g_assert_cmpint (g_atomic_int_get (&n_requests), ==, 1);
+
+  clear_calls (states, G_N_ELEMENTS (states));
+}
+
+int
+main (int     argc,
+      gchar **argv)
+{
+  SoupServer *server;
+  gchar *uri;
+  gint ret;
+
+  g_test_init (&argc, &argv, NULL);
+
+  server = test_server_new ();
+  soup_server_add_handler (server, NULL, server_callback, NULL, NULL);
+  test_server_run_in_thread (server);
+  uri = test_server_get_uri (server, "http", NULL);
+
+  g_test_add_data_func ("/coalesce/identical", uri, coalesce_test);
+  g_test_add_data_func ("/coalesce/distinct", uri, distinct_test);
+  g_test_add_data_func ("/coalesce/cancel", uri, cancel_test);
+  g_test_add_data_func ("/coalesce/context", uri, context_test);
+
+  ret = g_test_run ();
+
+  g_free (uri);
+
+  return ret;
+}
@@ -0,0 +1,238 @@
+/*
+ * librest - RESTful web services access
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/*
+ * Compares a plain download with segmented downloads against a server that
+ * sends at most CHUNK_SIZE bytes every TICK_MS on each connection, which is
+ * what a long, thin link looks like to a single TCP stream.
+ */
+
+#include <config.h>
+#include <glib/gstdio.h>
+#include <libsoup/soup.h>
+#include <rest/rest-proxy.h>
+#include "helper/test-server.h"
+
+#define BODY_SIZE (8 * 1024 * 1024)
+#define CHUNK_SIZE (32 * 1024)
+#define TICK_MS 10
+
+static char *body;
+
+typedef struct {
+  SoupServer *server;
+#ifdef WITH_SOUP_2
+  SoupMessage *msg;
+#else
+  SoupServerMessage *msg;
+#endif
+  goffset next;
+  goffset end;
+  GSource *source;
+} Transfer;
+
+static void
+transfer_finished_cb (gpointer  msg,
+                      Transfer *transfer)
+{
+  g_source_destroy (transfer->source);
+  g_source_unref (transfer->source);
+  g_free (transfer);
+}
+
+static gboolean
+transfer_tick_cb (gpointer user_data)
+{
+  Transfer *transfer = user_data;
+  gsize len = MIN (CHUNK_SIZE, transfer->end - transfer->next);
+#ifdef WITH_SOUP_2
+  SoupMessageBody *response_body = transfer->msg->response_body;
+#else
+  SoupMessageBody *response_body = soup_server_message_get_response_body (transfer->msg);
+#endif
+
+  soup_message_body_append (response_body, SOUP_MEMORY_STATIC, body + transfer->next, len);
+  transfer->next += len;
+  if (transfer->next == transfer->end)
+    soup_message_body_complete (response_body);
+
+#ifdef WITH_SOUP_2
+  soup_server_unpause_message (transfer->server, transfer->msg);
+#else
+  soup_server_message_unpause (transfer->msg);
+#endif
+
+  return transfer->next < transfer->end ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+}
+
+static guint
+start_transfer (SoupServer         *server,
+                gpointer            msg,
+                SoupMessageHeaders *request_headers,
+                SoupMessageHeaders *response_headers)
+{
+  Transfer *transfer;
+  SoupRange *ranges;
+  int n_ranges;
+  guint status = SOUP_STATUS_OK;
+
+  transfer = g_new0 (Transfer, 1);
+  transfer->server = server;
+  transfer->msg = msg;
+  transfer->end = BODY_SIZE;
+
+  soup_message_headers_replace (response_headers, "ETag", "\"bench\"");
+  soup_message_headers_set_encoding (response_headers, SOUP_ENCODING_CHUNKED);
+
+  if (soup_message_headers_get_ranges (request_headers, BODY_SIZE, &ranges, &n_ranges))
+    {
+      transfer->next = ranges[0].start;
+      transfer->end = ranges[0].end + 1;
+      soup_message_headers_set_content_range (response_headers,
+                                              ranges[0].start,
+                                              ranges[0].end,
+                                              BODY_SIZE);
+      soup_message_headers_free_ranges (request_headers, ranges);
+      status = SOUP_STATUS_PARTIAL_CONTENT;
+    }
+
+  transfer->source = g_timeout_source_new (TICK_MS);
+  g_source_set_callback (transfer->source, transfer_tick_cb, transfer, NULL);
+  g_source_attach (transfer->source, g_main_context_get_thread_default ());
+
+  g_signal_connect (msg, "finished", G_CALLBACK (transfer_finished_cb), transfer);
+
+  return status;
+}
+
+#ifdef WITH_SOUP_2
+static void
+server_callback (SoupServer        *server,
+                 SoupMessage       *msg,
+                 const gchar       *path,
+                 GHashTable        *query,
+                 SoupClientContext *client,
+                 gpointer           user_data)
+{
+  guint status;
+
+  status = start_transfer (server, msg, msg->request_headers, msg->response_headers);
+  soup_message_set_status (msg, status);
+  soup_server_pause_message (server, msg);
+}
+#else
+static void
+server_callback (SoupServer        *server,
+                 SoupServerMessage *msg,
+                 const char        *path,
+                 GHashTable        *query,
+                 gpointer           user_data)
+{
+  guint status;
+
+  status = start_transfer (server, msg,
+                           soup_server_message_get_request_headers (msg),
+                           soup_server_message_get_response_headers (msg));
+  soup_server_message_set_status (msg, status, NULL);
+  soup_server_message_pause (msg);
+}
+#endif
+
+static void
+ready_cb (GObject      *source,
+          GAsyncResult *result,
+          gpointer      user_data)
+{
+  gboolean *done = user_data;
+  GError *error = NULL;
+
+  if (g_async_result_is_tagged (result, rest_proxy_call_download_segmented_async))
+    rest_proxy_call_download_segmented_finish (REST_PROXY_CALL (source), result, &error);
+  else
+    rest_proxy_call_download_to_file_finish (REST_PROXY_CALL (source), result, &error);
+  g_assert_no_error (error);
+
+  *done = TRUE;
+}
+
+static gdouble
+run (RestProxy *proxy,
+     GFile     *file,
+     guint      n_segments)
+{
+  g_autoptr(RestProxyCall) call = rest_proxy_new_call (proxy);
+  g_autoptr(GTimer) timer = g_timer_new ();
+  gboolean done = FALSE;
+
+  g_file_delete (file, NULL, NULL);
+  rest_proxy_call_set_function (call, "file");
+
+  if (n_segments > 1)
+    rest_proxy_call_download_segmented_async (call, file, n_segments, NULL, NULL,
+                                              NULL, ready_cb, &done);
+  else
+    rest_proxy_call_download_to_file_async (call, file, NULL, NULL,
+                                            NULL, ready_cb, &done);
+
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+
+  return g_timer_elapsed (timer, NULL);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  static const guint segments[] = { 1, 2, 4, 8 };
+  g_autoptr(RestProxy) proxy = NULL;
+  g_autoptr(GFile) file = NULL;
+  g_autofree gchar *uri = NULL;
+  g_autofree gchar *path = NULL;
+  SoupServer *server;
+  gdouble single = 0;
+
+  body = g_malloc0 (BODY_SIZE);
+
+  server = test_server_new ();
+  soup_server_add_handler (server, NULL, server_callback, NULL, NULL);
+  test_server_run_in_thread (server);
+  uri = test_server_get_uri (server, "http", NULL);
+
+  proxy = rest_proxy_new (uri, FALSE);
+  path = g_build_filename (g_get_tmp_dir (), "rest-download-bench", NULL);
+  file = g_file_new_for_path (path);
+
+  g_print ("%u KiB/s per connection, %u MiB body\n",
+           CHUNK_SIZE * (1000 / TICK_MS) / 1024, BODY_SIZE / (1024 * 1024));
+
+  for (guint i = 0; i < G_N_ELEMENTS (segments); i++)
+    {
+      gdouble elapsed = run (proxy, file, segments[i]);
+
+      if (i == 0)
+        single = elapsed;
+
+      g_print ("%u segment(s): %8.3fs  (%.1fx)\n", segments[i], elapsed, single / elapsed);
+    }
+
+  g_file_delete (file, NULL, NULL);
+  g_free (body);
+
+  return 0;
+}
@@ -0,0 +1,419 @@
+/*
+ * librest - RESTful web services access
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <glib/gstdio.h>
+#include <libsoup/soup.h>
+#include <rest/rest-proxy.h>
+#include "helper/test-server.h"
+
+#define BODY_SIZE (256 * 1024 + 17)
+#define ETAG "\"v1\""
+#define VALIDATOR_ATTRIBUTE "xattr::librest-validator"
+
+static char *body;
+/* Start of the last range request the server saw, or -1 */
+static gint64 range_start = -1;
+/* Requests answered with the whole body */
+static guint n_full_bodies;
+
+/*
+ * Serves body at /download, honouring Range and If-Range, and without range
+ * support at /download/norange.
+ */
+static guint
+handle_download (const char         *path,
+                 SoupMessageHeaders *request_headers,
+                 SoupMessageHeaders *response_headers,
+                 const char        **data,
+                 gsize              *len)
+{
+  SoupRange *ranges;
+  const char *if_range;
+  int n_ranges;
+
+  *data = body;
+  *len = BODY_SIZE;
+
+  if (g_str_equal (path, "/download/norange"))
+    {
+      /* Chunked, so the server does not handle the range by itself */
+      soup_message_headers_set_encoding (response_headers, SOUP_ENCODING_CHUNKED);
+      n_full_bodies++;
+      return SOUP_STATUS_OK;
+    }
+
+  soup_message_headers_replace (response_headers, "ETag", ETAG);
+  soup_message_headers_replace (response_headers, "Accept-Ranges", "bytes");
+
+  if_range = soup_message_headers_get_one (request_headers, "If-Range");
+  if ((if_range && !g_str_equal (if_range, ETAG)) ||
+      !soup_message_headers_get_ranges (request_headers, BODY_SIZE, &ranges, &n_ranges))
+    {
+      n_full_bodies++;
+      return SOUP_STATUS_OK;
+    }
+
+  range_start = ranges[0].start;
+
+  if (ranges[0].start >= BODY_SIZE)
+    {
+      char *content_range = g_strdup_printf ("bytes */%d", BODY_SIZE);
+
+      soup_message_headers_replace (response_headers, "Content-Range", content_range);
+      g_free (content_range);
+      soup_message_headers_free_ranges (request_headers, ranges);
+      *len = 0;
+      return SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE;
+    }
+
+  *data = body + ranges[0].start;
+  *len = ranges[0].end - ranges[0].start + 1;
+  soup_message_headers_set_content_range (response_headers,
+                                          ranges[0].start,
+                                          ranges[0].end,
+                                          BODY_SIZE);
+  soup_message_headers_free_ranges (request_headers, ranges);
+
+  return SOUP_STATUS_PARTIAL_CONTENT;
+}
+
+#ifdef WITH_SOUP_2
+static void
+server_callback (SoupServer        *server,
+                 SoupMessage       *msg,
+                 const gchar       *path,
+                 GHashTable        *query,
+                 SoupClientContext *client,
+                 gpointer           user_data)
+{
+  const char *data;
+  gsize len;
+  guint status;
+
+  status = handle_download (path, msg->request_headers, msg->response_headers, &data, &len);
+  soup_message_body_append (msg->response_body, SOUP_MEMORY_STATIC, data, len);
+  soup_message_set_status (msg, status);
+}
+#else
+static void
+server_callback (SoupServer        *server,
+                 SoupServerMessage *msg,
+                 const char        *path,
+                 GHashTable        *query,
+                 gpointer           user_data)
+{
+  const char *data;
+  gsize len;
+  guint status;
+
+  status = handle_download (path,
+                            soup_server_message_get_request_headers (msg),
+                            soup_server_message_get_response_headers (msg),
+                            &data, &len);
+  soup_message_body_append (soup_server_message_get_response_body (msg),
+                            SOUP_MEMORY_STATIC, data, len);
+  soup_server_message_set_status (msg, status, NULL);
+}
+#endif
+
+typedef struct {
+  goffset total;
+  goffset downloaded;
+  gboolean done;
+  GError *error;
+} DownloadState;
+
+static void
+progress_cb (RestProxyCall *call,
+             goffset        total,
+             goffset        downloaded,
+             gpointer       userdata)
+{
+  DownloadState *state = userdata;
+
+  g_assert_cmpint (downloaded, >=, state->downloaded);
+  state->total = total;
+  state->downloaded = downloaded;
+}
+
+static void
+download_ready_cb (GObject      *source,
+                   GAsyncResult *result,
+                   gpointer      user_data)
+{
+  DownloadState *state = user_data;
+
+  rest_proxy_call_download_to_file_finish (REST_PROXY_CALL (source), result, &state->error);
+  state->done = TRUE;
+}
+
+static void
+segmented_ready_cb (GObject      *source,
+                    GAsyncResult *result,
+                    gpointer      user_data)
+{
+  DownloadState *state = user_data;
+
+  rest_proxy_call_download_segmented_finish (REST_PROXY_CALL (source), result, &state->error);
+  state->done = TRUE;
+}
+
+static void
+download (RestProxy     *proxy,
+          const char    *function,
+          GFile         *file,
+          guint          n_segments,
+          DownloadState *state)
+{
+  RestProxyCall *call;
+
+  call = rest_proxy_new_call (proxy);
+  rest_proxy_call_set_function (call, function);
+  if (n_segments > 0)
+    rest_proxy_call_download_segmented_async (call, file, n_segments, progress_cb, state,
+                                              NULL, segmented_ready_cb, state);
+  else
+    rest_proxy_call_download_to_file_async (call, file, progress_cb, state,
+                                            NULL, download_ready_cb, state);
+
+  while (!state->done)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_no_error (state->error);
+  g_object_unref (call);
+}
+
+static GFile *
+create_file (const char *contents,
+             gsize       len)
+{
+  g_autofree char *path = NULL;
+  GError *error = NULL;
+  int fd;
+
+  fd = g_file_open_tmp ("rest-download-XXXXXX", &path, &error);
+  g_assert_no_error (error);
+  g_close (fd, NULL);
+
+  if (contents)
+    g_file_set_contents (path, contents, len, &error);
+  else
+    g_unlink (path);
+  g_assert_no_error (error);
+
+  return g_file_new_for_path (path);
+}
+
+/* Stores @validator with @file as a download would, or skips the test if the
+ * file system can't */
+static gboolean
+set_validator (GFile      *file,
+               const char *validator)
+{
+  if (!g_file_set_attribute_string (file, VALIDATOR_ATTRIBUTE, validator,
+                                    G_FILE_QUERY_INFO_NONE, NULL, NULL))
+    {
+      g_test_skip ("No extended attributes");
+      g_file_delete (file, NULL, NULL);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+assert_file_contents (GFile *file)
+{
+  g_autofree char *contents = NULL;
+  gsize len;
+  GError *error = NULL;
+
+  g_file_load_contents (file, NULL, &contents, &len, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpmem (contents, len, body, BODY_SIZE);
+
+  g_file_delete (file, NULL, NULL);
+}
+
+static void
+download_test (gconstpointer data)
+{
+  RestProxy *proxy = (RestProxy *)data;
+  g_autoptr(GFile) file = create_file (NULL, 0);
+  DownloadState state = { 0, };
+
+  g_autoptr(GFileInfo) info = NULL;
+
+  range_start = -1;
+  download (proxy, "download", file, 0, &state);
+
+  g_assert_cmpint (range_start, ==, -1);
+  g_assert_cmpint (state.total, ==, BODY_SIZE);
+  g_assert_cmpint (state.downloaded, ==, BODY_SIZE);
+
+  /* Written once the file was closed, so it survives the replacement */
+  info = g_file_query_info (file, VALIDATOR_ATTRIBUTE, G_FILE_QUERY_INFO_NONE, NULL, NULL);
+  if (info && g_file_info_has_attribute (info, VALIDATOR_ATTRIBUTE))
+    g_assert_cmpstr (g_file_info_get_attribute_string (info, VALIDATOR_ATTRIBUTE), ==, ETAG);
+
+  assert_file_contents (file);
+}
+
+static void
+resume_test (gconstpointer data)
+{
+  RestProxy *proxy = (RestProxy *)data;
+  g_autoptr(GFile) file = create_file (body, BODY_SIZE / 3);
+  DownloadState state = { 0, };
+
+  if (!set_validator (file, ETAG))
+    return;
+
+  range_start = -1;
+  n_full_bodies = 0;
+  download (proxy, "download", file, 0, &state);
+
+  g_assert_cmpint (range_start, ==, BODY_SIZE / 3);
+  g_assert_cmpuint (n_full_bodies, ==, 0);
+  g_assert_cmpint (state.total, ==, BODY_SIZE);
+  g_assert_cmpint (state.downloaded, ==, BODY_SIZE);
+  assert_file_contents (file);
+}
+
+static void
+complete_test (gconstpointer data)
+{
+  RestProxy *proxy = (RestProxy *)data;
+  g_autoptr(GFile) file = create_file (body, BODY_SIZE);
+  DownloadState state = { 0, };
+
+  if (!set_validator (file, ETAG))
+    return;
+
+  /* Nothing is left to fetch, so the server refuses the range, giving the
+   * length of the body the file already holds */
+  n_full_bodies = 0;
+  download (proxy, "download", file, 0, &state);
+
+  g_assert_cmpuint (n_full_bodies, ==, 0);
+  g_assert_cmpint (state.total, ==, BODY_SIZE);
+  g_assert_cmpint (state.downloaded, ==, BODY_SIZE);
+  assert_file_contents (file);
+}
+
+static void
+weak_validator_test (gconstpointer data)
+{
+  RestProxy *proxy = (RestProxy *)data;
+  g_autoptr(GFile) file = create_file (body, BODY_SIZE / 3);
+  DownloadState state = { 0, };
+
+  if (!set_validator (file, "W/" ETAG))
+    return;
+
+  /* A weak ETag can't be used in If-Range, so the whole body is fetched */
+  range_start = -1;
+  download (proxy, "download", file, 0, &state);
+
+  g_assert_cmpint (range_start, ==, -1);
+  g_assert_cmpint (state.downloaded, ==, BODY_SIZE);
+  assert_file_contents (file);
+}
+
+static void
+no_range_test (gconstpointer data)
+{
+  RestProxy *proxy = (RestProxy *)data;
+  g_autoptr(GFile) file = create_file ("not the body", 12);
+  DownloadState state = { 0, };
+
+  download (proxy, "download/norange", file, 0, &state);
+
+  g_assert_cmpint (state.total, ==, -1);
+  g_assert_cmpint (state.downloaded, ==, BODY_SIZE);
+  assert_file_contents (file);
+}
+
+static void
+segmented_test (gconstpointer data)
+{
+  RestProxy *proxy = (RestProxy *)data;
+  g_autoptr(GFile) file = create_file ("an old file that is replaced", 28);
+  DownloadState state = { 0, };
+
+  download (proxy, "download", file, 4, &state);
+
+  g_assert_cmpint (state.total, ==, BODY_SIZE);
+  g_assert_cmpint (state.downloaded, ==, BODY_SIZE);
+  assert_file_contents (file);
+}
+
+static void
+segmented_no_range_test (gconstpointer data)
+{
+  RestProxy *proxy = (RestProxy *)data;
+  g_autoptr(GFile) file = create_file (NULL, 0);
+  DownloadState state = { 0, };
+
+  download (proxy, "download/norange", file, 4, &state);
+
+  g_assert_cmpint (state.downloaded, ==, BODY_SIZE);
+  assert_file_contents (file);
+}
+
+int
+main (int     argc,
+      gchar **argv)
+{
+  RestProxy *proxy;
+  SoupServer *server;
+  gchar *uri;
+  gint ret;
+
+  g_test_init (&argc, &argv, NULL);
+
+  body = g_malloc (BODY_SIZE);
+  for (gsize i = 0; i < BODY_SIZE; i++)
+    body[i] = 'a' + (i * 7 + i / 251) % 26;
+
+  server = test_server_new ();
+  soup_server_add_handler (server, NULL, server_callback, NULL, NULL);
+  test_server_run_in_thread (server);
+  uri = test_server_get_uri (server, "http", NULL);
+
+  proxy = rest_proxy_new (uri, FALSE);
+
+  g_test_add_data_func ("/download/full", proxy, download_test);
+  g_test_add_data_func ("/download/resume", proxy, resume_test);
+  g_test_add_data_func ("/download/complete", proxy, complete_test);
+  g_test_add_data_func ("/download/weak-validator", proxy, weak_validator_test);
+  g_test_add_data_func ("/download/no-range", proxy, no_range_test);
+  g_test_add_data_func ("/download/segmented", proxy, segmented_test);
+  g_test_add_data_func ("/download/segmented-no-range", proxy, segmented_no_range_test);
+
+  ret = g_test_run ();
+
+  g_object_unref (proxy);
+  g_free (uri);
+  g_free (body);
+
+  return ret;
+}
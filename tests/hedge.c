@@ -0,0 +1,281 @@
+/*
+ * librest - RESTful web services access
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <libsoup/soup.h>
+#include <rest/rest-proxy.h>
+#include "helper/test-server.h"
+
+#define SLOW_MS 1000
+
+/* The server runs in its own thread */
+static volatile gint n_requests;
+
+typedef struct {
+  SoupServer *server;
+  gpointer msg;
+  GSource *source;
+} SlowResponse;
+
+static void
+respond (gpointer    msg,
+         guint       status,
+         const char *body)
+{
+#ifdef WITH_SOUP_2
+  soup_message_set_status (msg, status);
+  soup_message_body_append (((SoupMessage *) msg)->response_body,
+                            SOUP_MEMORY_STATIC, body, strlen (body));
+#else
+  soup_server_message_set_status (msg, status, NULL);
+  soup_message_body_append (soup_server_message_get_response_body (msg),
+                            SOUP_MEMORY_STATIC, body, strlen (body));
+#endif
+}
+
+static gboolean
+slow_response_cb (gpointer user_data)
+{
+  SlowResponse *slow = user_data;
+
+  respond (slow->msg, SOUP_STATUS_OK, "slow");
+#ifdef WITH_SOUP_2
+  soup_server_unpause_message (slow->server, slow->msg);
+#else
+  soup_server_message_unpause (slow->msg);
+#endif
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+slow_finished_cb (gpointer      msg,
+                  SlowResponse *slow)
+{
+  g_source_destroy (slow->source);
+  g_source_unref (slow->source);
+  g_free (slow);
+}
+
+/* The first request of a test is answered late, the others at once, with
+ * an error for /failing */
+static void
+handle_request (SoupServer *server,
+                gpointer    msg,
+                const char *path)
+{
+  SlowResponse *slow;
+
+  if (g_atomic_int_add (&n_requests, 1) > 0)
+    {
+      if (g_str_equal (path, "/failing"))
+        respond (msg, SOUP_STATUS_SERVICE_UNAVAILABLE, "failed");
+      else
+        respond (msg, SOUP_STATUS_OK, "fast");
+      return;
+    }
+
+  slow = g_new0 (SlowResponse, 1);
+  slow->server = server;
+  slow->msg = msg;
+  slow->source = g_timeout_source_new (SLOW_MS);
+  g_source_set_callback (slow->source, slow_response_cb, slow, NULL);
+  g_source_attach (slow->source, g_main_context_get_thread_default ());
+  g_signal_connect (msg, "finished", G_CALLBACK (slow_finished_cb), slow);
+
+#ifdef WITH_SOUP_2
+  soup_server_pause_message (server, msg);
+#else
+  soup_server_message_pause (msg);
+#endif
+}
+
+#ifdef WITH_SOUP_2
+static void
+server_callback (SoupServer        *server,
+                 SoupMessage       *msg,
+                 const gchar       *path,
+                 GHashTable        *query,
+                 SoupClientContext *client,
+                 gpointer           user_data)
+{
+  handle_request (server, msg, path);
+}
+#else
+static void
+server_callback (SoupServer        *server,
+                 SoupServerMessage *msg,
+                 const char        *path,
+                 GHashTable        *query,
+                 gpointer           user_data)
+{
+  handle_request (server, msg, path);
+}
+#endif
+
+static void
+invoke_cb (GObject      *source,
+           GAsyncResult *result,
+           gpointer      user_data)
+{
+  gboolean *done = user_data;
+  GError *error = NULL;
+
+  rest_proxy_call_invoke_finish (REST_PROXY_CALL (source), result, &error);
+  g_assert_no_error (error);
+  *done = TRUE;
+}
+
+/* Returns the payload of a call to @function with @method */
+static char *
+run_call (RestProxy  *proxy,
+          const char *method,
+          const char *function)
+{
+  g_autoptr(RestProxyCall) call = rest_proxy_new_call (proxy);
+  gboolean done = FALSE;
+
+  g_atomic_int_set (&n_requests, 0);
+
+  rest_proxy_call_set_method (call, method);
+  rest_proxy_call_set_function (call, function);
+  rest_proxy_call_invoke_async (call, NULL, invoke_cb, &done);
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+
+  return g_strndup (rest_proxy_call_get_payload (call),
+                    rest_proxy_call_get_payload_length (call));
+}
+
+static RestProxy *
+new_proxy (const char *uri,
+           double      budget)
+{
+  return g_object_new (REST_TYPE_PROXY,
+                       "url-format", uri,
+                       "hedge-delay", 50,
+                       "hedge-budget", budget,
+                       NULL);
+}
+
+static void
+hedge_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = new_proxy (data, 1.0);
+  g_autofree char *payload = NULL;
+  guint64 hedged, won;
+  gint64 start;
+
+  start = g_get_monotonic_time ();
+  payload = run_call (proxy, "GET", "resource");
+
+  /* The hedge answered, without waiting for the slow request */
+  g_assert_cmpstr (payload, ==, "fast");
+  g_assert_cmpint (g_get_monotonic_time () - start, <, SLOW_MS * G_TIME_SPAN_MILLISECOND);
+  rest_proxy_get_hedge_stats (proxy, &hedged, &won);
+  g_assert_cmpint (hedged, ==, 1);
+  g_assert_cmpint (won, ==, 1);
+}
+
+static void
+non_idempotent_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = new_proxy (data, 1.0);
+  g_autofree char *payload = NULL;
+  guint64 hedged;
+
+  payload = run_call (proxy, "POST", "resource");
+
+  g_assert_cmpstr (payload, ==, "slow");
+  rest_proxy_get_hedge_stats (proxy, &hedged, NULL);
+  g_assert_cmpint (hedged, ==, 0);
+}
+
+static void
+budget_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = new_proxy (data, 0.0);
+  g_autofree char *payload = NULL;
+  guint64 hedged;
+
+  payload = run_call (proxy, "GET", "resource");
+
+  g_assert_cmpstr (payload, ==, "slow");
+  rest_proxy_get_hedge_stats (proxy, &hedged, NULL);
+  g_assert_cmpint (hedged, ==, 0);
+}
+
+static void
+server_error_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = new_proxy (data, 1.0);
+  g_autofree char *payload = NULL;
+  guint64 hedged, won;
+
+  payload = run_call (proxy, "GET", "failing");
+
+  /* The hedge failed, so the slow request answered */
+  g_assert_cmpstr (payload, ==, "slow");
+  rest_proxy_get_hedge_stats (proxy, &hedged, &won);
+  g_assert_cmpint (hedged, ==, 1);
+  g_assert_cmpint (won, ==, 0);
+}
+
+static void
+coalesce_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = new_proxy (data, 1.0);
+  g_autofree char *payload = NULL;
+
+  /* The hedge isn't coalesced with the request it races */
+  g_object_set (proxy, "coalesce-requests", TRUE, NULL);
+  payload = run_call (proxy, "GET", "resource");
+
+  g_assert_cmpstr (payload, ==, "fast");
+  g_assert_cmpint (g_atomic_int_get (&n_requests), ==, 2);
+}
+
+int
+main (int     argc,
+      gchar **argv)
+{
+  SoupServer *server;
+  gchar *uri;
+  gint ret;
+
+  g_test_init (&argc, &argv, NULL);
+
+  server = test_server_new ();
+  soup_server_add_handler (server, NULL, server_callback, NULL, NULL);
+  test_server_run_in_thread (server);
+  uri = test_server_get_uri (server, "http", NULL);
+
+  g_test_add_data_func ("/hedge/hedge", uri, hedge_test);
+  g_test_add_data_func ("/hedge/non-idempotent", uri, non_idempotent_test);
+  g_test_add_data_func ("/hedge/budget", uri, budget_test);
+  g_test_add_data_func ("/hedge/server-error", uri, server_error_test);
+  g_test_add_data_func ("/hedge/coalesce", uri, coalesce_test);
+
+  ret = g_test_run ();
+
+  g_free (uri);
+
+  return ret;
+}
@@ -0,0 +1,118 @@
+/*
+ * librest - RESTful web services access
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/*
+ * Compares RestParams against the GList based store it replaced: append,
+ * lookup by name and iteration with g_list_nth() on every step.
+ */
+
+#include <glib.h>
+#include "rest/rest-params.h"
+#include "rest/rest-param.h"
+
+static gint
+find_param (gconstpointer param,
+            gconstpointer name)
+{
+  return g_strcmp0 (rest_param_get_name ((RestParam *)param), name);
+}
+
+static gdouble
+bench_list (GPtrArray *params,
+            GPtrArray *names)
+{
+  g_autoptr(GTimer) timer = g_timer_new ();
+  GList *list = NULL;
+  GList *cur;
+  guint found = 0;
+
+  for (guint i = 0; i < params->len; i++)
+    list = g_list_append (list, g_ptr_array_index (params, i));
+
+  for (guint i = 0; i < names->len; i++)
+    if (g_list_find_custom (list, g_ptr_array_index (names, i), find_param))
+      found++;
+
+  for (guint i = 0; (cur = g_list_nth (list, i)) != NULL; i++)
+    found += rest_param_get_content_length (cur->data) > 0;
+
+  g_assert_cmpuint (found, ==, names->len + params->len);
+  g_list_free (list);
+
+  return g_timer_elapsed (timer, NULL);
+}
+
+static gdouble
+bench_params (GPtrArray *params,
+              GPtrArray *names)
+{
+  g_autoptr(GTimer) timer = g_timer_new ();
+  g_autoptr(RestParams) rest_params = rest_params_new ();
+  RestParamsIter iter;
+  RestParam *param;
+  guint found = 0;
+
+  for (guint i = 0; i < params->len; i++)
+    rest_params_add (rest_params, rest_param_ref (g_ptr_array_index (params, i)));
+
+  for (guint i = 0; i < names->len; i++)
+    if (rest_params_get (rest_params, g_ptr_array_index (names, i)))
+      found++;
+
+  rest_params_iter_init (&iter, rest_params);
+  while (rest_params_iter_next (&iter, NULL, &param))
+    found += rest_param_get_content_length (param) > 0;
+
+  g_assert_cmpuint (found, ==, names->len + params->len);
+
+  return g_timer_elapsed (timer, NULL);
+}
+
+static void
+run (guint n_params)
+{
+  g_autoptr(GPtrArray) params = g_ptr_array_new_with_free_func ((GDestroyNotify) rest_param_unref);
+  g_autoptr(GPtrArray) names = g_ptr_array_new_with_free_func (g_free);
+  gdouble list_time, params_time;
+
+  for (guint i = 0; i < n_params; i++)
+    {
+      g_autofree char *name = g_strdup_printf ("param%u", i);
+
+      g_ptr_array_add (params, rest_param_new_string (name, REST_MEMORY_COPY, "value"));
+      g_ptr_array_add (names, g_steal_pointer (&name));
+    }
+
+  list_time = bench_list (params, names);
+  params_time = bench_params (params, names);
+
+  g_print ("%6u params: GList %10.6fs  RestParams %10.6fs  (%.1fx)\n",
+           n_params, list_time, params_time,
+           params_time > 0 ? list_time / params_time : 0.0);
+}
+
+gint
+main (gint   argc,
+      gchar *argv[])
+{
+  run (10);
+  run (100);
+  run (10000);
+
+  return 0;
+}
@@ -85,6 +85,59 @@ test_params_get (void)
   g_assert_cmpstr (rest_param_get_content (p1), ==, "value2");
 }
 
+static void
+test_params_repeated (void)
+{
+  g_autoptr(RestParams) params = NULL;
+  RestParamsIter iter;
+  const char *name;
+  RestParam *param;
+  const char *expected[] = { "b", "c", "a2" };
+  gint pos = 0;
+
+  params = rest_params_new ();
+  rest_params_add (params, rest_param_new_string ("a", REST_MEMORY_STATIC, "a1"));
+  rest_params_add (params, rest_param_new_string ("b", REST_MEMORY_STATIC, "b"));
+  rest_params_add (params, rest_param_new_string ("c", REST_MEMORY_STATIC, "c"));
+  rest_params_add (params, rest_param_new_string ("a", REST_MEMORY_STATIC, "a2"));
+
+  g_assert_cmpstr (rest_param_get_content (rest_params_get (params, "a")), ==, "a1");
+  g_assert_null (rest_params_get (params, "missing"));
+
+  /* Removing the first "a" exposes the second one */
+  rest_params_remove (params, "a");
+  g_assert_cmpstr (rest_param_get_content (rest_params_get (params, "a")), ==, "a2");
+
+  rest_params_iter_init (&iter, params);
+  while (rest_params_iter_next (&iter, &name, &param))
+    {
+      g_assert_cmpstr (rest_param_get_content (param), ==, expected[pos]);
+      pos++;
+    }
+  g_assert_cmpint (pos, ==, G_N_ELEMENTS (expected));
+
+  rest_params_remove (params, "a");
+  rest_params_remove (params, "missing");
+  g_assert_null (rest_params_get (params, "a"));
+}
+
+static void
+test_params_copy (void)
+{
+  g_autoptr(RestParams) params = NULL;
+  g_autoptr(RestParams) copy = NULL;
+
+  params = rest_params_new ();
+  rest_params_add (params, rest_param_new_string ("a", REST_MEMORY_STATIC, "a1"));
+  rest_params_add (params, rest_param_new_string ("a", REST_MEMORY_STATIC, "a2"));
+
+  copy = rest_params_copy (params);
+  rest_params_remove (params, "a");
+
+  g_assert_cmpstr (rest_param_get_content (rest_params_get (params, "a")), ==, "a2");
+  g_assert_cmpstr (rest_param_get_content (rest_params_get (copy, "a")), ==, "a1");
+}
+
 static void
 test_params_is_string (void)
 {
@@ -127,6 +180,29 @@ test_params_is_string (void)
   g_assert_false (rest_params_are_strings (params));
 }
 
+static void
+test_param_bytes (void)
+{
+  g_autoptr(GBytes) bytes = NULL;
+  static const char data[] = "\x89PNG binary";
+  RestParam *p;
+
+  bytes = g_bytes_new_static (data, sizeof (data));
+  p = rest_param_new_from_bytes ("media", bytes, "image/png", "media.png");
+
+  /* The value is shared, not copied */
+  g_assert_true (rest_param_get_bytes (p) == bytes);
+  g_assert_true (rest_param_get_content (p) == data);
+  g_assert_cmpuint (rest_param_get_content_length (p), ==, sizeof (data));
+  g_assert_false (rest_param_is_string (p));
+  rest_param_unref (p);
+
+  p = rest_param_new_string ("name", REST_MEMORY_STATIC, "value");
+  g_assert_true (g_bytes_get_data (rest_param_get_bytes (p), NULL) == rest_param_get_content (p));
+  g_assert_cmpstr (rest_param_get_content (p), ==, "value");
+  rest_param_unref (p);
+}
+
 gint
 main (gint   argc,
       gchar *argv[])
@@ -136,6 +212,9 @@ main (gint   argc,
   g_test_add_func("/rest/params", test_params);
   g_test_add_func("/rest/params_get", test_params_get);
   g_test_add_func("/rest/params_is_strings", test_params_is_string);
+  g_test_add_func("/rest/params_repeated", test_params_repeated);
+  g_test_add_func("/rest/params_copy", test_params_copy);
+  g_test_add_func("/rest/param_bytes", test_param_bytes);
 
   return g_test_run ();
 }
@@ -35,6 +35,7 @@ static GMainLoop *loop = NULL;
 static guint8 server_count = 0;
 static guint8 client_count = 0;
 static SoupServer *server;
+static RestProxy *shared_proxy;
 
 static gboolean
 send_chunks (gpointer user_data)
@@ -67,6 +68,53 @@ send_chunks (gpointer user_data)
   }
 }
 
+/* Records split into awkward pieces, so they span reads */
+#define RECORD_PIECE 3
+
+static const char lines[] = "{\"a\":1}\n\r\n{\"b\":2}\r\n\n{\"c\":3}";
+static const char delimited[] = "one||two||||three||";
+static const char prefixed[] = "\0\0\0\3one\0\0\0\0\0\0\0\5three";
+
+/* What the server sends on each connection to /events; the third one gets
+ * 204 No Content */
+static const char *events[] = {
+  "retry: 10\r\n: keep-alive\nid: 1\ndata: first\n\n"
+  "event: update\ndata: line1\ndata:line2\nid: 2\r\n\r\n"
+  "data: cut off",
+  "data: third\n\n",
+};
+static guint event_connections = 0;
+
+typedef struct {
+  gpointer msg;
+  const char *data;
+  gsize len;
+  gsize sent;
+} PieceSender;
+
+static gboolean
+send_pieces (gpointer user_data)
+{
+  PieceSender *sender = user_data;
+  gsize len = MIN (RECORD_PIECE, sender->len - sender->sent);
+#ifdef WITH_SOUP_2
+  SoupMessageBody *response_body = ((SoupMessage *)sender->msg)->response_body;
+#else
+  SoupMessageBody *response_body = soup_server_message_get_response_body (sender->msg);
+#endif
+
+  soup_message_body_append (response_body, SOUP_MEMORY_STATIC, sender->data + sender->sent, len);
+  soup_server_unpause_message (server, sender->msg);
+  sender->sent += len;
+
+  if (sender->sent < sender->len)
+    return TRUE;
+
+  soup_message_body_complete (response_body);
+  g_free (sender);
+  return FALSE;
+}
+
 static void
 #ifdef WITH_SOUP_2
 server_callback (SoupServer *server, SoupMessage *msg,
@@ -78,12 +126,32 @@ server_callback (SoupServer *server, SoupServerMessage *msg,
 #endif
 {
 #ifdef WITH_SOUP_2
+  SoupMessageHeaders *request_headers = msg->request_headers;
   SoupMessageHeaders *response_headers = msg->response_headers;
 #else
+  SoupMessageHeaders *request_headers = soup_server_message_get_request_headers (msg);
   SoupMessageHeaders *response_headers = soup_server_message_get_response_headers (msg);
 #endif
 
-  g_assert_cmpstr (path, ==, "/stream");
+  if (g_str_equal (path, "/events"))
+    {
+      g_assert_cmpstr (soup_message_headers_get_one (request_headers, "Accept"), ==, "text/event-stream");
+
+      event_connections++;
+      if (event_connections > 1)
+        g_assert_cmpstr (soup_message_headers_get_one (request_headers, "Last-Event-ID"), ==, "2");
+
+      if (event_connections > G_N_ELEMENTS (events))
+        {
+#ifdef WITH_SOUP_2
+          soup_message_set_status (msg, SOUP_STATUS_NO_CONTENT);
+#else
+          soup_server_message_set_status (msg, SOUP_STATUS_NO_CONTENT, NULL);
+#endif
+          return;
+        }
+    }
+
 #ifdef WITH_SOUP_2
   soup_message_set_status (msg, SOUP_STATUS_OK);
 #else
@@ -93,7 +161,39 @@ server_callback (SoupServer *server, SoupServerMessage *msg,
                                      SOUP_ENCODING_CHUNKED);
   soup_server_pause_message (server, msg);
 
-  g_idle_add (send_chunks, msg);
+  if (g_str_equal (path, "/stream"))
+    {
+      g_idle_add (send_chunks, msg);
+    }
+  else
+    {
+      PieceSender *sender = g_new0 (PieceSender, 1);
+
+      sender->msg = msg;
+      if (g_str_equal (path, "/lines"))
+        {
+          sender->data = lines;
+          sender->len = sizeof (lines) - 1;
+        }
+      else if (g_str_equal (path, "/events"))
+        {
+          sender->data = events[event_connections - 1];
+          sender->len = strlen (sender->data);
+        }
+      else if (g_str_equal (path, "/delimited"))
+        {
+          sender->data = delimited;
+          sender->len = sizeof (delimited) - 1;
+        }
+      else
+        {
+          g_assert_cmpstr (path, ==, "/prefixed");
+          sender->data = prefixed;
+          sender->len = sizeof (prefixed) - 1;
+        }
+
+      g_idle_add (send_pieces, sender);
+    }
 }
 
 static void
@@ -146,13 +246,67 @@ stream_test (RestProxy *proxy)
 }
 
 static void
-continuous ()
+_call_records_cb (RestProxyCall *call,
+                  const gchar   *buf,
+                  gsize          len,
+                  const GError  *error,
+                  GObject       *weak_object,
+                  gpointer       userdata)
+{
+  GPtrArray *records = userdata;
+
+  g_assert_no_error (error);
+
+  if (buf == NULL)
+    {
+      g_main_loop_quit (loop);
+      return;
+    }
+
+  g_ptr_array_add (records, g_strndup (buf, len));
+}
+
+static void
+records_test (RestProxy            *proxy,
+              const char           *function,
+              RestProxyCallFraming  framing,
+              const char           *delimiter,
+              const char          **expected)
+{
+  RestProxyCall *call;
+  GPtrArray *records;
+  GError *error = NULL;
+
+  records = g_ptr_array_new_with_free_func (g_free);
+
+  call = rest_proxy_new_call (proxy);
+  rest_proxy_call_set_function (call, function);
+  rest_proxy_call_set_continuous_framing (call, framing, delimiter);
+  /* Too small for a whole record, so the buffer has to grow */
+  rest_proxy_call_set_continuous_buffer_size (call, 2);
+
+  rest_proxy_call_continuous (call, _call_records_cb, NULL, records, &error);
+  g_assert_no_error (error);
+  g_main_loop_run (loop);
+
+  g_assert_cmpuint (records->len, ==, g_strv_length ((char **)expected));
+  for (guint i = 0; i < records->len; i++)
+    g_assert_cmpstr (g_ptr_array_index (records, i), ==, expected[i]);
+
+  g_ptr_array_unref (records);
+  g_object_unref (call);
+}
+
+/* The server and the proxy are shared by all tests */
+static RestProxy *
+get_proxy (void)
 {
   char *url;
-  RestProxy *proxy;
   GError *error = NULL;
   GSList *uris;
 
+  if (shared_proxy)
+    return shared_proxy;
 
   server = soup_server_new (NULL, NULL);
   soup_server_listen_local (server, 0, SOUP_SERVER_LISTEN_IPV4_ONLY, &error);
@@ -171,24 +325,103 @@ continuous ()
 
   loop = g_main_loop_new (NULL, FALSE);
 
-  proxy = rest_proxy_new (url, FALSE);
-  stream_test (proxy);
+  shared_proxy = rest_proxy_new (url, FALSE);
 #ifdef WITH_SOUP_2
   g_slist_free_full (uris, (GDestroyNotify)soup_uri_free);
 #else
   g_slist_free_full (uris, (GDestroyNotify)g_uri_unref);
 #endif
+  g_free (url);
+
+  return shared_proxy;
+}
 
+static void
+continuous ()
+{
+  stream_test (get_proxy ());
   g_main_loop_run (loop);
-  g_free (url);
-  g_main_loop_unref (loop);
+}
+
+static void
+framing (void)
+{
+  const char *expected_lines[] = { "{\"a\":1}", "{\"b\":2}", "{\"c\":3}", NULL };
+  const char *expected_delimited[] = { "one", "two", "", "three", NULL };
+  const char *expected_prefixed[] = { "one", "", "three", NULL };
+
+  records_test (get_proxy (), "lines", REST_PROXY_CALL_FRAMING_NEWLINE, NULL, expected_lines);
+  records_test (get_proxy (), "delimited", REST_PROXY_CALL_FRAMING_DELIMITER, "||", expected_delimited);
+  records_test (get_proxy (), "prefixed", REST_PROXY_CALL_FRAMING_LENGTH_PREFIX, NULL, expected_prefixed);
+}
+
+static void
+_event_cb (RestProxyCall *call,
+           const gchar   *event,
+           const gchar   *data,
+           const gchar   *id,
+           const GError  *error,
+           GObject       *weak_object,
+           gpointer       userdata)
+{
+  GPtrArray *received = userdata;
+
+  g_assert_no_error (error);
+
+  if (data == NULL)
+    {
+      g_main_loop_quit (loop);
+      return;
+    }
+
+  g_ptr_array_add (received, g_strdup_printf ("%s|%s|%s", event, data, id));
+}
+
+static void
+event_source (void)
+{
+  const char *expected[] = {
+    "message|first|1",
+    "update|line1\nline2|2",
+    "message|third|2",
+  };
+  RestProxyCall *call;
+  GPtrArray *received;
+  GError *error = NULL;
+
+  received = g_ptr_array_new_with_free_func (g_free);
+
+  call = rest_proxy_new_call (get_proxy ());
+  rest_proxy_call_set_function (call, "events");
+  rest_proxy_call_event_source (call, _event_cb, NULL, received, &error);
+  g_assert_no_error (error);
+  g_object_unref (call);
+
+  g_main_loop_run (loop);
+
+  g_assert_cmpuint (event_connections, ==, 3);
+  g_assert_cmpuint (received->len, ==, G_N_ELEMENTS (expected));
+  for (guint i = 0; i < received->len; i++)
+    g_assert_cmpstr (g_ptr_array_index (received, i), ==, expected[i]);
+
+  g_ptr_array_unref (received);
 }
 
 int
 main (int argc, char **argv)
 {
+  gint ret;
+
   g_test_init (&argc, &argv, NULL);
   g_test_add_func ("/proxy/continuous", continuous);
+  g_test_add_func ("/proxy/continuous-framing", framing);
+  g_test_add_func ("/proxy/event-source", event_source);
+
+  ret = g_test_run ();
+
+  g_clear_object (&shared_proxy);
+  g_clear_object (&server);
+  g_clear_pointer (&loop, g_main_loop_unref);
 
-  return g_test_run ();
+  return ret;
 }
@@ -35,6 +35,7 @@
 #include <stdlib.h>
 #include <libsoup/soup.h>
 #include <rest/rest-proxy.h>
+#include <rest/rest-call-template.h>
 #include "helper/test-server.h"
 
 #if SOUP_CHECK_VERSION (2, 28, 0)
@@ -42,6 +43,36 @@
 #define soup_message_headers_get soup_message_headers_get_one
 #endif
 
+/* Describes the parts of a multipart/form-data body as name=value; pairs */
+static char *
+describe_multipart (SoupMultipart *multipart)
+{
+  GString *description = g_string_new (NULL);
+
+  for (int i = 0; i < soup_multipart_get_length (multipart); i++) {
+    SoupMessageHeaders *headers;
+    GHashTable *params;
+#ifdef WITH_SOUP_2
+    SoupBuffer *body;
+#else
+    GBytes *body;
+#endif
+
+    soup_multipart_get_part (multipart, i, &headers, &body);
+    soup_message_headers_get_content_disposition (headers, NULL, &params);
+    g_string_append_printf (description, "%s=", (char *)g_hash_table_lookup (params, "name"));
+#ifdef WITH_SOUP_2
+    g_string_append_len (description, body->data, body->length);
+#else
+    g_string_append_len (description, g_bytes_get_data (body, NULL), g_bytes_get_size (body));
+#endif
+    g_string_append_c (description, ';');
+    g_hash_table_destroy (params);
+  }
+
+  return g_string_free (description, FALSE);
+}
+
 #ifdef WITH_SOUP_2
 static void
 server_callback (SoupServer        *server,
@@ -95,6 +126,37 @@ server_callback (SoupServer        *server,
       soup_message_set_status (msg, SOUP_STATUS_EXPECTATION_FAILED);
     }
   }
+  else if (g_str_equal (path, "/headers")) {
+    soup_message_headers_append (msg->response_headers, "Set-Cookie", "a=1");
+    soup_message_headers_append (msg->response_headers, "Set-Cookie", "b=2");
+    soup_message_set_status (msg, SOUP_STATUS_OK);
+  }
+  else if (g_str_equal (path, "/defaultheader")) {
+    SoupMessageHeaders *request_headers = msg->request_headers;
+    const char *value;
+    value = soup_message_headers_get_one (request_headers, "X-Client");
+    if (g_strcmp0 (value, g_hash_table_lookup (query, "expect")) == 0) {
+      soup_message_set_status (msg, SOUP_STATUS_OK);
+    } else {
+      soup_message_set_status (msg, SOUP_STATUS_EXPECTATION_FAILED);
+    }
+  }
+  else if (g_str_equal (path, "/upload")) {
+    SoupMultipart *multipart;
+    char *description;
+
+    multipart = soup_multipart_new_from_message (msg->request_headers, msg->request_body);
+    if (multipart == NULL) {
+      soup_message_set_status (msg, SOUP_STATUS_BAD_REQUEST);
+      return;
+    }
+
+    description = describe_multipart (multipart);
+    soup_message_set_response (msg, "text/plain", SOUP_MEMORY_TAKE,
+                               description, strlen (description));
+    soup_message_set_status (msg, SOUP_STATUS_OK);
+    soup_multipart_free (multipart);
+  }
   else if (g_str_equal (path, "/useragent/testsuite")) {
     SoupMessageHeaders *request_headers = msg->request_headers;
     const char *value;
@@ -159,6 +221,43 @@ server_callback (SoupServer        *server,
       soup_server_message_set_status (msg, SOUP_STATUS_EXPECTATION_FAILED, NULL);
     }
   }
+  else if (g_str_equal (path, "/headers")) {
+    SoupMessageHeaders *response_headers = soup_server_message_get_response_headers (msg);
+
+    soup_message_headers_append (response_headers, "Set-Cookie", "a=1");
+    soup_message_headers_append (response_headers, "Set-Cookie", "b=2");
+    soup_server_message_set_status (msg, SOUP_STATUS_OK, NULL);
+  }
+  else if (g_str_equal (path, "/defaultheader")) {
+    SoupMessageHeaders *request_headers = soup_server_message_get_request_headers (msg);
+    const char *value;
+    value = soup_message_headers_get_one (request_headers, "X-Client");
+    if (g_strcmp0 (value, g_hash_table_lookup (query, "expect")) == 0) {
+      soup_server_message_set_status (msg, SOUP_STATUS_OK, NULL);
+    } else {
+      soup_server_message_set_status (msg, SOUP_STATUS_EXPECTATION_FAILED, NULL);
+    }
+  }
+  else if (g_str_equal (path, "/upload")) {
+    SoupMessageBody *request_body = soup_server_message_get_request_body (msg);
+    SoupMultipart *multipart;
+    GBytes *body;
+    char *description;
+
+    body = soup_message_body_flatten (request_body);
+    multipart = soup_multipart_new_from_message (soup_server_message_get_request_headers (msg), body);
+    g_bytes_unref (body);
+    if (multipart == NULL) {
+      soup_server_message_set_status (msg, SOUP_STATUS_BAD_REQUEST, NULL);
+      return;
+    }
+
+    description = describe_multipart (multipart);
+    soup_server_message_set_response (msg, "text/plain", SOUP_MEMORY_TAKE,
+                                      description, strlen (description));
+    soup_server_message_set_status (msg, SOUP_STATUS_OK, NULL);
+    soup_multipart_free (multipart);
+  }
   else if (g_str_equal (path, "/useragent/testsuite")) {
     SoupMessageHeaders *request_headers = soup_server_message_get_request_headers (msg);
     const char *value;
@@ -301,6 +400,341 @@ test_user_agent (gconstpointer data)
   test_status_ok (proxy, "useragent/testsuite");
 }
 
+static void
+default_header_test (gconstpointer data)
+{
+  RestProxy *proxy = (RestProxy *)data;
+  RestProxyCall *call;
+  GError *error = NULL;
+
+  rest_proxy_add_default_header (proxy, "X-Client", "default");
+
+  call = rest_proxy_new_call (proxy);
+  rest_proxy_call_set_function (call, "defaultheader");
+  rest_proxy_call_add_param (call, "expect", "default");
+  rest_proxy_call_sync (call, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (rest_proxy_call_get_status_code (call), ==, SOUP_STATUS_OK);
+  g_object_unref (call);
+
+  /* Headers of the call win over the defaults */
+  call = rest_proxy_new_call (proxy);
+  rest_proxy_call_set_function (call, "defaultheader");
+  rest_proxy_call_add_header_static (call, "x-client", "call");
+  rest_proxy_call_add_param (call, "expect", "call");
+  rest_proxy_call_sync (call, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (rest_proxy_call_get_status_code (call), ==, SOUP_STATUS_OK);
+  g_assert_cmpstr (rest_proxy_call_lookup_header (call, "X-Client"), ==, "call");
+  g_object_unref (call);
+
+  rest_proxy_remove_default_header (proxy, "X-Client");
+}
+
+static void
+default_user_agent_test (void)
+{
+  g_autoptr(RestProxy) proxy = rest_proxy_new ("http://localhost/", FALSE);
+
+  /* The default header and the property are one and the same */
+  rest_proxy_add_default_header (proxy, "user-agent", "header/1.0");
+  g_assert_cmpstr (rest_proxy_get_user_agent (proxy), ==, "header/1.0");
+
+  rest_proxy_remove_default_header (proxy, "User-Agent");
+  g_assert_null (rest_proxy_get_user_agent (proxy));
+}
+
+static void
+bind_test (gconstpointer data)
+{
+  RestProxy *proxy = (RestProxy *)data;
+  g_autoptr(RestProxy) bound_proxy = NULL;
+  g_autoptr(RestProxyCall) echo_call = NULL;
+  g_autoptr(RestProxyCall) reverse_call = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *uri = NULL;
+  g_autofree gchar *url_format = NULL;
+
+  g_object_get (proxy, "url-format", &uri, NULL);
+  url_format = g_strconcat (uri, "%s", NULL);
+  bound_proxy = rest_proxy_new (url_format, TRUE);
+
+  /* Two calls on one proxy with different bindings */
+  echo_call = rest_proxy_new_call (bound_proxy);
+  g_assert_true (rest_proxy_call_bind (echo_call, "echo"));
+  rest_proxy_call_add_param (echo_call, "value", "bindme");
+
+  reverse_call = rest_proxy_new_call (bound_proxy);
+  g_assert_true (rest_proxy_call_bind (reverse_call, "reverse"));
+  rest_proxy_call_add_param (reverse_call, "value", "bindme");
+
+  rest_proxy_call_sync (reverse_call, &error);
+  g_assert_no_error (error);
+  rest_proxy_call_sync (echo_call, &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpstr (rest_proxy_call_get_payload (echo_call), ==, "bindme");
+  g_assert_cmpstr (rest_proxy_call_get_payload (reverse_call), ==, "emdnib");
+}
+
+static void
+template_test (gconstpointer data)
+{
+  RestProxy *proxy = (RestProxy *)data;
+  g_autoptr(RestCallTemplate) call_template = NULL;
+  g_autoptr(GError) error = NULL;
+
+  call_template = rest_call_template_new (proxy, "GET", "echo");
+  rest_call_template_add_header (call_template, "Accept", "text/plain");
+  rest_call_template_add_param (call_template, "value", "stamped");
+
+  for (gint i = 0; i < 3; i++)
+    {
+      g_autoptr(RestProxyCall) call = NULL;
+      g_autofree gchar *extra = g_strdup_printf ("%d", i);
+
+      call = rest_call_template_new_call (call_template);
+      g_assert_cmpstr (rest_proxy_call_get_function (call), ==, "echo");
+      g_assert_cmpstr (rest_proxy_call_lookup_header (call, "Accept"), ==, "text/plain");
+
+      rest_proxy_call_add_param (call, "extra", extra);
+      rest_proxy_call_sync (call, &error);
+      g_assert_no_error (error);
+      g_assert_cmpstr (rest_proxy_call_get_payload (call), ==, "stamped");
+    }
+}
+
+static void
+pool_test (gconstpointer data)
+{
+  RestProxy *proxy = (RestProxy *)data;
+  RestProxyCall *call;
+  RestProxyCall *reused;
+  RestParamsIter iter;
+  g_autoptr(GError) error = NULL;
+
+  call = rest_proxy_acquire_call (proxy);
+  rest_proxy_call_set_function (call, "echo");
+  rest_proxy_call_add_header (call, "X-Test", "1");
+  rest_proxy_call_add_param (call, "value", "pooled");
+  rest_proxy_call_sync (call, &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (rest_proxy_call_get_payload (call), ==, "pooled");
+  rest_proxy_release_call (proxy, call);
+
+  reused = rest_proxy_acquire_call (proxy);
+  g_assert_true (reused == call);
+  g_assert_null (rest_proxy_call_get_function (reused));
+  g_assert_null (rest_proxy_call_lookup_header (reused, "X-Test"));
+  g_assert_null (rest_proxy_call_get_payload (reused));
+  g_assert_cmpint (rest_proxy_call_get_status_code (reused), ==, 0);
+  rest_params_iter_init (&iter, rest_proxy_call_get_params (reused));
+  g_assert_false (rest_params_iter_next (&iter, NULL, NULL));
+
+  rest_proxy_call_set_function (reused, "reverse");
+  rest_proxy_call_add_param (reused, "value", "pooled");
+  rest_proxy_call_sync (reused, &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (rest_proxy_call_get_payload (reused), ==, "delloop");
+  rest_proxy_release_call (proxy, reused);
+}
+
+typedef struct {
+  gboolean done;
+  gchar *payload;
+} PoolState;
+
+static void
+pool_invoke_cb (GObject      *source,
+                GAsyncResult *result,
+                gpointer      user_data)
+{
+  RestProxyCall *call = REST_PROXY_CALL (source);
+  PoolState *state = user_data;
+  GError *error = NULL;
+
+  rest_proxy_call_invoke_finish (call, result, &error);
+  g_assert_no_error (error);
+  state->payload = g_strndup (rest_proxy_call_get_payload (call),
+                              rest_proxy_call_get_payload_length (call));
+  state->done = TRUE;
+}
+
+static void
+pool_running_test (gconstpointer data)
+{
+  RestProxy *proxy = (RestProxy *)data;
+  RestProxyCall *call;
+  RestProxyCall *other;
+  PoolState state = { 0, };
+
+  call = rest_proxy_acquire_call (proxy);
+  rest_proxy_call_set_function (call, "echo");
+  rest_proxy_call_add_param (call, "value", "running");
+  rest_proxy_call_invoke_async (call, NULL, pool_invoke_cb, &state);
+  g_assert_false (rest_proxy_call_reset (call));
+
+  /* Given back while it runs, so it isn't handed out again */
+  rest_proxy_release_call (proxy, call);
+  other = rest_proxy_acquire_call (proxy);
+  g_assert_true (other != call);
+
+  while (!state.done)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpstr (state.payload, ==, "running");
+  g_assert_null (rest_proxy_call_get_payload (other));
+  rest_proxy_release_call (proxy, other);
+  g_free (state.payload);
+}
+
+static void
+response_headers_test (gconstpointer data)
+{
+  RestProxy *proxy = (RestProxy *)data;
+  g_autoptr(RestProxyCall) call = NULL;
+  g_autoptr(GHashTable) headers = NULL;
+  g_autoptr(GError) error = NULL;
+  RestProxyCallHeadersIter iter;
+  const gchar *name;
+  const gchar *value;
+  const gchar *expected[] = { "a=1", "b=2" };
+  guint n = 0;
+
+  call = rest_proxy_new_call (proxy);
+  rest_proxy_call_set_function (call, "headers");
+  /* No response yet */
+  g_assert_null (rest_proxy_call_get_response_headers (call));
+  rest_proxy_call_sync (call, &error);
+  g_assert_no_error (error);
+
+  g_assert_nonnull (rest_proxy_call_lookup_response_header (call, "set-cookie"));
+  g_assert_cmpstr (rest_proxy_call_lookup_response_header_list (call, "SET-COOKIE"), ==, "a=1, b=2");
+  g_assert_null (rest_proxy_call_lookup_response_header (call, "X-Missing"));
+
+  rest_proxy_call_response_headers_iter_init (&iter, call, "Set-Cookie");
+  while (rest_proxy_call_response_headers_iter_next (&iter, &name, &value))
+    {
+      g_assert_cmpint (g_ascii_strcasecmp (name, "Set-Cookie"), ==, 0);
+      g_assert_cmpuint (n, <, G_N_ELEMENTS (expected));
+      g_assert_cmpstr (value, ==, expected[n]);
+      n++;
+    }
+  g_assert_cmpuint (n, ==, G_N_ELEMENTS (expected));
+
+  headers = rest_proxy_call_get_response_headers (call);
+  g_assert_nonnull (g_hash_table_lookup (headers, "set-cookie"));
+}
+
+static void
+stream_ready_cb (GObject      *source,
+                 GAsyncResult *result,
+                 gpointer      user_data)
+{
+  GInputStream **stream = user_data;
+  GError *error = NULL;
+
+  *stream = rest_proxy_call_invoke_stream_finish (REST_PROXY_CALL (source), result, &error);
+  g_assert_no_error (error);
+}
+
+static void
+splice_ready_cb (GObject      *source,
+                 GAsyncResult *result,
+                 gpointer      user_data)
+{
+  GAsyncResult **out = user_data;
+
+  *out = g_object_ref (result);
+}
+
+static void
+stream_test (gconstpointer data)
+{
+  RestProxy *proxy = (RestProxy *)data;
+  RestProxyCall *call;
+  GInputStream *stream = NULL;
+  GOutputStream *output;
+  GAsyncResult *result = NULL;
+  GError *error = NULL;
+
+  call = rest_proxy_new_call (proxy);
+  rest_proxy_call_set_function (call, "echo");
+  rest_proxy_call_add_param (call, "value", "streamme");
+  rest_proxy_call_invoke_stream_async (call, NULL, stream_ready_cb, &stream);
+
+  while (stream == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpint (rest_proxy_call_get_status_code (call), ==, SOUP_STATUS_OK);
+  g_assert_cmpstr (rest_proxy_call_lookup_response_header (call, "Content-Type"), ==, "text/plain");
+  g_assert_null (rest_proxy_call_get_payload (call));
+
+  output = g_memory_output_stream_new_resizable ();
+  g_output_stream_splice_async (output, stream,
+                                G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+                                G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                                G_PRIORITY_DEFAULT, NULL,
+                                splice_ready_cb, &result);
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpint (g_output_stream_splice_finish (output, result, &error), ==, 8);
+  g_assert_no_error (error);
+  g_assert_cmpmem (g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (output)),
+                   g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (output)),
+                   "streamme", 8);
+
+  g_object_unref (result);
+  g_object_unref (output);
+  g_object_unref (stream);
+  g_object_unref (call);
+}
+
+static void
+upload_stream_test (gconstpointer data)
+{
+  RestProxy *proxy = (RestProxy *)data;
+  g_autoptr(GFile) file = NULL;
+  g_autoptr(GFileIOStream) file_stream = NULL;
+  g_autoptr(GInputStream) stream = NULL;
+  RestProxyCall *call;
+  RestParam *param;
+  GError *error = NULL;
+
+  file = g_file_new_tmp ("rest-upload-XXXXXX", &file_stream, &error);
+  g_assert_no_error (error);
+  g_file_replace_contents (file, "file contents", 13, NULL, FALSE,
+                           G_FILE_CREATE_NONE, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  /* Only the first ten bytes of the stream belong to the parameter */
+  stream = g_memory_input_stream_new_from_data ("0123456789extra", 15, NULL);
+
+  call = rest_proxy_new_call (proxy);
+  rest_proxy_call_set_function (call, "upload");
+  rest_proxy_call_add_param (call, "title", "hello");
+  rest_proxy_call_add_param_full (call,
+                                  rest_param_new_from_stream ("stream", stream, 10,
+                                                              "application/octet-stream",
+                                                              "stream.bin"));
+  param = rest_param_new_from_file ("file", file, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (rest_param_is_stream (param));
+  g_assert_false (rest_param_is_string (param));
+  g_assert_cmpuint (rest_param_get_content_length (param), ==, 13);
+  rest_proxy_call_add_param_full (call, param);
+
+  rest_proxy_call_sync (call, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (rest_proxy_call_get_status_code (call), ==, SOUP_STATUS_OK);
+  g_assert_cmpstr (rest_proxy_call_get_payload (call), ==,
+                   "title=hello;stream=0123456789;file=file contents;");
+
+  g_object_unref (call);
+  g_file_delete (file, NULL, NULL);
+}
+
 int
 main (int     argc,
       gchar **argv)
@@ -325,6 +759,15 @@ main (int     argc,
   g_test_add_data_func ("/proxy/status_ok_test", proxy, status_test);
   g_test_add_data_func ("/proxy/status_error_test", proxy, status_test_error);
   g_test_add_data_func ("/proxy/user_agent", proxy, test_user_agent);
+  g_test_add_data_func ("/proxy/default_header", proxy, default_header_test);
+  g_test_add_func ("/proxy/default_user_agent", default_user_agent_test);
+  g_test_add_data_func ("/proxy/bind", proxy, bind_test);
+  g_test_add_data_func ("/proxy/template", proxy, template_test);
+  g_test_add_data_func ("/proxy/pool", proxy, pool_test);
+  g_test_add_data_func ("/proxy/pool_running", proxy, pool_running_test);
+  g_test_add_data_func ("/proxy/response_headers", proxy, response_headers_test);
+  g_test_add_data_func ("/proxy/stream", proxy, stream_test);
+  g_test_add_data_func ("/proxy/upload_stream", proxy, upload_stream_test);
 
   ret = g_test_run ();
 
@@ -0,0 +1,255 @@
+/*
+ * librest - RESTful web services access
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <config.h>
+
+#include <libsoup/soup.h>
+#include <rest/rest-proxy.h>
+#include "helper/test-server.h"
+
+#define N_CALLS 5
+
+/* /exhausted says the quota is used up for a second, /busy asks to come back
+ * in a second and /slow takes 300ms to answer */
+static guint
+handle_request (const char         *path,
+                SoupMessageHeaders *response_headers)
+{
+  if (g_str_equal (path, "/exhausted"))
+    {
+      soup_message_headers_append (response_headers, "X-RateLimit-Remaining", "0");
+      soup_message_headers_append (response_headers, "X-RateLimit-Reset", "1");
+    }
+  else if (g_str_equal (path, "/busy"))
+    {
+      soup_message_headers_append (response_headers, "Retry-After", "1");
+      return 429;
+    }
+  else if (g_str_equal (path, "/slow"))
+    {
+      g_usleep (300 * G_TIME_SPAN_MILLISECOND);
+    }
+
+  return SOUP_STATUS_OK;
+}
+
+#ifdef WITH_SOUP_2
+static void
+server_callback (SoupServer        *server,
+                 SoupMessage       *msg,
+                 const gchar       *path,
+                 GHashTable        *query,
+                 SoupClientContext *client,
+                 gpointer           user_data)
+{
+  soup_message_set_status (msg, handle_request (path, msg->response_headers));
+}
+#else
+static void
+server_callback (SoupServer        *server,
+                 SoupServerMessage *msg,
+                 const char        *path,
+                 GHashTable        *query,
+                 gpointer           user_data)
+{
+  guint status;
+
+  status = handle_request (path, soup_server_message_get_response_headers (msg));
+  soup_server_message_set_status (msg, status, NULL);
+}
+#endif
+
+typedef struct {
+  RestProxyCall *call;
+  gboolean done;
+  GError *error;
+} CallState;
+
+static void
+invoke_cb (GObject      *source,
+           GAsyncResult *result,
+           gpointer      user_data)
+{
+  CallState *state = user_data;
+
+  rest_proxy_call_invoke_finish (REST_PROXY_CALL (source), result, &state->error);
+  state->done = TRUE;
+}
+
+/* Runs @n_calls calls of @function together, and returns how long they took
+ * in milliseconds */
+static gint64
+run_calls (RestProxy  *proxy,
+           const char *function,
+           guint       n_calls)
+{
+  CallState *states = g_new0 (CallState, n_calls);
+  gint64 start;
+
+  start = g_get_monotonic_time ();
+
+  for (guint i = 0; i < n_calls; i++)
+    {
+      states[i].call = rest_proxy_new_call (proxy);
+      rest_proxy_call_set_function (states[i].call, function);
+      rest_proxy_call_invoke_async (states[i].call, NULL, invoke_cb, &states[i]);
+    }
+
+  for (guint i = 0; i < n_calls; i++)
+    {
+      while (!states[i].done)
+        g_main_context_iteration (NULL, TRUE);
+      g_clear_object (&states[i].call);
+      g_clear_error (&states[i].error);
+    }
+
+  g_free (states);
+
+  return (g_get_monotonic_time () - start) / G_TIME_SPAN_MILLISECOND;
+}
+
+static void
+rate_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = rest_proxy_new (data, FALSE);
+
+  /* Ten a second, one at a time: the calls are spread over 400ms */
+  rest_proxy_set_rate_limit (proxy, NULL, NULL, 10, 1);
+  g_assert_cmpint (run_calls (proxy, "resource", N_CALLS), >=, 350);
+
+  /* The calls wait, they don't fail */
+  rest_proxy_set_rate_limit (proxy, NULL, NULL, 0, 0);
+  g_assert_cmpint (run_calls (proxy, "resource", N_CALLS), <, 350);
+}
+
+static void
+function_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = rest_proxy_new (data, FALSE);
+
+  rest_proxy_set_rate_limit (proxy, NULL, "limited", 10, 1);
+
+  g_assert_cmpint (run_calls (proxy, "limited", N_CALLS), >=, 350);
+  g_assert_cmpint (run_calls (proxy, "free", N_CALLS), <, 350);
+}
+
+static void
+headers_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = rest_proxy_new (data, FALSE);
+
+  /* Even without a limit, the calls wait for the quota to come back */
+  g_assert_cmpint (run_calls (proxy, "exhausted", 1), <, 500);
+  g_assert_cmpint (run_calls (proxy, "resource", 1), >=, 500);
+
+  g_assert_cmpint (run_calls (proxy, "busy", 1), <, 500);
+  g_assert_cmpint (run_calls (proxy, "resource", 1), >=, 500);
+}
+
+static void
+cancel_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = rest_proxy_new (data, FALSE);
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  CallState states[N_CALLS] = { { 0, }, };
+
+  /* Two a second, one at a time: all but the first call wait */
+  rest_proxy_set_rate_limit (proxy, NULL, NULL, 2, 1);
+
+  for (guint i = 0; i < N_CALLS; i++)
+    {
+      states[i].call = rest_proxy_new_call (proxy);
+      rest_proxy_call_set_function (states[i].call, "resource");
+      rest_proxy_call_invoke_async (states[i].call, cancellable, invoke_cb, &states[i]);
+    }
+
+  g_cancellable_cancel (cancellable);
+
+  for (guint i = 0; i < N_CALLS; i++)
+    {
+      while (!states[i].done)
+        g_main_context_iteration (NULL, TRUE);
+      g_clear_object (&states[i].call);
+      g_clear_error (&states[i].error);
+    }
+
+  /* Only the first call is owed a token, not the ones that gave up */
+  g_assert_cmpint (run_calls (proxy, "resource", 1), <, 1000);
+}
+
+static void
+queued_cancel_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = rest_proxy_new (data, FALSE);
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  CallState states[3] = { { 0, }, };
+
+  /* Three tokens, one more a second, and one request at a time */
+  rest_proxy_set_rate_limit (proxy, NULL, NULL, 1, 3);
+  rest_proxy_set_max_host_requests (proxy, 1);
+
+  /* The first call holds the host, the others wait for it with a token */
+  for (guint i = 0; i < G_N_ELEMENTS (states); i++)
+    {
+      states[i].call = rest_proxy_new_call (proxy);
+      rest_proxy_call_set_function (states[i].call, i == 0 ? "slow" : "resource");
+      rest_proxy_call_invoke_async (states[i].call, i == 0 ? NULL : cancellable,
+                                    invoke_cb, &states[i]);
+    }
+
+  g_cancellable_cancel (cancellable);
+
+  for (guint i = 0; i < G_N_ELEMENTS (states); i++)
+    {
+      while (!states[i].done)
+        g_main_context_iteration (NULL, TRUE);
+      g_clear_object (&states[i].call);
+      g_clear_error (&states[i].error);
+    }
+
+  /* Only the first call used its token */
+  g_assert_cmpint (run_calls (proxy, "resource", 2), <, 500);
+}
+
+int
+main (int     argc,
+      gchar **argv)
+{
+  SoupServer *server;
+  gchar *uri;
+  gint ret;
+
+  g_test_init (&argc, &argv, NULL);
+
+  server = test_server_new ();
+  soup_server_add_handler (server, NULL, server_callback, NULL, NULL);
+  test_server_run_in_thread (server);
+  uri = test_server_get_uri (server, "http", NULL);
+
+  g_test_add_data_func ("/rate-limit/rate", uri, rate_test);
+  g_test_add_data_func ("/rate-limit/function", uri, function_test);
+  g_test_add_data_func ("/rate-limit/headers", uri, headers_test);
+  g_test_add_data_func ("/rate-limit/cancel", uri, cancel_test);
+  g_test_add_data_func ("/rate-limit/queued-cancel", uri, queued_cancel_test);
+
+  ret = g_test_run ();
+
+  g_free (uri);
+
+  return ret;
+}
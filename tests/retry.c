@@ -0,0 +1,313 @@
+/*
+ * librest - RESTful web services access
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <libsoup/soup.h>
+#include <rest/rest-proxy.h>
+#include "helper/test-server.h"
+
+#define ETAG "\"v1\""
+
+/* The server runs in its own thread */
+static volatile gint n_requests;
+
+/*
+ * /flaky fails twice before it works, /broken never does.  /revalidate is
+ * stored with an ETag, and the first request revalidating it fails.  A
+ * request that is sent again without its body is refused.
+ */
+static guint
+handle_request (const char         *path,
+                gsize               body_length,
+                SoupMessageHeaders *request_headers,
+                SoupMessageHeaders *response_headers)
+{
+  const char *content_type;
+  guint n;
+
+  n = g_atomic_int_add (&n_requests, 1) + 1;
+
+  content_type = soup_message_headers_get_content_type (request_headers, NULL);
+  if (content_type && body_length == 0)
+    return SOUP_STATUS_BAD_REQUEST;
+
+  if (g_str_equal (path, "/flaky") && n > 2)
+    return SOUP_STATUS_OK;
+
+  if (g_str_equal (path, "/revalidate"))
+    {
+      soup_message_headers_replace (response_headers, "Cache-Control", "no-cache");
+      soup_message_headers_replace (response_headers, "ETag", ETAG);
+
+      if (g_strcmp0 (soup_message_headers_get_one (request_headers, "If-None-Match"), ETAG) != 0)
+        return SOUP_STATUS_OK;
+      if (n > 1)
+        return SOUP_STATUS_NOT_MODIFIED;
+    }
+
+  soup_message_headers_append (response_headers, "Retry-After", "0");
+  return SOUP_STATUS_SERVICE_UNAVAILABLE;
+}
+
+#ifdef WITH_SOUP_2
+static void
+server_callback (SoupServer        *server,
+                 SoupMessage       *msg,
+                 const gchar       *path,
+                 GHashTable        *query,
+                 SoupClientContext *client,
+                 gpointer           user_data)
+{
+  soup_message_set_status (msg, handle_request (path,
+                                                msg->request_body->length,
+                                                msg->request_headers,
+                                                msg->response_headers));
+}
+#else
+static void
+server_callback (SoupServer        *server,
+                 SoupServerMessage *msg,
+                 const char        *path,
+                 GHashTable        *query,
+                 gpointer           user_data)
+{
+  guint status;
+
+  status = handle_request (path,
+                           soup_server_message_get_request_body (msg)->length,
+                           soup_server_message_get_request_headers (msg),
+                           soup_server_message_get_response_headers (msg));
+  soup_server_message_set_status (msg, status, NULL);
+}
+#endif
+
+static RestProxy *
+new_proxy (const char *uri)
+{
+  g_autoptr(RestRetryPolicy) policy = rest_retry_policy_new ();
+
+  rest_retry_policy_set_delays (policy, 10, 100);
+
+  return g_object_new (REST_TYPE_PROXY,
+                       "url-format", uri,
+                       "retry-policy", policy,
+                       NULL);
+}
+
+static RestProxyCall *
+new_call (RestProxy  *proxy,
+          const char *method,
+          const char *function)
+{
+  RestProxyCall *call = rest_proxy_new_call (proxy);
+
+  rest_proxy_call_set_method (call, method);
+  rest_proxy_call_set_function (call, function);
+  if (g_str_equal (method, "POST"))
+    rest_proxy_call_add_param (call, "name", "value");
+
+  return call;
+}
+
+typedef struct {
+  gboolean done;
+  GError *error;
+} InvokeState;
+
+static void
+invoke_cb (GObject      *source,
+           GAsyncResult *result,
+           gpointer      user_data)
+{
+  InvokeState *state = user_data;
+
+  rest_proxy_call_invoke_finish (REST_PROXY_CALL (source), result, &state->error);
+  state->done = TRUE;
+}
+
+/* Runs @call asynchronously, or synchronously if @sync */
+static gboolean
+run_call (RestProxyCall  *call,
+          gboolean        sync,
+          GError        **error)
+{
+  InvokeState state = { FALSE, NULL };
+
+  g_atomic_int_set (&n_requests, 0);
+
+  if (sync)
+    return rest_proxy_call_sync (call, error);
+
+  rest_proxy_call_invoke_async (call, NULL, invoke_cb, &state);
+  while (!state.done)
+    g_main_context_iteration (NULL, TRUE);
+
+  if (state.error)
+    {
+      g_propagate_error (error, state.error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+flaky_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = new_proxy (data);
+  g_autoptr(GError) error = NULL;
+
+  for (guint sync = 0; sync < 2; sync++)
+    {
+      g_autoptr(RestProxyCall) call = new_call (proxy, "GET", "flaky");
+
+      g_assert_true (run_call (call, sync, &error));
+      g_assert_no_error (error);
+      g_assert_cmpint (rest_proxy_call_get_status_code (call), ==, SOUP_STATUS_OK);
+      g_assert_cmpint (g_atomic_int_get (&n_requests), ==, 3);
+    }
+}
+
+static void
+max_attempts_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = new_proxy (data);
+  g_autoptr(RestProxyCall) call = new_call (proxy, "GET", "broken");
+  g_autoptr(GError) error = NULL;
+
+  g_assert_false (run_call (call, FALSE, &error));
+  g_assert_error (error, REST_PROXY_ERROR, SOUP_STATUS_SERVICE_UNAVAILABLE);
+  g_assert_cmpint (g_atomic_int_get (&n_requests), ==, 3);
+}
+
+static void
+idempotent_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = new_proxy (data);
+  g_autoptr(RestProxyCall) call = NULL;
+  g_autoptr(RestRetryPolicy) policy = NULL;
+  g_autoptr(GError) error = NULL;
+
+  /* POST isn't retried by default */
+  call = new_call (proxy, "POST", "flaky");
+  g_assert_false (run_call (call, FALSE, &error));
+  g_assert_error (error, REST_PROXY_ERROR, SOUP_STATUS_SERVICE_UNAVAILABLE);
+  g_assert_cmpint (g_atomic_int_get (&n_requests), ==, 1);
+  g_clear_error (&error);
+  g_clear_object (&call);
+
+  /* Unless the call says so, and then its body is sent every time */
+  policy = rest_retry_policy_new ();
+  rest_retry_policy_set_delays (policy, 10, 100);
+  rest_retry_policy_set_retry_non_idempotent (policy, TRUE);
+  call = new_call (proxy, "POST", "flaky");
+  rest_proxy_call_set_retry_policy (call, policy);
+  g_assert_true (run_call (call, FALSE, &error));
+  g_assert_no_error (error);
+  g_assert_cmpint (g_atomic_int_get (&n_requests), ==, 3);
+}
+
+static void
+disabled_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = rest_proxy_new (data, FALSE);
+  g_autoptr(RestProxyCall) call = new_call (proxy, "GET", "flaky");
+  g_autoptr(GError) error = NULL;
+
+  g_assert_false (run_call (call, FALSE, &error));
+  g_assert_error (error, REST_PROXY_ERROR, SOUP_STATUS_SERVICE_UNAVAILABLE);
+  g_assert_cmpint (g_atomic_int_get (&n_requests), ==, 1);
+}
+
+static void
+revalidate_test (gconstpointer data)
+{
+  for (guint sync = 0; sync < 2; sync++)
+    {
+      g_autoptr(RestProxy) proxy = new_proxy (data);
+      g_autoptr(RestProxyCall) call = NULL;
+      g_autoptr(GError) error = NULL;
+
+      rest_proxy_set_cache_size (proxy, 1024 * 1024);
+
+      call = new_call (proxy, "GET", "revalidate");
+      g_assert_true (run_call (call, sync, &error));
+      g_assert_no_error (error);
+      g_clear_object (&call);
+
+      /* The retry is made conditional again, so its 304 is answered from the cache */
+      call = new_call (proxy, "GET", "revalidate");
+      g_assert_true (run_call (call, sync, &error));
+      g_assert_no_error (error);
+      g_assert_cmpint (rest_proxy_call_get_status_code (call), ==, SOUP_STATUS_OK);
+      g_assert_cmpint (g_atomic_int_get (&n_requests), ==, 2);
+    }
+}
+
+static void
+budget_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = new_proxy (data);
+  RestRetryPolicy *policy = rest_proxy_get_retry_policy (proxy);
+  guint total = 0;
+
+  /* Two tokens: the first failure leaves one, and retries stop there */
+  rest_retry_policy_set_budget (policy, 2, 0.1);
+
+  for (guint i = 0; i < 3; i++)
+    {
+      g_autoptr(RestProxyCall) call = new_call (proxy, "GET", "broken");
+      g_autoptr(GError) error = NULL;
+
+      g_assert_false (run_call (call, FALSE, &error));
+      total += g_atomic_int_get (&n_requests);
+    }
+
+  g_assert_cmpint (total, ==, 3);
+}
+
+int
+main (int     argc,
+      gchar **argv)
+{
+  SoupServer *server;
+  gchar *uri;
+  gint ret;
+
+  g_test_init (&argc, &argv, NULL);
+
+  server = test_server_new ();
+  soup_server_add_handler (server, NULL, server_callback, NULL, NULL);
+  test_server_run_in_thread (server);
+  uri = test_server_get_uri (server, "http", NULL);
+
+  g_test_add_data_func ("/retry/flaky", uri, flaky_test);
+  g_test_add_data_func ("/retry/max-attempts", uri, max_attempts_test);
+  g_test_add_data_func ("/retry/idempotent", uri, idempotent_test);
+  g_test_add_data_func ("/retry/disabled", uri, disabled_test);
+  g_test_add_data_func ("/retry/budget", uri, budget_test);
+  g_test_add_data_func ("/retry/revalidate", uri, revalidate_test);
+
+  ret = g_test_run ();
+
+  g_free (uri);
+
+  return ret;
+}
@@ -0,0 +1,254 @@
+/*
+ * librest - RESTful web services access
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <libsoup/soup.h>
+#include <rest/rest-proxy.h>
+#include "helper/test-server.h"
+
+/* The server runs in its own thread */
+static GMutex requests_lock;
+static GString *requests;
+
+/* Notes the order requests come in, answering slowly so the calls of a test
+ * queue up behind the first one */
+static void
+handle_request (const char *path)
+{
+  g_mutex_lock (&requests_lock);
+  g_string_append (requests, path + 1);
+  g_string_append_c (requests, ' ');
+  g_mutex_unlock (&requests_lock);
+
+  g_usleep (G_USEC_PER_SEC / 10);
+}
+
+#ifdef WITH_SOUP_2
+static void
+server_callback (SoupServer        *server,
+                 SoupMessage       *msg,
+                 const gchar       *path,
+                 GHashTable        *query,
+                 SoupClientContext *client,
+                 gpointer           user_data)
+{
+  handle_request (path);
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+}
+#else
+static void
+server_callback (SoupServer        *server,
+                 SoupServerMessage *msg,
+                 const char        *path,
+                 GHashTable        *query,
+                 gpointer           user_data)
+{
+  handle_request (path);
+  soup_server_message_set_status (msg, SOUP_STATUS_OK, NULL);
+}
+#endif
+
+typedef struct {
+  RestProxyCall *call;
+  GCancellable *cancellable;
+  gboolean done;
+  GError *error;
+} CallState;
+
+static void
+invoke_cb (GObject      *source,
+           GAsyncResult *result,
+           gpointer      user_data)
+{
+  CallState *state = user_data;
+
+  rest_proxy_call_invoke_finish (REST_PROXY_CALL (source), result, &state->error);
+  state->done = TRUE;
+}
+
+static void
+start_call (RestProxy             *proxy,
+            const char            *function,
+            RestProxyCallPriority  priority,
+            const char            *group,
+            CallState             *state)
+{
+  state->call = rest_proxy_new_call (proxy);
+  state->cancellable = g_cancellable_new ();
+  rest_proxy_call_set_function (state->call, function);
+  rest_proxy_call_set_priority (state->call, priority);
+  rest_proxy_call_set_queue_group (state->call, group);
+
+  rest_proxy_call_invoke_async (state->call, state->cancellable, invoke_cb, state);
+}
+
+static void
+wait_calls (CallState *states,
+            guint      n_states)
+{
+  for (guint i = 0; i < n_states; i++)
+    {
+      while (!states[i].done)
+        g_main_context_iteration (NULL, TRUE);
+    }
+}
+
+static void
+clear_calls (CallState *states,
+             guint      n_states)
+{
+  for (guint i = 0; i < n_states; i++)
+    {
+      g_clear_object (&states[i].call);
+      g_clear_object (&states[i].cancellable);
+      g_clear_error (&states[i].error);
+    }
+}
+
+static RestProxy *
+new_proxy (const char *uri)
+{
+  g_mutex_lock (&requests_lock);
+  g_string_truncate (requests, 0);
+  g_mutex_unlock (&requests_lock);
+
+  return g_object_new (REST_TYPE_PROXY,
+                       "url-format", uri,
+                       "max-host-requests", 1,
+                       NULL);
+}
+
+static void
+assert_requests (const char *expected)
+{
+  g_mutex_lock (&requests_lock);
+  g_assert_cmpstr (requests->str, ==, expected);
+  g_mutex_unlock (&requests_lock);
+}
+
+static void
+priority_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = new_proxy (data);
+  CallState states[4] = { { 0, }, };
+  guint waiting;
+  guint64 dequeued;
+  gint64 wait_time;
+
+  start_call (proxy, "first", REST_PROXY_CALL_PRIORITY_NORMAL, NULL, &states[0]);
+  start_call (proxy, "background", REST_PROXY_CALL_PRIORITY_BACKGROUND, NULL, &states[1]);
+  start_call (proxy, "normal", REST_PROXY_CALL_PRIORITY_NORMAL, NULL, &states[2]);
+  start_call (proxy, "interactive", REST_PROXY_CALL_PRIORITY_INTERACTIVE, NULL, &states[3]);
+
+  rest_proxy_get_queue_stats (proxy, &waiting, NULL, NULL);
+  g_assert_cmpint (waiting, ==, 3);
+
+  wait_calls (states, G_N_ELEMENTS (states));
+
+  for (guint i = 0; i < G_N_ELEMENTS (states); i++)
+    g_assert_no_error (states[i].error);
+  assert_requests ("first interactive normal background ");
+
+  rest_proxy_get_queue_stats (proxy, &waiting, &dequeued, &wait_time);
+  g_assert_cmpint (waiting, ==, 0);
+  g_assert_cmpint (dequeued, ==, 3);
+  g_assert_cmpint (wait_time, >, 0);
+
+  clear_calls (states, G_N_ELEMENTS (states));
+}
+
+static void
+fairness_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = new_proxy (data);
+  CallState states[5] = { { 0, }, };
+
+  /* A group making many calls doesn't hold up the other */
+  start_call (proxy, "first", REST_PROXY_CALL_PRIORITY_NORMAL, NULL, &states[0]);
+  start_call (proxy, "a1", REST_PROXY_CALL_PRIORITY_NORMAL, "a", &states[1]);
+  start_call (proxy, "a2", REST_PROXY_CALL_PRIORITY_NORMAL, "a", &states[2]);
+  start_call (proxy, "a3", REST_PROXY_CALL_PRIORITY_NORMAL, "a", &states[3]);
+  start_call (proxy, "b1", REST_PROXY_CALL_PRIORITY_NORMAL, "b", &states[4]);
+  wait_calls (states, G_N_ELEMENTS (states));
+
+  for (guint i = 0; i < G_N_ELEMENTS (states); i++)
+    g_assert_no_error (states[i].error);
+  assert_requests ("first a1 b1 a2 a3 ");
+
+  clear_calls (states, G_N_ELEMENTS (states));
+}
+
+static void
+cancel_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = new_proxy (data);
+  CallState states[3] = { { 0, }, };
+  guint waiting;
+
+  start_call (proxy, "first", REST_PROXY_CALL_PRIORITY_NORMAL, NULL, &states[0]);
+  start_call (proxy, "cancelled", REST_PROXY_CALL_PRIORITY_NORMAL, NULL, &states[1]);
+  start_call (proxy, "last", REST_PROXY_CALL_PRIORITY_NORMAL, NULL, &states[2]);
+
+  /* A waiting call gives up at once, without being sent */
+  g_cancellable_cancel (states[1].cancellable);
+  while (!states[1].done)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_false (states[0].done);
+  rest_proxy_get_queue_stats (proxy, &waiting, NULL, NULL);
+  g_assert_cmpint (waiting, ==, 1);
+
+  wait_calls (states, G_N_ELEMENTS (states));
+
+  g_assert_no_error (states[0].error);
+  g_assert_error (states[1].error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_no_error (states[2].error);
+  assert_requests ("first last ");
+
+  clear_calls (states, G_N_ELEMENTS (states));
+}
+
+int
+main (int     argc,
+      gchar **argv)
+{
+  SoupServer *server;
+  gchar *uri;
+  gint ret;
+
+  g_test_init (&argc, &argv, NULL);
+
+  requests = g_string_new (NULL);
+
+  server = test_server_new ();
+  soup_server_add_handler (server, NULL, server_callback, NULL, NULL);
+  test_server_run_in_thread (server);
+  uri = test_server_get_uri (server, "http", NULL);
+
+  g_test_add_data_func ("/scheduler/priority", uri, priority_test);
+  g_test_add_data_func ("/scheduler/fairness", uri, fairness_test);
+  g_test_add_data_func ("/scheduler/cancel", uri, cancel_test);
+
+  ret = g_test_run ();
+
+  g_free (uri);
+  g_string_free (requests, TRUE);
+
+  return ret;
+}
@@ -0,0 +1,167 @@
+/*
+ * librest - RESTful web services access
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+/*
+ * Compares proxies each making their own session with proxies sharing one,
+ * for many short calls: how long they take, and how many connections the
+ * server sees opened for them.
+ */
+
+#include <config.h>
+#include <libsoup/soup.h>
+#include <rest/rest-proxy.h>
+#include "helper/test-server.h"
+
+#define N_PROXIES 16
+#define N_CALLS 64
+
+static GMutex ports_lock;
+static GHashTable *ports;
+
+static void
+add_port (GSocketAddress *address)
+{
+  guint16 port = g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (address));
+
+  g_mutex_lock (&ports_lock);
+  g_hash_table_add (ports, GUINT_TO_POINTER (port));
+  g_mutex_unlock (&ports_lock);
+}
+
+#ifdef WITH_SOUP_2
+static void
+server_callback (SoupServer        *server,
+                 SoupMessage       *msg,
+                 const gchar       *path,
+                 GHashTable        *query,
+                 SoupClientContext *client,
+                 gpointer           user_data)
+{
+  add_port (soup_client_context_get_remote_address (client));
+  soup_message_set_response (msg, "text/plain", SOUP_MEMORY_STATIC, "ok", 2);
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+}
+#else
+static void
+server_callback (SoupServer        *server,
+                 SoupServerMessage *msg,
+                 const char        *path,
+                 GHashTable        *query,
+                 gpointer           user_data)
+{
+  add_port (soup_server_message_get_remote_address (msg));
+  soup_server_message_set_response (msg, "text/plain", SOUP_MEMORY_STATIC, "ok", 2);
+  soup_server_message_set_status (msg, SOUP_STATUS_OK, NULL);
+}
+#endif
+
+static void
+ready_cb (GObject      *source,
+          GAsyncResult *result,
+          gpointer      user_data)
+{
+  guint *pending = user_data;
+  GError *error = NULL;
+
+  rest_proxy_call_invoke_finish (REST_PROXY_CALL (source), result, &error);
+  g_assert_no_error (error);
+
+  (*pending)--;
+}
+
+/* Makes N_PROXIES proxies, each short-lived as in an application making
+ * one per request, and runs N_CALLS calls on each */
+static gdouble
+run (const char *uri,
+     gboolean    shared_session,
+     guint      *n_connections)
+{
+  g_autoptr(GTimer) timer = g_timer_new ();
+  RestProxy *keep_alive = NULL;
+
+  g_mutex_lock (&ports_lock);
+  g_hash_table_remove_all (ports);
+  g_mutex_unlock (&ports_lock);
+
+  /* Keeps the shared session from going with the last proxy using it */
+  if (shared_session)
+    keep_alive = g_object_new (REST_TYPE_PROXY,
+                               "url-format", uri,
+                               "shared-session", TRUE,
+                               NULL);
+
+  for (guint i = 0; i < N_PROXIES; i++)
+    {
+      g_autoptr(RestProxy) proxy = NULL;
+      guint pending = N_CALLS;
+
+      proxy = g_object_new (REST_TYPE_PROXY,
+                            "url-format", uri,
+                            "shared-session", shared_session,
+                            NULL);
+
+      for (guint j = 0; j < N_CALLS; j++)
+        {
+          g_autoptr(RestProxyCall) call = rest_proxy_new_call (proxy);
+
+          rest_proxy_call_set_function (call, "ping");
+          rest_proxy_call_invoke_async (call, NULL, ready_cb, &pending);
+        }
+
+      while (pending > 0)
+        g_main_context_iteration (NULL, TRUE);
+    }
+
+  g_clear_object (&keep_alive);
+
+  g_mutex_lock (&ports_lock);
+  *n_connections = g_hash_table_size (ports);
+  g_mutex_unlock (&ports_lock);
+
+  return g_timer_elapsed (timer, NULL);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  g_autofree gchar *uri = NULL;
+  SoupServer *server;
+  gdouble own, shared;
+  guint own_connections, shared_connections;
+
+  ports = g_hash_table_new (NULL, NULL);
+
+  server = test_server_new ();
+  soup_server_add_handler (server, NULL, server_callback, NULL, NULL);
+  test_server_run_in_thread (server);
+  uri = test_server_get_uri (server, "http", NULL);
+
+  g_print ("%u proxies, %u calls each\n", N_PROXIES, N_CALLS);
+
+  own = run (uri, FALSE, &own_connections);
+  g_print ("own sessions:   %8.3fs  %4u connections\n", own, own_connections);
+
+  shared = run (uri, TRUE, &shared_connections);
+  g_print ("shared session: %8.3fs  %4u connections  (%.1fx)\n",
+           shared, shared_connections, own / shared);
+
+  g_hash_table_unref (ports);
+
+  return 0;
+}
@@ -0,0 +1,242 @@
+/*
+ * librest - RESTful web services access
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <config.h>
+
+#include <libsoup/soup.h>
+#include <rest/rest-proxy.h>
+#include "helper/test-server.h"
+
+/* The client ports the server was called from, one per connection */
+static GMutex ports_lock;
+static GHashTable *ports;
+
+static void
+add_port (GSocketAddress *address)
+{
+  guint16 port = g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (address));
+
+  g_mutex_lock (&ports_lock);
+  g_hash_table_add (ports, GUINT_TO_POINTER (port));
+  g_mutex_unlock (&ports_lock);
+}
+
+static guint
+reset_ports (void)
+{
+  guint n_ports;
+
+  g_mutex_lock (&ports_lock);
+  n_ports = g_hash_table_size (ports);
+  g_hash_table_remove_all (ports);
+  g_mutex_unlock (&ports_lock);
+
+  return n_ports;
+}
+
+#ifdef WITH_SOUP_2
+static void
+server_callback (SoupServer        *server,
+                 SoupMessage       *msg,
+                 const gchar       *path,
+                 GHashTable        *query,
+                 SoupClientContext *client,
+                 gpointer           user_data)
+{
+  add_port (soup_client_context_get_remote_address (client));
+  soup_message_set_response (msg, "text/plain", SOUP_MEMORY_STATIC, "ok", 2);
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+}
+#else
+static void
+server_callback (SoupServer        *server,
+                 SoupServerMessage *msg,
+                 const char        *path,
+                 GHashTable        *query,
+                 gpointer           user_data)
+{
+  add_port (soup_server_message_get_remote_address (msg));
+  soup_server_message_set_response (msg, "text/plain", SOUP_MEMORY_STATIC, "ok", 2);
+  soup_server_message_set_status (msg, SOUP_STATUS_OK, NULL);
+}
+#endif
+
+static void
+run_calls (RestProxy *proxy,
+           guint      n_calls)
+{
+  for (guint i = 0; i < n_calls; i++)
+    {
+      g_autoptr(RestProxyCall) call = rest_proxy_new_call (proxy);
+      g_autoptr(GError) error = NULL;
+
+      rest_proxy_call_set_function (call, "ping");
+      g_assert_true (rest_proxy_call_sync (call, &error));
+      g_assert_no_error (error);
+      g_assert_cmpint (rest_proxy_call_get_status_code (call), ==, SOUP_STATUS_OK);
+    }
+}
+
+static SoupSession *
+get_session (RestProxy *proxy)
+{
+  SoupSession *session;
+
+  g_object_get (proxy, "session", &session, NULL);
+  g_assert_nonnull (session);
+  /* The proxy holds it too */
+  g_object_unref (session);
+
+  return session;
+}
+
+static void
+own_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) proxy = NULL;
+  g_autoptr(RestProxy) other = rest_proxy_new (data, FALSE);
+  guint idle_timeout;
+
+  proxy = g_object_new (REST_TYPE_PROXY,
+                        "url-format", data,
+                        "idle-timeout", 5,
+                        NULL);
+
+  g_assert_true (get_session (proxy) != get_session (other));
+  g_object_get (get_session (proxy), "idle-timeout", &idle_timeout, NULL);
+  g_assert_cmpuint (idle_timeout, ==, 5);
+
+  /* Still applies to the session once made */
+  g_object_set (proxy, "idle-timeout", 10, NULL);
+  g_object_get (get_session (proxy), "idle-timeout", &idle_timeout, NULL);
+  g_assert_cmpuint (idle_timeout, ==, 10);
+
+  /* Calls go over the one connection, kept open between them */
+  reset_ports ();
+  run_calls (proxy, 5);
+  g_assert_cmpuint (reset_ports (), ==, 1);
+
+  /* Which those of another proxy don't use */
+  run_calls (proxy, 1);
+  run_calls (other, 1);
+  g_assert_cmpuint (reset_ports (), ==, 2);
+}
+
+static void
+given_test (gconstpointer data)
+{
+  g_autoptr(SoupSession) session = soup_session_new ();
+  g_autoptr(RestProxy) proxy = NULL;
+  guint idle_timeout;
+
+  g_object_set (session, "idle-timeout", 30, NULL);
+  proxy = g_object_new (REST_TYPE_PROXY,
+                        "url-format", data,
+                        "session", session,
+                        NULL);
+  g_assert_true (get_session (proxy) == session);
+
+  /* A session given is used as it is */
+  g_object_set (proxy, "idle-timeout", 10, NULL);
+  g_object_get (session, "idle-timeout", &idle_timeout, NULL);
+  g_assert_cmpuint (idle_timeout, ==, 30);
+
+  reset_ports ();
+  run_calls (proxy, 3);
+  g_assert_cmpuint (reset_ports (), ==, 1);
+}
+
+static void
+shared_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) first = NULL;
+  g_autoptr(RestProxy) second = NULL;
+  gboolean shared_session;
+
+  first = g_object_new (REST_TYPE_PROXY,
+                        "url-format", data,
+                        "shared-session", TRUE,
+                        NULL);
+  second = g_object_new (REST_TYPE_PROXY,
+                         "url-format", data,
+                         "shared-session", TRUE,
+                         NULL);
+
+  g_object_get (first, "shared-session", &shared_session, NULL);
+  g_assert_true (shared_session);
+  g_assert_true (get_session (first) == get_session (second));
+
+  /* The second proxy reuses the connection of the first */
+  reset_ports ();
+  run_calls (first, 2);
+  run_calls (second, 2);
+  g_assert_cmpuint (reset_ports (), ==, 1);
+}
+
+static void
+shared_no_cookies_test (gconstpointer data)
+{
+  g_autoptr(RestProxy) with_cookies = NULL;
+  g_autoptr(RestProxy) without_cookies = NULL;
+
+  with_cookies = g_object_new (REST_TYPE_PROXY,
+                               "url-format", data,
+                               "shared-session", TRUE,
+                               NULL);
+  without_cookies = g_object_new (REST_TYPE_PROXY,
+                                  "url-format", data,
+                                  "shared-session", TRUE,
+                                  "disable-cookies", TRUE,
+                                  NULL);
+
+  g_assert_true (get_session (with_cookies) != get_session (without_cookies));
+  g_assert_nonnull (soup_session_get_feature (get_session (with_cookies),
+                                              SOUP_TYPE_COOKIE_JAR));
+  g_assert_null (soup_session_get_feature (get_session (without_cookies),
+                                           SOUP_TYPE_COOKIE_JAR));
+}
+
+int
+main (int     argc,
+      gchar **argv)
+{
+  SoupServer *server;
+  gchar *uri;
+  gint ret;
+
+  g_test_init (&argc, &argv, NULL);
+
+  ports = g_hash_table_new (NULL, NULL);
+
+  server = test_server_new ();
+  soup_server_add_handler (server, NULL, server_callback, NULL, NULL);
+  test_server_run_in_thread (server);
+  uri = test_server_get_uri (server, "http", NULL);
+
+  g_test_add_data_func ("/session/own", uri, own_test);
+  g_test_add_data_func ("/session/given", uri, given_test);
+  g_test_add_data_func ("/session/shared", uri, shared_test);
+  g_test_add_data_func ("/session/shared-no-cookies", uri, shared_no_cookies_test);
+
+  ret = g_test_run ();
+
+  g_free (uri);
+  g_hash_table_unref (ports);
+
+  return ret;
+}
@@ -0,0 +1,235 @@
+/*
+ * librest - RESTful web services access
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU Lesser General Public License,
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <glib/gstdio.h>
+#include <libsoup/soup.h>
+#include <rest/rest-proxy.h>
+#include "helper/test-server.h"
+
+static const char ca_certificate[] =
+  "-----BEGIN CERTIFICATE-----\n"
+  "MIIBizCCATGgAwIBAgIUPKWdc7M14xi/CC/O+i67WGg2Lm0wCgYIKoZIzj0EAwIw\n"
+  "GjEYMBYGA1UEAwwPbGlicmVzdCB0ZXN0IENBMCAXDTI2MTAxNzAzNDA0OVoYDzIx\n"
+  "MjYwOTIzMDM0MDQ5WjAaMRgwFgYDVQQDDA9saWJyZXN0IHRlc3QgQ0EwWTATBgcq\n"
+  "hkjOPQIBBggqhkjOPQMBBwNCAAQLZ3ON+YRISB+r4ywcVmWzan0AmMEZlPPJFhJO\n"
+  "kTGuo16eV1rYyu2U7mGvbbQxDR41WI89qbxWEubUdz2XYoJco1MwUTAdBgNVHQ4E\n"
+  "FgQUR/cywFFBDvJbWO1o+kOvPNuD2fYwHwYDVR0jBBgwFoAUR/cywFFBDvJbWO1o\n"
+  "+kOvPNuD2fYwDwYDVR0TAQH/BAUwAwEB/zAKBggqhkjOPQQDAgNIADBFAiEAg7oa\n"
+  "QyvLYjiwR4ygaMe+w9aBugQtwiD7fqbG40Rd6qACIFroopcC/7TFoJ27tJeDqxYz\n"
+  "qCJ0IS7Ice9K5SQAZRD7\n"
+  "-----END CERTIFICATE-----\n";
+
+static char *ca_file;
+static char *http_uri;
+static char *https_uri;
+
+/* /redirect sends the call on to the server over https */
+#ifdef WITH_SOUP_2
+static void
+server_callback (SoupServer        *server,
+                 SoupMessage       *msg,
+                 const gchar       *path,
+                 GHashTable        *query,
+                 SoupClientContext *client,
+                 gpointer           user_data)
+{
+  if (g_str_equal (path, "/redirect"))
+    soup_message_set_redirect (msg, SOUP_STATUS_FOUND, https_uri);
+  else
+    soup_message_set_status (msg, SOUP_STATUS_OK);
+}
+#else
+static void
+server_callback (SoupServer        *server,
+                 SoupServerMessage *msg,
+                 const char        *path,
+                 GHashTable        *query,
+                 gpointer           user_data)
+{
+  if (g_str_equal (path, "/redirect"))
+    soup_server_message_set_redirect (msg, SOUP_STATUS_FOUND, https_uri);
+  else
+    soup_server_message_set_status (msg, SOUP_STATUS_OK, NULL);
+}
+#endif
+
+static RestProxy *
+new_proxy (const char *uri)
+{
+  return g_object_new (REST_TYPE_PROXY,
+                       "url-format", uri,
+                       "ssl-ca-file", ca_file,
+                       NULL);
+}
+
+/* Runs a call to @function on @proxy, and returns the database its session
+ * was left with */
+static GTlsDatabase *
+run_call (RestProxy  *proxy,
+          const char *function)
+{
+  g_autoptr(RestProxyCall) call = NULL;
+  g_autoptr(SoupSession) session = NULL;
+  GTlsDatabase *database;
+
+  call = rest_proxy_new_call (proxy);
+  if (function)
+    rest_proxy_call_set_function (call, function);
+
+  /* The server doesn't speak TLS, so calls over it fail once the
+   * database is loaded */
+  rest_proxy_call_sync (call, NULL);
+
+  g_object_get (proxy, "session", &session, NULL);
+  g_object_get (session, "tls-database", &database, NULL);
+
+  return database;
+}
+
+static void
+touch_ca_file (void)
+{
+  g_autoptr(GFile) file = g_file_new_for_path (ca_file);
+  g_autoptr(GFileInfo) info = NULL;
+  g_autoptr(GError) error = NULL;
+  guint64 mtime;
+
+  info = g_file_query_info (file, G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                            G_FILE_QUERY_INFO_NONE, NULL, &error);
+  g_assert_no_error (error);
+  mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+  g_file_set_attribute_uint64 (file, G_FILE_ATTRIBUTE_TIME_MODIFIED, mtime + 1,
+                               G_FILE_QUERY_INFO_NONE, NULL, &error);
+  g_assert_no_error (error);
+}
+
+static void
+shared_test (void)
+{
+  g_autoptr(RestProxy) proxy = new_proxy (https_uri);
+  g_autoptr(RestProxy) other = new_proxy (https_uri);
+  g_autoptr(GTlsDatabase) first = NULL;
+  g_autoptr(GTlsDatabase) second = NULL;
+  g_autofree char *anchors = NULL;
+
+  first = run_call (proxy, NULL);
+  g_assert_true (G_IS_TLS_FILE_DATABASE (first));
+  g_object_get (first, "anchors", &anchors, NULL);
+  g_assert_cmpstr (anchors, ==, ca_file);
+
+  /* Loaded once, while some session uses it */
+  second = run_call (other, NULL);
+  g_assert_true (second == first);
+}
+
+static void
+lazy_test (void)
+{
+  g_autoptr(RestProxy) proxy = new_proxy (https_uri);
+  g_autoptr(RestProxy) plain_proxy = new_proxy (http_uri);
+  g_autoptr(GTlsDatabase) database = NULL;
+  g_autoptr(GTlsDatabase) plain = NULL;
+
+  database = run_call (proxy, NULL);
+
+  /* Calls that don't use TLS leave the session the one of libsoup */
+  plain = run_call (plain_proxy, NULL);
+  g_assert_true (plain != database);
+}
+
+static void
+redirect_test (void)
+{
+  g_autoptr(RestProxy) proxy = new_proxy (http_uri);
+  g_autoptr(RestProxy) other = new_proxy (https_uri);
+  g_autoptr(GTlsDatabase) database = NULL;
+  g_autoptr(GTlsDatabase) direct = NULL;
+
+  /* Starts out over http, and is only then sent over TLS */
+  database = run_call (proxy, "redirect");
+  g_assert_true (G_IS_TLS_FILE_DATABASE (database));
+
+  direct = run_call (other, NULL);
+  g_assert_true (direct == database);
+}
+
+static void
+modified_test (void)
+{
+  g_autoptr(RestProxy) proxy = new_proxy (https_uri);
+  g_autoptr(RestProxy) other = new_proxy (https_uri);
+  g_autoptr(GTlsDatabase) database = NULL;
+  g_autoptr(GTlsDatabase) reloaded = NULL;
+  g_autoptr(GTlsDatabase) shared = NULL;
+
+  database = run_call (proxy, NULL);
+  touch_ca_file ();
+
+  /* The session that already has a database picks up the new file */
+  reloaded = run_call (proxy, NULL);
+  g_assert_true (G_IS_TLS_FILE_DATABASE (reloaded));
+  g_assert_true (reloaded != database);
+
+  shared = run_call (other, NULL);
+  g_assert_true (shared == reloaded);
+}
+
+int
+main (int     argc,
+      gchar **argv)
+{
+  SoupServer *server;
+  g_autoptr(GError) error = NULL;
+  gint ret;
+  int fd;
+
+  g_test_init (&argc, &argv, NULL);
+
+  /* Without it the database of a file can't be loaded */
+  if (!g_tls_backend_supports_tls (g_tls_backend_get_default ()))
+    return g_test_run ();
+
+  fd = g_file_open_tmp ("rest-tls-database-XXXXXX.pem", &ca_file, &error);
+  g_assert_no_error (error);
+  g_close (fd, NULL);
+  g_file_set_contents (ca_file, ca_certificate, -1, &error);
+  g_assert_no_error (error);
+
+  server = test_server_new ();
+  soup_server_add_handler (server, NULL, server_callback, NULL, NULL);
+  test_server_run_in_thread (server);
+  http_uri = test_server_get_uri (server, "http", NULL);
+  https_uri = g_strconcat ("https", http_uri + strlen ("http"), NULL);
+
+  g_test_add_func ("/tls-database/shared", shared_test);
+  g_test_add_func ("/tls-database/lazy", lazy_test);
+  g_test_add_func ("/tls-database/redirect", redirect_test);
+  g_test_add_func ("/tls-database/modified", modified_test);
+
+  ret = g_test_run ();
+
+  g_unlink (ca_file);
+  g_free (ca_file);
+  g_free (http_uri);
+  g_free (https_uri);
+
+  return ret;
+}